@@ -3,7 +3,7 @@
 set -eu
 
 sudo apt update
-sudo apt install -y libconfig++-dev libboost-program-options-dev libavahi-client3 cmake libcamera-dev libevent-pthreads-2.1-7 libevent-core-2.1-7 libevent-dev
+sudo apt install -y libconfig++-dev libasound2-dev libjpeg-dev libboost-program-options-dev libavahi-client3 cmake libcamera-dev libdrm-dev liburing-dev libavformat-dev libavcodec-dev
 
 ./build.sh
 sudo ./install.sh
@@ -3,20 +3,17 @@
 from gpiozero import Button
 from subprocess import check_call
 from signal import pause
+import signal
 
 is_NDI = True
 
 def toggle_NDI():
     global is_NDI
+    #raspindi swaps between NDI and HDMI itself, without reopening the camera
+    check_call(['sudo', 'pkill', '--signal', str(int(signal.SIGRTMIN)), '-x', 'raspindi'])
     if is_NDI:
-        #Turn off NDI and turn on HDMI
-        check_call(['sudo', 'systemctl', 'stop', 'RasPi-NDI.start.service'])
-        check_call(['sudo', 'systemctl', 'start', 'RasPi-HDMI.start.service'])
         print("HDMI mode")
     else:
-        #Turn on NDI and turn off HDMI
-        check_call(['sudo', 'systemctl', 'stop', 'RasPi-HDMI.start.service'])
-        check_call(['sudo', 'systemctl', 'start', 'RasPi-NDI.start.service'])
         print("NDI mode")
     is_NDI = not is_NDI
 
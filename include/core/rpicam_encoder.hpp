@@ -23,6 +23,8 @@ public:
 	using FrameBuffer = libcamera::FrameBuffer;
 
 	RPiCamEncoder() : RPiCamApp(std::make_unique<VideoOptions>()) {}
+	// Derived applications may supply their own (extended) video options.
+	RPiCamEncoder(std::unique_ptr<VideoOptions> opts) : RPiCamApp(std::move(opts)) {}
 
 	void StartEncoder()
 	{
@@ -9,7 +9,9 @@
 
 #include <cstdio>
 
+#include <algorithm>
 #include <string>
+#include <vector>
 
 #include "core/video_options.hpp"
 
@@ -20,27 +22,430 @@ struct NDIOptions : public VideoOptions
 		using namespace boost::program_options;
 		// Generally we shall use zero or empty values to avoid over-writing the
 		// codec's default behaviour.  = "";
-		// clang-format off 
+		// clang-format off
 		options_->add_options()
-			("neopixel_path", value<std::string>(&v_->neopixel_path_)->default_value("/tmp/neopixel.state"),
+			("raspindi_config", value<std::string>(&raspindi_config)->default_value("/etc/raspindi.conf"),
+			 "Read settings from this libconfig file, where they override the command line. Send SIGHUP "
+			 "to reload it while running. Set it empty to read no file")
+			("ndi_name", value<std::string>(&ndi_name)->default_value("Video Feed"),
+			 "Set the name of the NDI source")
+			("ndi_groups", value<std::string>(&ndi_groups)->default_value(""),
+			 "Set a comma separated list of NDI groups to publish the source to (default: NDI's own)")
+			("ndi_transport", value<std::string>(&ndi_transport)->default_value(""),
+			 "Send to receivers by \"unicast\" (a stream to each one), or \"multicast\" (one stream, however many "
+			 "receivers there are, where the network allows it). Empty leaves it to NDI's own config file. "
+			 "Needs the NDI Advanced SDK")
+			("ndi_discovery", value<std::string>(&ndi_discovery)->default_value(""),
+			 "Register the source with these NDI discovery servers (a comma separated list of addresses), so "
+			 "that receivers find it again as soon as it restarts. Empty leaves it to NDI's own config file. "
+			 "Needs the NDI Advanced SDK")
+			("warm_start", value<std::string>(&warm_start)->default_value(""),
+			 "Save the exposure, gain and colour gains AE and AWB converge on to this file, and start "
+			 "the camera from them next time, so that the first frames are already usable")
+			("neopixel_path", value<std::string>(&neopixel_path)->default_value("/tmp/neopixel.state"),
 			 "Set the location for the neopixel state.")
+			("ndi_proxy", value<bool>(&ndi_proxy)->default_value(false)->implicit_value(true),
+			 "Also publish \"<ndi_name> (proxy)\", a low resolution source for multiviewers, from the lores "
+			 "stream the ISP scales for free. Set its size with --lores-width and --lores-height")
+			("ndi_proxy_fps", value<float>(&ndi_proxy_fps)->default_value(0),
+			 "Limit the proxy source to this frame rate. 0 sends every frame")
+			("ndi_idle_fps", value<float>(&ndi_idle_fps)->default_value(0),
+			 "While no NDI receivers are connected, send nothing and slow the camera to this frame rate, "
+			 "to save power and keep the Pi cool. The camera stays at full rate while there are branches "
+			 "or HDMI output. 0 always sends")
+			("ndi_slate_seconds", value<float>(&ndi_slate_seconds)->default_value(3),
+			 "While the camera is recovering or restarting, repeat its last frame for this many "
+			 "seconds, and then send a NO SIGNAL slate with the source name until it's back. 0 goes "
+			 "straight to the slate. Compressed NDI only ever repeats the last keyframe")
+			("analysis_file", value<std::string>(&analysis_file)->default_value(""),
+			 "Run the post processing stages in this file (as for --post-process-file) on a thread of their "
+			 "own, on the newest frame whenever they are free, so that they never hold up the video")
+			("analysis_threads", value<unsigned int>(&analysis_threads)->default_value(0),
+			 "Threads for TensorFlow Lite analysis stages that don't set number_of_threads. 0 uses the "
+			 "cores left after two for the video")
+			("ndi_ptz", value<bool>(&ndi_ptz)->default_value(false)->implicit_value(true),
+			 "Let NDI receivers pan, tilt and zoom, and store and recall presets, by moving the ISP's crop "
+			 "(so the output size and CPU cost stay the same)")
+			("ndi_ptz_max_zoom", value<float>(&ndi_ptz_max_zoom)->default_value(4),
+			 "How far --ndi_ptz zooms in, as a magnification. Beyond the sensor's resolution over the "
+			 "output size, the picture gets soft")
+			("ndi_camera_control", value<bool>(&ndi_camera_control)->default_value(false)->implicit_value(true),
+			 "Let NDI receivers set the exposure, white balance and focus with PTZ commands, and any camera "
+			 "setting the config file takes with <raspindi_ccu .../> metadata")
+			("ndi_scopes", value<bool>(&ndi_scopes)->default_value(false)->implicit_value(true),
+			 "Send a histogram and waveform of every frame (from the lores stream if there is one) as NDI "
+			 "metadata, for receivers to draw exposure scopes with")
+			("tone_curve", value<std::string>(&tone_curve)->default_value(""),
+			 "A curve applied to the picture's brightness, as \"x,y x,y ...\" points from 0 to 255, or "
+			 "\"gamma:<g>\" (above 1 lifts the midtones)")
+			("ndi_tone_curve", value<bool>(&ndi_tone_curve)->default_value(false)->implicit_value(true),
+			 "Let NDI receivers replace the tone curve, with <raspindi_tone_curve curve=\"...\"/> metadata")
+			("overlay", value<std::string>(&overlay)->default_value(""),
+			 "Draw these onto the video, as a comma separated list of: tally (a red border on program, "
+			 "green on preview), id (the camera ID, bottom left), timecode (bottom right) and clock (top right)")
+			("overlay_id", value<std::string>(&overlay_id)->default_value(""),
+			 "The camera ID for --overlay to show (default: the NDI name)")
+			("ndi_ptp", value<std::string>(&ndi_ptp)->default_value(""),
+			 "Take NDI timecodes from this PTP hardware clock (such as /dev/ptp0, kept by linuxptp's ptp4l), "
+			 "rather than the system wall clock")
+			("ndi_genlock", value<bool>(&ndi_genlock)->default_value(false)->implicit_value(true),
+			 "Round NDI timecodes to a grid of frame periods from the epoch, which every unit shares. With "
+			 "--sync and synchronised wall clocks, frames captured together get the same timecode")
+			("ndi_send_phase", value<std::string>(&send_phase_)->default_value("0"),
+			 "With --ndi_genlock, send each frame this long after its timecode, so that every unit sends "
+			 "in step. Make it longer than the slowest unit takes to get a frame ready. 0 sends at once")
+			("ndi_audio", value<bool>(&ndi_audio)->default_value(false)->implicit_value(true),
+			 "Send audio with the video, captured from --audio-device (an ALSA device) with "
+			 "--audio-channels and --audio-samplerate, and offset by --av-sync")
+			("ndi_async", value<bool>(&ndi_async)->default_value(true)->implicit_value(true),
+			 "Send frames to NDI asynchronously (ndi codec only). Each camera buffer is then recycled "
+			 "one frame later, once NDI has released it, rather than as soon as the send returns")
+			("ndi_fourcc", value<std::string>(&ndi_fourcc)->default_value("i420"),
+			 "Pixel format for uncompressed NDI frames: i420 (sent straight from the camera buffer), "
+			 "or uyvy or nv12 (converted, which saves the receiver or NDI itself doing it). p216 keeps "
+			 "the ISP's full precision, 16 bits per sample in 4:2:2 (Pi 5 only)")
+			("ndi_low_bitrate", value<std::string>(&low_bitrate_)->default_value("1mbps"),
+			 "Set the bitrate of the low bandwidth NDI|HX stream (ndi_h264 or ndi_hevc codec with a lores stream only)")
+			("ndi_rate_control", value<bool>(&ndi_rate_control)->default_value(true)->implicit_value(true),
+			 "Let NDI's target bitrate, which follows what receivers are asking for, override the "
+			 "encoder bitrates while running (ndi_h264 or ndi_hevc codec only)")
+			("ndi_intra_refresh", value<bool>(&ndi_intra_refresh)->default_value(false)->implicit_value(true),
+			 "Refresh the picture a band at a time over each --intra period (default one second) "
+			 "instead of sending keyframes, which keeps every frame about the same size. Keyframes are "
+			 "then only sent when a new receiver needs one (ndi_h264 or ndi_hevc codec only)")
+			("branch", value<std::vector<std::string>>(&branches)->composing(),
+			 "Also encode the camera frames to another output, given as codec:output, for example "
+			 "h264:iso:/home/pi/iso.mp4 or mjpeg:tcp://0.0.0.0:8554. May be given more than once. An output of "
+			 "iso:<file> records to an MP4 or MKV file, through a buffer that rides out disk stalls, and "
+			 "replay:<directory> saves instant replays there whenever the source goes to program (see "
+			 "--replay_seconds)")
+			("replay_seconds", value<unsigned int>(&replay_seconds)->default_value(10),
+			 "How much video from before the trigger each instant replay starts with. Replays are also "
+			 "started and stopped by pressing r or, with --signal, by sending SIGRTMIN+1")
+			("mjpeg_threads", value<unsigned int>(&mjpeg_threads)->default_value(0),
+			 "Number of threads, and slices per frame, for MJPEG encoding. 0 uses one per online core")
+			("mjpeg_affinity", value<bool>(&mjpeg_affinity)->default_value(false)->implicit_value(true),
+			 "Pin each MJPEG encoding thread to its own core")
+			("ndi_shq_threads", value<unsigned int>(&ndi_shq_threads)->default_value(0),
+			 "Number of threads encoding SpeedHQ with --codec ndi_shq, each taking whole frames in turn. "
+			 "0 uses one per online core, up to 4. 1 leaves the other cores of a Pi Zero 2 W alone")
+			("ndi_shq_affinity", value<bool>(&ndi_shq_affinity)->default_value(true)->implicit_value(true),
+			 "Pin each SpeedHQ encoding thread to its own core")
+			("latency_budget", value<std::string>(&latency_budget_)->default_value("0"),
+			 "Drop any frame older than this (from its sensor timestamp) before it is encoded or sent, "
+			 "rather than let delay build up. 0 keeps every frame")
+			("latency_profile", value<std::string>(&latency_profile)->default_value(""),
+			 "\"low\" trades the odd dropped frame for 2-3 frames less latency: the fewest camera buffers "
+			 "(unless --buffer-count says otherwise), synchronous NDI sends, and never more than one frame "
+			 "waiting in the encoder. \"normal\" changes nothing. Either way, the latency from capture to "
+			 "send is logged every minute")
+			("output_mode", value<std::string>(&output_mode)->default_value("ndi"),
+			 "Send frames to \"ndi\", to the \"hdmi\" preview or to \"both\" at startup. Press n or h to "
+			 "toggle either one, or with --signal, send SIGRTMIN to swap one for the other")
+			("hdmi_kms", value<bool>(&hdmi_kms)->default_value(false)->implicit_value(true),
+			 "Drive HDMI output straight from the camera buffers on a KMS overlay plane, with no GL and no "
+			 "copy, instead of through rpicam's preview window. Falls back to the preview window if the "
+			 "display is already in use, by a desktop for example")
+			("hdmi_max_age", value<std::string>(&hdmi_max_age_)->default_value("0"),
+			 "With --hdmi_kms, skip any frame older than this (from its sensor timestamp) by the time the display "
+			 "can take it, as a newer one is nearly ready. 0 shows them all")
+			("latency_stats", value<std::string>(&latency_stats)->default_value(""),
+			 "Trace each frame from capture to NDI send, and write rolling p50/p95/p99 latencies for each "
+			 "stage to this file every few seconds")
+			("metadata_log", value<std::string>(&metadata_log)->default_value(""),
+			 "Log every frame's exposure, gains, colour temperature, lux and focus to this file, a ring of "
+			 "fixed size records that raspindi_metadata turns into CSV or JSON. Cheap enough to leave on")
+			("metadata_log_frames", value<unsigned int>(&metadata_log_frames)->default_value(216000),
+			 "How many frames the metadata log keeps, 64 bytes each (the default is an hour at 60fps)")
+			("flight_recorder", value<std::string>(&flight_recorder)->default_value("/tmp"),
+			 "Keep the last few minutes of frame, encode, send, drop and control events in memory, and "
+			 "dump them to a file in this directory on SIGUSR2, a main loop stall, an error or a crash, for "
+			 "raspindi_flight to print. An empty directory turns it off")
+			("flight_recorder_events", value<unsigned int>(&flight_recorder_events)->default_value(16384),
+			 "How many events the flight recorder keeps for each thread, 32 bytes each (the default is a "
+			 "few minutes at 60fps)")
+			("metrics_port", value<unsigned int>(&metrics_port)->default_value(0),
+			 "Serve Prometheus metrics (frame rates, drops, queue depths, stage latencies, NDI connections, "
+			 "temperature and throttling) over HTTP at /metrics on this port. 0 turns them off")
+			("thread_policy", value<std::string>(&thread_policy)->default_value(""),
+			 "Real-time priorities and cores for each kind of thread, as role=priority[:cpus] separated by "
+			 "commas, where the roles are capture, encode, send, audio and ndi (libndi's own threads), and "
+			 "the cpus one core or a range, for example capture=50:2,encode=40:3,send=45:1-3. Needs root or "
+			 "CAP_SYS_NICE")
+			("mlockall", value<bool>(&mlockall)->default_value(false)->implicit_value(true),
+			 "Lock all of raspindi's memory, so that none of it is ever paged out")
+			("low_memory", value<bool>(&low_memory)->default_value(false)->implicit_value(true),
+			 "Run in as little memory as possible, for a Pi Zero 2 W: compressed NDI only (--codec ndi_h264), "
+			 "no raw stream, no HDMI output or post processing, and the fewest camera buffers (unless "
+			 "--buffer-count says otherwise). Logs what each part costs in memory at startup")
 		;
 		// clang-format on
 	}
 
+	std::string raspindi_config;
+	std::string ndi_name;
+	std::string ndi_groups;
+	std::string ndi_transport;
+	std::string ndi_discovery;
+	std::string warm_start;
 	std::string neopixel_path;
+	bool ndi_proxy;
+	float ndi_proxy_fps;
+	float ndi_idle_fps;
+	float ndi_slate_seconds;
+	std::string analysis_file;
+	unsigned int analysis_threads;
+	bool ndi_ptz;
+	float ndi_ptz_max_zoom;
+	bool ndi_camera_control;
+	bool ndi_scopes;
+	std::string tone_curve;
+	bool ndi_tone_curve;
+	std::string overlay;
+	std::string overlay_id;
+	std::string ndi_ptp;
+	bool ndi_genlock;
+	TimeVal<std::chrono::milliseconds> ndi_send_phase;
+	bool ndi_audio;
+	bool ndi_async;
+	std::string ndi_fourcc;
+	Bitrate low_bitrate;
+	bool ndi_rate_control;
+	bool ndi_intra_refresh;
+	std::vector<std::string> branches;
+	unsigned int replay_seconds;
+	unsigned int mjpeg_threads;
+	bool mjpeg_affinity;
+	unsigned int ndi_shq_threads;
+	bool ndi_shq_affinity;
+	std::string latency_stats;
+	std::string metadata_log;
+	unsigned int metadata_log_frames;
+	std::string flight_recorder;
+	unsigned int flight_recorder_events;
+	unsigned int metrics_port;
+	std::string output_mode;
+	bool hdmi_kms;
+	TimeVal<std::chrono::milliseconds> hdmi_max_age;
+	std::string thread_policy;
+	bool mlockall;
+	bool low_memory;
+	TimeVal<std::chrono::milliseconds> latency_budget;
+	std::string latency_profile;
 
 	virtual bool Parse(int argc, char *argv[]) override
 	{
 		if (Options::Parse(argc, argv) == false)
 			return false;
 
-		return v_->ParseVideo();
+		if (!v_->ParseVideo())
+			return false;
+
+		if (Get().codec == "ndi_h264" || Get().codec == "ndi_hevc" || Get().codec == "ndi_shq")
+		{
+#ifndef NDI_ADVANCED_SDK
+			throw std::runtime_error("the " + Get().codec + " codec needs raspindi built with the NDI Advanced SDK");
+#endif
+		}
+		else if (Get().codec != "ndi" && Get().codec != "yuv420")
+			throw std::runtime_error("NDI output requires the ndi, ndi_h264, ndi_hevc, ndi_shq or yuv420 codec");
+
+		if (ndi_transport != "" && ndi_transport != "unicast" && ndi_transport != "multicast")
+			throw std::runtime_error("ndi_transport must be unicast or multicast");
+#ifndef NDI_ADVANCED_SDK
+		if (!ndi_transport.empty() || !ndi_discovery.empty())
+			throw std::runtime_error("ndi_transport and ndi_discovery need raspindi built with the NDI Advanced SDK");
+#endif
+		if (ndi_fourcc != "i420" && ndi_fourcc != "uyvy" && ndi_fourcc != "nv12" && ndi_fourcc != "p216")
+			throw std::runtime_error("ndi_fourcc must be i420, uyvy, nv12 or p216");
+		if (ndi_fourcc == "p216")
+		{
+			// Frames come from a 16-bit RGB stream, which nothing that works on the camera's
+			// YUV420 can use.
+			if (Get().codec != "ndi")
+				throw std::runtime_error("ndi_fourcc p216 is uncompressed, so needs --codec ndi");
+			if (output_mode != "ndi" || hdmi_kms)
+				throw std::runtime_error("ndi_fourcc p216 has no HDMI output, so needs --output_mode ndi");
+			if (ndi_proxy || ndi_scopes || !overlay.empty() || !tone_curve.empty() || ndi_tone_curve ||
+				!analysis_file.empty() || !Get().post_process_file.empty() || !branches.empty())
+				throw std::runtime_error("ndi_fourcc p216 can't be used with the proxy, scopes, overlays, tone "
+										 "curves, analysis, post processing or branches");
+			Set().nopreview = true;
+		}
+		if (Get().codec == "ndi_shq" && ndi_fourcc != "i420")
+			throw std::runtime_error("the ndi_shq codec encodes the camera's 4:2:0 frames as they are, so needs "
+									 "--ndi_fourcc i420");
+		if (ndi_intra_refresh && Get().codec != "ndi_h264" && Get().codec != "ndi_hevc")
+			throw std::runtime_error("ndi_intra_refresh needs --codec ndi_h264 or ndi_hevc");
+		if (ndi_proxy && (!Get().lores_width || !Get().lores_height))
+			throw std::runtime_error("ndi_proxy needs a lores stream, set --lores-width and --lores-height");
+		if (!metadata_log.empty() && !metadata_log_frames)
+			throw std::runtime_error("metadata_log_frames must be at least 1");
+		if (!flight_recorder.empty() && flight_recorder_events < 256)
+			throw std::runtime_error("flight_recorder_events must be at least 256");
+		if (ndi_idle_fps < 0)
+			throw std::runtime_error("ndi_idle_fps must not be negative");
+		if (ndi_slate_seconds < 0)
+			throw std::runtime_error("ndi_slate_seconds must not be negative");
+		if (output_mode != "ndi" && output_mode != "hdmi" && output_mode != "both")
+			throw std::runtime_error("output_mode must be ndi, hdmi or both");
+		if (low_memory)
+		{
+			if (Get().codec != "ndi_h264")
+				throw std::runtime_error("low_memory sends compressed NDI only, so needs --codec ndi_h264");
+			if (output_mode != "ndi" || hdmi_kms)
+				throw std::runtime_error("low_memory has no HDMI output, so needs --output_mode ndi");
+			if (!Get().post_process_file.empty() || !analysis_file.empty())
+				throw std::runtime_error("low_memory can't run post processing stages");
+			if (ndi_proxy)
+				throw std::runtime_error("low_memory can't send the (uncompressed) proxy source");
+			Set().nopreview = true;
+			Set().no_raw = true;
+			if (!Get().buffer_count)
+				Set().buffer_count = LOW_MEMORY_BUFFERS + branches.size();
+		}
+		if (latency_profile != "" && latency_profile != "normal" && latency_profile != "low")
+			throw std::runtime_error("latency_profile must be normal or low");
+		if (latency_profile == "low")
+		{
+			// Each camera buffer queued ahead of the one being filled is a frame of delay,
+			// and an async send keeps hold of a buffer for a frame longer than it need.
+			if (!Get().buffer_count)
+				Set().buffer_count = LOW_LATENCY_BUFFERS + hdmiBuffers() + branches.size();
+			ndi_async = false;
+		}
+		if (!branches.empty() && !BranchBuffers())
+			throw std::runtime_error(std::to_string(branches.size()) + " branches need a buffer_count of at least " +
+									 std::to_string(mainPathBuffers() + branches.size()));
+		if (output_mode != "ndi" && Get().nopreview)
+			throw std::runtime_error("HDMI output needs the preview window, so can't be used with --nopreview");
+
+		if (ndi_ptz && ndi_ptz_max_zoom < 1)
+			throw std::runtime_error("ndi_ptz_max_zoom must be at least 1");
+		if (ndi_ptz && Get().roi_width)
+			throw std::runtime_error("ndi_ptz moves the crop itself, so can't be used with --roi");
+
+		ndi_send_phase.set(send_phase_);
+		if (ndi_send_phase && !ndi_genlock)
+			throw std::runtime_error("ndi_send_phase needs ndi_genlock");
+		if (ndi_genlock && !Get().sync)
+			LOG(1, "Warning: without --sync, genlocked timecodes only line up if the sensors do");
+
+		low_bitrate.set(low_bitrate_);
+		latency_budget.set(latency_budget_);
+		hdmi_max_age.set(hdmi_max_age_);
+
+		return true;
 	}
 
 	virtual void Print() const override
 	{
 		Options::Print();
 		v_->PrintVideo();
+		if (!raspindi_config.empty())
+			std::cerr << "    raspindi_config: " << raspindi_config << std::endl;
+		std::cerr << "    ndi_name: " << ndi_name << std::endl;
+		if (!ndi_groups.empty())
+			std::cerr << "    ndi_groups: " << ndi_groups << std::endl;
+		if (!ndi_transport.empty())
+			std::cerr << "    ndi_transport: " << ndi_transport << std::endl;
+		if (!ndi_discovery.empty())
+			std::cerr << "    ndi_discovery: " << ndi_discovery << std::endl;
+		if (!warm_start.empty())
+			std::cerr << "    warm_start: " << warm_start << std::endl;
+		std::cerr << "    neopixel_path: " << neopixel_path << std::endl;
+		std::cerr << "    ndi_proxy: " << ndi_proxy << std::endl;
+		if (ndi_proxy)
+			std::cerr << "    ndi_proxy_fps: " << ndi_proxy_fps << std::endl;
+		if (ndi_idle_fps)
+			std::cerr << "    ndi_idle_fps: " << ndi_idle_fps << std::endl;
+		std::cerr << "    ndi_slate_seconds: " << ndi_slate_seconds << std::endl;
+		if (!analysis_file.empty())
+			std::cerr << "    analysis_file: " << analysis_file << std::endl;
+		if (analysis_threads)
+			std::cerr << "    analysis_threads: " << analysis_threads << std::endl;
+		std::cerr << "    ndi_ptz: " << ndi_ptz << std::endl;
+		if (ndi_ptz)
+			std::cerr << "    ndi_ptz_max_zoom: " << ndi_ptz_max_zoom << std::endl;
+		std::cerr << "    ndi_camera_control: " << ndi_camera_control << std::endl;
+		std::cerr << "    ndi_scopes: " << ndi_scopes << std::endl;
+		if (!tone_curve.empty())
+			std::cerr << "    tone_curve: " << tone_curve << std::endl;
+		std::cerr << "    ndi_tone_curve: " << ndi_tone_curve << std::endl;
+		if (!overlay.empty())
+			std::cerr << "    overlay: " << overlay << std::endl;
+		if (!overlay_id.empty())
+			std::cerr << "    overlay_id: " << overlay_id << std::endl;
+		if (!ndi_ptp.empty())
+			std::cerr << "    ndi_ptp: " << ndi_ptp << std::endl;
+		std::cerr << "    ndi_genlock: " << ndi_genlock << std::endl;
+		if (ndi_genlock)
+			std::cerr << "    ndi_send_phase: " << ndi_send_phase.get() << "ms" << std::endl;
+		std::cerr << "    ndi_audio: " << ndi_audio << std::endl;
+		std::cerr << "    ndi_async: " << ndi_async << std::endl;
+		std::cerr << "    ndi_fourcc: " << ndi_fourcc << std::endl;
+		std::cerr << "    ndi_low_bitrate: " << low_bitrate.kbps() << "kbps" << std::endl;
+		std::cerr << "    ndi_rate_control: " << ndi_rate_control << std::endl;
+		std::cerr << "    ndi_intra_refresh: " << ndi_intra_refresh << std::endl;
+		for (auto const &branch : branches)
+			std::cerr << "    branch: " << branch << std::endl;
+		std::cerr << "    replay_seconds: " << replay_seconds << std::endl;
+		std::cerr << "    mjpeg_threads: " << mjpeg_threads << std::endl;
+		std::cerr << "    mjpeg_affinity: " << mjpeg_affinity << std::endl;
+		std::cerr << "    ndi_shq_threads: " << ndi_shq_threads << std::endl;
+		std::cerr << "    ndi_shq_affinity: " << ndi_shq_affinity << std::endl;
+		std::cerr << "    output_mode: " << output_mode << std::endl;
+		std::cerr << "    hdmi_kms: " << hdmi_kms << std::endl;
+		if (hdmi_kms)
+			std::cerr << "    hdmi_max_age: " << hdmi_max_age.get() << "ms" << std::endl;
+		std::cerr << "    latency_budget: " << latency_budget.get() << "ms" << std::endl;
+		if (!latency_profile.empty())
+			std::cerr << "    latency_profile: " << latency_profile << std::endl;
+		if (!latency_stats.empty())
+			std::cerr << "    latency_stats: " << latency_stats << std::endl;
+		if (!metadata_log.empty())
+			std::cerr << "    metadata_log: " << metadata_log << " (" << metadata_log_frames << " frames)" << std::endl;
+		if (!flight_recorder.empty())
+			std::cerr << "    flight_recorder: " << flight_recorder << " (" << flight_recorder_events << " events)"
+					  << std::endl;
+		if (metrics_port)
+			std::cerr << "    metrics_port: " << metrics_port << std::endl;
+		if (!thread_policy.empty())
+			std::cerr << "    thread_policy: " << thread_policy << std::endl;
+		std::cerr << "    mlockall: " << mlockall << std::endl;
+		std::cerr << "    low_memory: " << low_memory << std::endl;
 	}
+
+	// How many camera buffers each branch may hold at once. The rest are kept for the
+	// camera and the NDI (and HDMI) output, so that a slow branch can never stall them.
+	unsigned int BranchBuffers() const
+	{
+		unsigned int buffers = Get().buffer_count ? Get().buffer_count : DEFAULT_BUFFERS;
+		if (branches.empty() || buffers <= mainPathBuffers())
+			return 0;
+		return std::min<unsigned int>(MAX_BRANCH_BUFFERS, (buffers - mainPathBuffers()) / branches.size());
+	}
+
+private:
+	// What RPiCamApp configures without a --buffer-count.
+	static constexpr unsigned int DEFAULT_BUFFERS = 6;
+	// Few enough that the encoders we use always have a free input buffer.
+	static constexpr unsigned int MAX_BRANCH_BUFFERS = 4;
+
+	// One being filled, one with the encoder, and one done and waiting for it.
+	static constexpr unsigned int LOW_MEMORY_BUFFERS = 3;
+	// The same, plus what the HDMI output holds (see hdmiBuffers), if it's on.
+	static constexpr unsigned int LOW_LATENCY_BUFFERS = 3;
+	// With --hdmi_kms, the frame on screen, the one being flipped to and the one waiting
+	// (see kms_preview.hpp), or otherwise the one the preview window shows.
+	unsigned int hdmiBuffers() const { return output_mode == "ndi" ? 0 : hdmi_kms ? 3 : 1; }
+
+	// One being filled and one with the NDI output, another if an async send is still
+	// reading the last, and one for the HDMI output to show.
+	unsigned int mainPathBuffers() const { return 2 + ndi_async + (output_mode != "ndi"); }
+
+	std::string low_bitrate_;
+	std::string latency_budget_;
+	std::string send_phase_;
+	std::string hdmi_max_age_;
 };
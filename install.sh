@@ -24,6 +24,6 @@ chmod +x "$INSTALL_DIR/control-button.py"
 systemctl enable RasPi-NDI-HDMI-button.start.service
 
 echo '#!/usr/bin/env sh
-LD_LIBRARY_PATH="/opt/RasPi-NDI-HDMI/lib" /opt/RasPi-NDI-HDMI/bin/raspindi
+LD_LIBRARY_PATH="/opt/RasPi-NDI-HDMI/lib" /opt/RasPi-NDI-HDMI/bin/raspindi --codec ndi --timeout 0 --fullscreen --signal --output_mode ndi --hdmi_kms --warm_start /opt/RasPi-NDI-HDMI/warm_start
 ' > "$INSTALL_DIR/RasPi-NDI-HDMI.sh"
 chmod +x "$INSTALL_DIR/RasPi-NDI-HDMI.sh"
\ No newline at end of file
@@ -0,0 +1,244 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * analysis_scheduler.cpp - run post processing stages off the video path.
+ */
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <stdexcept>
+
+#include "core/logging.hpp"
+#include "post_processing_stages/post_processing_stage.hpp"
+
+#include "analysis_scheduler.hpp"
+#include "thread_policy.hpp"
+
+static std::vector<int64_t> const histogram_bounds_us = { 1000, 2000, 5000, 10000, 20000, 50000,
+														   100000, 200000, 500000, 1000000 };
+
+AnalysisScheduler::AnalysisScheduler(RPiCamApp *app, std::string const &file, std::string const &libs_dir,
+									 unsigned int threads)
+	: app_(app), abort_(false), running_(false)
+{
+	// Stages register themselves as their libraries load. Any the app has loaded already
+	// just load again as the same library.
+	if (!libs_dir.empty())
+	{
+		std::error_code ec;
+		for (auto const &entry : std::filesystem::directory_iterator(libs_dir, ec))
+		{
+			if (entry.path().extension() == ".so")
+				libs_.emplace_back(entry.path().string());
+		}
+	}
+
+	unsigned int cores = std::thread::hardware_concurrency();
+	if (!threads)
+		threads = cores > VIDEO_CORES ? cores - VIDEO_CORES : 1;
+
+	Metrics &metrics = Metrics::Get();
+	boost::property_tree::ptree root;
+	boost::property_tree::read_json(file, root);
+	auto const &registry = GetPostProcessingStages();
+	for (auto const &[name, config] : root)
+	{
+		auto it = registry.find(name);
+		if (it == registry.end())
+			throw std::runtime_error("no post processing stage called " + name);
+		auto stage = std::make_unique<Stage>();
+		stage->name = name;
+		boost::property_tree::ptree params = config;
+		// Ours, not the stage's.
+		int depth = params.get<int>("queue_depth", 1);
+		std::string drop = params.get<std::string>("queue_drop", "oldest");
+		params.erase("queue_depth");
+		params.erase("queue_drop");
+		if (depth < 1)
+			throw std::runtime_error("queue_depth for " + name + " must be at least 1");
+		if (drop != "oldest" && drop != "newest")
+			throw std::runtime_error("queue_drop for " + name + " must be oldest or newest");
+		stage->queue_depth = depth;
+		stage->drop_newest = drop == "newest";
+		stage->overrun = false;
+		if (params.find("number_of_threads") == params.not_found())
+			params.put("number_of_threads", threads);
+		if (params.find("refresh_rate") == params.not_found())
+			params.put("refresh_rate", 1);
+		stage->stage.reset(it->second(app_));
+		stage->stage->Read(params);
+
+		std::string label = Metrics::Label("stage", name);
+		stage->skipped = &metrics.AddCounter("raspindi_analysis_skipped_total",
+											 "Frames an analysis stage skipped, as its queue was full", label);
+		stage->queued = &metrics.AddHistogram("raspindi_analysis_queued_seconds",
+											  "Time frames wait in an analysis stage's queue",
+											  histogram_bounds_us, label);
+		stage->process = &metrics.AddHistogram("raspindi_analysis_process_seconds", "Time an analysis stage takes",
+											   histogram_bounds_us, label);
+		stages_.push_back(std::move(stage));
+		LOG(1, "Analysis stage " << name << " loaded, queue depth " << depth << ", dropping the " << drop);
+	}
+
+	frames_ = &metrics.AddCounter("raspindi_analysis_frames_total", "Frames the analysis stages have run on");
+}
+
+AnalysisScheduler::~AnalysisScheduler()
+{
+	Stop();
+	stages_.clear();
+}
+
+void AnalysisScheduler::Configure()
+{
+	for (auto &stage : stages_)
+		stage->stage->Configure();
+}
+
+void AnalysisScheduler::Start()
+{
+	for (auto &stage : stages_)
+		stage->stage->Start();
+	abort_ = false;
+	running_ = true;
+	for (unsigned int i = 0; i < stages_.size(); i++)
+		stages_[i]->thread = std::thread(&AnalysisScheduler::stageThread, this, i);
+}
+
+void AnalysisScheduler::Stop()
+{
+	if (!running_)
+		return;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+		// Hand the camera its buffers back before it stops.
+		for (auto &stage : stages_)
+			stage->queue.clear();
+	}
+	for (auto &stage : stages_)
+	{
+		stage->cond_var.notify_one();
+		stage->thread.join();
+	}
+	running_ = false;
+	for (auto &stage : stages_)
+		stage->stage->Stop();
+}
+
+void AnalysisScheduler::Teardown()
+{
+	for (auto &stage : stages_)
+		stage->stage->Teardown();
+	std::lock_guard<std::mutex> lock(mutex_);
+	latest_.reset();
+}
+
+void AnalysisScheduler::Submit(CompletedRequestPtr const &request)
+{
+	if (stages_.empty())
+		return;
+	// The stages get a copy of the frame with nothing in its post_process_metadata (the
+	// earlier results ApplyResults has just added, for one), so that the next results are
+	// only what they set. The copy keeps the frame itself, and so its buffers, to hand.
+	CompletedRequestPtr copy(new CompletedRequest(*request), [request](CompletedRequest *r) { delete r; });
+	copy->post_process_metadata.Clear();
+	std::lock_guard<std::mutex> lock(mutex_);
+	push(0, { std::move(copy), Clock::now(), false, {} });
+}
+
+void AnalysisScheduler::ApplyResults(CompletedRequestPtr &request)
+{
+	std::shared_ptr<Results const> results;
+	std::string overrun;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		results = latest_;
+		for (auto &stage : stages_)
+		{
+			if (stage->overrun)
+				overrun += (overrun.empty() ? "" : ",") + stage->name;
+			stage->overrun = false;
+		}
+	}
+	if (results)
+		results->CopyInto(request->post_process_metadata);
+	// The stages that have skipped frames since the last one out.
+	if (!overrun.empty())
+		request->post_process_metadata.Set("analysis.overrun", overrun);
+}
+
+void AnalysisScheduler::push(unsigned int index, Job &&job)
+{
+	Stage &stage = *stages_[index];
+	if (stage.queue.size() >= stage.queue_depth)
+	{
+		stage.skipped->Inc();
+		stage.overrun = true;
+		if (stage.drop_newest)
+			return;
+		stage.queue.pop_front();
+	}
+	stage.queue.push_back(std::move(job));
+	stage.cond_var.notify_one();
+}
+
+void AnalysisScheduler::stageThread(unsigned int index)
+{
+	ThreadPolicy::Get().Apply(ThreadPolicy::OTHER, "analysis");
+	// Capture and encoding come first.
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
+
+	Stage &stage = *stages_[index];
+	bool last = index + 1 == stages_.size();
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (true)
+	{
+		stage.cond_var.wait(lock, [&] { return abort_ || !stage.queue.empty(); });
+		if (abort_)
+			return;
+		Job job = std::move(stage.queue.front());
+		stage.queue.pop_front();
+		lock.unlock();
+
+		Clock::time_point start = Clock::now();
+		// A stage may want to drop the frame, which here just means skipping the rest.
+		if (!job.dropped)
+			job.dropped = stage.stage->Process(job.request);
+		Clock::time_point end = Clock::now();
+		int64_t queued_us = std::chrono::duration_cast<std::chrono::microseconds>(start - job.queued).count();
+		int64_t process_us = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+		stage.queued->Observe(queued_us);
+		stage.process->Observe(process_us);
+		job.timing.stages.push_back({ stage.name, queued_us, process_us });
+
+		if (!last)
+		{
+			job.queued = end;
+			lock.lock();
+			if (!abort_)
+				push(index + 1, std::move(job));
+			continue;
+		}
+
+		// The frame itself may still be on its way elsewhere, so its results are moved out
+		// of the stages' copy.
+		auto fresh = std::make_shared<Results>();
+		fresh->Dynamic() = std::move(job.request->post_process_metadata);
+		fresh->Set<AnalysisTimingTag>(std::move(job.timing));
+		std::shared_ptr<Results const> results = std::move(fresh);
+		job.request.reset();
+		frames_->Inc();
+
+		lock.lock();
+		latest_.swap(results);
+		// Let the old results go (if ApplyResults has finished with them) without the lock.
+		lock.unlock();
+		results.reset();
+		lock.lock();
+	}
+}
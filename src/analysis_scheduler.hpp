@@ -0,0 +1,141 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * analysis_scheduler.hpp - run post processing stages off the video path.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "core/completed_request.hpp"
+#include "core/dl_lib.hpp"
+#include "core/metadata.hpp"
+
+#include "metrics.hpp"
+#include "tagged_metadata.hpp"
+
+class PostProcessingStage;
+class RPiCamApp;
+
+// rpicam_app's own post processing (--post-process-file) sits in the request path: no
+// frame reaches us, and so NDI, until every stage has finished with it. That's what
+// drawing stages need, but for analysis, such as object detection, it just adds the
+// model's latency to the video.
+//
+// Here, the same stages run on frames the main loop hands over, each stage on a thread of
+// its own at a lower priority, so that a slow model holds up nothing but itself. Each stage
+// has a bounded queue in front of it (queue_depth in its parameters, 1 by default), so at
+// most the depths plus one frame a stage are out with us at once, and the camera never
+// runs short of buffers. When a queue is full, queue_drop says whether its oldest frame
+// ("oldest", the default, so inference starts on the newest frame) or the new one
+// ("newest", for stages that want an unbroken run) is skipped. Either way nothing waits;
+// the next frame out is tagged with "analysis.overrun" instead. Each frame gets the latest
+// results, and how long they spent in each stage as "analysis.timing", in its
+// post_process_metadata, once they are ready.
+//
+// TensorFlow Lite stages are given the cores the video path leaves over, as their
+// number_of_threads, and a refresh_rate of 1, as skipping stale frames already keeps
+// them from falling behind (either can still be set in the file). Stages that draw on the
+// image don't belong here, as the frame may already be on its way to NDI.
+
+// Where a set of results has been, stage by stage.
+struct AnalysisTiming
+{
+	struct Stage
+	{
+		std::string name;
+		// Waiting in the stage's queue, and in the stage itself.
+		int64_t queued_us;
+		int64_t process_us;
+	};
+	std::vector<Stage> stages;
+};
+
+struct AnalysisTimingTag
+{
+	typedef AnalysisTiming Type;
+	static constexpr char NAME[] = "analysis.timing";
+};
+
+class AnalysisScheduler
+{
+public:
+	// The file is in the same format as --post-process-file, and the stages are found in
+	// the same libraries. A threads of 0 picks the number of cores not needed for video.
+	AnalysisScheduler(RPiCamApp *app, std::string const &file, std::string const &libs_dir, unsigned int threads);
+	~AnalysisScheduler();
+
+	// As for the PostProcessor: once the camera is configured, before it starts, once it
+	// has stopped, and before it is reconfigured.
+	void Configure();
+	void Start();
+	void Stop();
+	void Teardown();
+
+	// Never waits, whatever the stages are doing.
+	void Submit(CompletedRequestPtr const &request);
+	// Add the latest results to the frame's post_process_metadata, wherever it has
+	// nothing of its own.
+	void ApplyResults(CompletedRequestPtr &request);
+
+private:
+	// Cores to leave for capture, encoding and sending.
+	static constexpr unsigned int VIDEO_CORES = 2;
+
+	typedef std::chrono::steady_clock Clock;
+
+	struct Job
+	{
+		CompletedRequestPtr request;
+		Clock::time_point queued;
+		// Once a stage drops the frame, the rest just pass it along.
+		bool dropped;
+		AnalysisTiming timing;
+	};
+
+	struct Stage
+	{
+		std::unique_ptr<PostProcessingStage> stage;
+		std::string name;
+		unsigned int queue_depth;
+		bool drop_newest;
+		std::deque<Job> queue;
+		std::condition_variable cond_var;
+		std::thread thread;
+		// Set when the queue overruns, until the next frame out has been tagged.
+		bool overrun;
+		Metrics::Counter *skipped;
+		Metrics::Histogram *queued;
+		Metrics::Histogram *process;
+	};
+
+	// With the lock held.
+	void push(unsigned int index, Job &&job);
+	void stageThread(unsigned int index);
+
+	// What the stages left in the last frame through them, and its timing.
+	typedef TaggedMetadata<AnalysisTimingTag> Results;
+
+	RPiCamApp *app_;
+	std::vector<DlLib> libs_;
+	std::vector<std::unique_ptr<Stage>> stages_;
+
+	// For every queue, and the results.
+	std::mutex mutex_;
+	bool abort_;
+	bool running_;
+	// Replaced whole, never changed, so that ApplyResults only holds the lock to take a
+	// reference, and copies the results out after.
+	std::shared_ptr<Results const> latest_;
+
+	Metrics::Counter *frames_;
+};
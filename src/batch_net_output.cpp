@@ -0,0 +1,128 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * batch_net_output.cpp - send output over network, in as few system calls as we can.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "core/logging.hpp"
+
+#include "batch_net_output.hpp"
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+BatchNetOutput::BatchNetOutput(VideoOptions const *options)
+	: Output(options), gso_(false)
+{
+	std::string const &output = options->Get().output;
+	tcp_ = output.rfind("tcp://", 0) == 0;
+	if (!tcp_ && output.rfind("udp://", 0) != 0)
+		throw std::runtime_error("BatchNetOutput: unrecognised address " + output);
+	size_t colon = output.rfind(':');
+	if (colon < 6)
+		throw std::runtime_error("BatchNetOutput: " + output + " has no port");
+
+	sockaddr_in saddr = {};
+	saddr.sin_family = AF_INET;
+	saddr.sin_port = htons(std::stoi(output.substr(colon + 1)));
+	std::string address = output.substr(6, colon - 6);
+	if (!inet_aton(address.c_str(), &saddr.sin_addr))
+		throw std::runtime_error("BatchNetOutput: bad address " + address);
+
+	fd_ = libcamera::UniqueFD(socket(AF_INET, tcp_ ? SOCK_STREAM : SOCK_DGRAM, 0));
+	if (!fd_.isValid())
+		throw std::runtime_error("BatchNetOutput: unable to open socket");
+
+	if (tcp_ && options->Get().listen)
+	{
+		int enable = 1;
+		setsockopt(fd_.get(), SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+		if (bind(fd_.get(), (sockaddr *)&saddr, sizeof(saddr)) < 0 || listen(fd_.get(), 1) < 0)
+			throw std::runtime_error("BatchNetOutput: failed to listen on " + output);
+		LOG(2, "Waiting for client to connect to " << output);
+		int client = accept(fd_.get(), nullptr, nullptr);
+		if (client < 0)
+			throw std::runtime_error("BatchNetOutput: accept failed");
+		fd_.reset(client);
+	}
+	// A connected UDP socket needs no address with each datagram.
+	else if (connect(fd_.get(), (sockaddr *)&saddr, sizeof(saddr)) < 0)
+		throw std::runtime_error("BatchNetOutput: failed to connect to " + output);
+
+	if (!tcp_)
+	{
+		int segment = UDP_PAYLOAD;
+		gso_ = !setsockopt(fd_.get(), SOL_UDP, UDP_SEGMENT, &segment, sizeof(segment));
+	}
+	LOG(2, "BatchNetOutput: sending to " << output << (gso_ ? " with UDP segmentation offload" : ""));
+}
+
+void BatchNetOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	if (tcp_)
+		sendTcp((uint8_t *)mem, size);
+	else
+		sendUdp((uint8_t *)mem, size);
+}
+
+void BatchNetOutput::sendUdp(uint8_t *data, size_t size)
+{
+	// Each message is a datagram, or with segmentation offload, a run of them. All point
+	// straight into the encoder's buffer.
+	size_t message_size = gso_ ? UDP_PAYLOAD * GSO_SEGMENTS : UDP_PAYLOAD;
+	iovec iov[MAX_BATCH];
+	mmsghdr msgs[MAX_BATCH];
+	while (size)
+	{
+		unsigned int n = 0;
+		for (size_t offset = 0; n < MAX_BATCH && offset < size; n++, offset += message_size)
+		{
+			iov[n].iov_base = data + offset;
+			iov[n].iov_len = std::min(message_size, size - offset);
+			msgs[n] = {};
+			msgs[n].msg_hdr.msg_iov = &iov[n];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+		}
+
+		int sent = sendmmsg(fd_.get(), msgs, n, 0);
+		if (sent < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			// Nobody listening, or the network is busy. The rest of the frame is lost, as
+			// it would be anyway over UDP.
+			LOG(2, "BatchNetOutput: send failed: " << strerror(errno));
+			return;
+		}
+		for (int i = 0; i < sent; i++)
+		{
+			data += iov[i].iov_len;
+			size -= iov[i].iov_len;
+		}
+	}
+}
+
+void BatchNetOutput::sendTcp(uint8_t *data, size_t size)
+{
+	while (size)
+	{
+		ssize_t sent = send(fd_.get(), data, size, MSG_NOSIGNAL);
+		if (sent < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error(std::string("BatchNetOutput: send failed: ") + strerror(errno));
+		}
+		data += sent;
+		size -= sent;
+	}
+}
@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * batch_net_output.hpp - send output over network, in as few system calls as we can.
+ */
+
+#pragma once
+
+#include <netinet/in.h>
+
+#include <libcamera/base/unique_fd.h>
+
+#include "output/output.hpp"
+
+// Takes the same udp:// and tcp:// outputs (and --listen) as NetOutput, but sends every
+// frame straight from the encoder's buffer without copying it first.
+//
+// Over UDP, a frame is cut into datagrams that fit the MTU. Where the kernel can do that
+// itself (UDP_SEGMENT), each system call hands it up to 64KB at a time, and otherwise
+// each system call is a sendmmsg of many datagrams, rather than one call per datagram.
+// Over TCP, each frame is a plain send. MSG_ZEROCOPY doesn't pay there: the encoder's
+// buffer goes back to it as soon as we return, long before the kernel is done
+// transmitting, so the frame would need copying first anyway.
+
+class BatchNetOutput : public Output
+{
+public:
+	BatchNetOutput(VideoOptions const *options);
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	// A datagram that fits in a 1500 byte Ethernet frame.
+	static constexpr size_t UDP_PAYLOAD = 1472;
+	// The most the kernel segments from one send, in whole datagrams under its 64KB limit,
+	static constexpr size_t GSO_SEGMENTS = 44;
+	// and how many sends we give it in each system call.
+	static constexpr unsigned int MAX_BATCH = 64;
+
+	void sendUdp(uint8_t *data, size_t size);
+	void sendTcp(uint8_t *data, size_t size);
+
+	// Closed for us, even if the constructor throws.
+	libcamera::UniqueFD fd_;
+	bool tcp_;
+	bool gso_;
+};
@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * bitmap_font.hpp - the 5x7 font the overlay and slate draw with.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+// A 5x7 font, each row's leftmost pixel in bit 4.
+struct Glyph
+{
+	char c;
+	uint8_t rows[7];
+};
+
+constexpr unsigned int GLYPH_WIDTH = 5, GLYPH_HEIGHT = 7;
+
+// Letters come out in capitals, and anything the font doesn't have as a question mark.
+Glyph const &glyph_for(char c);
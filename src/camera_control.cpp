@@ -0,0 +1,164 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * camera_control.cpp - exposure, white balance, focus and shading from NDI receivers.
+ */
+
+#include <algorithm>
+#include <cmath>
+
+#include <libcamera/control_ids.h>
+
+#include "core/logging.hpp"
+
+#include "camera_control.hpp"
+#include "ndi_metadata.hpp"
+#include "raspindi_config.hpp"
+
+using namespace libcamera;
+
+// NDI's PTZ commands give levels from 0 to 1.
+static bool level_attribute(std::string const &xml, char const *name, float &value)
+{
+	if (!metadata_attribute(xml, name, value))
+		return false;
+	value = std::clamp(value, 0.0f, 1.0f);
+	return true;
+}
+
+CameraControl::CameraControl()
+	: pending_(false), controls_(controls::controls), one_push_(false), applied_(controls::controls)
+{
+}
+
+void CameraControl::Command(std::string const &xml)
+{
+	std::string name = metadata_element(xml), mode;
+	metadata_attribute(xml, "mode", mode);
+	ControlList cl(controls::controls);
+	bool one_push = false;
+	float value, red, blue;
+
+	if (name == "ntk_ptz_exposure" && mode == "auto")
+	{
+		cl.set(controls::ExposureTimeMode, controls::ExposureTimeModeAuto);
+		cl.set(controls::AnalogueGainMode, controls::AnalogueGainModeAuto);
+		cl.set(controls::ExposureValue, 0.0f);
+	}
+	else if (name == "ntk_ptz_exposure")
+	{
+		// An overall level leaves the AE running, and just moves its target.
+		if (level_attribute(xml, "value", value))
+			cl.set(controls::ExposureValue, (value * 2 - 1) * MAX_EV);
+		if (level_attribute(xml, "gain", value))
+		{
+			cl.set(controls::AnalogueGainMode, controls::AnalogueGainModeManual);
+			cl.set(controls::AnalogueGain, 1 + value * (MAX_GAIN - 1));
+		}
+		if (level_attribute(xml, "shutter_speed", value))
+		{
+			cl.set(controls::ExposureTimeMode, controls::ExposureTimeModeManual);
+			cl.set(controls::ExposureTime,
+				   (int32_t)(MIN_EXPOSURE_US * std::pow(MAX_EXPOSURE_US / MIN_EXPOSURE_US, value)));
+		}
+	}
+	else if (name == "ntk_ptz_white_balance")
+	{
+		if (mode == "auto" || mode == "indoor" || mode == "outdoor")
+		{
+			cl.set(controls::AwbEnable, true);
+			cl.set(controls::AwbMode, mode == "indoor"	  ? controls::AwbIndoor
+									  : mode == "outdoor" ? controls::AwbDaylight
+														  : controls::AwbAuto);
+		}
+		else if (mode == "one_push")
+			one_push = true;
+		// Gains from 0.5 to 8, with 2 (about right for daylight) in the middle.
+		else if (mode == "manual" && level_attribute(xml, "red", red) && level_attribute(xml, "blue", blue))
+			cl.set(controls::ColourGains,
+				   Span<const float, 2>({ std::exp2(red * 4 - 1), std::exp2(blue * 4 - 1) }));
+	}
+	else if (name == "ntk_ptz_focus" && mode == "auto")
+		cl.set(controls::AfMode, controls::AfModeContinuous);
+	else if (name == "ntk_ptz_focus" && level_attribute(xml, "distance", value))
+	{
+		// From infinity to as close as it goes.
+		cl.set(controls::AfMode, controls::AfModeManual);
+		cl.set(controls::LensPosition, value * MAX_DIOPTRES);
+	}
+	else if (name == "raspindi_ccu")
+	{
+		// Just as the config file would set them.
+		RaspindiConfig config;
+		std::string text;
+		if (metadata_attribute(xml, "awb", text))
+			config.awb = text;
+		if (metadata_attribute(xml, "exposuremode", text))
+			config.exposuremode = text;
+		if (metadata_attribute(xml, "meteringmode", text))
+			config.meteringmode = text;
+		if (metadata_attribute(xml, "r_gain", value))
+			config.r_gain = value;
+		if (metadata_attribute(xml, "b_gain", value))
+			config.b_gain = value;
+		if (metadata_attribute(xml, "gain", value))
+			config.gain = value;
+		if (metadata_attribute(xml, "saturation", value))
+			config.saturation = value;
+		if (metadata_attribute(xml, "sharpness", value))
+			config.sharpness = value;
+		if (metadata_attribute(xml, "contrast", value))
+			config.contrast = value;
+		if (metadata_attribute(xml, "brightness", value))
+			config.brightness = std::clamp((int)value, 0, 100);
+		try
+		{
+			cl = config.Controls();
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR("Ignoring camera settings from receiver: " << e.what());
+			return;
+		}
+	}
+
+	if (cl.empty() && !one_push)
+		return;
+	std::lock_guard<std::mutex> lock(mutex_);
+	// Later values replace earlier ones, so a burst of them comes to one update.
+	controls_.merge(cl, ControlList::MergePolicy::OverwriteExisting);
+	one_push_ |= one_push;
+	pending_ = true;
+}
+
+bool CameraControl::Update(ControlList const &metadata, ControlList &controls)
+{
+	if (!pending_.load(std::memory_order_relaxed))
+		return false;
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (one_push_)
+	{
+		// Fix the gains AWB has now.
+		auto colour_gains = metadata.get(controls::ColourGains);
+		if (colour_gains && colour_gains->size() == 2)
+		{
+			controls_.set(controls::ColourGains, Span<const float, 2>({ (*colour_gains)[0], (*colour_gains)[1] }));
+			one_push_ = false;
+		}
+	}
+	pending_ = one_push_;
+	if (controls_.empty())
+		return false;
+	controls.merge(controls_, ControlList::MergePolicy::OverwriteExisting);
+	applied_.merge(controls_, ControlList::MergePolicy::OverwriteExisting);
+	controls_.clear();
+	return true;
+}
+
+ControlList CameraControl::Controls()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return applied_;
+}
@@ -0,0 +1,60 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * camera_control.hpp - exposure, white balance, focus and shading from NDI receivers.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <string>
+
+#include <libcamera/controls.h>
+
+// Lets receivers shade the camera remotely. PTZ tools send their exposure, white balance
+// and focus commands as ntk_ptz_ metadata, and CCU panels can send any of the camera
+// settings /etc/raspindi.conf takes as the attributes of a <raspindi_ccu .../> element, for
+// example <raspindi_ccu gain="2" saturation="1.2" awb="custom" r_gain="1.8" b_gain="1.5"/>.
+//
+// Commands arrive on the metadata thread, often as a burst of them while a slider moves,
+// and each only updates the pending controls; the main loop then picks up whatever the
+// latest values are once a frame (see Update), so it never passes more than one set of
+// controls to the camera per frame, however many messages came in. Everything applied
+// is also remembered, so that it survives the camera restarting.
+
+class CameraControl
+{
+public:
+	CameraControl();
+
+	// From receivers. Anything we don't understand is ignored.
+	void Command(std::string const &xml);
+
+	// Main loop only, with each frame's metadata. Adds the controls that have changed since
+	// the last call to controls, and returns true if there were any.
+	bool Update(libcamera::ControlList const &metadata, libcamera::ControlList &controls);
+
+	// Every control receivers have set so far, to apply when the camera starts.
+	libcamera::ControlList Controls();
+
+	// What to advertise to receivers.
+	static constexpr char const *CCU_CAPABILITY = "<raspindi_ccu enabled=\"true\"/>";
+
+private:
+	// How the 0 to 1 ranges of NDI's PTZ commands map onto the camera.
+	static constexpr float MAX_EV = 2; // either way, for the exposure level
+	static constexpr float MAX_GAIN = 16;
+	static constexpr float MIN_EXPOSURE_US = 100;
+	static constexpr float MAX_EXPOSURE_US = 33333;
+	static constexpr float MAX_DIOPTRES = 10; // as close as focus goes (10cm)
+
+	std::mutex mutex_;
+	// Set while there's something pending, so that usually the main loop needn't lock.
+	std::atomic<bool> pending_;
+	libcamera::ControlList controls_;
+	// A one-push white balance waits for the next frame's colour gains.
+	bool one_push_;
+	libcamera::ControlList applied_;
+};
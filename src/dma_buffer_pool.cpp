@@ -0,0 +1,78 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * dma_buffer_pool.cpp - dma-heap buffers that outlive the encoders using them.
+ */
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "core/logging.hpp"
+
+#include "dma_buffer_pool.hpp"
+#include "metrics.hpp"
+
+DmaBufferPool &DmaBufferPool::Get()
+{
+	static DmaBufferPool pool;
+	return pool;
+}
+
+DmaBufferPool::~DmaBufferPool()
+{
+	for (auto &allocation : allocations_)
+		munmap(allocation.mem, allocation.size);
+}
+
+bool DmaBufferPool::Acquire(size_t size, Buffer &buffer)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto it = free_.lower_bound(size);
+	if (it != free_.end() && it->first <= 2 * size)
+	{
+		buffer = it->second;
+		free_.erase(it);
+		return true;
+	}
+
+	if (!heap_)
+	{
+		heap_ = std::make_unique<DmaHeap>();
+		Metrics::Get().AddGaugeFunction("raspindi_dma_pool_bytes", "Memory held in the dma buffer pool", [this] {
+			std::lock_guard<std::mutex> lock(mutex_);
+			size_t total = 0;
+			for (auto const &allocation : allocations_)
+				total += allocation.size;
+			return (double)total;
+		}, this);
+	}
+	if (!heap_->isValid())
+		return false;
+
+	size_t page = sysconf(_SC_PAGESIZE);
+	size = (size + page - 1) / page * page;
+	libcamera::UniqueFD fd = heap_->alloc("raspindi", size);
+	if (!fd.isValid())
+	{
+		LOG(1, "Failed to allocate a " << size << " byte dma buffer");
+		return false;
+	}
+	// Fault every page in now, rather than on the first frames written to it.
+	void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd.get(), 0);
+	if (mem == MAP_FAILED)
+	{
+		LOG(1, "Failed to map a " << size << " byte dma buffer");
+		return false;
+	}
+	buffer = { fd.get(), mem, size };
+	allocations_.push_back({ std::move(fd), mem, size });
+	LOG(2, "Allocated a " << size << " byte dma buffer, " << allocations_.size() << " now in the pool");
+	return true;
+}
+
+void DmaBufferPool::Release(Buffer const &buffer)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	free_.emplace(buffer.size, buffer);
+}
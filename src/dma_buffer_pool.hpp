@@ -0,0 +1,63 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * dma_buffer_pool.hpp - dma-heap buffers that outlive the encoders using them.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <libcamera/base/unique_fd.h>
+
+#include "core/dma_heaps.hpp"
+
+// Every restart (a camera timeout, a mode change) tears the encoders down and builds them
+// again, and each time they used to free their contiguous (CMA) buffers and ask for new
+// ones. On a 1GB Pi that has been up for days, CMA gets too fragmented for that to keep
+// working. Buffers from here are allocated once, mapped once with their pages faulted in,
+// and handed back to the pool rather than freed, so a restart just picks up the same
+// buffers again.
+//
+// Buffers are matched by size, taking the smallest free one that is big enough but not
+// wastefully so. They are never freed before the process exits. The mappings are cached,
+// so whoever reads a buffer a device wrote must bracket that with DMA_BUF_IOCTL_SYNC.
+
+class DmaBufferPool
+{
+public:
+	struct Buffer
+	{
+		int fd;
+		void *mem;
+		size_t size;
+	};
+
+	static DmaBufferPool &Get();
+
+	// Returns false if there's no dma heap, or it has no room.
+	bool Acquire(size_t size, Buffer &buffer);
+	void Release(Buffer const &buffer);
+
+private:
+	DmaBufferPool() = default;
+	~DmaBufferPool();
+
+	struct Allocation
+	{
+		libcamera::UniqueFD fd;
+		void *mem;
+		size_t size;
+	};
+
+	std::mutex mutex_;
+	std::unique_ptr<DmaHeap> heap_;
+	std::vector<Allocation> allocations_;
+	// The free ones, by size.
+	std::multimap<size_t, Buffer> free_;
+};
@@ -0,0 +1,121 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * encoder_branch.cpp - an extra encoder and output fed from the camera.
+ */
+
+#include "core/buffer_sync.hpp"
+#include "core/logging.hpp"
+
+#include "batch_net_output.hpp"
+#include "encoder_branch.hpp"
+#include "iso_output.hpp"
+#include "mjpeg_slice_encoder.hpp"
+#include "rpicam_ndi_app.hpp"
+#include "rtsp_output.hpp"
+
+using namespace std::placeholders;
+
+EncoderBranch::EncoderBranch(RPiCamApp *app, NDIOptions const *options, std::string const &description,
+							 RPiCamApp::Stream *stream)
+	: app_(app), description_(description), stream_(stream), options_(std::make_unique<NDIOptions>()),
+	  replay_(nullptr), queue_(options->BranchBuffers()), drops_(0)
+{
+	size_t colon = description.find(':');
+	if (colon == std::string::npos || colon == 0 || colon == description.size() - 1)
+		throw std::runtime_error("branch " + description + " should be codec:output");
+
+	options_->Set() = options->Get();
+	options_->Set().codec = description.substr(0, colon);
+	options_->Set().output = description.substr(colon + 1);
+	options_->mjpeg_threads = options->mjpeg_threads;
+	options_->mjpeg_affinity = options->mjpeg_affinity;
+
+	info_ = app_->GetStreamInfo(stream_);
+	if (options_->Get().output.rfind("replay:", 0) == 0)
+	{
+		// Replays must be playable from any keyframe.
+		options_->Set().inline_headers = true;
+		replay_ = new ReplayOutput(options_.get(), options_->Get().output.substr(7), options->replay_seconds);
+		output_ = std::unique_ptr<Output>(replay_);
+	}
+	else if (options_->Get().output.rfind("rtsp://", 0) == 0)
+	{
+		// Each client starts at a keyframe, which must bring its own SPS and PPS.
+		options_->Set().inline_headers = true;
+		output_ = std::make_unique<RtspOutput>(options_.get());
+	}
+	else if (options_->Get().output.rfind("iso:", 0) == 0)
+	{
+		// Each fragment starts at a keyframe, with its own SPS and PPS.
+		options_->Set().inline_headers = true;
+		output_ = std::make_unique<IsoOutput>(options_.get(), options_->Get().output.substr(4), info_);
+	}
+	else if (options_->Get().output.rfind("udp://", 0) == 0 || options_->Get().output.rfind("tcp://", 0) == 0)
+		output_ = std::make_unique<BatchNetOutput>(options_.get());
+	else
+		output_ = std::unique_ptr<Output>(Output::Create(options_.get()));
+	if (options_->Get().codec == "mjpeg")
+		encoder_ = std::make_unique<MjpegSliceEncoder>(options_.get(), info_);
+	else
+		encoder_ = std::unique_ptr<Encoder>(Encoder::Create(options_.get(), info_));
+	encoder_->SetInputDoneCallback(std::bind(&EncoderBranch::inputDone, this, _1));
+	encoder_->SetOutputReadyCallback(std::bind(&Output::OutputReady, output_.get(), _1, _2, _3, _4));
+
+	std::string label = Metrics::Label("branch", description_);
+	drops_counter_ = &Metrics::Get().AddCounter("raspindi_branch_drops_total",
+												"Frames a branch dropped because its encoder was busy", label);
+	Metrics::Get().AddGaugeFunction("raspindi_branch_queue_depth", "Frames waiting for a branch's encoder",
+									[this] { return queue_.Size(); }, this, label);
+	LOG(1, "Branch " << description_ << " encoding " << info_.width << "x" << info_.height);
+}
+
+EncoderBranch::~EncoderBranch()
+{
+	Metrics::Get().RemoveGaugeFunctions(this);
+	// The encoder must finish with (and return) its buffers before the output goes.
+	encoder_.reset();
+	output_.reset();
+	CompletedRequestPtr completed_request;
+	while (queue_.TryPop(completed_request))
+		completed_request.reset();
+	if (drops_)
+		LOG(1, "Branch " << description_ << " dropped " << drops_ << " frames");
+}
+
+void EncoderBranch::Trigger(bool on)
+{
+	if (replay_)
+		replay_->Trigger(on);
+}
+
+void EncoderBranch::EncodeBuffer(CompletedRequestPtr &completed_request)
+{
+	RPiCamApp::FrameBuffer *buffer = completed_request->buffers[stream_];
+	// A request can come back without a buffer for our stream, and then has nothing for us.
+	if (!buffer)
+		return;
+	BufferReadSync r(app_, buffer);
+	libcamera::Span span = r.Get()[0];
+	if (!span.data())
+		throw std::runtime_error("no buffer for branch " + description_);
+
+	if (!queue_.Push(completed_request)) // creates a new reference
+	{
+		drops_++;
+		drops_counter_->Inc();
+		return;
+	}
+	encoder_->EncodeBuffer(buffer->planes()[0].fd.get(), span.size(), span.data(), info_,
+						   RPiCamNdiApp::FrameTimestamp(completed_request, buffer));
+}
+
+void EncoderBranch::inputDone(void *mem)
+{
+	CompletedRequestPtr completed_request;
+	if (!queue_.TryPop(completed_request))
+		throw std::runtime_error("no buffer to return for branch " + description_);
+	// Dropping the reference here returns the request to the camera, once nobody else
+	// holds one.
+}
@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * encoder_branch.hpp - an extra encoder and output fed from the camera.
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "core/completed_request.hpp"
+#include "core/rpicam_app.hpp"
+#include "encoder/encoder.hpp"
+#include "output/output.hpp"
+
+#include "metrics.hpp"
+#include "ndi_options.hpp"
+#include "replay_output.hpp"
+#include "spsc_ring.hpp"
+
+// Every branch gets the same camera frames as the NDI stream, and encodes and outputs
+// them its own way, for example h264 to a file or circular buffer as an ISO recording,
+// or mjpeg to the network for a confidence monitor. Nothing is copied: each branch just
+// holds another reference to the request until its encoder has finished reading the
+// buffer.
+//
+// A branch is described as "codec:output", where the output is anything --output takes
+// (a file, or a udp:// or tcp:// address, sent by BatchNetOutput), an rtsp:// address to
+// serve (see rtsp_output.hpp), "iso:" and an .mp4 or .mkv file for an ISO recording that
+// a slow disk can't hold up (see iso_output.hpp), or "replay:" and a directory for
+// instant replays (see replay_output.hpp). It inherits every other setting from the main options, so
+// --bitrate, --circular, --listen and so on apply to it too.
+
+class EncoderBranch
+{
+public:
+	EncoderBranch(RPiCamApp *app, NDIOptions const *options, std::string const &description,
+				  RPiCamApp::Stream *stream);
+	~EncoderBranch();
+
+	// Encode the frame, or drop it if the encoder is still busy with earlier ones. A
+	// branch never holds more camera buffers than NDIOptions::BranchBuffers allows, so it
+	// never holds up the NDI stream.
+	void EncodeBuffer(CompletedRequestPtr &completed_request);
+
+	// Start or stop saving a replay, if this is a replay branch.
+	void Trigger(bool on);
+
+	std::string const &Description() const { return description_; }
+
+private:
+	void inputDone(void *mem);
+
+	RPiCamApp *app_;
+	std::string description_;
+	RPiCamApp::Stream *stream_;
+	StreamInfo info_;
+	// Owned separately from the main options, with the codec and output replaced.
+	std::unique_ptr<NDIOptions> options_;
+	std::unique_ptr<Output> output_;
+	ReplayOutput *replay_; // output_, if it is one
+	std::unique_ptr<Encoder> encoder_;
+	SpscRing<CompletedRequestPtr> queue_;
+	unsigned int drops_;
+	Metrics::Counter *drops_counter_;
+};
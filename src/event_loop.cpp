@@ -1,99 +1,171 @@
-/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* SPDX-License-Identifier: BSD-2-Clause */
 /*
- * Copyright (C) 2020, Google Inc.
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
  *
- * event_loop.cpp - Event loop based on cam
+ * event_loop.cpp - one thread for signals, keypresses, sockets and timers.
  */
 
-#include "event_loop.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
 
-#include <assert.h>
-#include <event2/event.h>
-#include <event2/thread.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
 
-EventLoop *EventLoop::instance_ = nullptr;
+#include "core/logging.hpp"
 
-EventLoop::EventLoop()
-{
-	assert(!instance_);
+#include "event_loop.hpp"
+#include "thread_policy.hpp"
 
-	evthread_use_pthreads();
-	event_ = event_base_new();
-	instance_ = this;
+EventLoop::EventLoop() : signal_fd_(-1), abort_(false)
+{
+	epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+	wake_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (epoll_fd_ < 0 || wake_fd_ < 0)
+		throw std::runtime_error("failed to create the event loop");
+	sigemptyset(&signals_);
+	add(wake_fd_, { WAKE, nullptr, nullptr });
 }
 
 EventLoop::~EventLoop()
 {
-	instance_ = nullptr;
-
-	event_base_free(event_);
-	libevent_global_shutdown();
+	Stop();
+	for (auto const &[fd, handler] : handlers_)
+	{
+		if (handler.kind != FD)
+			close(fd);
+	}
+	close(epoll_fd_);
 }
 
-int EventLoop::exec()
+void EventLoop::add(int fd, Handler &&handler)
 {
-	exitCode_ = -1;
-	exit_.store(false, std::memory_order_release);
+	epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.fd = fd;
+	if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) < 0)
+		throw std::runtime_error(std::string("failed to add to the event loop: ") + strerror(errno));
+	std::lock_guard<std::mutex> lock(mutex_);
+	handlers_[fd] = std::move(handler);
+}
 
-	while (!exit_.load(std::memory_order_acquire)) {
-		dispatchCalls();
-		event_base_loop(event_, EVLOOP_NO_EXIT_ON_EMPTY);
+void EventLoop::AddSignal(int signal, Callback callback)
+{
+	sigaddset(&signals_, signal);
+	if (pthread_sigmask(SIG_BLOCK, &signals_, nullptr))
+		throw std::runtime_error("failed to block signal " + std::to_string(signal));
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		signal_callbacks_[signal] = callback;
 	}
-
-	return exitCode_;
+	// Passing the existing signalfd just updates its mask.
+	int fd = signalfd(signal_fd_, &signals_, SFD_CLOEXEC | SFD_NONBLOCK);
+	if (fd < 0)
+		throw std::runtime_error("failed to create a signalfd");
+	if (signal_fd_ < 0)
+		add(signal_fd_ = fd, { SIGNALS, nullptr, nullptr });
 }
 
-void EventLoop::exit(int code)
+bool EventLoop::AddFd(int fd, FdCallback callback)
 {
-	exitCode_ = code;
-	exit_.store(true, std::memory_order_release);
-	interrupt();
+	try
+	{
+		add(fd, { FD, callback, nullptr });
+	}
+	catch (std::exception const &e)
+	{
+		LOG(1, "Not watching fd " << fd << ", " << e.what());
+		return false;
+	}
+	return true;
 }
 
-void EventLoop::interrupt()
+void EventLoop::RemoveFd(int fd)
 {
-	event_base_loopbreak(event_);
+	std::lock_guard<std::mutex> lock(mutex_);
+	epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+	handlers_.erase(fd);
 }
 
-
-void EventLoop::timeoutTriggered(int fd, short event, void *arg)
+void EventLoop::AddTimer(std::chrono::milliseconds period, Callback callback)
 {
-	EventLoop *self = static_cast<EventLoop *>(arg);
-	self->exit();
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (fd < 0)
+		throw std::runtime_error("failed to create a timerfd");
+	itimerspec spec = {};
+	spec.it_interval.tv_sec = period.count() / 1000;
+	spec.it_interval.tv_nsec = (period.count() % 1000) * 1000000;
+	spec.it_value = spec.it_interval;
+	timerfd_settime(fd, 0, &spec, nullptr);
+	add(fd, { TIMER, nullptr, callback });
 }
 
-void EventLoop::timeout(unsigned int sec)
+void EventLoop::Start()
 {
-	struct event *ev;
-	struct timeval tv;
-
-	tv.tv_sec = sec;
-	tv.tv_usec = 0;
-	ev = evtimer_new(event_, &timeoutTriggered, this);
-	evtimer_add(ev, &tv);
+	abort_ = false;
+	loop_thread_ = std::thread(&EventLoop::loopThread, this);
 }
 
-void EventLoop::callLater(const std::function<void()> &func)
+void EventLoop::Stop()
 {
-	{
-		std::unique_lock<std::mutex> locker(lock_);
-		calls_.push_back(func);
-	}
-
-	interrupt();
+	if (!loop_thread_.joinable())
+		return;
+	abort_ = true;
+	uint64_t one = 1;
+	[[maybe_unused]] ssize_t n = write(wake_fd_, &one, sizeof(one));
+	loop_thread_.join();
 }
 
-void EventLoop::dispatchCalls()
+void EventLoop::loopThread()
 {
-	std::unique_lock<std::mutex> locker(lock_);
-
-	for (auto iter = calls_.begin(); iter != calls_.end(); ) {
-		std::function<void()> call = std::move(*iter);
+	ThreadPolicy::Get().Apply(ThreadPolicy::OTHER, "event-loop");
 
-		iter = calls_.erase(iter);
-
-		locker.unlock();
-		call();
-		locker.lock();
+	epoll_event events[MAX_EVENTS];
+	while (!abort_)
+	{
+		int num = epoll_wait(epoll_fd_, events, MAX_EVENTS, -1);
+		if (num < 0 && errno != EINTR)
+		{
+			LOG_ERROR("Event loop failed: " << strerror(errno));
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (int i = 0; i < num && !abort_; i++)
+		{
+			int fd = events[i].data.fd;
+			// It may have gone since epoll_wait returned.
+			auto it = handlers_.find(fd);
+			if (it == handlers_.end())
+				continue;
+			Handler &handler = it->second;
+			if (handler.kind == SIGNALS)
+			{
+				signalfd_siginfo info;
+				while (read(fd, &info, sizeof(info)) == sizeof(info))
+				{
+					LOG(1, "Received signal " << info.ssi_signo);
+					if (info.ssi_signo < signal_callbacks_.size() && signal_callbacks_[info.ssi_signo])
+						signal_callbacks_[info.ssi_signo]();
+				}
+			}
+			else if (handler.kind == TIMER)
+			{
+				uint64_t expirations;
+				if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+					handler.callback();
+			}
+			else if (handler.kind == FD)
+			{
+				if (!handler.fd_callback())
+				{
+					epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+					handlers_.erase(it);
+				}
+			}
+		}
 	}
 }
@@ -0,0 +1,84 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * event_loop.hpp - one thread for signals, keypresses, sockets and timers.
+ */
+
+#pragma once
+
+#include <signal.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+
+// Everything that isn't a camera frame arrives here, on a single epoll thread: signals
+// (through a signalfd), readable file descriptors such as stdin and listening sockets,
+// and timers (timerfds). The main loop never has to poll for any of them; callbacks just
+// leave it something to pick up (see main.cpp's commands) or get on with the job
+// themselves.
+//
+// Handlers are added up front, so dispatching one allocates nothing, and callbacks must
+// not add or remove handlers themselves. An fd callback returns false to be removed, for
+// example at end of file.
+
+class EventLoop
+{
+public:
+	typedef std::function<void()> Callback;
+	typedef std::function<bool()> FdCallback;
+
+	EventLoop();
+	~EventLoop();
+
+	// Signals are blocked, so that only the signalfd sees them, in the calling thread and any
+	// it starts from then on. So add them all from the main thread, before anything else
+	// starts a thread.
+	void AddSignal(int signal, Callback callback);
+	// Called whenever fd is readable. Returns false if fd can't be waited for (a regular
+	// file, say).
+	bool AddFd(int fd, FdCallback callback);
+	void RemoveFd(int fd);
+	void AddTimer(std::chrono::milliseconds period, Callback callback);
+
+	void Start();
+	void Stop();
+
+private:
+	static constexpr unsigned int MAX_EVENTS = 16;
+
+	enum Kind
+	{
+		WAKE,
+		SIGNALS,
+		FD,
+		TIMER
+	};
+
+	struct Handler
+	{
+		Kind kind;
+		FdCallback fd_callback;
+		Callback callback;
+	};
+
+	void add(int fd, Handler &&handler);
+	void loopThread();
+
+	int epoll_fd_;
+	// Written to stop the loop.
+	int wake_fd_;
+	int signal_fd_;
+	sigset_t signals_;
+	std::array<Callback, _NSIG> signal_callbacks_;
+	// By fd. Held while dispatching, so that handlers are never removed mid-call.
+	std::mutex mutex_;
+	std::map<int, Handler> handlers_;
+	std::atomic<bool> abort_;
+	std::thread loop_thread_;
+};
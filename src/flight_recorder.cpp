@@ -0,0 +1,296 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * flight_recorder.cpp - the last few minutes of pipeline events, kept for post-mortems.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+#include "core/logging.hpp"
+
+#include "flight_recorder.hpp"
+
+static char const SHM_DIR[] = "/dev/shm";
+static char const SHM_PREFIX[] = "raspindi-flight.";
+
+static constexpr int NO_RING = -2;
+
+// Each thread's claim on a ring, given up as the thread exits.
+struct FlightRingClaim
+{
+	int index = -1;
+	~FlightRingClaim()
+	{
+		if (index >= 0)
+			FlightRecorder::Get().release(index);
+	}
+};
+
+static thread_local FlightRingClaim claim;
+
+static int64_t clock_ns(clockid_t clock)
+{
+	timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// How much of the file a dump needs, leaving out the rings nobody has used.
+static size_t used_size(FlightRecorderHeader const *header)
+{
+	return FlightRecorderHeader::SIZE + (size_t)header->num_rings * header->capacity * sizeof(FlightEvent);
+}
+
+FlightRecorder &FlightRecorder::Get()
+{
+	static FlightRecorder recorder;
+	return recorder;
+}
+
+FlightRecorder::FlightRecorder() : header_(nullptr), events_(nullptr), size_(0), crash_path_()
+{
+	for (auto &in_use : in_use_)
+		in_use = false;
+}
+
+void FlightRecorder::Start(std::string const &dir, uint32_t capacity)
+{
+	dir_ = dir;
+	saveLeftovers();
+
+	shm_path_ = std::string(SHM_DIR) + "/" + SHM_PREFIX + std::to_string(getpid());
+	size_ = FlightRecorderHeader::SIZE + (size_t)FlightRecorderHeader::MAX_RINGS * capacity * sizeof(FlightEvent);
+	// Left sparse, so that rings only cost memory once a thread writes to them.
+	int fd = open(shm_path_.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0 || ftruncate(fd, size_) < 0)
+	{
+		LOG_ERROR("Flight recorder can't make " << shm_path_ << ": " << strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	void *mem = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED)
+	{
+		LOG_ERROR("Flight recorder can't map " << shm_path_ << ": " << strerror(errno));
+		unlink(shm_path_.c_str());
+		return;
+	}
+
+	FlightRecorderHeader *header = (FlightRecorderHeader *)mem;
+	memcpy(header->magic, FlightRecorderHeader::MAGIC, sizeof(header->magic));
+	header->version = FlightRecorderHeader::VERSION;
+	header->event_size = sizeof(FlightEvent);
+	header->num_rings = 0;
+	header->capacity = capacity;
+	header->pid = getpid();
+	header->realtime_offset_ns = clock_ns(CLOCK_REALTIME) - clock_ns(CLOCK_MONOTONIC);
+	events_ = (FlightEvent *)((uint8_t *)mem + FlightRecorderHeader::SIZE);
+	header_ = header;
+
+	snprintf(crash_path_, sizeof(crash_path_), "%s/raspindi-flight-%d-crash.bin", dir_.c_str(), (int)getpid());
+	struct sigaction action = {};
+	action.sa_handler = &FlightRecorder::crashHandler;
+	action.sa_flags = SA_RESETHAND;
+	sigemptyset(&action.sa_mask);
+	for (int sig : { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT })
+		sigaction(sig, &action, nullptr);
+	LOG(2, "Flight recorder keeping " << capacity << " events a thread in " << shm_path_ << ", dumping to "
+									  << dir_);
+}
+
+void FlightRecorder::Stop()
+{
+	if (header_)
+		unlink(shm_path_.c_str());
+}
+
+void FlightRecorder::Record(FlightEvent::Type type, int64_t frame_us, int64_t value, uint16_t detail)
+{
+	if (!header_)
+		return;
+	unsigned int index;
+	FlightRecorderHeader::Ring *ring = this->ring(index);
+	if (!ring)
+		return;
+
+	// Only this thread writes to the ring, so only dumps need the atomics.
+	uint64_t n = ring->written;
+	FlightEvent &event = events_[(size_t)index * header_->capacity + n % header_->capacity];
+	__atomic_store_n(&event.position, FlightEvent::INVALID, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	event.time_ns = clock_ns(CLOCK_MONOTONIC);
+	event.frame_us = frame_us;
+	event.value = value;
+	event.type = type;
+	event.detail = detail;
+	__atomic_store_n(&event.position, (uint32_t)n, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->written, n + 1, __ATOMIC_RELEASE);
+}
+
+FlightRecorderHeader::Ring *FlightRecorder::ring(unsigned int &index)
+{
+	if (claim.index == NO_RING)
+		return nullptr;
+	if (claim.index < 0)
+	{
+		for (unsigned int i = 0; i < FlightRecorderHeader::MAX_RINGS && claim.index < 0; i++)
+		{
+			bool expected = false;
+			if (in_use_[i].compare_exchange_strong(expected, true))
+				claim.index = i;
+		}
+		if (claim.index < 0)
+		{
+			LOG(1, "Flight recorder has no ring left for another thread");
+			claim.index = NO_RING;
+			return nullptr;
+		}
+
+		FlightRecorderHeader::Ring &ring = header_->rings[claim.index];
+		char name[16] = {};
+		pthread_getname_np(pthread_self(), name, sizeof(name));
+		memcpy(ring.thread_name, name, sizeof(ring.thread_name));
+		uint32_t num_rings = __atomic_load_n(&header_->num_rings, __ATOMIC_RELAXED);
+		while (num_rings <= (uint32_t)claim.index &&
+			   !__atomic_compare_exchange_n(&header_->num_rings, &num_rings, claim.index + 1, false, __ATOMIC_RELEASE,
+											__ATOMIC_RELAXED))
+			;
+	}
+	index = claim.index;
+	return &header_->rings[index];
+}
+
+void FlightRecorder::release(unsigned int index)
+{
+	// The events stay, for the next thread to carry on after.
+	in_use_[index] = false;
+}
+
+void FlightRecorder::Dump(char const *reason)
+{
+	if (!header_)
+		return;
+	std::lock_guard<std::mutex> lock(dump_mutex_);
+
+	// Take a copy first, as the rings carry on being written while the file is. The
+	// counts come before the events, so any event overwritten since shows up as such.
+	uint32_t num_rings = __atomic_load_n(&header_->num_rings, __ATOMIC_ACQUIRE);
+	std::vector<uint8_t> copy(FlightRecorderHeader::SIZE + (size_t)num_rings * header_->capacity * sizeof(FlightEvent));
+	FlightRecorderHeader *header = (FlightRecorderHeader *)copy.data();
+	memcpy(header, header_, sizeof(FlightRecorderHeader));
+	for (unsigned int i = 0; i < num_rings; i++)
+		header->rings[i].written = __atomic_load_n(&header_->rings[i].written, __ATOMIC_ACQUIRE);
+	memcpy(copy.data() + FlightRecorderHeader::SIZE, events_, copy.size() - FlightRecorderHeader::SIZE);
+	header->num_rings = num_rings;
+	snprintf(header->reason, sizeof(header->reason), "%s", reason);
+
+	char stamp[32];
+	time_t now = time(nullptr);
+	tm local;
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime_r(&now, &local));
+	std::string path = dir_ + "/raspindi-flight-" + stamp + "-" + reason + ".bin";
+	if (writeFile(path, copy.data(), copy.size()))
+		LOG(1, "Flight recorder dumped to " << path);
+}
+
+bool FlightRecorder::writeFile(std::string const &path, void const *data, size_t size)
+{
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		LOG_ERROR("Flight recorder can't write " << path << ": " << strerror(errno));
+		return false;
+	}
+	for (size_t done = 0; done < size;)
+	{
+		ssize_t ret = write(fd, (uint8_t const *)data + done, size - done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+		{
+			LOG_ERROR("Flight recorder failed writing " << path << ": " << strerror(errno));
+			close(fd);
+			return false;
+		}
+		done += ret;
+	}
+	close(fd);
+	return true;
+}
+
+void FlightRecorder::saveLeftovers()
+{
+	// A raspindi that was killed, or crashed without its handler managing a dump, leaves
+	// its rings behind. Anything of ours still running is left alone.
+	std::error_code ec;
+	for (auto const &entry : std::filesystem::directory_iterator(SHM_DIR, ec))
+	{
+		std::string name = entry.path().filename();
+		if (name.rfind(SHM_PREFIX, 0) != 0)
+			continue;
+		int pid = atoi(name.c_str() + strlen(SHM_PREFIX));
+		if (pid <= 0 || pid == getpid() || kill(pid, 0) == 0 || errno != ESRCH)
+			continue;
+
+		std::ifstream file(entry.path(), std::ios::binary);
+		std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		FlightRecorderHeader const *header = (FlightRecorderHeader const *)data.data();
+		if (data.size() >= FlightRecorderHeader::SIZE &&
+			!memcmp(header->magic, FlightRecorderHeader::MAGIC, sizeof(header->magic)) &&
+			header->num_rings <= FlightRecorderHeader::MAX_RINGS && used_size(header) <= data.size())
+		{
+			FlightRecorderHeader *copy = (FlightRecorderHeader *)data.data();
+			if (!copy->reason[0])
+				snprintf(copy->reason, sizeof(copy->reason), "died");
+			std::string path = dir_ + "/raspindi-flight-" + std::to_string(pid) + "-died.bin";
+			if (writeFile(path, data.data(), used_size(header)))
+				LOG(1, "Flight recorder saved what raspindi " << pid << " left behind to " << path);
+		}
+		std::filesystem::remove(entry.path(), ec);
+	}
+}
+
+void FlightRecorder::crashHandler(int sig)
+{
+	// Nothing here may allocate or take a lock. The rings are written as they are, and the
+	// default action taken once we're done.
+	FlightRecorder &recorder = Get();
+	FlightRecorderHeader *header = recorder.header_;
+	memcpy(header->reason, "crash", sizeof("crash"));
+	int fd = open(recorder.crash_path_, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd >= 0)
+	{
+		uint8_t const *data = (uint8_t const *)header;
+		size_t size = used_size(header), done = 0;
+		while (done < size)
+		{
+			ssize_t ret = write(fd, data + done, size - done);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0)
+				break;
+			done += ret;
+		}
+		close(fd);
+		// Saved, so the next run needn't.
+		if (done == size)
+			unlink(recorder.shm_path_.c_str());
+	}
+	raise(sig);
+}
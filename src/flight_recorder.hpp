@@ -0,0 +1,147 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * flight_recorder.hpp - the last few minutes of pipeline events, kept for post-mortems.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+// When someone reports a stutter at 8:42, there needs to be something to look at. Logging
+// every frame costs too much to leave on, so instead each thread that does anything per
+// frame writes 32 byte events into a ring of its own: frames arriving, going into and
+// coming out of the encoder, being sent, and being dropped (and why), and controls being
+// applied. Writing one is a clock read and a few stores, with no lock and no system call.
+//
+// The rings live in a file in /dev/shm, so they outlast the process. A copy goes to the
+// dump directory on SIGUSR2, when the watchdog sees the main loop stall, or when raspindi
+// fails; on a crash, the signal handler writes it, and failing that, the next run saves
+// whatever a dead process left behind. raspindi_flight prints a dump as one timeline.
+//
+// The layout below is all raspindi_flight needs to read a dump.
+
+struct FlightEvent
+{
+	enum Type : uint16_t
+	{
+		FRAME_ARRIVED = 1, // value is the camera's sequence number
+		ENCODE_START,
+		ENCODE_END, // value is the encoded size, and detail the stream, 1 for low bandwidth
+		SEND_START, // detail as for ENCODE_END
+		SEND_END,
+		DROP, // detail is the Reason
+		CONTROL, // value is how many controls were set
+		HOLD, // value is 1 as the hold starts, and 0 as it ends
+		NUM_TYPES
+	};
+
+	enum Reason : uint16_t
+	{
+		LATE_FOR_ENCODE, // see LatencyBudget
+		LATE_FOR_SEND,
+		AWAITING_KEYFRAME,
+		ENCODER_BUSY, // --latency_profile low
+		ENCODER_BACKLOG, // the encoder fell behind and threw frames away
+		NUM_REASONS
+	};
+
+	// CLOCK_MONOTONIC.
+	int64_t time_ns;
+	// The frame's encoder timestamp, as everything downstream of the main loop knows it
+	// by, or 0.
+	int64_t frame_us;
+	int64_t value;
+	uint16_t type;
+	uint16_t detail;
+	// The low bits of the event's position in its ring, written last (and INVALID before
+	// anything else), so that a reader can tell an event that was being overwritten as the
+	// dump was taken.
+	uint32_t position;
+
+	static constexpr uint32_t INVALID = 0xffffffff;
+};
+static_assert(sizeof(FlightEvent) == 32, "flight events should be 32 bytes");
+
+// Ring r's events follow the header at SIZE + r * capacity * sizeof(FlightEvent). Event n
+// of a ring (counting from the first it ever held) is at n % capacity, so a ring holds
+// events [written - capacity, written) once it has wrapped.
+struct FlightRecorderHeader
+{
+	static constexpr char MAGIC[8] = { 'R', 'N', 'D', 'I', 'F', 'L', 'G', 'T' };
+	static constexpr uint32_t VERSION = 1;
+	static constexpr size_t SIZE = 4096;
+	static constexpr unsigned int MAX_RINGS = 32;
+
+	struct Ring
+	{
+		// The last thread to write to it, as ThreadPolicy named it.
+		char thread_name[16];
+		uint64_t written;
+		uint8_t pad[40];
+	};
+
+	char magic[8];
+	uint32_t version;
+	uint32_t event_size;
+	// How many rings have ever been written to. The rest aren't in a dump.
+	uint32_t num_rings;
+	uint32_t capacity;
+	int64_t pid;
+	// CLOCK_REALTIME less CLOCK_MONOTONIC, in nanoseconds, so that the events can be put
+	// against the wall clock.
+	int64_t realtime_offset_ns;
+	// Why the dump was taken, filled in on the copy.
+	char reason[24];
+	Ring rings[MAX_RINGS];
+};
+static_assert(sizeof(FlightRecorderHeader::Ring) == 64, "flight recorder rings should start on cache lines");
+static_assert(sizeof(FlightRecorderHeader) <= FlightRecorderHeader::SIZE, "flight recorder header too big");
+
+class FlightRecorder
+{
+public:
+	static FlightRecorder &Get();
+
+	// Start recording capacity events per thread, with dumps going to dir, first saving
+	// whatever any raspindi that died left behind there. Call once, from the main thread,
+	// before any others start. Until then (or if this fails), Record does nothing.
+	void Start(std::string const &dir, uint32_t capacity);
+	// On a clean exit, the rings needn't outlast us.
+	void Stop();
+
+	// From any thread. Never blocks, and makes no system calls.
+	void Record(FlightEvent::Type type, int64_t frame_us = 0, int64_t value = 0, uint16_t detail = 0);
+
+	// Copy the rings to a file in the dump directory, named for the time and the reason.
+	// From any thread, but not from a signal handler.
+	void Dump(char const *reason);
+
+private:
+	FlightRecorder();
+
+	// The calling thread's ring, claiming one if it has none, or null if they're all in
+	// use. Threads give theirs up as they exit.
+	FlightRecorderHeader::Ring *ring(unsigned int &index);
+	void release(unsigned int index);
+	void saveLeftovers();
+	bool writeFile(std::string const &path, void const *data, size_t size);
+	static void crashHandler(int sig);
+
+	FlightRecorderHeader *header_;
+	FlightEvent *events_;
+	size_t size_;
+	std::string dir_;
+	std::string shm_path_;
+	// Worked out in advance, as the crash handler can't.
+	char crash_path_[256];
+	std::atomic<bool> in_use_[FlightRecorderHeader::MAX_RINGS];
+	std::mutex dump_mutex_;
+
+	friend struct FlightRingClaim;
+};
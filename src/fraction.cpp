@@ -1,66 +1,46 @@
-// C++ code adapted from https://www.geeksforgeeks.org/convert-given-float-value-to-equivalent-fraction/
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * fraction.cpp - express a frame rate as an exact fraction.
+ */
 
-#include <bits/stdc++.h>
-using namespace std;
+#include <cmath>
 
-// Function to convert the floating
-// values into fraction
+#include "fraction.hpp"
 
-struct fraction_t
-{
-    int num;
-    int den;
-};
+// Relative, so that it scales with the rate. A frame duration in whole microseconds is
+// only within a few hundredths of a percent of the rate it stands for, while the NTSC
+// rates are a tenth of a percent from their neighbours, so half that splits the two.
+static constexpr double TOLERANCE = 0.0005;
+static constexpr long MAX_DENOMINATOR = 1001;
 
 fraction_t findFraction(float f)
 {
-    char chr[10];
-    sprintf(chr, "%.2f", f);
-    
-    string s(chr);
-	// Initialize variables
-	string be_deci = "",
-		af_deci = "",
-		reccu = "";
-
-	bool x = true, y = false,
-		z = false;
-
-	// Traverse the floating string
-	for (int i = 0; i < s.size(); ++i) {
-
-		// Check if decimal part exist
-		if (s[i] == '.') {
-			x = false;
-			y = true;
-			continue;
-		}
-
-		// Retrieve decimal part
-		if (x)
-			be_deci += s[i];
-
-		if (y)
-			af_deci += s[i];
+	if (!(f > 0))
+		return { 0, 1 };
+
+	// A frame rate that is a whole number of frames once multiplied by 1.001, but not
+	// before, is an NTSC one.
+	double ntsc = std::round(f * 1.001);
+	if (std::fabs(f * 1.001 - ntsc) < ntsc * TOLERANCE && std::fabs(f - ntsc) >= ntsc * TOLERANCE)
+		return { (int)ntsc * 1000, 1001 };
+
+	// Otherwise walk the continued fraction expansion, whose convergents are the best
+	// approximations there are for their size, until one is close enough.
+	double x = f;
+	long p0 = 0, q0 = 1, p1 = 1, q1 = 0;
+	for (unsigned int i = 0; i < 16; i++)
+	{
+		long a = (long)std::floor(x);
+		long p2 = a * p1 + p0, q2 = a * q1 + q0;
+		if (q2 > MAX_DENOMINATOR)
+			break;
+		p0 = p1, q0 = q1;
+		p1 = p2, q1 = q2;
+		if (std::fabs(f - (double)p1 / q1) < f * TOLERANCE || x - a < 1e-9)
+			break;
+		x = 1 / (x - a);
 	}
-
-	// Convert string to integer
-	int num_be_deci = stoi(be_deci);
-    int num_af_deci = stoi(af_deci);
-
-	// Initialize numerator & denominator
-	int numr = num_be_deci
-				* pow(10, af_deci.size())
-			+ num_af_deci;
-
-	int deno = pow(10, af_deci.size());
-
-    int gd = __gcd(numr, deno);
-
-    // Print the result
-    fraction_t res;
-
-    res.num = numr / gd;
-    res.den = deno / gd;
-    return res;
-}
\ No newline at end of file
+	return { (int)p1, (int)q1 };
+}
@@ -0,0 +1,20 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * fraction.hpp - express a frame rate as an exact fraction.
+ */
+
+#pragma once
+
+struct fraction_t
+{
+	int num;
+	int den;
+};
+
+// Find the fraction NDI should advertise for a frame rate. The NTSC family (23.976,
+// 29.97, 59.94 and so on) comes out as n*1000/1001; anything else as the simplest fraction
+// within 0.05% of it, so 25 is 25/1 and 12.5 is 25/2. That's loose enough for rates worked
+// out from frame durations in whole microseconds: 16666us and 16667us are both 60/1.
+fraction_t findFraction(float f);
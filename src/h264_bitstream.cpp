@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * h264_bitstream.cpp - picking apart the encoders' Annex B output.
+ */
+
+#include "h264_bitstream.hpp"
+
+// The parameter set NAL unit types: SPS and PPS for H.264, and VPS, SPS and PPS for HEVC,
+// whose NAL headers put the type a bit further up.
+static bool is_parameter_set(uint8_t header, bool hevc)
+{
+	if (hevc)
+		return ((header >> 1) & 0x3f) >= 32 && ((header >> 1) & 0x3f) <= 34;
+	return (header & 0x1f) == 7 || (header & 0x1f) == 8;
+}
+
+void extract_parameter_sets(uint8_t const *data, size_t size, std::vector<uint8_t> &parameter_sets, bool hevc)
+{
+	parameter_sets.clear();
+	size_t start = size, i = 0;
+	auto flush = [&](size_t end) {
+		if (start < end && is_parameter_set(data[start], hevc))
+		{
+			static const uint8_t start_code[] = { 0, 0, 0, 1 };
+			parameter_sets.insert(parameter_sets.end(), start_code, start_code + sizeof(start_code));
+			parameter_sets.insert(parameter_sets.end(), data + start, data + end);
+		}
+	};
+	while (i + 3 <= size)
+	{
+		if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1)
+		{
+			// Trailing zeroes belong to the next (4 byte) start code.
+			size_t end = i;
+			while (end > start && data[end - 1] == 0)
+				end--;
+			flush(end);
+			i += 3;
+			start = i;
+		}
+		else
+			i++;
+	}
+	flush(size);
+}
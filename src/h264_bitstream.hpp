@@ -0,0 +1,17 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * h264_bitstream.hpp - picking apart the encoders' Annex B output.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Copy any SPS and PPS NAL units (and for HEVC, VPS) with their start codes out of an
+// Annex B bitstream.
+void extract_parameter_sets(uint8_t const *data, size_t size, std::vector<uint8_t> &parameter_sets,
+							bool hevc = false);
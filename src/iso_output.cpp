@@ -0,0 +1,371 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * iso_output.cpp - record to a fragmented MP4 or MKV file, without the disk holding us up.
+ */
+
+#include <fcntl.h>
+#include <liburing.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+extern "C"
+{
+#include "libavformat/avformat.h"
+#include "libavutil/mem.h"
+}
+
+#include "core/logging.hpp"
+
+#include "h264_bitstream.hpp"
+#include "iso_output.hpp"
+#include "thread_policy.hpp"
+
+// The muxer's write callback was given a const buffer in FFmpeg 7.
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+typedef uint8_t const *AvioBuffer;
+#else
+typedef uint8_t *AvioBuffer;
+#endif
+
+static size_t ring_size(VideoOptions const *options, uint64_t default_bitrate_bps, unsigned int seconds,
+						size_t min_size)
+{
+	uint64_t bitrate_bps = options->Get().bitrate.bps() ? options->Get().bitrate.bps() : default_bitrate_bps;
+	return std::max<size_t>(bitrate_bps / 8 * seconds, min_size);
+}
+
+IsoOutput::IsoOutput(VideoOptions const *options, std::string const &filename, StreamInfo const &info)
+	: Output(options), info_(info), fd_(-1),
+	  ring_(ring_size(options, DEFAULT_BITRATE_BPS, BUFFER_SECONDS, MIN_BUFFER), "iso"), fmt_ctx_(nullptr),
+	  stream_(nullptr), packet_(av_packet_alloc()), file_pos_(0), file_end_(0), unwritten_(0),
+	  resync_(false), write_pos_(0), flushed_pos_(0), failed_(false), abort_(false), allocated_(0),
+	  preallocating_(true)
+{
+	if (options->Get().codec == "h264")
+		codec_id_ = AV_CODEC_ID_H264;
+	else if (options->Get().codec == "mjpeg")
+		codec_id_ = AV_CODEC_ID_MJPEG;
+	else
+		throw std::runtime_error("IsoOutput: can only record the h264 or mjpeg codec");
+	AVOutputFormat const *format = av_guess_format(nullptr, filename.c_str(), nullptr);
+	if (!format || avformat_query_codec(format, (AVCodecID)codec_id_, FF_COMPLIANCE_NORMAL) != 1)
+		throw std::runtime_error("IsoOutput: can't record " + options->Get().codec + " to " + filename);
+
+	openFile(filename);
+	dropped_ = &Metrics::Get().AddCounter("raspindi_iso_frames_dropped_total",
+										  "Frames an ISO recording dropped because the disk was too slow",
+										  Metrics::Label("file", filename));
+	Metrics::Get().AddGaugeFunction("raspindi_iso_buffered_bytes", "Recorded bytes waiting to be written to disk",
+									[this] {
+										std::lock_guard<std::mutex> lock(mutex_);
+										return write_pos_ - flushed_pos_;
+									}, this, Metrics::Label("file", filename));
+	writer_thread_ = std::thread(&IsoOutput::writerThread, this);
+	LOG(1, "Recording to " << filename_ << " through a " << (ring_.Size() >> 20) << "MB ring");
+}
+
+IsoOutput::~IsoOutput()
+{
+	Metrics::Get().RemoveGaugeFunctions(this);
+	// The trailer (an MKV's index, say) goes through the ring like everything else.
+	if (fmt_ctx_ && stream_)
+	{
+		av_write_trailer(fmt_ctx_);
+		avio_flush(fmt_ctx_->pb);
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	cond_var_.notify_all();
+	writer_thread_.join();
+
+	// Give back whatever was allocated beyond the end.
+	if (allocated_ > (off_t)file_end_)
+		fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, file_end_, allocated_ - file_end_);
+	close(fd_);
+	if (fmt_ctx_)
+	{
+		if (fmt_ctx_->pb)
+			av_freep(&fmt_ctx_->pb->buffer);
+		avio_context_free(&fmt_ctx_->pb);
+		avformat_free_context(fmt_ctx_);
+	}
+	av_packet_free(&packet_);
+	LOG(1, "Recording to " << filename_ << " finished, " << (file_end_ >> 20) << "MB");
+}
+
+void IsoOutput::openFile(std::string const &filename)
+{
+	size_t dot = filename.rfind('.');
+	if (dot == std::string::npos || filename.find('/', dot) != std::string::npos)
+		dot = filename.size();
+	for (unsigned int n = 0; n < 1000; n++)
+	{
+		filename_ = n ? filename.substr(0, dot) + "-" + std::to_string(n) + filename.substr(dot) : filename;
+		fd_ = open(filename_.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+		if (fd_ >= 0 || errno != EEXIST)
+			break;
+	}
+	if (fd_ < 0)
+		throw std::runtime_error("IsoOutput: could not create " + filename_ + ": " + strerror(errno));
+}
+
+void IsoOutput::startMuxer(uint8_t const *mem, size_t size)
+{
+	if (avformat_alloc_output_context2(&fmt_ctx_, nullptr, nullptr, filename_.c_str()) < 0)
+		throw std::runtime_error("IsoOutput: failed to create the muxer");
+	uint8_t *io_buffer = (uint8_t *)av_malloc(IO_BUFFER_SIZE);
+	fmt_ctx_->pb = avio_alloc_context(
+		io_buffer, IO_BUFFER_SIZE, 1, this, nullptr,
+		[](void *opaque, AvioBuffer data, int size) { return static_cast<IsoOutput *>(opaque)->write(data, size); },
+		[](void *opaque, int64_t offset, int whence)
+		{ return static_cast<IsoOutput *>(opaque)->seek(offset, whence); });
+	if (!io_buffer || !fmt_ctx_->pb)
+		throw std::runtime_error("IsoOutput: failed to create the muxer's output");
+	fmt_ctx_->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+	stream_ = avformat_new_stream(fmt_ctx_, nullptr);
+	if (!stream_)
+		throw std::runtime_error("IsoOutput: failed to add the video stream");
+	AVCodecParameters *par = stream_->codecpar;
+	par->codec_type = AVMEDIA_TYPE_VIDEO;
+	par->codec_id = (AVCodecID)codec_id_;
+	par->width = info_.width;
+	par->height = info_.height;
+	stream_->time_base = { 1, 1000000 };
+	// A fragmented MP4 describes the stream before the first fragment, so needs the
+	// parameter sets up front. They come with every keyframe (see EncoderBranch).
+	if (codec_id_ == AV_CODEC_ID_H264)
+	{
+		std::vector<uint8_t> parameter_sets;
+		extract_parameter_sets(mem, size, parameter_sets);
+		par->extradata = (uint8_t *)av_mallocz(parameter_sets.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+		memcpy(par->extradata, parameter_sets.data(), parameter_sets.size());
+		par->extradata_size = parameter_sets.size();
+	}
+
+	AVDictionary *opts = nullptr;
+	if (!strcmp(fmt_ctx_->oformat->name, "mp4") || !strcmp(fmt_ctx_->oformat->name, "mov"))
+		av_dict_set(&opts, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+	int ret = avformat_write_header(fmt_ctx_, &opts);
+	av_dict_free(&opts);
+	if (ret < 0)
+		throw std::runtime_error("IsoOutput: failed to start " + filename_);
+}
+
+void IsoOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	bool keyframe = flags & FLAG_KEYFRAME;
+	if (!fmt_ctx_)
+	{
+		if (!keyframe)
+			return;
+		startMuxer((uint8_t const *)mem, size);
+	}
+
+	// Leave room for everything the muxer may yet write out, as it can't be told to wait.
+	size_t space;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (failed_)
+			return;
+		space = ring_.Size() - (write_pos_ - flushed_pos_);
+	}
+	// After a drop, nothing will decode until the next keyframe.
+	if ((resync_ && !keyframe) || unwritten_ + size + IO_BUFFER_SIZE + MUX_OVERHEAD > space)
+	{
+		if (!resync_)
+			LOG(1, "IsoOutput: disk too slow, dropping frames");
+		resync_ = true;
+		dropped_->Inc();
+		return;
+	}
+	resync_ = false;
+
+	packet_->data = (uint8_t *)mem;
+	packet_->size = size;
+	packet_->stream_index = stream_->index;
+	packet_->pts = packet_->dts = av_rescale_q(timestamp_us, { 1, 1000000 }, stream_->time_base);
+	packet_->flags = keyframe ? AV_PKT_FLAG_KEY : 0;
+	unwritten_ += size;
+	if (av_write_frame(fmt_ctx_, packet_) < 0)
+		LOG_ERROR("ERROR: IsoOutput failed to write a frame to " << filename_);
+}
+
+int IsoOutput::write(uint8_t const *data, int size)
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	// Only if outputBuffer left too little room, or the trailer is bigger than we allowed.
+	cond_var_.wait(lock, [&] { return failed_ || ring_.Size() - (write_pos_ - flushed_pos_) >= (size_t)size; });
+	if (failed_)
+		return AVERROR(EIO);
+
+	memcpy(ring_.At(write_pos_), data, size);
+	Extent *last = extents_.empty() ? nullptr : &extents_.back();
+	if (last && last->offset + last->size == file_pos_ && last->size + size <= MAX_WRITE)
+		last->size += size;
+	else
+		extents_.push_back({ file_pos_, write_pos_, (size_t)size });
+	write_pos_ += size;
+	file_pos_ += size;
+	file_end_ = std::max(file_end_, file_pos_);
+	unwritten_ = 0;
+	cond_var_.notify_all();
+	return size;
+}
+
+int64_t IsoOutput::seek(int64_t offset, int whence)
+{
+	// An MKV goes back to fill in its header once it's finished.
+	switch (whence & ~AVSEEK_FORCE)
+	{
+	case SEEK_SET:
+		file_pos_ = offset;
+		break;
+	case SEEK_CUR:
+		file_pos_ += offset;
+		break;
+	case SEEK_END:
+		file_pos_ = file_end_ + offset;
+		break;
+	case AVSEEK_SIZE:
+		return file_end_;
+	default:
+		return -1;
+	}
+	return file_pos_;
+}
+
+void IsoOutput::writerThread()
+{
+	ThreadPolicy::Get().Apply(ThreadPolicy::OTHER, "iso-write");
+	// Capture and encoding come first.
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
+
+	io_uring uring;
+	bool have_uring = io_uring_queue_init(QUEUE_DEPTH, &uring, 0) == 0;
+	if (!have_uring)
+		LOG(1, "IsoOutput: no io_uring, writing one block at a time");
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (true)
+	{
+		if (extents_.empty())
+		{
+			if (abort_)
+				break;
+			cond_var_.wait(lock);
+			continue;
+		}
+
+		// The muxer only ever adds to the last extent, so these are ours now.
+		Extent extents[QUEUE_DEPTH];
+		unsigned int n = 0;
+		for (; n < QUEUE_DEPTH && !extents_.empty(); n++)
+		{
+			extents[n] = extents_.front();
+			extents_.pop_front();
+		}
+		lock.unlock();
+		bool ok = !failed_ && writeExtents(have_uring ? &uring : nullptr, extents, n);
+		lock.lock();
+		if (!ok && !failed_)
+		{
+			LOG_ERROR("ERROR: IsoOutput write to " << filename_ << " failed: " << strerror(errno));
+			failed_ = true;
+		}
+		flushed_pos_ = extents[n - 1].pos + extents[n - 1].size;
+		cond_var_.notify_all();
+	}
+
+	lock.unlock();
+	if (have_uring)
+		io_uring_queue_exit(&uring);
+}
+
+bool IsoOutput::writeExtents(void *uring, Extent *extents, unsigned int n)
+{
+	uint64_t end = 0;
+	for (unsigned int i = 0; i < n; i++)
+		end = std::max(end, extents[i].offset + extents[i].size);
+	preallocate(end);
+
+	if (!uring)
+	{
+		for (unsigned int i = 0; i < n; i++)
+		{
+			for (size_t done = 0; done < extents[i].size;)
+			{
+				ssize_t written = pwrite(fd_, ring_.At(extents[i].pos + done), extents[i].size - done,
+										 extents[i].offset + done);
+				if (written < 0 && errno != EINTR)
+					return false;
+				done += std::max<ssize_t>(written, 0);
+			}
+		}
+		return true;
+	}
+
+	// All of them at once, and then again whatever was left of any short writes.
+	io_uring *ring = (io_uring *)uring;
+	std::vector<size_t> done(n, 0);
+	for (unsigned int pending = n; pending;)
+	{
+		for (unsigned int i = 0; i < n; i++)
+		{
+			if (done[i] == extents[i].size)
+				continue;
+			io_uring_sqe *sqe = io_uring_get_sqe(ring);
+			io_uring_prep_write(sqe, fd_, ring_.At(extents[i].pos + done[i]), extents[i].size - done[i],
+								extents[i].offset + done[i]);
+			io_uring_sqe_set_data(sqe, (void *)(uintptr_t)i);
+		}
+		if (io_uring_submit(ring) < 0)
+			return false;
+		for (unsigned int submitted = pending; submitted; submitted--)
+		{
+			io_uring_cqe *cqe;
+			int ret = io_uring_wait_cqe(ring, &cqe);
+			if (ret < 0)
+			{
+				errno = -ret;
+				return false;
+			}
+			unsigned int i = (uintptr_t)io_uring_cqe_get_data(cqe);
+			int res = cqe->res;
+			io_uring_cqe_seen(ring, cqe);
+			if (res < 0 && res != -EINTR && res != -EAGAIN)
+			{
+				errno = -res;
+				return false;
+			}
+			done[i] += std::max(res, 0);
+			if (done[i] == extents[i].size)
+				pending--;
+		}
+	}
+	return true;
+}
+
+void IsoOutput::preallocate(uint64_t end)
+{
+	if (!preallocating_ || (off_t)end <= allocated_)
+		return;
+	// Keeping the size means a recording cut short doesn't end in a run of zeroes.
+	off_t length = ((end - allocated_) + PREALLOCATE - 1) / PREALLOCATE * PREALLOCATE;
+	if (fallocate(fd_, FALLOC_FL_KEEP_SIZE, allocated_, length) == 0)
+		allocated_ += length;
+	else
+	{
+		LOG(1, "IsoOutput: can't preallocate " << filename_ << ": " << strerror(errno));
+		preallocating_ = false;
+	}
+}
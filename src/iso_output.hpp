@@ -0,0 +1,118 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * iso_output.hpp - record to a fragmented MP4 or MKV file, without the disk holding us up.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "core/stream_info.hpp"
+#include "output/output.hpp"
+
+#include "metrics.hpp"
+#include "mirrored_ring.hpp"
+
+struct AVFormatContext;
+struct AVPacket;
+struct AVStream;
+
+// An ISO recording, muxed by libavformat into the container the file name's extension
+// asks for: MP4 written as fragments (a moof and mdat for each keyframe interval), or
+// MKV, a cluster at a time. Either way, a recording cut short by a power cut or a pulled
+// card plays up to its last fragment.
+//
+// The muxer never writes to the file itself. Its output goes into a MirroredRing, and a
+// thread of its own queues it to the kernel through io_uring, several writes at once,
+// with the file preallocated well ahead of them so that the filesystem isn't hunting for
+// blocks as it goes. A card or SSD that stalls for a while only fills the ring; should it
+// fill completely, frames are dropped (up to the next keyframe) rather than the encoder,
+// and so the camera, ever waiting on the disk.
+//
+// A recording never replaces another: if the file exists, a number is added to the name,
+// so a restart carries on in a new file.
+
+class IsoOutput : public Output
+{
+public:
+	// Throws if the file can't be created or the codec can't go in the container.
+	IsoOutput(VideoOptions const *options, std::string const &filename, StreamInfo const &info);
+	~IsoOutput();
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	// How much of the recording, at the bitrate, the ring holds while the disk is stalled.
+	static constexpr unsigned int BUFFER_SECONDS = 8;
+	static constexpr size_t MIN_BUFFER = 8 << 20;
+	// When we're told nothing about the bitrate, assume it's as high as the h.264 encoder goes.
+	static constexpr uint64_t DEFAULT_BITRATE_BPS = 25000000;
+	static constexpr int IO_BUFFER_SIZE = 64 << 10;
+	// What the muxer may add to the frames it writes out, its headers and indexes.
+	static constexpr size_t MUX_OVERHEAD = 256 << 10;
+	// Writes in flight at once, and the most each one takes from the ring.
+	static constexpr unsigned int QUEUE_DEPTH = 8;
+	static constexpr size_t MAX_WRITE = 1 << 20;
+	// How far ahead of the writes the file is allocated.
+	static constexpr off_t PREALLOCATE = 64 << 20;
+
+	// Part of the file, waiting in the ring to be written.
+	struct Extent
+	{
+		uint64_t offset; // in the file
+		uint64_t pos; // in the ring
+		size_t size;
+	};
+
+	void openFile(std::string const &filename);
+	void startMuxer(uint8_t const *mem, size_t size);
+	// From the muxer.
+	int write(uint8_t const *data, int size);
+	int64_t seek(int64_t offset, int whence);
+	void writerThread();
+	bool writeExtents(void *uring, Extent *extents, unsigned int n);
+	void preallocate(uint64_t end);
+
+	std::string filename_;
+	StreamInfo info_;
+	int codec_id_;
+	int fd_;
+	MirroredRing ring_;
+
+	// The muxer, from the encoder's output thread.
+	AVFormatContext *fmt_ctx_;
+	AVStream *stream_;
+	AVPacket *packet_;
+	uint64_t file_pos_;
+	uint64_t file_end_;
+	// Roughly what the muxer is holding on to: what it has been given since it last wrote.
+	size_t unwritten_;
+	bool resync_;
+
+	// All guarded by mutex_. The ring holds write_pos_ - flushed_pos_ bytes still to be
+	// written, and extents_ says where they go.
+	std::deque<Extent> extents_;
+	uint64_t write_pos_;
+	uint64_t flushed_pos_;
+	bool failed_;
+	bool abort_;
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+	std::thread writer_thread_;
+
+	// The writer thread's.
+	off_t allocated_;
+	bool preallocating_;
+
+	Metrics::Counter *dropped_;
+};
@@ -0,0 +1,429 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * kms_preview.cpp - HDMI output straight from the camera buffers, through KMS.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <drm_fourcc.h>
+#include <xf86drm.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <libcamera/control_ids.h>
+#include <libcamera/formats.h>
+#include <libcamera/framebuffer.h>
+
+#include "core/logging.hpp"
+
+#include "event_loop.hpp"
+#include "kms_preview.hpp"
+
+using namespace libcamera;
+
+static int64_t now_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+		.count();
+}
+
+// The id of an object's property, or 0 if it has none, and its current value.
+static uint32_t get_property(int fd, uint32_t object, uint32_t type, char const *name, uint64_t *value = nullptr)
+{
+	uint32_t id = 0;
+	drmModeObjectProperties *props = drmModeObjectGetProperties(fd, object, type);
+	for (uint32_t i = 0; props && i < props->count_props && !id; i++)
+	{
+		drmModePropertyRes *prop = drmModeGetProperty(fd, props->props[i]);
+		if (prop && !strcmp(prop->name, name))
+		{
+			id = prop->prop_id;
+			if (value)
+				*value = props->prop_values[i];
+		}
+		drmModeFreeProperty(prop);
+	}
+	drmModeFreeObjectProperties(props);
+	return id;
+}
+
+// The value of one of an enum property's names.
+static bool get_enum(int fd, uint32_t property, char const *name, uint64_t &value)
+{
+	drmModePropertyRes *prop = drmModeGetProperty(fd, property);
+	bool found = false;
+	for (int i = 0; prop && i < prop->count_enums && !found; i++)
+	{
+		if ((found = !strcmp(prop->enums[i].name, name)))
+			value = prop->enums[i].value;
+	}
+	drmModeFreeProperty(prop);
+	return found;
+}
+
+KmsPreview::KmsPreview(EventLoop &event_loop, std::chrono::microseconds max_age)
+	: event_loop_(event_loop), max_age_ns_(max_age.count() * 1000), fd_(-1), connector_id_(0), crtc_id_(0),
+	  plane_id_(0), primary_plane_id_(0), modeset_(false), mode_blob_(0), props_ {}, color_encoding_(0),
+	  color_range_(0), warned_(false)
+{
+	// The Pi 5 has the 3D block (with no displays) as a card of its own, so try them all.
+	std::string error = "no display connected";
+	for (unsigned int card = 0; card < 4 && fd_ < 0; card++)
+	{
+		std::string device = "/dev/dri/card" + std::to_string(card);
+		fd_ = ::open(device.c_str(), O_RDWR | O_CLOEXEC);
+		if (fd_ < 0)
+			continue;
+		try
+		{
+			openDisplay();
+			LOG(1, "HDMI output through " << device << " at " << mode_.hdisplay << "x" << mode_.vdisplay);
+		}
+		catch (std::exception const &e)
+		{
+			error = e.what();
+			close(fd_);
+			fd_ = -1;
+		}
+	}
+	if (fd_ < 0)
+		throw std::runtime_error("can't drive the display, " + error);
+
+	Metrics &metrics = Metrics::Get();
+	frames_shown_ = &metrics.AddCounter("raspindi_hdmi_frames_shown_total", "Frames put on the HDMI display");
+	frames_superseded_ = &metrics.AddCounter("raspindi_hdmi_frames_dropped_total",
+											 "Frames the HDMI display never showed", "reason=\"superseded\"");
+	frames_late_ = &metrics.AddCounter("raspindi_hdmi_frames_dropped_total", "Frames the HDMI display never showed",
+									   "reason=\"late\"");
+
+	event_loop_.AddFd(fd_, std::bind(&KmsPreview::readEvents, this));
+}
+
+KmsPreview::~KmsPreview()
+{
+	// While flip events can still arrive.
+	Reset();
+	event_loop_.RemoveFd(fd_);
+	close(fd_);
+}
+
+void KmsPreview::openDisplay()
+{
+	if (drmSetClientCap(fd_, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) || drmSetClientCap(fd_, DRM_CLIENT_CAP_ATOMIC, 1))
+		throw std::runtime_error("no atomic modesetting");
+	// Someone else, such as a desktop, already drives the display.
+	if (drmSetMaster(fd_))
+		throw std::runtime_error(std::string("the display is in use: ") + strerror(errno));
+
+	drmModeRes *res = drmModeGetResources(fd_);
+	if (!res)
+		throw std::runtime_error("no KMS resources");
+	int crtc_index = -1;
+	for (int i = 0; i < res->count_connectors && crtc_index < 0; i++)
+	{
+		drmModeConnector *connector = drmModeGetConnector(fd_, res->connectors[i]);
+		if (!connector || connector->connection != DRM_MODE_CONNECTED || !connector->count_modes)
+		{
+			drmModeFreeConnector(connector);
+			continue;
+		}
+		// Keep whatever mode the console already set, or else take the preferred one.
+		drmModeEncoder *encoder = connector->encoder_id ? drmModeGetEncoder(fd_, connector->encoder_id) : nullptr;
+		drmModeCrtc *crtc = encoder && encoder->crtc_id ? drmModeGetCrtc(fd_, encoder->crtc_id) : nullptr;
+		if (crtc && crtc->mode_valid)
+			mode_ = crtc->mode;
+		else
+		{
+			mode_ = connector->modes[0];
+			for (int m = 0; m < connector->count_modes; m++)
+			{
+				if (connector->modes[m].type & DRM_MODE_TYPE_PREFERRED)
+					mode_ = connector->modes[m];
+			}
+			modeset_ = true;
+		}
+		// Otherwise, the first CRTC that can drive it.
+		uint32_t possible_crtcs = 0;
+		if (!crtc && connector->count_encoders)
+		{
+			drmModeEncoder *first = drmModeGetEncoder(fd_, connector->encoders[0]);
+			possible_crtcs = first ? first->possible_crtcs : 0;
+			drmModeFreeEncoder(first);
+		}
+		for (int c = 0; c < res->count_crtcs && crtc_index < 0; c++)
+		{
+			if (crtc ? res->crtcs[c] == crtc->crtc_id : (possible_crtcs & (1 << c)) != 0)
+				crtc_index = c;
+		}
+		connector_id_ = connector->connector_id;
+		drmModeFreeCrtc(crtc);
+		drmModeFreeEncoder(encoder);
+		drmModeFreeConnector(connector);
+	}
+	if (crtc_index >= 0)
+		crtc_id_ = res->crtcs[crtc_index];
+	drmModeFreeResources(res);
+	if (crtc_index < 0)
+		throw std::runtime_error("no display connected");
+
+	// An overlay plane for the CRTC that takes I420, or failing that, the primary plane.
+	plane_id_ = 0;
+	bool overlay = false;
+	drmModePlaneRes *planes = drmModeGetPlaneResources(fd_);
+	for (uint32_t i = 0; planes && i < planes->count_planes; i++)
+	{
+		drmModePlane *plane = drmModeGetPlane(fd_, planes->planes[i]);
+		if (!plane || !(plane->possible_crtcs & (1 << crtc_index)))
+		{
+			drmModeFreePlane(plane);
+			continue;
+		}
+		uint64_t type = 0;
+		get_property(fd_, plane->plane_id, DRM_MODE_OBJECT_PLANE, "type", &type);
+		if (type == DRM_PLANE_TYPE_PRIMARY)
+			primary_plane_id_ = plane->plane_id;
+		for (uint32_t f = 0; f < plane->count_formats; f++)
+		{
+			if (plane->formats[f] == DRM_FORMAT_YUV420 && !overlay && (type == DRM_PLANE_TYPE_OVERLAY || !plane_id_))
+			{
+				plane_id_ = plane->plane_id;
+				overlay = type == DRM_PLANE_TYPE_OVERLAY;
+			}
+		}
+		drmModeFreePlane(plane);
+	}
+	drmModeFreePlaneResources(planes);
+	if (!plane_id_)
+		throw std::runtime_error("no plane can show I420");
+	if (plane_id_ == primary_plane_id_)
+		primary_plane_id_ = 0;
+
+	props_.connector_crtc_id = get_property(fd_, connector_id_, DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID");
+	props_.crtc_mode_id = get_property(fd_, crtc_id_, DRM_MODE_OBJECT_CRTC, "MODE_ID");
+	props_.crtc_active = get_property(fd_, crtc_id_, DRM_MODE_OBJECT_CRTC, "ACTIVE");
+	props_.fb_id = get_property(fd_, plane_id_, DRM_MODE_OBJECT_PLANE, "FB_ID");
+	props_.crtc_id = get_property(fd_, plane_id_, DRM_MODE_OBJECT_PLANE, "CRTC_ID");
+	props_.src_x = get_property(fd_, plane_id_, DRM_MODE_OBJECT_PLANE, "SRC_X");
+	props_.src_y = get_property(fd_, plane_id_, DRM_MODE_OBJECT_PLANE, "SRC_Y");
+	props_.src_w = get_property(fd_, plane_id_, DRM_MODE_OBJECT_PLANE, "SRC_W");
+	props_.src_h = get_property(fd_, plane_id_, DRM_MODE_OBJECT_PLANE, "SRC_H");
+	props_.crtc_x = get_property(fd_, plane_id_, DRM_MODE_OBJECT_PLANE, "CRTC_X");
+	props_.crtc_y = get_property(fd_, plane_id_, DRM_MODE_OBJECT_PLANE, "CRTC_Y");
+	props_.crtc_w = get_property(fd_, plane_id_, DRM_MODE_OBJECT_PLANE, "CRTC_W");
+	props_.crtc_h = get_property(fd_, plane_id_, DRM_MODE_OBJECT_PLANE, "CRTC_H");
+	// Not every driver lets the YCbCr conversion be chosen, and then it's BT.601.
+	props_.color_encoding = get_property(fd_, plane_id_, DRM_MODE_OBJECT_PLANE, "COLOR_ENCODING");
+	props_.color_range = get_property(fd_, plane_id_, DRM_MODE_OBJECT_PLANE, "COLOR_RANGE");
+	if (primary_plane_id_)
+	{
+		props_.primary_fb_id = get_property(fd_, primary_plane_id_, DRM_MODE_OBJECT_PLANE, "FB_ID");
+		props_.primary_crtc_id = get_property(fd_, primary_plane_id_, DRM_MODE_OBJECT_PLANE, "CRTC_ID");
+	}
+	if (!props_.fb_id || !props_.crtc_id || !props_.crtc_w || !props_.src_w || !props_.crtc_mode_id ||
+		!props_.connector_crtc_id)
+		throw std::runtime_error("the display is missing atomic properties");
+	if (modeset_ && drmModeCreatePropertyBlob(fd_, &mode_, sizeof(mode_), &mode_blob_))
+		throw std::runtime_error("can't set the display mode");
+}
+
+KmsPreview::Framebuffer const *KmsPreview::framebuffer(int fd, StreamInfo const &info)
+{
+	auto it = framebuffers_.find(fd);
+	if (it != framebuffers_.end())
+		return &it->second;
+
+	if (info.pixel_format != formats::YUV420)
+	{
+		if (!warned_)
+			LOG_ERROR("ERROR: HDMI output can only show YUV420 frames");
+		warned_ = true;
+		return nullptr;
+	}
+	// The camera's I420 is all in one dma-buf, U and V straight after Y.
+	Framebuffer framebuffer = { 0, 0, info.width, info.height };
+	uint32_t chroma_stride = info.stride / 2;
+	uint32_t offsets[4] = { 0, info.stride * info.height,
+							info.stride * info.height + chroma_stride * (info.height / 2), 0 };
+	uint32_t pitches[4] = { info.stride, chroma_stride, chroma_stride, 0 };
+	if (drmPrimeFDToHandle(fd_, fd, &framebuffer.handle))
+	{
+		LOG_ERROR("ERROR: can't import a camera buffer for HDMI output: " << strerror(errno));
+		return nullptr;
+	}
+	uint32_t handles[4] = { framebuffer.handle, framebuffer.handle, framebuffer.handle, 0 };
+	if (drmModeAddFB2(fd_, info.width, info.height, DRM_FORMAT_YUV420, handles, pitches, offsets, &framebuffer.id, 0))
+	{
+		LOG_ERROR("ERROR: can't create a framebuffer for HDMI output: " << strerror(errno));
+		drmCloseBufferHandle(fd_, framebuffer.handle);
+		return nullptr;
+	}
+
+	// Every buffer has the camera's colour space.
+	color_encoding_ = color_range_ = 0;
+	if (props_.color_encoding)
+	{
+		char const *encoding = "ITU-R BT.601 YCbCr";
+		if (info.colour_space && info.colour_space->ycbcrEncoding == ColorSpace::YcbcrEncoding::Rec709)
+			encoding = "ITU-R BT.709 YCbCr";
+		else if (info.colour_space && info.colour_space->ycbcrEncoding == ColorSpace::YcbcrEncoding::Rec2020)
+			encoding = "ITU-R BT.2020 YCbCr";
+		get_enum(fd_, props_.color_encoding, encoding, color_encoding_);
+	}
+	if (props_.color_range)
+	{
+		bool full = !info.colour_space || info.colour_space->range == ColorSpace::Range::Full;
+		get_enum(fd_, props_.color_range, full ? "YCbCr full range" : "YCbCr limited range", color_range_);
+	}
+
+	return &(framebuffers_[fd] = framebuffer);
+}
+
+void KmsPreview::Show(CompletedRequestPtr &completed_request, Stream *stream, StreamInfo const &info)
+{
+	FrameBuffer *buffer = completed_request->buffers[stream];
+	// Declared before the lock, so that any frame it replaces goes back after it's released.
+	Frame frame;
+	std::lock_guard<std::mutex> lock(mutex_);
+	frame.framebuffer = framebuffer(buffer->planes()[0].fd.get(), info);
+	if (!frame.framebuffer)
+		return;
+	frame.completed_request = completed_request;
+	frame.sensor_timestamp_ns = completed_request->metadata.get(controls::SensorTimestamp).value_or(0);
+	if (flipping_.completed_request)
+	{
+		if (waiting_.completed_request)
+			frames_superseded_->Inc();
+		std::swap(frame, waiting_);
+	}
+	else
+		commit(frame);
+}
+
+void KmsPreview::commit(Frame &frame)
+{
+	if (max_age_ns_ && frame.sensor_timestamp_ns && now_ns() - frame.sensor_timestamp_ns > max_age_ns_)
+	{
+		frames_late_->Inc();
+		return;
+	}
+
+	// Fit the frame to the screen, keeping its shape.
+	Framebuffer const &fb = *frame.framebuffer;
+	uint32_t width = mode_.hdisplay, height = mode_.vdisplay;
+	if ((uint64_t)fb.width * mode_.vdisplay > (uint64_t)fb.height * mode_.hdisplay)
+		height = (uint64_t)fb.height * mode_.hdisplay / fb.width;
+	else
+		width = (uint64_t)fb.width * mode_.vdisplay / fb.height;
+
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	uint32_t flags = DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK;
+	if (modeset_)
+	{
+		drmModeAtomicAddProperty(req, connector_id_, props_.connector_crtc_id, crtc_id_);
+		drmModeAtomicAddProperty(req, crtc_id_, props_.crtc_mode_id, mode_blob_);
+		drmModeAtomicAddProperty(req, crtc_id_, props_.crtc_active, 1);
+		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+	}
+	drmModeAtomicAddProperty(req, plane_id_, props_.fb_id, fb.id);
+	drmModeAtomicAddProperty(req, plane_id_, props_.crtc_id, crtc_id_);
+	drmModeAtomicAddProperty(req, plane_id_, props_.src_x, 0);
+	drmModeAtomicAddProperty(req, plane_id_, props_.src_y, 0);
+	drmModeAtomicAddProperty(req, plane_id_, props_.src_w, (uint64_t)fb.width << 16);
+	drmModeAtomicAddProperty(req, plane_id_, props_.src_h, (uint64_t)fb.height << 16);
+	drmModeAtomicAddProperty(req, plane_id_, props_.crtc_x, (mode_.hdisplay - width) / 2);
+	drmModeAtomicAddProperty(req, plane_id_, props_.crtc_y, (mode_.vdisplay - height) / 2);
+	drmModeAtomicAddProperty(req, plane_id_, props_.crtc_w, width);
+	drmModeAtomicAddProperty(req, plane_id_, props_.crtc_h, height);
+	if (props_.color_encoding)
+		drmModeAtomicAddProperty(req, plane_id_, props_.color_encoding, color_encoding_);
+	if (props_.color_range)
+		drmModeAtomicAddProperty(req, plane_id_, props_.color_range, color_range_);
+	if (primary_plane_id_ && props_.primary_fb_id && props_.primary_crtc_id)
+	{
+		drmModeAtomicAddProperty(req, primary_plane_id_, props_.primary_fb_id, 0);
+		drmModeAtomicAddProperty(req, primary_plane_id_, props_.primary_crtc_id, 0);
+	}
+	int ret = drmModeAtomicCommit(fd_, req, flags, this);
+	int error = errno;
+	drmModeAtomicFree(req);
+
+	if (ret && primary_plane_id_)
+	{
+		// Some displays won't run without their primary plane, so leave the console there.
+		LOG(1, "Leaving the console behind HDMI output");
+		primary_plane_id_ = 0;
+		commit(frame);
+		return;
+	}
+	if (ret)
+	{
+		if (!warned_)
+			LOG_ERROR("ERROR: HDMI output failed: " << strerror(error));
+		warned_ = true;
+		return;
+	}
+	modeset_ = false;
+	std::swap(flipping_, frame);
+}
+
+bool KmsPreview::readEvents()
+{
+	drmEventContext context = {};
+	context.version = 2;
+	context.page_flip_handler = &KmsPreview::pageFlipHandler;
+	drmHandleEvent(fd_, &context);
+	return true;
+}
+
+void KmsPreview::pageFlipHandler(int, unsigned int, unsigned int, unsigned int, void *user_data)
+{
+	static_cast<KmsPreview *>(user_data)->flipped();
+}
+
+void KmsPreview::flipped()
+{
+	// The frame that was on screen (and a waiting one that's too late) go back to the camera
+	// once the lock is released.
+	Frame done, next;
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (!flipping_.completed_request)
+		return;
+	std::swap(done, shown_);
+	std::swap(shown_, flipping_);
+	frames_shown_->Inc();
+	flip_cond_var_.notify_all();
+	std::swap(next, waiting_);
+	if (next.completed_request)
+		commit(next);
+}
+
+void KmsPreview::Reset()
+{
+	Frame waiting, flipping, shown;
+	std::unique_lock<std::mutex> lock(mutex_);
+	std::swap(waiting, waiting_);
+	// Wait for any flip to finish, so that its event doesn't get taken for a later one's.
+	flip_cond_var_.wait_for(lock, FLIP_TIMEOUT, [this] { return !flipping_.completed_request; });
+	std::swap(flipping, flipping_);
+	std::swap(shown, shown_);
+
+	// Take the plane off the screen before any of its buffers go back.
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	drmModeAtomicAddProperty(req, plane_id_, props_.fb_id, 0);
+	drmModeAtomicAddProperty(req, plane_id_, props_.crtc_id, 0);
+	drmModeAtomicCommit(fd_, req, 0, nullptr);
+	drmModeAtomicFree(req);
+	for (auto const &[fd, framebuffer] : framebuffers_)
+	{
+		drmModeRmFB(fd_, framebuffer.id);
+		drmCloseBufferHandle(fd_, framebuffer.handle);
+	}
+	framebuffers_.clear();
+	warned_ = false;
+}
@@ -0,0 +1,111 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * kms_preview.hpp - HDMI output straight from the camera buffers, through KMS.
+ */
+
+#pragma once
+
+#include <xf86drmMode.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+
+#include <libcamera/stream.h>
+
+#include "core/completed_request.hpp"
+#include "core/stream_info.hpp"
+
+#include "metrics.hpp"
+
+class EventLoop;
+
+// rpicam's preview draws each frame with GL (or on a desktop, through X), which costs a
+// frame of latency and, on a Pi 3B+, a good deal of GPU memory. This drives the display
+// itself instead: each camera buffer is imported once as a KMS framebuffer, and shown by
+// putting it on a hardware overlay plane with an atomic commit that takes effect at the
+// next vblank. The display scales it to fit, and nothing is copied.
+//
+// Only one flip is ever in flight. A frame arriving meanwhile waits, replacing any frame
+// already waiting, so the screen always moves straight to the newest. If the waiting
+// frame is older than max_age (from its sensor timestamp) by the time the flip completes,
+// it's dropped too, as a newer one is about to arrive. Flip events come in on the event
+// loop.
+//
+// The frame on screen, the one being flipped to and the one waiting all hold on to their
+// requests, so the camera won't reuse their buffers until they're done with.
+
+class KmsPreview
+{
+public:
+	// Throws if there's no display we can drive, for example if a desktop already has it.
+	KmsPreview(EventLoop &event_loop, std::chrono::microseconds max_age);
+	~KmsPreview();
+
+	// Main loop only. Never waits for the display.
+	void Show(CompletedRequestPtr &completed_request, libcamera::Stream *stream, StreamInfo const &info);
+	// Blanks the display and gives back every request, and forgets the framebuffers. Call
+	// it whenever the camera stops, before its buffers go.
+	void Reset();
+
+private:
+	static constexpr std::chrono::milliseconds FLIP_TIMEOUT { 100 };
+
+	struct Framebuffer
+	{
+		uint32_t id;
+		uint32_t handle;
+		unsigned int width;
+		unsigned int height;
+	};
+
+	struct Frame
+	{
+		CompletedRequestPtr completed_request;
+		Framebuffer const *framebuffer = nullptr;
+		int64_t sensor_timestamp_ns = 0;
+	};
+
+	void openDisplay();
+	Framebuffer const *framebuffer(int fd, StreamInfo const &info);
+	void commit(Frame &frame);
+	bool readEvents();
+	static void pageFlipHandler(int fd, unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec,
+								void *user_data);
+	void flipped();
+
+	EventLoop &event_loop_;
+	int64_t max_age_ns_;
+	int fd_;
+	uint32_t connector_id_;
+	uint32_t crtc_id_;
+	uint32_t plane_id_;
+	// Switched off on the first commit, so that the console doesn't show round the picture.
+	uint32_t primary_plane_id_;
+	drmModeModeInfo mode_;
+	// The mode needs setting on the first commit.
+	bool modeset_;
+	uint32_t mode_blob_;
+	struct
+	{
+		uint32_t connector_crtc_id, crtc_mode_id, crtc_active;
+		uint32_t fb_id, crtc_id, src_x, src_y, src_w, src_h, crtc_x, crtc_y, crtc_w, crtc_h;
+		uint32_t color_encoding, color_range, primary_fb_id, primary_crtc_id;
+	} props_;
+	uint64_t color_encoding_, color_range_;
+	bool warned_;
+
+	std::mutex mutex_;
+	std::condition_variable flip_cond_var_;
+	// By camera buffer (dma-buf) fd.
+	std::map<int, Framebuffer> framebuffers_;
+	Frame waiting_, flipping_, shown_;
+
+	Metrics::Counter *frames_shown_;
+	Metrics::Counter *frames_superseded_;
+	Metrics::Counter *frames_late_;
+};
@@ -0,0 +1,101 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * latency_budget.cpp - drop frames that are too old to be worth sending.
+ */
+
+#include "core/logging.hpp"
+
+#include "flight_recorder.hpp"
+#include "latency_budget.hpp"
+
+static_assert((int)LatencyBudget::LATE_FOR_ENCODE == FlightEvent::LATE_FOR_ENCODE &&
+				  (int)LatencyBudget::LATE_FOR_SEND == FlightEvent::LATE_FOR_SEND &&
+				  (int)LatencyBudget::AWAITING_KEYFRAME == FlightEvent::AWAITING_KEYFRAME,
+			  "flight recorder drop reasons start with the latency budget's");
+
+static char const *const reason_names[] = { "late for encode", "late for send", "awaiting keyframe" };
+static char const *const reason_labels[] = { "late_for_encode", "late_for_send", "awaiting_keyframe" };
+
+static int64_t now_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+		.count();
+}
+
+LatencyBudget::LatencyBudget(std::chrono::microseconds budget, bool compressed)
+	: budget_us_(budget.count()), compressed_(compressed), timestamp_offset_us_(0), awaiting_keyframe_(false),
+	  last_report_ns_(now_ns())
+{
+	for (auto &drops : drops_)
+		drops = 0;
+	for (unsigned int reason = 0; reason < NUM_REASONS; reason++)
+		drop_counters_[reason] =
+			&Metrics::Get().AddCounter("raspindi_latency_budget_drops_total",
+									   "Frames dropped for being over the latency budget",
+									   std::string("reason=\"") + reason_labels[reason] + "\"");
+	LOG(2, "Frames older than " << budget_us_ / 1000 << "ms will be dropped");
+}
+
+LatencyBudget::~LatencyBudget()
+{
+	for (unsigned int reason = 0; reason < NUM_REASONS; reason++)
+		if (drops_[reason])
+			LOG(1, "Dropped " << drops_[reason] << " frames " << reason_names[reason]);
+}
+
+bool LatencyBudget::AdmitToEncoder(int64_t timestamp_us, int64_t sensor_timestamp_ns)
+{
+	if (!sensor_timestamp_ns)
+		return true;
+
+	timestamp_offset_us_ = timestamp_us - sensor_timestamp_ns / 1000;
+	if ((now_ns() - sensor_timestamp_ns) / 1000 <= budget_us_)
+		return true;
+
+	drop(LATE_FOR_ENCODE, timestamp_us);
+	return false;
+}
+
+bool LatencyBudget::AdmitToSend(int64_t timestamp_us, bool keyframe)
+{
+	if (awaiting_keyframe_ && keyframe)
+		awaiting_keyframe_ = false;
+
+	int64_t sensor_timestamp_us = timestamp_us - timestamp_offset_us_;
+	if (now_ns() / 1000 - sensor_timestamp_us > budget_us_)
+	{
+		drop(LATE_FOR_SEND, timestamp_us);
+		if (compressed_ && !awaiting_keyframe_)
+		{
+			awaiting_keyframe_ = true;
+			if (keyframe_request_callback_)
+				keyframe_request_callback_();
+		}
+		return false;
+	}
+
+	if (awaiting_keyframe_)
+	{
+		drop(AWAITING_KEYFRAME, timestamp_us);
+		return false;
+	}
+	return true;
+}
+
+void LatencyBudget::drop(Reason reason, int64_t timestamp_us)
+{
+	drops_[reason]++;
+	drop_counters_[reason]->Inc();
+	FlightRecorder::Get().Record(FlightEvent::DROP, timestamp_us, 0, reason);
+
+	// Say what's happening now and again, rather than for every frame.
+	int64_t now = now_ns();
+	int64_t last_report = last_report_ns_;
+	if (now - last_report >= std::chrono::nanoseconds(REPORT_INTERVAL).count() &&
+		last_report_ns_.compare_exchange_strong(last_report, now))
+		LOG(1, "Over the latency budget: dropped " << drops_[LATE_FOR_ENCODE] << " frames late for encode, "
+												   << drops_[LATE_FOR_SEND] << " late for send, "
+												   << drops_[AWAITING_KEYFRAME] << " awaiting a keyframe");
+}
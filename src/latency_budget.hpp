@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * latency_budget.hpp - drop frames that are too old to be worth sending.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+#include "metrics.hpp"
+
+// For live production a dropped frame is better than delay that keeps building up. Every
+// frame is given a maximum age, measured from its sensor timestamp, and is checked twice:
+// before it is encoded (from the main loop) and before it is sent (from wherever the
+// encoder delivers its output). Anything over budget is dropped and counted.
+//
+// The encoders carry either a wall clock or a monotonic timestamp, so the main loop also
+// records how far that timestamp is from the sensor's, which lets the send side work out
+// the age of a frame from its timestamp alone.
+
+class LatencyBudget
+{
+public:
+	enum Reason
+	{
+		LATE_FOR_ENCODE, // over budget before it reached the encoder
+		LATE_FOR_SEND, // over budget when the encoder had finished with it
+		AWAITING_KEYFRAME, // compressed frames that can't be decoded after an earlier drop
+		NUM_REASONS
+	};
+
+	LatencyBudget(std::chrono::microseconds budget, bool compressed);
+	~LatencyBudget();
+
+	// Main loop only. The sensor timestamp is in CLOCK_MONOTONIC nanoseconds.
+	bool AdmitToEncoder(int64_t timestamp_us, int64_t sensor_timestamp_ns);
+	// Encoder output only. Returns false if the frame must not be sent. Once a compressed
+	// frame has been dropped, everything up to the next keyframe has to go too.
+	bool AdmitToSend(int64_t timestamp_us, bool keyframe);
+
+	// Called when a compressed stream needs a keyframe to recover from a drop.
+	typedef std::function<void()> KeyframeRequestCallback;
+	void SetKeyframeRequestCallback(KeyframeRequestCallback callback) { keyframe_request_callback_ = callback; }
+
+	unsigned int Drops(Reason reason) const { return drops_[reason]; }
+
+private:
+	static constexpr std::chrono::seconds REPORT_INTERVAL = std::chrono::seconds(5);
+
+	typedef std::chrono::steady_clock Clock;
+
+	void drop(Reason reason, int64_t timestamp_us);
+
+	int64_t budget_us_;
+	bool compressed_;
+	// The encoder timestamp minus the sensor timestamp, in microseconds.
+	std::atomic<int64_t> timestamp_offset_us_;
+	bool awaiting_keyframe_;
+	std::atomic<unsigned int> drops_[NUM_REASONS];
+	Metrics::Counter *drop_counters_[NUM_REASONS];
+	std::atomic<int64_t> last_report_ns_;
+	KeyframeRequestCallback keyframe_request_callback_;
+};
@@ -0,0 +1,147 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * latency_tracer.cpp - per frame latency through the capture, encode and send pipeline.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+
+#include "core/logging.hpp"
+
+#include "latency_tracer.hpp"
+
+// The CAPTURE slot holds the capture to sent total.
+static char const *const stage_names[] = { "total", "dequeue", "encode", "output", "sent" };
+// Histogram buckets, from a fraction of a frame to several frames at 60fps.
+static std::vector<int64_t> const histogram_bounds_us = { 1000, 2000, 4000, 8000, 16000, 33000, 50000, 100000, 200000 };
+
+LatencyTracer::LatencyTracer(std::string const &stats_file, std::string const &profile)
+	: stats_file_(stats_file), profile_(profile), last_report_(Clock::now()), last_profile_log_(Clock::now())
+{
+	for (Frame &frame : frames_)
+		frame.active = false;
+	for (Window &window : windows_)
+	{
+		window.samples.resize(WINDOW_SIZE);
+		window.next = window.count = 0;
+	}
+	for (unsigned int stage = 0; stage < NUM_STAGES; stage++)
+		histograms_[stage] = &Metrics::Get().AddHistogram(
+			"raspindi_latency_seconds",
+			"Time from each pipeline stage to the next, or from capture to sent for \"total\"",
+			histogram_bounds_us, std::string("stage=\"") + stage_names[stage] + "\"");
+}
+
+void LatencyTracer::Begin(unsigned int sequence, int64_t key, int64_t sensor_timestamp_ns)
+{
+	int64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	// A frame still occupying this slot was dropped somewhere along the way.
+	Frame &frame = frames_[sequence % MAX_FRAMES_IN_FLIGHT];
+	frame.active = true;
+	frame.sequence = sequence;
+	frame.key = key;
+	std::fill(std::begin(frame.time_ns), std::end(frame.time_ns), -1);
+	frame.time_ns[CAPTURE] = sensor_timestamp_ns ? sensor_timestamp_ns : now_ns;
+	frame.time_ns[DEQUEUE] = now_ns;
+}
+
+void LatencyTracer::Mark(int64_t key, Stage stage)
+{
+	int64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	for (Frame &frame : frames_)
+	{
+		if (frame.active && frame.key == key)
+		{
+			frame.time_ns[stage] = now_ns;
+			if (stage == SENT)
+				complete(frame);
+			return;
+		}
+	}
+}
+
+void LatencyTracer::complete(Frame &frame)
+{
+	frame.active = false;
+
+	int64_t previous_ns = frame.time_ns[CAPTURE];
+	for (unsigned int stage = DEQUEUE; stage < NUM_STAGES; stage++)
+	{
+		// Skip any stage that never got marked.
+		if (frame.time_ns[stage] < 0)
+			continue;
+		Window &window = windows_[stage];
+		window.samples[window.next] = (frame.time_ns[stage] - previous_ns) / 1000;
+		window.next = (window.next + 1) % WINDOW_SIZE;
+		window.count = std::min(window.count + 1, WINDOW_SIZE);
+		histograms_[stage]->Observe((frame.time_ns[stage] - previous_ns) / 1000);
+		previous_ns = frame.time_ns[stage];
+	}
+	Window &total = windows_[CAPTURE];
+	total.samples[total.next] = (frame.time_ns[SENT] - frame.time_ns[CAPTURE]) / 1000;
+	total.next = (total.next + 1) % WINDOW_SIZE;
+	total.count = std::min(total.count + 1, WINDOW_SIZE);
+	histograms_[CAPTURE]->Observe((frame.time_ns[SENT] - frame.time_ns[CAPTURE]) / 1000);
+
+	LOG(3, "Frame " << frame.sequence << " sent " << total.samples[(total.next + WINDOW_SIZE - 1) % WINDOW_SIZE]
+				 << "us after capture");
+
+	if (!stats_file_.empty() && Clock::now() - last_report_ >= REPORT_INTERVAL)
+		report();
+	if (!profile_.empty() && Clock::now() - last_profile_log_ >= PROFILE_LOG_INTERVAL)
+		logProfile();
+}
+
+void LatencyTracer::logProfile()
+{
+	last_profile_log_ = Clock::now();
+	Window const &total = windows_[CAPTURE];
+	if (!total.count)
+		return;
+	std::vector<int64_t> sorted(total.samples.begin(), total.samples.begin() + total.count);
+	std::sort(sorted.begin(), sorted.end());
+	auto percentile = [&sorted](unsigned int p) { return sorted[(sorted.size() - 1) * p / 100] / 1000.0; };
+	LOG(1, "Latency profile " << profile_ << ": capture to sent p50 " << percentile(50) << "ms, p95 "
+							  << percentile(95) << "ms, p99 " << percentile(99) << "ms over " << total.count
+							  << " frames");
+}
+
+void LatencyTracer::report()
+{
+	last_report_ = Clock::now();
+
+	// Write the whole report to one side and then rename it, so that anyone watching the
+	// file never sees half of it.
+	std::string tmp_file = stats_file_ + ".tmp";
+	std::ofstream out(tmp_file);
+	if (!out)
+	{
+		LOG_ERROR("LatencyTracer: failed to write " << tmp_file);
+		return;
+	}
+
+	out << "# stage samples p50_us p95_us p99_us (each stage measured from the one before)" << std::endl;
+	std::vector<int64_t> sorted;
+	for (unsigned int stage = 0; stage < NUM_STAGES; stage++)
+	{
+		Window const &window = windows_[stage];
+		if (!window.count)
+			continue;
+		sorted.assign(window.samples.begin(), window.samples.begin() + window.count);
+		std::sort(sorted.begin(), sorted.end());
+		auto percentile = [&sorted](unsigned int p) { return sorted[(sorted.size() - 1) * p / 100]; };
+		out << stage_names[stage] << " " << window.count << " " << percentile(50)
+			<< " " << percentile(95) << " " << percentile(99) << std::endl;
+	}
+	out.close();
+
+	if (std::rename(tmp_file.c_str(), stats_file_.c_str()))
+		LOG_ERROR("LatencyTracer: failed to rename " << tmp_file << " to " << stats_file_);
+}
@@ -0,0 +1,84 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * latency_tracer.hpp - per frame latency through the capture, encode and send pipeline.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "metrics.hpp"
+
+// Each frame is followed through the pipeline by the timestamp that the encoder hands
+// on with it, so that stages which never see the CompletedRequest can still find it.
+// Once the frame has been sent, the time spent in each stage goes into a rolling
+// window, and every few seconds the p50/p95/p99 of each window are written to a file.
+// Each sample also goes into a metrics histogram, and with no file, that's all we do.
+// Under a --latency_profile, the capture to send latency is also logged every minute,
+// so that what the profile buys can be seen.
+
+class LatencyTracer
+{
+public:
+	enum Stage
+	{
+		CAPTURE, // the sensor timestamp of the frame
+		DEQUEUE, // the main loop received the completed request
+		ENCODE, // the frame was handed to the encoder
+		OUTPUT, // the encoder produced its output, and the NDI send began
+		SENT, // the NDI send returned
+		NUM_STAGES
+	};
+
+	LatencyTracer(std::string const &stats_file, std::string const &profile = "");
+
+	// Start following a frame. The sensor timestamp is in CLOCK_MONOTONIC nanoseconds.
+	void Begin(unsigned int sequence, int64_t key, int64_t sensor_timestamp_ns);
+	// Record that the frame has reached the given stage now. Frames we aren't following
+	// (or have lost track of) are ignored. Reaching SENT completes the frame.
+	void Mark(int64_t key, Stage stage);
+
+private:
+	static constexpr unsigned int MAX_FRAMES_IN_FLIGHT = 32;
+	static constexpr unsigned int WINDOW_SIZE = 512;
+	static constexpr std::chrono::seconds REPORT_INTERVAL = std::chrono::seconds(5);
+	static constexpr std::chrono::seconds PROFILE_LOG_INTERVAL = std::chrono::seconds(60);
+
+	typedef std::chrono::steady_clock Clock;
+
+	struct Frame
+	{
+		bool active;
+		unsigned int sequence;
+		int64_t key;
+		int64_t time_ns[NUM_STAGES];
+	};
+
+	// Rolling window of the last WINDOW_SIZE samples, in microseconds.
+	struct Window
+	{
+		std::vector<int64_t> samples;
+		unsigned int next;
+		unsigned int count;
+	};
+
+	void complete(Frame &frame);
+	void report();
+	void logProfile();
+
+	std::string stats_file_;
+	std::string profile_;
+	std::mutex mutex_;
+	Frame frames_[MAX_FRAMES_IN_FLIGHT];
+	// One window for each stage's interval from the previous stage, plus one for the total.
+	Window windows_[NUM_STAGES];
+	Metrics::Histogram *histograms_[NUM_STAGES];
+	Clock::time_point last_report_;
+	Clock::time_point last_profile_log_;
+};
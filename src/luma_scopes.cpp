@@ -0,0 +1,142 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * luma_scopes.cpp - histogram and waveform of the Y plane, for exposure monitoring.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "luma_scopes.hpp"
+
+// Each count as a byte, relative to the largest, base64 encoded.
+template <size_t N>
+static std::string encode(std::array<uint32_t, N> const &counts)
+{
+	static char const digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	uint32_t max = std::max(1u, *std::max_element(counts.begin(), counts.end()));
+	std::string out;
+	out.reserve((N + 2) / 3 * 4);
+	for (size_t i = 0; i < N; i += 3)
+	{
+		uint32_t bits = 0;
+		for (size_t j = i; j < i + 3; j++)
+			bits = bits << 8 | (j < N ? (uint64_t)counts[j] * 255 / max : 0);
+		out += digits[bits >> 18];
+		out += digits[(bits >> 12) & 63];
+		out += i + 1 < N ? digits[(bits >> 6) & 63] : '=';
+		out += i + 2 < N ? digits[bits & 63] : '=';
+	}
+	return out;
+}
+
+std::string LumaStats::Xml() const
+{
+	std::ostringstream xml;
+	xml << "<raspindi_scopes samples=\"" << samples << "\" mean=\"" << mean << "\" low=\"" << low << "\" median=\""
+		<< median << "\" high=\"" << high << "\" black_clip=\"" << black_clip << "\" white_clip=\"" << white_clip
+		<< "\" columns=\"" << WAVEFORM_COLUMNS << "\" levels=\"" << WAVEFORM_LEVELS << "\"><histogram>"
+		<< encode(histogram) << "</histogram><waveform>" << encode(waveform) << "</waveform></raspindi_scopes>";
+	return xml.str();
+}
+
+void LumaScopes::Compute(uint8_t const *y, unsigned int width, unsigned int height, unsigned int stride,
+						 LumaStats &stats)
+{
+	unsigned int step = 1;
+	while ((uint64_t)(width / step) * (height / step) > MAX_SAMPLES)
+		step++;
+	if (width != width_ || step != step_)
+	{
+		width_ = width;
+		step_ = step;
+		column_of_.clear();
+		for (unsigned int x = 0; x < width; x += 2 * step)
+			column_of_.push_back(x * LumaStats::WAVEFORM_COLUMNS / width);
+	}
+
+	memset(partial_, 0, sizeof(partial_));
+	stats.waveform.fill(0);
+	uint32_t *h0 = partial_[0], *h1 = partial_[1], *h2 = partial_[2], *h3 = partial_[3];
+	uint32_t *waveform = stats.waveform.data();
+	for (unsigned int row = 0, n = 0; row < height; row += step, n++)
+	{
+		uint8_t const *p = y + row * stride;
+		unsigned int x = 0;
+		if (step == 1)
+		{
+			for (; x + 8 <= width; x += 8)
+			{
+				uint64_t v;
+				memcpy(&v, p + x, 8);
+				h0[v & 0xff]++;
+				h1[(v >> 8) & 0xff]++;
+				h2[(v >> 16) & 0xff]++;
+				h3[(v >> 24) & 0xff]++;
+				h0[(v >> 32) & 0xff]++;
+				h1[(v >> 40) & 0xff]++;
+				h2[(v >> 48) & 0xff]++;
+				h3[v >> 56]++;
+			}
+		}
+		for (; x < width; x += step)
+			h0[p[x]]++;
+
+		// The row is still in the cache for this.
+		if (n & 1)
+			continue;
+		uint16_t const *column = column_of_.data();
+		for (x = 0; x < width; x += 2 * step, column++)
+			waveform[*column * LumaStats::WAVEFORM_LEVELS + (p[x] >> 3)]++;
+	}
+
+	uint32_t *histogram = stats.histogram.data();
+#if defined(__ARM_NEON)
+	for (unsigned int i = 0; i < 256; i += 4)
+		vst1q_u32(histogram + i, vaddq_u32(vaddq_u32(vld1q_u32(h0 + i), vld1q_u32(h1 + i)),
+										   vaddq_u32(vld1q_u32(h2 + i), vld1q_u32(h3 + i))));
+#else
+	for (unsigned int i = 0; i < 256; i++)
+		histogram[i] = h0[i] + h1[i] + h2[i] + h3[i];
+#endif
+
+	uint64_t samples = 0, sum = 0;
+	for (unsigned int i = 0; i < 256; i++)
+	{
+		samples += histogram[i];
+		sum += (uint64_t)i * histogram[i];
+	}
+	stats.samples = samples;
+	stats.mean = samples ? (float)sum / samples : 0;
+
+	uint64_t low = samples / 100, median = samples / 2, high = samples - samples / 100, cumulative = 0;
+	stats.low = stats.median = stats.high = 0;
+	for (unsigned int i = 0; i < 256; i++)
+	{
+		cumulative += histogram[i];
+		if (cumulative <= low)
+			stats.low = i + 1;
+		if (cumulative <= median)
+			stats.median = i + 1;
+		if (cumulative < high)
+			stats.high = i + 1;
+	}
+	stats.low = std::min(stats.low, 255u);
+	stats.median = std::min(stats.median, 255u);
+	stats.high = std::min(stats.high, 255u);
+
+	uint64_t black = 0, white = 0;
+	for (unsigned int i = 0; i < CLIP_MARGIN; i++)
+	{
+		black += histogram[i];
+		white += histogram[255 - i];
+	}
+	stats.black_clip = samples ? (float)black / samples : 0;
+	stats.white_clip = samples ? (float)white / samples : 0;
+}
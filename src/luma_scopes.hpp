@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * luma_scopes.hpp - histogram and waveform of the Y plane, for exposure monitoring.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// What a histogram and a waveform monitor would show of one frame. The waveform is a
+// histogram of each of a number of vertical strips across the picture, with black at
+// level 0.
+struct LumaStats
+{
+	static constexpr unsigned int WAVEFORM_COLUMNS = 64;
+	static constexpr unsigned int WAVEFORM_LEVELS = 32;
+
+	uint32_t samples;
+	std::array<uint32_t, 256> histogram;
+	// Column by column, each from black to white.
+	std::array<uint32_t, WAVEFORM_COLUMNS * WAVEFORM_LEVELS> waveform;
+	float mean;
+	// The levels 1%, 50% and 99% of the way through the histogram.
+	unsigned int low, median, high;
+	// The fractions of the picture crushed to black, and blown out to white.
+	float black_clip, white_clip;
+
+	// All of it, as NDI metadata for receivers to draw their own scopes from. The
+	// histogram and waveform are scaled to bytes and base64 encoded.
+	std::string Xml() const;
+};
+
+// Works out LumaStats from a Y plane in one pass. Each pixel is a scattered increment of
+// a histogram bin, which NEON can't help with, so runs of similar pixels are spread over
+// several partial histograms instead, which stops each increment waiting for the last
+// one's store to the same bin. Only merging them uses NEON.
+//
+// A lores frame takes a small fraction of a millisecond. Larger planes are sampled down
+// to about the same number of pixels, and the waveform is built from a quarter of them.
+
+class LumaScopes
+{
+public:
+	void Compute(uint8_t const *y, unsigned int width, unsigned int height, unsigned int stride, LumaStats &stats);
+
+private:
+	static constexpr unsigned int PARTIALS = 4;
+	static constexpr uint64_t MAX_SAMPLES = 640 * 360;
+	// Levels within this far of either end count as clipped.
+	static constexpr unsigned int CLIP_MARGIN = 2;
+
+	uint32_t partial_[PARTIALS][256];
+	// The waveform column of each sampled pixel along a row.
+	std::vector<uint16_t> column_of_;
+	unsigned int width_ = 0, step_ = 0;
+};
@@ -1,307 +1,801 @@
+#include <atomic>
+#include <cctype>
 #include <chrono>
-#include <poll.h>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
 #include <signal.h>
-#include <sys/signalfd.h>
 #include <sys/stat.h>
 
 #include "core/rpicam_encoder.hpp"
 #include "output/output.hpp"
+#include "analysis_scheduler.hpp"
+#include "camera_control.hpp"
+#include "encoder_branch.hpp"
+#include "event_loop.hpp"
+#include "flight_recorder.hpp"
+#include "kms_preview.hpp"
 #include "ndi_output.hpp"
 #include "ndi_options.hpp"
-//#include <libconfig.h++>
+#include "latency_budget.hpp"
+#include "latency_tracer.hpp"
+#include "luma_scopes.hpp"
+#include "memory_report.hpp"
+#include "metadata_log.hpp"
+#include "metrics.hpp"
+#include "overlay.hpp"
+#include "pipeline_recovery.hpp"
+#include "raspindi_config.hpp"
+#include "rpicam_ndi_app.hpp"
+#include "thread_policy.hpp"
+#include "thermal_governor.hpp"
+#include "tone_curve.hpp"
+#include "warm_start.hpp"
+#include "watchdog.hpp"
 
 using namespace std::placeholders;
-bool exit_loop = false;
-//libconfig::Config cfg;
-static int signal_received;
 
-static void sigint_handler(int)
+// Keypresses and signals come in on the event loop, which leaves the main loop these to
+// pick up next time round, so that it never has to poll for them.
+enum Command : unsigned int
 {
-	exit_loop = true;
+	CMD_SIGNAL = 1, // as for --signal, SIGUSR1 or enter
+	CMD_QUIT = 2,
+	CMD_NDI = 4,
+	CMD_HDMI = 8,
+	CMD_SWAP = 16, // NDI and HDMI
+	CMD_REPLAY = 32,
+	CMD_RELOAD = 64, // the config file
+	CMD_TALLY = 128, // has changed
+	CMD_ANNOUNCE = 256, // the thermal governor's next step
+	CMD_PROFILE = 512, // thermal, to step to
+	// These restart the camera, so wait for the top of the loop, when no request is held.
+	CMD_RESTARTS = CMD_RELOAD | CMD_PROFILE,
+};
+static std::atomic<unsigned int> commands;
+
+static void post(unsigned int command)
+{
+	commands.fetch_or(command, std::memory_order_relaxed);
 }
 
-/*int loadConfig()
+// The first character of each line typed.
+static bool read_keys()
 {
-	try
-	{
-		cfg.readFile("/etc/raspindi.conf");
-	}
-	catch(const libconfig::FileIOException &fioex)
+	static bool line_start = true;
+	char buffer[256];
+	ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+	if (n <= 0)
+		return false;
+	for (ssize_t i = 0; i < n; i++)
 	{
-		std::cerr << "Could not open config file /etc/raspindi.conf"
-			<< std::endl;
-		return(EXIT_FAILURE);
+		char key = std::tolower(buffer[i]);
+		if (line_start)
+			post(key == '\n' ? CMD_SIGNAL : key == 'x' ? CMD_QUIT : key == 'n' ? CMD_NDI : key == 'h' ? CMD_HDMI
+				 : key == 'r' ? CMD_REPLAY : key == 's' ? CMD_SWAP : 0);
+		line_start = key == '\n';
 	}
-	catch(const libconfig::ParseException &pex)
-	{
-		std::cerr << "Parse error at " << pex.getFile() << ":" << pex.getLine()
-              << " - " << pex.getError() << std::endl;
-    	return(EXIT_FAILURE);
-	}
-	return 0;
+	return true;
 }
 
-int _getValue(std::string parameter, int defaultValue, int min, int max)
+static void add_signals(EventLoop &events, NDIOptions const *options)
 {
-    try
-    {
-        int value = cfg.lookup(parameter);
-        if (value > max)
-        {
-            std::cerr << "Invalid value for " << parameter << ": " << value << std::endl;
-            return 100;
-        }
-        if (value < 0)
-        {
-            std::cerr << "Invalid value for " << parameter << ": " << value << std::endl;
-            return 0;
-        }
-        return value;
-    } catch (libconfig::SettingNotFoundException)
-    {
-        return defaultValue;
-    }
+	bool signals = options->Get().signal;
+	events.AddSignal(SIGINT, [] { post(CMD_QUIT); });
+	events.AddSignal(SIGUSR1, [signals] { post(signals ? CMD_SIGNAL : 0); });
+	// Dumps the flight recorder, with or without --signal.
+	events.AddSignal(SIGUSR2, [signals] {
+		FlightRecorder::Get().Dump("signal");
+		post(signals ? CMD_QUIT : 0);
+	});
+	// SIGPIPE gets raised when trying to write to an already closed socket. This can happen, when
+	// you're using TCP to stream to VLC and the user presses the stop button in VLC. Catching the
+	// signal to be able to react on it, otherwise the app terminates.
+	events.AddSignal(SIGPIPE, [signals] { post(signals ? CMD_QUIT : 0); });
+	// Swaps the NDI and HDMI outputs over (see below).
+	events.AddSignal(SIGRTMIN, [signals] { post(signals ? CMD_SWAP : 0); });
+	// Starts or stops an instant replay.
+	events.AddSignal(SIGRTMIN + 1, [signals] { post(signals ? CMD_REPLAY : 0); });
+	// Reloads the config file, with or without --signal.
+	if (!options->raspindi_config.empty())
+		events.AddSignal(SIGHUP, [] { post(CMD_RELOAD); });
 }
 
-int _getValue(std::string parameter, int defaultValue)
-{
-	try
-    {
-        int value = cfg.lookup(parameter);
-        return value;
-    } catch (libconfig::SettingNotFoundException)
-    {
-        return defaultValue;
-    }
-}
+// How many frames after we stop being idle may still be arriving at the idle rate.
+static constexpr unsigned int MAX_RAMP_FRAMES = 8;
 
-float _getValue(std::string parameter, float defaultValue)
+static int get_colourspace_flags(std::string const &codec)
 {
-	try
-    {
-        float value = cfg.lookup(parameter);
-        return value;
-    } catch (libconfig::SettingNotFoundException)
-    {
-        return defaultValue;
-    }
+	if (codec == "mjpeg" || codec == "yuv420")
+		return RPiCamEncoder::FLAG_VIDEO_JPEG_COLOURSPACE;
+	else
+		return RPiCamEncoder::FLAG_VIDEO_NONE;
 }
 
-std::string _getValue(std::string parameter, std::string defaultValue)
-{
-	try
-    {
-        std::string value = cfg.lookup(parameter);
-        return value;
-    } catch (libconfig::SettingNotFoundException)
-    {
-        return defaultValue;
-    }
-}
+// The main even loop for the application.
 
-void mirrored_rotation(VideoOptions *options)
+static void event_loop(RPiCamNdiApp &app, RaspindiConfig config)
 {
-	std::string value = _getValue("mirror", "none");
-	libcamera::Transform transform = libcamera::Transform::Identity;
-	bool hflip = false;
-	bool vflip = false;
-	if (value == "horizontal")
+	NDIOptions const *options = app.GetOptions();
+	std::unique_ptr<MemoryReport> memory_report;
+	if (options->low_memory)
+		memory_report = std::make_unique<MemoryReport>();
+	// Before anything starts a thread, so that they all leave the signals to the event loop.
+	Watchdog watchdog;
+	std::unique_ptr<ThermalGovernor> governor;
+	EventLoop events;
+	add_signals(events, options);
+	if (options->Get().keypress)
+		events.AddFd(STDIN_FILENO, read_keys);
+	events.AddTimer(watchdog.Period(), std::bind(&Watchdog::Check, &watchdog));
+	// Profiles come from the config file, so may turn up in a reload.
+	if (!options->raspindi_config.empty())
 	{
-		hflip = true;
+		governor = std::make_unique<ThermalGovernor>(
+			config.thermal_profiles, options,
+			[](ThermalGovernor::Event event) { post(event == ThermalGovernor::STEP ? CMD_PROFILE : CMD_ANNOUNCE); });
+		events.AddTimer(ThermalGovernor::CHECK_PERIOD, std::bind(&ThermalGovernor::Check, governor.get()));
+		config = governor->Apply(config);
 	}
-	if (value == "vertical")
+	// The file's own settings, before the governor's.
+	RaspindiConfig file_config = config;
+	events.Start();
+	// With nobody receiving, we stop sending and (unless some other output still wants
+	// every frame) slow the camera right down. It's asked back up straight from the thread
+	// that hears of the first connection, as the main loop might be most of a slow frame
+	// from noticing. Frames already on their way still come at the slow rate, but from
+	// the connection on, every one is sent. All this must outlive the output, whose thread
+	// uses it.
+	std::atomic<bool> ndi_idle(false), may_slow_camera(false);
+	std::mutex camera_rate_mutex;
+	bool camera_slow = false;
+	auto update_camera_rate = [&]()
+	{
+		std::lock_guard<std::mutex> lock(camera_rate_mutex);
+		bool slow = ndi_idle && may_slow_camera;
+		if (slow == camera_slow)
+			return;
+		camera_slow = slow;
+		float fps = slow ? options->ndi_idle_fps : options->Get().framerate.value_or(30);
+		int64_t frame_duration_us = 1e6 / fps;
+		libcamera::ControlList controls(controls::controls);
+		controls.set(controls::FrameDurationLimits,
+					 libcamera::Span<const int64_t, 2>({ frame_duration_us, frame_duration_us }));
+		app.SetControls(controls);
+		LOG(1, "Camera running at " << fps << "fps");
+	};
+	// Applied to both streams, so that every output matches. Receivers can change it from
+	// the output's metadata thread, so it must outlive the output too.
+	ToneCurve tone_curve;
+	tone_curve.Set(options->tone_curve);
+	CameraControl camera_control;
+	// Before the camera opens, or rpicam's own preview takes the display first.
+	std::unique_ptr<KmsPreview> kms_preview;
+	if (options->hdmi_kms && !options->Get().nopreview)
 	{
-		vflip = true;
+		try
+		{
+			kms_preview = std::make_unique<KmsPreview>(
+				events, std::chrono::microseconds(options->hdmi_max_age.get<std::chrono::microseconds>()));
+			options->Set().nopreview = true;
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR("ERROR: using the preview window for HDMI output, " << e.what());
+		}
 	}
-	if (value == "both")
+	// Creating the NDI sender (and starting to advertise it) takes a while, and so does
+	// opening and configuring the camera, so do both at once.
+	std::future<std::unique_ptr<NdiOutput>> pending_output = std::async(std::launch::async, [options]() {
+		// libndi's threads start along with the sender, and take their settings from here.
+		ThreadPolicy::Get().Apply(ThreadPolicy::NDI, "ndi-start");
+		return std::make_unique<NdiOutput>(options);
+	});
+	// Unless we want to know what each costs.
+	std::unique_ptr<NdiOutput> output;
+	if (memory_report)
 	{
-		hflip = true;
-		vflip = true;
+		output = pending_output.get();
+		memory_report->Mark("NDI sender");
 	}
-	if (hflip)
-		transform = libcamera::Transform::HFlip * transform;
-	if (vflip)
-		transform = libcamera::Transform::VFlip * transform;
-	
-	bool ok;
-	libcamera::Transform rotation = libcamera::transformFromRotation(_getValue("rotation", 0), &ok);
-	if (!ok)
-		throw std::runtime_error("illegal rotation value");
-	transform = rotation * transform;
-	options->Set().transform = transform;
-}*/
+	app.OpenCamera();
+	app.ConfigureMain(get_colourspace_flags(options->Get().codec));
+	if (memory_report)
+		memory_report->Mark("camera");
+	else
+		output = pending_output.get();
+	std::unique_ptr<WarmStart> warm_start;
+	if (!options->warm_start.empty())
+		warm_start = std::make_unique<WarmStart>(options->warm_start);
+	std::unique_ptr<AnalysisScheduler> analysis;
+	if (!options->analysis_file.empty())
+		analysis = std::make_unique<AnalysisScheduler>(&app, options->analysis_file, options->Get().post_process_libs,
+													   options->analysis_threads);
+	// Scopes come from the lores stream where there is one, as it's cheaper to read.
+	std::unique_ptr<LumaScopes> scopes;
+	if (options->ndi_scopes)
+		scopes = std::make_unique<LumaScopes>();
+	libcamera::Stream *scopes_stream = nullptr;
+	StreamInfo scopes_info;
+	if (options->ndi_tone_curve)
+		output->AddMetadataHandler("raspindi_tone_curve", std::bind(&ToneCurve::Command, &tone_curve, _1),
+								   "<raspindi_tone_curve enabled=\"true\"/>");
+	if (options->ndi_camera_control)
+	{
+		// Advertised once, whoever handles it.
+		output->AddMetadataHandler("ntk_ptz_", std::bind(&CameraControl::Command, &camera_control, _1),
+								   options->ndi_ptz ? "" : "<ntk_ptz enabled=\"true\"/>");
+		output->AddMetadataHandler("raspindi_ccu", std::bind(&CameraControl::Command, &camera_control, _1),
+								   CameraControl::CCU_CAPABILITY);
+	}
+	StreamInfo video_info, lores_info;
+	std::unique_ptr<Overlay> overlay;
+	if (!options->overlay.empty())
+		overlay = std::make_unique<Overlay>(options->overlay,
+											options->overlay_id.empty() ? options->ndi_name : options->overlay_id);
+	std::unique_ptr<MetricsServer> metrics_server;
+	if (options->metrics_port)
+		metrics_server = std::make_unique<MetricsServer>(options->metrics_port);
+	// The tracer also feeds the latency histograms, so metrics need it too.
+	std::unique_ptr<LatencyTracer> latency_tracer;
+	if (!options->latency_stats.empty() || metrics_server || !options->latency_profile.empty())
+		latency_tracer = std::make_unique<LatencyTracer>(options->latency_stats, options->latency_profile);
+	// Never more than one frame waiting in the encoder (see --latency_profile).
+	unsigned int max_encoder_backlog = options->latency_profile == "low" ? 1 : 0;
+	std::unique_ptr<MetadataLog> metadata_log;
+	if (!options->metadata_log.empty())
+		metadata_log = std::make_unique<MetadataLog>(options->metadata_log, options->metadata_log_frames);
+	std::unique_ptr<LatencyBudget> latency_budget;
+	// The ndi codec sends each frame before EncodeBuffer returns, so the main loop's check
+	// covers it. Dropping a frame at its send would also be unsafe there, as an async send
+	// of the previous frame would still be using a buffer the encoder is about to recycle.
+	bool check_send_budget = options->Get().codec != "ndi";
+	if (options->latency_budget)
+	{
+		latency_budget = std::make_unique<LatencyBudget>(
+			std::chrono::microseconds(options->latency_budget.get<std::chrono::microseconds>()),
+			options->Get().codec == "ndi_h264" || options->Get().codec == "ndi_hevc");
+		latency_budget->SetKeyframeRequestCallback(std::bind(&RPiCamNdiApp::RequestKeyframe, &app, false));
+	}
+	if (latency_tracer || latency_budget)
+	{
+		// Output rebases the timestamps it passes on to zero, so this has to happen out
+		// here, where they still match the ones the main loop saw.
+		app.SetEncodeOutputReadyCallback(
+			[&](void *mem, size_t size, int64_t timestamp_us, bool keyframe)
+			{
+				if (latency_budget && check_send_budget && !latency_budget->AdmitToSend(timestamp_us, keyframe))
+					return;
+				if (latency_tracer)
+					latency_tracer->Mark(timestamp_us, LatencyTracer::OUTPUT);
+				output->FrameReady(mem, size, timestamp_us, keyframe);
+				if (latency_tracer)
+					latency_tracer->Mark(timestamp_us, LatencyTracer::SENT);
+			});
+	}
+	else
+		app.SetEncodeOutputReadyCallback(std::bind(&NdiOutput::FrameReady, output.get(), _1, _2, _3, _4));
+	app.SetMetadataReadyCallback(std::bind(&Output::MetadataReady, output.get(), _1));
 
-static void default_signal_handler(int signal_number)
-{
-	signal_received = signal_number;
-	LOG(1, "Received signal " << signal_number);
-}
+	Metrics &metrics = Metrics::Get();
+	Metrics::Counter &frames_in = metrics.AddCounter("raspindi_camera_frames_total", "Frames from the camera");
+	Metrics::Gauge &camera_fps = metrics.AddGauge("raspindi_camera_fps", "The rate frames arrive from the camera");
+	// The encoder's own queues are out of reach, but this less raspindi_ndi_frames_sent_total
+	// is what it's still working on (while NDI is on, and nothing is over budget).
+	Metrics::Counter &frames_encoded =
+		metrics.AddCounter("raspindi_frames_encoded_total", "Frames passed to the main encoder");
+	Metrics::Counter &encoder_busy_drops = metrics.AddCounter(
+		"raspindi_encoder_busy_drops_total", "Frames not encoded as the encoder still had one (--latency_profile low)");
 
-static int get_key_or_signal(VideoOptions const *options, pollfd p[1])
-{
-	int key = 0;
-	if (signal_received == SIGINT)
-		return 'x';
-	if (options->Get().keypress)
+	std::vector<std::unique_ptr<EncoderBranch>> branches;
+	bool replay_on = false, replay_requested = false;
+
+	if (options->ndi_idle_fps)
+	{
+		output->SetConnectionCallback(
+			[&](bool connected)
+			{
+				ndi_idle = !connected;
+				update_camera_rate();
+			});
+	}
+	auto start_pipeline = [&](bool configured)
 	{
-		poll(p, 1, 0);
-		if (p[0].revents & POLLIN)
+		if (!configured)
+			app.ConfigureMain(get_colourspace_flags(options->Get().codec));
+		StreamInfo info;
+		app.MainStream(&info);
+		output->SetStreamInfo(info);
+		video_info = info;
+		if (overlay)
+			overlay->SetGeometry(info);
+		app.LoresStream(&lores_info);
+		if (analysis)
+			analysis->Configure();
+		if (scopes && !(scopes_stream = app.LoresStream(&scopes_info)))
+			scopes_stream = app.MainStream(&scopes_info);
+		if (NdiPtz *ptz = output->Ptz())
 		{
-			char *user_string = nullptr;
-			size_t len;
-			[[maybe_unused]] size_t r = getline(&user_string, &len, stdin);
-			key = user_string[0];
+			auto sensor_area = app.GetProperties().get(properties::ScalerCropMaximum);
+			if (sensor_area)
+			{
+				ptz->SetGeometry(*sensor_area, libcamera::Size(info.width, info.height));
+				libcamera::ControlList controls(controls::controls);
+				controls.set(controls::ScalerCrop, ptz->Crop());
+				app.SetControls(controls);
+			}
+			else
+				LOG_ERROR("The camera can't crop, so PTZ won't move it");
 		}
-	}
-	if (options->Get().signal)
+		if (app.LoresStream(&info))
+			output->SetLoresStreamInfo(info);
+		app.StartEncoder();
+		if (options->Get().codec == "ndi_h264" || options->Get().codec == "ndi_hevc")
+		{
+			app.StartLowBandwidthEncoder(std::bind(&NdiOutput::LowBandwidthReady, output.get(), _1, _2, _3, _4));
+			output->SetKeyframeRequestCallback(std::bind(&RPiCamNdiApp::RequestKeyframe, &app, _1));
+			output->SetBitrateCallback(std::bind(&RPiCamNdiApp::SetBitrate, &app, _1, _2));
+		}
+		else if (options->Get().codec == "ndi_shq")
+		{
+			app.StartLowBandwidthEncoder(std::bind(&NdiOutput::LowBandwidthReady, output.get(), _1, _2, _3, _4));
+			output->SetQualityCallback(std::bind(&RPiCamNdiApp::SetQuality, &app, _1));
+		}
+		for (auto const &branch : options->branches)
+			branches.push_back(std::make_unique<EncoderBranch>(&app, options, branch, app.MainStream()));
+		// Seed only what neither the command line nor the config file fixes.
+		if (warm_start)
+			app.SetControls(warm_start->SeedControls(
+				!options->Get().shutter, !options->Get().gain && !(config.gain && *config.gain > 0),
+				!options->Get().awb_gain_r && !options->Get().awb_gain_b &&
+					!(config.awb && *config.awb == "custom" && config.r_gain && config.b_gain)));
+		app.SetControls(config.Controls());
+		app.SetControls(camera_control.Controls());
+		// The camera starts at full rate unless told otherwise.
+		{
+			std::lock_guard<std::mutex> lock(camera_rate_mutex);
+			camera_slow = false;
+		}
+		update_camera_rate();
+		if (analysis)
+			analysis->Start();
+		app.StartCamera();
+	};
+	auto stop_pipeline = [&]()
+	{
+		if (analysis)
+			analysis->Stop();
+		app.StopCamera(); // stop complains if encoder very slow to close
+		if (kms_preview)
+			kms_preview->Reset();
+		app.StopEncoder();
+		app.StopLowBandwidthEncoder();
+		branches.clear();
+		replay_on = false; // so that new branches are told
+		post(CMD_TALLY);
+		if (analysis)
+			analysis->Teardown();
+	};
+
+	if (memory_report)
+		memory_report->Mark("the rest");
+	start_pipeline(true);
+	if (memory_report)
 	{
-		if (signal_received == SIGUSR1)
-			key = '\n';
-		else if ((signal_received == SIGUSR2) || (signal_received == SIGPIPE))
-			key = 'x';
-		signal_received = 0;
+		memory_report->Mark("encoders");
+		memory_report->Print();
 	}
-	return key;
-}
+	auto start_time = std::chrono::high_resolution_clock::now();
 
-static int get_colourspace_flags(std::string const &codec)
-{
-	if (codec == "mjpeg" || codec == "yuv420")
-		return RPiCamEncoder::FLAG_VIDEO_JPEG_COLOURSPACE;
-	else
-		return RPiCamEncoder::FLAG_VIDEO_NONE;
-}
+	// Every frame can go to NDI, to the HDMI preview, or to both, and each can be switched
+	// on and off without touching the camera. Both are handed the same buffer, so neither
+	// costs a copy. NDI is switched through Output's own enable state, which also makes an
+	// h.264 stream restart cleanly from a keyframe.
+	bool ndi_enabled = true, hdmi_enabled = options->output_mode != "ndi";
+	auto set_ndi = [&](bool enable)
+	{
+		if (enable == ndi_enabled)
+			return;
+		ndi_enabled = enable;
+		output->Signal();
+		if (ndi_enabled)
+		{
+			app.RequestKeyframe(false);
+			app.RequestKeyframe(true);
+		}
+		LOG(1, "NDI output " << (ndi_enabled ? "on" : "off"));
+	};
+	auto set_hdmi = [&](bool enable)
+	{
+		if (enable == hdmi_enabled)
+			return;
+		if (enable && !kms_preview && options->Get().nopreview)
+		{
+			LOG_ERROR("ERROR: cannot switch HDMI output on when running with --nopreview");
+			return;
+		}
+		hdmi_enabled = enable;
+		LOG(1, "HDMI output " << (hdmi_enabled ? "on" : "off"));
+	};
+	set_ndi(options->output_mode != "hdmi");
 
-// The main even loop for the application.
+	// While idle, and for the first few frames after, the camera isn't running at the
+	// rate we want receivers to think it does.
+	bool was_idle = false;
+	unsigned int ramp_frames = 0;
+	float full_framerate = 0;
 
-static void event_loop(RPiCamEncoder &app)
-{
-	VideoOptions const *options = app.GetOptions();
-	std::unique_ptr<Output> output = std::unique_ptr<Output>(Output::Create(options));
-//	std::unique_ptr<Output> output = std::unique_ptr<Output>(new NdiOutput(options, _getValue("neopixel_path", "/tmp/neopixel.state")));
-	app.SetEncodeOutputReadyCallback(std::bind(&Output::OutputReady, output.get(), _1, _2, _3, _4));
-	app.SetMetadataReadyCallback(std::bind(&Output::MetadataReady, output.get(), _1));
+	// Replay branches save whenever we're on program, or have been told to by hand.
+	auto update_replay = [&]()
+	{
+		bool on = replay_requested || output->isProgram();
+		if (on == replay_on)
+			return;
+		replay_on = on;
+		for (auto &branch : branches)
+			branch->Trigger(replay_on);
+	};
 
-	app.OpenCamera();
-	app.ConfigureVideo(get_colourspace_flags(options->Get().codec));
-	app.StartEncoder();
-	app.StartCamera();
-	auto start_time = std::chrono::high_resolution_clock::now();
+	// Set while a restart holds the NDI frame, until the first new one arrives.
+	bool restarting = false;
+	// Apply a new config (from the file, or the thermal governor) as lightly as we can:
+	// camera controls go out with the next request, and a new NDI name or groups only
+	// recreates the sender. A new camera or mode needs the whole pipeline restarted.
+	auto apply_config = [&](RaspindiConfig new_config)
+	{
+		if (governor)
+			new_config = governor->Apply(new_config);
+		bool restart = new_config.NeedsRestart(config);
+		bool new_camera = new_config.camera_number != config.camera_number;
+		bool new_source = new_config.NdiSourceChanged(config);
+		config = new_config;
+		config.ApplyToOptions(app.GetOptions());
 
-	// Monitoring for keypresses and signals.
-	signal(SIGUSR1, default_signal_handler);
-	signal(SIGUSR2, default_signal_handler);
-	signal(SIGINT, default_signal_handler);
-	// SIGPIPE gets raised when trying to write to an already closed socket. This can happen, when
-	// you're using TCP to stream to VLC and the user presses the stop button in VLC. Catching the
-	// signal to be able to react on it, otherwise the app terminates.
-	signal(SIGPIPE, default_signal_handler);
-	pollfd p[1] = { { STDIN_FILENO, POLLIN, 0 } };
+		if (restart)
+		{
+			LOG(1, "Camera mode changed, restarting");
+			// Receivers get the held frame, and then the slate, until the camera is back.
+			if (ndi_enabled)
+			{
+				output->HoldFrame();
+				restarting = true;
+			}
+			output->Flush();
+			stop_pipeline();
+			app.Teardown();
+			if (new_camera)
+			{
+				app.CloseCamera();
+				app.OpenCamera();
+			}
+		}
+		if (new_source)
+			output->SetSource(options);
+		if (restart)
+			start_pipeline(false);
+		else
+			app.SetControls(config.Controls());
+	};
+	// On SIGHUP, re-read the config file.
+	auto reload_config = [&]()
+	{
+		RaspindiConfig new_config;
+		try
+		{
+			new_config = RaspindiConfig::Load(options->raspindi_config);
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR("ERROR: keeping the current settings, " << e.what());
+			return;
+		}
+		LOG(1, "Reloading " << options->raspindi_config);
+		file_config = new_config;
+		if (governor)
+			governor->SetProfiles(file_config.thermal_profiles);
+		apply_config(file_config);
+	};
+
+	// The NDI sender stays up throughout, sending the last frame again, so that receivers
+	// see a freeze rather than the source vanishing and have nothing to reconnect to.
+	PipelineRecovery recovery;
+	auto recover = [&]()
+	{
+		for (;;)
+		{
+			std::chrono::milliseconds backoff;
+			PipelineRecovery::Action action = recovery.Next(backoff);
+			auto until = std::chrono::steady_clock::now() + backoff;
+			while (std::chrono::steady_clock::now() < until)
+			{
+				if (commands.load(std::memory_order_relaxed) & CMD_QUIT)
+					return false;
+				watchdog.Feed();
+				std::this_thread::sleep_for(std::chrono::milliseconds(50));
+			}
+
+			try
+			{
+				if (action == PipelineRecovery::RESTART_CAMERA)
+				{
+					if (analysis)
+						analysis->Stop();
+					app.StopCamera();
+					if (analysis)
+						analysis->Start();
+					app.StartCamera();
+				}
+				else
+				{
+					output->Flush();
+					stop_pipeline();
+					app.Teardown();
+					if (action == PipelineRecovery::REOPEN_CAMERA)
+					{
+						app.CloseCamera();
+						app.OpenCamera();
+					}
+					start_pipeline(false);
+				}
+				return true;
+			}
+			catch (std::exception const &e)
+			{
+				LOG_ERROR("ERROR: camera recovery failed, " << e.what());
+			}
+		}
+	};
+
+	// Replay branches follow the tally, which no longer needs checking every frame.
+	output->SetTallyCallback([](NdiTally::State) { post(CMD_TALLY); });
+	post(CMD_TALLY);
 
 	for (unsigned int count = 0; ; count++)
 	{
+		// Don't hold on to a request while the camera might be restarting.
+		watchdog.Feed();
+		if (commands.load(std::memory_order_relaxed) & CMD_RESTARTS)
+		{
+			unsigned int command = commands.fetch_and(~CMD_RESTARTS, std::memory_order_relaxed);
+			if (command & CMD_RELOAD)
+				reload_config();
+			else
+				apply_config(file_config);
+		}
 		RPiCamEncoder::Msg msg = app.Wait();
 		if (msg.type == RPiCamApp::MsgType::Timeout)
 		{
-			LOG_ERROR("ERROR: Device timeout detected, attempting a restart!!!");
-			app.StopCamera();
-			app.StartCamera();
+			if (recovery.Timeout())
+			{
+				LOG_ERROR("ERROR: Device timeout detected, attempting a recovery");
+				if (ndi_enabled)
+					output->HoldFrame();
+				if (!recover())
+					return;
+			}
 			continue;
 		}
 		if (msg.type == RPiCamEncoder::MsgType::Quit)
 			return;
 		else if (msg.type != RPiCamEncoder::MsgType::RequestComplete)
 			throw std::runtime_error("unrecognised message!");
-		int key = get_key_or_signal(options, p);
-		if (key == '\n')
-			output->Signal();
+		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
+		if (recovery.FrameReceived() || restarting)
+		{
+			restarting = false;
+			output->ReleaseFrame();
+			app.RequestKeyframe(false);
+			app.RequestKeyframe(true);
+		}
+		int64_t timestamp_us =
+			RPiCamNdiApp::FrameTimestamp(completed_request, completed_request->buffers[app.MainStream()]);
+		int64_t sensor_timestamp_ns = completed_request->metadata.get(controls::SensorTimestamp).value_or(0);
+		if (latency_tracer)
+			latency_tracer->Begin(completed_request->sequence, timestamp_us, sensor_timestamp_ns);
+		FlightRecorder::Get().Record(FlightEvent::FRAME_ARRIVED, timestamp_us, completed_request->sequence);
+		bool idle = ndi_idle;
+		if (idle != was_idle)
+		{
+			was_idle = idle;
+			if (idle)
+				output->Flush();
+			else
+			{
+				// Whoever just connected needs a keyframe.
+				app.RequestKeyframe(false);
+				app.RequestKeyframe(true);
+				ramp_frames = MAX_RAMP_FRAMES;
+			}
+		}
+		if (ramp_frames && completed_request->framerate >= full_framerate * 0.9f)
+			ramp_frames = 0;
+		if (!idle && !ramp_frames)
+		{
+			output->SetFrameRate(completed_request->framerate);
+			full_framerate = completed_request->framerate;
+		}
+		else if (ramp_frames)
+			ramp_frames--;
+		frames_in.Inc();
+		if (metadata_log)
+			metadata_log->Record(completed_request->sequence, timestamp_us, completed_request->metadata);
+		if (governor)
+			governor->Frame(completed_request->buffers[app.MainStream()]->metadata().sequence);
+		camera_fps.Set(completed_request->framerate);
+		// Before the analysis stages have the frame, as they read it on their own threads.
+		if (tone_curve.Active())
+		{
+			BufferWriteSync w(&app, completed_request->buffers[app.MainStream()]);
+			tone_curve.Apply(w.Get()[0].data(), video_info.width, video_info.height, video_info.stride);
+			if (app.LoresStream())
+			{
+				BufferWriteSync l(&app, completed_request->buffers[app.LoresStream()]);
+				tone_curve.Apply(l.Get()[0].data(), lores_info.width, lores_info.height, lores_info.stride);
+			}
+		}
+		if (analysis)
+		{
+			analysis->ApplyResults(completed_request);
+			analysis->Submit(completed_request);
+		}
+		// Whatever changes this frame goes to the camera in one go.
+		libcamera::ControlList controls(controls::controls);
+		libcamera::ControlList release;
+		if (warm_start && warm_start->Update(completed_request->metadata, release))
+			controls.merge(release);
+		libcamera::Rectangle crop;
+		if (output->Ptz() && output->Ptz()->Update(timestamp_us, crop))
+			controls.set(controls::ScalerCrop, crop);
+		// Receivers get the last word.
+		camera_control.Update(completed_request->metadata, controls);
+		if (!controls.empty())
+			app.SetControls(controls);
+		// Usually there's nothing, so save ourselves the locked instruction.
+		unsigned int command = 0;
+		if (commands.load(std::memory_order_relaxed) & ~CMD_RESTARTS)
+			command = commands.fetch_and(CMD_RESTARTS, std::memory_order_relaxed) & ~CMD_RESTARTS;
+		// As it always has, the signal pauses and resumes NDI, which stays in step with 'n'.
+		if (command & CMD_SIGNAL)
+			set_ndi(!ndi_enabled);
+		if (command & CMD_NDI)
+			set_ndi(!ndi_enabled);
+		if (command & CMD_HDMI)
+			set_hdmi(!hdmi_enabled);
+		if (command & CMD_REPLAY)
+			replay_requested = !replay_requested;
+		if ((command & CMD_SWAP) && ndi_enabled != hdmi_enabled)
+		{
+			set_ndi(!ndi_enabled);
+			set_hdmi(!hdmi_enabled);
+		}
+		if (command & (CMD_REPLAY | CMD_TALLY))
+			update_replay();
+		if (command & CMD_ANNOUNCE)
+		{
+			std::string announcement = governor->Announcement();
+			if (!announcement.empty())
+				output->SendMetadata(announcement, timestamp_us);
+		}
 
 		LOG(2, "Viewfinder frame " << count);
 		auto now = std::chrono::high_resolution_clock::now();
 		bool timeout = !options->Get().frames && options->Get().timeout &&
 					   ((now - start_time) > options->Get().timeout.value);
 		bool frameout = options->Get().frames && count >= options->Get().frames;
-		if (timeout || frameout || key == 'x' || key == 'X')
+		if (timeout || frameout || (command & CMD_QUIT))
 		{
 			if (timeout)
 				LOG(1, "Halting: reached timeout of " << options->Get().timeout.get<std::chrono::milliseconds>()
 													  << " milliseconds.");
-			app.StopCamera(); // stop complains if encoder very slow to close
-			app.StopEncoder();
+			stop_pipeline();
 			return;
 		}
-		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
-		if (!app.EncodeBuffer(completed_request, app.VideoStream()))
+		// Only the main stream, as the proxy and scopes are better off without.
+		NdiTally::State tally =
+			output->isProgram() ? NdiTally::PROGRAM : output->isPreview() ? NdiTally::PREVIEW : NdiTally::NONE;
+		if (overlay && overlay->Update(tally, completed_request->framerate))
+		{
+			BufferWriteSync w(&app, completed_request->buffers[app.MainStream()]);
+			overlay->Apply(w.Get()[0].data());
+		}
+		if (hdmi_enabled && kms_preview)
+			kms_preview->Show(completed_request, app.MainStream(), video_info);
+		else if (hdmi_enabled)
+			app.ShowPreview(completed_request, app.MainStream());
+		// Recordings keep every frame, whatever the latency budget says about NDI.
+		for (auto &branch : branches)
+			branch->EncodeBuffer(completed_request);
+		if (options->ndi_idle_fps && may_slow_camera != (branches.empty() && !hdmi_enabled))
+		{
+			may_slow_camera = !may_slow_camera;
+			update_camera_rate();
+		}
+		if (idle)
+			continue;
+		if (latency_budget && !latency_budget->AdmitToEncoder(timestamp_us, sensor_timestamp_ns))
+		{
+			if (governor)
+				governor->Dropped();
+			continue;
+		}
+		// Dropping a frame before it's encoded costs nothing but the frame, where queueing
+		// it behind one the encoder is still on delays every frame after.
+		if (max_encoder_backlog && app.EncoderBacklog() >= max_encoder_backlog)
+		{
+			encoder_busy_drops.Inc();
+			FlightRecorder::Get().Record(FlightEvent::DROP, timestamp_us, 0, FlightEvent::ENCODER_BUSY);
+			if (governor)
+				governor->Dropped();
+			continue;
+		}
+		if (latency_tracer)
+			latency_tracer->Mark(timestamp_us, LatencyTracer::ENCODE);
+		FlightRecorder::Get().Record(FlightEvent::ENCODE_START, timestamp_us);
+		frames_encoded.Inc();
+		if (!app.EncodeBuffer(completed_request, app.MainStream()))
 		{
 			// Keep advancing our "start time" if we're still waiting to start recording (e.g.
 			// waiting for synchronisation with another camera).
 			start_time = now;
 			count = 0; // reset the "frames encoded" counter too
 		}
-		app.ShowPreview(completed_request, app.VideoStream());
-	}
-
-/*	VideoOptions const *options = app.GetOptions();
-	std::unique_ptr<Output> output = std::unique_ptr<Output>(new NdiOutput(options, _getValue("neopixel_path", "/tmp/neopixel.state")));
-	app.SetEncodeOutputReadyCallback(std::bind(&Output::OutputReady, output.get(), _1, _2, _3, _4));
-
-
-	app.OpenCamera();
-	app.ConfigureVideo(RPiCamEncoder::FLAG_VIDEO_JPEG_COLOURSPACE);
-	app.StartEncoder();
-	app.StartCamera();
-	while (!exit_loop)
-	{
-		RPiCamEncoder::Msg msg = app.Wait();
-		if (msg.type == RPiCamEncoder::MsgType::Quit)
-			return;
-		else if (msg.type != RPiCamEncoder::MsgType::RequestComplete)
-			throw std::runtime_error("unrecognised message!");
-
-		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
-		app.EncodeBuffer(completed_request, app.VideoStream());
+		else if (ndi_enabled)
+		{
+			app.EncodeLowBandwidth(completed_request);
+			if (output->ProxyDue(timestamp_us))
+			{
+				BufferReadSync r(&app, completed_request->buffers[app.LoresStream()]);
+				output->ProxyFrameReady(r.Get()[0].data(), timestamp_us);
+			}
+		}
+		// Once the frame is on its way, so as not to hold it up.
+		if (scopes)
+		{
+			LumaStats stats;
+			{
+				BufferReadSync r(&app, completed_request->buffers[scopes_stream]);
+				scopes->Compute(r.Get()[0].data(), scopes_info.width, scopes_info.height, scopes_info.stride, stats);
+			}
+			if (ndi_enabled)
+				output->SendMetadata(stats.Xml(), timestamp_us);
+			completed_request->post_process_metadata.Set("luma.stats", std::move(stats));
+		}
 	}
-*/}
+}
 
 int main(int argc, char *argv[])
 {
 	try
 	{
-		RPiCamEncoder app;
+		RPiCamNdiApp app;
 		NDIOptions *options = app.GetOptions();
 		if (options->Parse(argc, argv))
 		{
+			RaspindiConfig config;
+			if (!options->raspindi_config.empty())
+			{
+				config = RaspindiConfig::Load(options->raspindi_config);
+				config.ApplyToOptions(options);
+			}
 			if (options->Get().verbose >= 2)
 				options->Get().Print();
 
-			event_loop(app);
+			// Before any threads start, so that the main thread's settings aren't what they
+			// all inherit. Its name is left alone, as that's the program's.
+			ThreadPolicy::Get().Configure(options->thread_policy, options->mlockall);
+			ThreadPolicy::Get().Apply(ThreadPolicy::CAPTURE, nullptr);
+			if (!options->flight_recorder.empty())
+				FlightRecorder::Get().Start(options->flight_recorder, options->flight_recorder_events);
+			event_loop(app, config);
+			FlightRecorder::Get().Stop();
 		}
-
-/*		loadConfig();
-		options->Set().codec = "YUV420";
-		options->Set().verbose = false;
-		options->Set().nopreview = true;
-		options->Set().denoise = "off";
-		// Set flip
-		options->Set().width = _getValue("width", 1280);
-		options->Set().height = _getValue("height", 720);
-		options->Set().framerate = _getValue("framerate", 25);
-		options->Set().awb = _getValue("awb", "auto");
-		options->Set().awb_gain_b = _getValue("b_gain", 0.0f);
-		options->Set().awb_gain_r = _getValue("r_gain", 0.0f);
-		options->Set().saturation = _getValue("saturation", 1);
-		options->Set().sharpness = _getValue("sharpness", 1);
-		options->Set().contrast = _getValue("contrast", 1);
-		options->Set().brightness = ((_getValue("brightness", 50) / 50) - 1);
-		options->Set().exposure = _getValue("exposuremode", "auto");
-		options->Set().metering = _getValue("meteringmode", "average");
-		mirrored_rotation(options);
-	//	options->Print();
-		event_loop(app);
-*/	}
+	}
 	catch (std::exception const &e)
 	{
 		std::cerr << "ERROR: *** " << e.what() << " ***" << std::endl;
+		FlightRecorder::Get().Dump("error");
+		FlightRecorder::Get().Stop();
 		return -1;
 	}
 	return 0;
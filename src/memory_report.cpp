@@ -0,0 +1,57 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * memory_report.cpp - what each part of raspindi costs in memory at startup.
+ */
+
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+#include "core/logging.hpp"
+
+#include "memory_report.hpp"
+
+// A "Name:   1234 kB" line from a /proc file, or 0 if it isn't there.
+static long proc_kb(char const *path, std::string const &name)
+{
+	std::ifstream file(path);
+	std::string line;
+	while (std::getline(file, line))
+	{
+		if (line.compare(0, name.size(), name) == 0 && line[name.size()] == ':')
+			return std::stol(line.substr(name.size() + 1));
+	}
+	return 0;
+}
+
+MemoryReport::MemoryReport() : last_(usage())
+{
+	entries_.push_back({ "startup", last_ });
+}
+
+MemoryReport::Usage MemoryReport::usage()
+{
+	return { proc_kb("/proc/self/status", "VmRSS"),
+			 proc_kb("/proc/meminfo", "CmaTotal") - proc_kb("/proc/meminfo", "CmaFree") };
+}
+
+void MemoryReport::Mark(char const *part)
+{
+	Usage now = usage();
+	entries_.push_back({ part, { now.rss_kb - last_.rss_kb, now.cma_kb - last_.cma_kb } });
+	last_ = now;
+}
+
+void MemoryReport::Print() const
+{
+	std::ostringstream report;
+	report << "Memory at startup (resident, CMA):";
+	for (auto const &entry : entries_)
+		report << "\n    " << std::left << std::setw(16) << entry.part + ":" << std::right << std::setw(8)
+			   << entry.growth.rss_kb << "kB " << std::setw(8) << entry.growth.cma_kb << "kB";
+	report << "\n    " << std::left << std::setw(16) << "total:" << std::right << std::setw(8) << last_.rss_kb
+		   << "kB " << std::setw(8) << last_.cma_kb << "kB";
+	LOG(1, report.str());
+}
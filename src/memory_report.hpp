@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * memory_report.hpp - what each part of raspindi costs in memory at startup.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Marked after each part of the pipeline starts, this puts the growth since the last
+// mark down to that part: resident memory, and CMA, which is where the camera and codec
+// buffers come from. On a 512MB Pi Zero 2 W, that's what shows whether a setting fits.
+// Both are for the whole process (and CMA for the whole system), so only parts started
+// one after the other can be told apart.
+
+class MemoryReport
+{
+public:
+	// Everything before, the program and its libraries, counts as startup.
+	MemoryReport();
+
+	void Mark(char const *part);
+	// At LOG level 1.
+	void Print() const;
+
+private:
+	struct Usage
+	{
+		long rss_kb;
+		long cma_kb;
+	};
+	static Usage usage();
+
+	struct Entry
+	{
+		std::string part;
+		Usage growth;
+	};
+	std::vector<Entry> entries_;
+	Usage last_;
+};
@@ -0,0 +1,126 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * metadata_log.cpp - every frame's exposure, gains and focus, in a fixed size ring file.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <stdexcept>
+
+#include <libcamera/control_ids.h>
+
+#include "core/logging.hpp"
+
+#include "metadata_log.hpp"
+
+using namespace libcamera;
+
+MetadataLog::MetadataLog(std::string const &filename, uint64_t capacity)
+	: size_(MetadataLogHeader::SIZE + capacity * sizeof(MetadataRecord))
+{
+	fd_ = open(filename.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd_ < 0)
+		throw std::runtime_error("failed to open metadata log " + filename + ": " + strerror(errno));
+
+	struct stat st;
+	bool resume = fstat(fd_, &st) == 0 && (size_t)st.st_size == size_;
+	// Allocating the blocks now means a full disk shows up here, rather than as a SIGBUS
+	// in the middle of a show.
+	if ((!resume && ftruncate(fd_, 0) < 0) || posix_fallocate(fd_, 0, size_))
+	{
+		close(fd_);
+		throw std::runtime_error("failed to make metadata log " + filename + " of " + std::to_string(size_) +
+								 " bytes");
+	}
+	void *mem = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+	if (mem == MAP_FAILED)
+	{
+		close(fd_);
+		throw std::runtime_error("failed to map metadata log " + filename + ": " + strerror(errno));
+	}
+	header_ = (MetadataLogHeader *)mem;
+	records_ = (MetadataRecord *)((uint8_t *)mem + MetadataLogHeader::SIZE);
+
+	resume = resume && !memcmp(header_->magic, MetadataLogHeader::MAGIC, sizeof(header_->magic)) &&
+			 header_->version == MetadataLogHeader::VERSION && header_->record_size == sizeof(MetadataRecord) &&
+			 header_->capacity == capacity;
+	if (!resume)
+	{
+		memcpy(header_->magic, MetadataLogHeader::MAGIC, sizeof(header_->magic));
+		header_->version = MetadataLogHeader::VERSION;
+		header_->record_size = sizeof(MetadataRecord);
+		header_->capacity = capacity;
+		header_->written = 0;
+	}
+	LOG(1, "Metadata log " << filename << (resume ? " carries on after " : " holds up to ")
+						   << (resume ? header_->written : capacity) << " frames");
+}
+
+MetadataLog::~MetadataLog()
+{
+	munmap(header_, size_);
+	close(fd_);
+}
+
+void MetadataLog::Record(uint64_t sequence, int64_t timestamp_us, ControlList const &metadata)
+{
+	uint64_t n = header_->written;
+	MetadataRecord &record = records_[n % header_->capacity];
+	record = {};
+	record.sequence = sequence;
+	record.timestamp_us = timestamp_us;
+	record.sensor_timestamp_ns = metadata.get(controls::SensorTimestamp).value_or(0);
+
+	if (auto exposure = metadata.get(controls::ExposureTime))
+	{
+		record.exposure_us = *exposure;
+		record.present |= MetadataRecord::EXPOSURE;
+	}
+	if (auto gain = metadata.get(controls::AnalogueGain))
+	{
+		record.analogue_gain = *gain;
+		record.present |= MetadataRecord::ANALOGUE_GAIN;
+	}
+	if (auto gain = metadata.get(controls::DigitalGain))
+	{
+		record.digital_gain = *gain;
+		record.present |= MetadataRecord::DIGITAL_GAIN;
+	}
+	auto colour_gains = metadata.get(controls::ColourGains);
+	if (colour_gains && colour_gains->size() == 2)
+	{
+		record.red_gain = (*colour_gains)[0];
+		record.blue_gain = (*colour_gains)[1];
+		record.present |= MetadataRecord::COLOUR_GAINS;
+	}
+	if (auto temperature = metadata.get(controls::ColourTemperature))
+	{
+		record.colour_temperature = *temperature;
+		record.present |= MetadataRecord::COLOUR_TEMPERATURE;
+	}
+	if (auto lux = metadata.get(controls::Lux))
+	{
+		record.lux = *lux;
+		record.present |= MetadataRecord::LUX;
+	}
+	if (auto position = metadata.get(controls::LensPosition))
+	{
+		record.lens_position = *position;
+		record.present |= MetadataRecord::LENS_POSITION;
+	}
+	if (auto fom = metadata.get(controls::FocusFoM))
+	{
+		record.focus_fom = *fom;
+		record.present |= MetadataRecord::FOCUS_FOM;
+	}
+
+	// The record before the count that covers it, so a reader never counts one still being written.
+	__atomic_store_n(&header_->written, n + 1, __ATOMIC_RELEASE);
+}
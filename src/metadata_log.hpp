@@ -0,0 +1,93 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * metadata_log.hpp - every frame's exposure, gains and focus, in a fixed size ring file.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace libcamera
+{
+class ControlList;
+}
+
+// rpicam's --metadata writes each frame's whole ControlList out as JSON text on the
+// output thread, which at 60fps costs too much to leave running. The metadata log keeps
+// just what colour matching after a show needs, as one fixed width record per frame in a
+// file mapped into memory: logging a frame is a few stores into the page cache, with no
+// system call and no formatting, and the kernel writes it back in its own time. The file
+// is a ring, so it never grows beyond the set number of frames, and always holds the
+// latest. raspindi_metadata converts it to CSV or JSON.
+//
+// This header is all raspindi_metadata needs to read the file, so it keeps libcamera out.
+
+// The file starts with a page holding this header, followed by capacity records. Record
+// n (counting from the first ever written) is at n % capacity, and written counts them
+// all, so the file holds records [written - capacity, written) once it has wrapped.
+struct MetadataLogHeader
+{
+	static constexpr char MAGIC[8] = { 'R', 'N', 'D', 'I', 'M', 'E', 'T', 'A' };
+	static constexpr uint32_t VERSION = 1;
+	static constexpr size_t SIZE = 4096;
+
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t capacity;
+	uint64_t written;
+};
+
+// A field a frame's metadata didn't have is zero, with its bit clear in present.
+struct MetadataRecord
+{
+	enum Field : uint32_t
+	{
+		EXPOSURE = 1,
+		ANALOGUE_GAIN = 2,
+		DIGITAL_GAIN = 4,
+		COLOUR_GAINS = 8,
+		COLOUR_TEMPERATURE = 16,
+		LUX = 32,
+		LENS_POSITION = 64,
+		FOCUS_FOM = 128
+	};
+
+	uint64_t sequence;
+	// The timestamp the encoders see, and the sensor's own.
+	int64_t timestamp_us;
+	int64_t sensor_timestamp_ns;
+	uint32_t present;
+	int32_t exposure_us;
+	float analogue_gain;
+	float digital_gain;
+	float red_gain;
+	float blue_gain;
+	int32_t colour_temperature;
+	float lux;
+	float lens_position;
+	int32_t focus_fom;
+};
+static_assert(sizeof(MetadataRecord) == 64, "metadata records should fill a cache line");
+
+class MetadataLog
+{
+public:
+	// Carries on from where an existing log of the same size left off, and otherwise
+	// starts a new one. Throws if the file can't be made.
+	MetadataLog(std::string const &filename, uint64_t capacity);
+	~MetadataLog();
+
+	// Main loop only.
+	void Record(uint64_t sequence, int64_t timestamp_us, libcamera::ControlList const &metadata);
+
+private:
+	int fd_;
+	size_t size_;
+	MetadataLogHeader *header_;
+	MetadataRecord *records_;
+};
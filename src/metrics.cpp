@@ -0,0 +1,307 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * metrics.cpp - counters, gauges and histograms for fleet monitoring.
+ */
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include "core/logging.hpp"
+
+#include "metrics.hpp"
+#include "thread_policy.hpp"
+
+static std::string with_labels(std::string const &name, std::string const &labels, std::string const &extra = "")
+{
+	std::string all = labels.empty() || extra.empty() ? labels + extra : labels + "," + extra;
+	return all.empty() ? name : name + "{" + all + "}";
+}
+
+// Prometheus spells "not a number" its own way.
+static std::string format_value(double value)
+{
+	if (std::isnan(value))
+		return "NaN";
+	std::ostringstream out;
+	out << value;
+	return out.str();
+}
+
+double read_number(char const *path, int base)
+{
+	std::ifstream file(path);
+	std::string value;
+	try
+	{
+		if (file >> value)
+			return std::stoll(value, nullptr, base);
+	}
+	catch (std::exception const &)
+	{
+	}
+	return NAN;
+}
+
+Metrics::Histogram::Histogram(std::vector<int64_t> const &bounds_us)
+	: bounds_us_(bounds_us), buckets_(new std::atomic<uint64_t>[bounds_us.size() + 1])
+{
+	for (unsigned int i = 0; i <= bounds_us_.size(); i++)
+		buckets_[i] = 0;
+}
+
+void Metrics::Histogram::Observe(int64_t value_us)
+{
+	unsigned int i = 0;
+	while (i < bounds_us_.size() && value_us > bounds_us_[i])
+		i++;
+	buckets_[i].fetch_add(1, std::memory_order_relaxed);
+	sum_us_.fetch_add(value_us, std::memory_order_relaxed);
+	count_.fetch_add(1, std::memory_order_relaxed);
+}
+
+Metrics &Metrics::Get()
+{
+	static Metrics metrics;
+	return metrics;
+}
+
+Metrics::Entry *Metrics::find(std::string const &name, std::string const &labels, Type type)
+{
+	for (auto &entry : entries_)
+	{
+		if (entry.name == name && entry.labels == labels)
+		{
+			if (entry.type != type)
+				throw std::runtime_error("metric " + name + " added twice with different types");
+			return &entry;
+		}
+	}
+	return nullptr;
+}
+
+Metrics::Entry &Metrics::add(std::string const &name, std::string const &help, std::string const &labels, Type type)
+{
+	entries_.emplace_back();
+	Entry &entry = entries_.back();
+	entry.name = name;
+	entry.help = help;
+	entry.labels = labels;
+	entry.type = type;
+	entry.owner = nullptr;
+	return entry;
+}
+
+Metrics::Counter &Metrics::AddCounter(std::string const &name, std::string const &help, std::string const &labels)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	Entry *entry = find(name, labels, COUNTER);
+	if (!entry)
+	{
+		entry = &add(name, help, labels, COUNTER);
+		entry->counter = std::make_unique<Counter>();
+	}
+	return *entry->counter;
+}
+
+Metrics::Gauge &Metrics::AddGauge(std::string const &name, std::string const &help, std::string const &labels)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	Entry *entry = find(name, labels, GAUGE);
+	if (!entry)
+	{
+		entry = &add(name, help, labels, GAUGE);
+		entry->gauge = std::make_unique<Gauge>();
+	}
+	return *entry->gauge;
+}
+
+Metrics::Histogram &Metrics::AddHistogram(std::string const &name, std::string const &help,
+										  std::vector<int64_t> const &bounds_us, std::string const &labels)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	Entry *entry = find(name, labels, HISTOGRAM);
+	if (!entry)
+	{
+		entry = &add(name, help, labels, HISTOGRAM);
+		entry->histogram = std::make_unique<Histogram>(bounds_us);
+	}
+	return *entry->histogram;
+}
+
+void Metrics::AddGaugeFunction(std::string const &name, std::string const &help, GaugeFunction fn,
+							   void const *owner, std::string const &labels)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	Entry *entry = find(name, labels, GAUGE_FUNCTION);
+	if (!entry)
+		entry = &add(name, help, labels, GAUGE_FUNCTION);
+	entry->fn = fn;
+	entry->owner = owner;
+}
+
+void Metrics::RemoveGaugeFunctions(void const *owner)
+{
+	// The entries stay, so they can be taken over again, but report nothing meanwhile.
+	std::lock_guard<std::mutex> lock(mutex_);
+	for (auto &entry : entries_)
+	{
+		if (entry.type == GAUGE_FUNCTION && entry.owner == owner)
+		{
+			entry.fn = nullptr;
+			entry.owner = nullptr;
+		}
+	}
+}
+
+std::string Metrics::Label(std::string const &name, std::string const &value)
+{
+	std::string label = name + "=\"";
+	for (char c : value)
+	{
+		if (c == '\\' || c == '"' || c == '\n')
+			label += '\\';
+		label += c == '\n' ? 'n' : c;
+	}
+	return label + "\"";
+}
+
+std::string Metrics::Render()
+{
+	static char const *const type_names[] = { "counter", "gauge", "gauge", "histogram" };
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	std::ostringstream out;
+	std::vector<bool> done(entries_.size());
+	// Prometheus wants each metric's lines together, under one HELP and TYPE.
+	for (size_t i = 0; i < entries_.size(); i++)
+	{
+		if (done[i])
+			continue;
+		out << "# HELP " << entries_[i].name << " " << entries_[i].help << "\n";
+		out << "# TYPE " << entries_[i].name << " " << type_names[entries_[i].type] << "\n";
+		for (size_t j = i; j < entries_.size(); j++)
+		{
+			Entry const &entry = entries_[j];
+			if (done[j] || entry.name != entries_[i].name)
+				continue;
+			done[j] = true;
+
+			if (entry.type == COUNTER)
+				out << with_labels(entry.name, entry.labels) << " " << entry.counter->Value() << "\n";
+			else if (entry.type == GAUGE)
+				out << with_labels(entry.name, entry.labels) << " " << format_value(entry.gauge->Value()) << "\n";
+			else if (entry.type == GAUGE_FUNCTION && entry.fn)
+				out << with_labels(entry.name, entry.labels) << " " << format_value(entry.fn()) << "\n";
+			else if (entry.type == HISTOGRAM)
+			{
+				Histogram const &h = *entry.histogram;
+				uint64_t cumulative = 0;
+				for (size_t b = 0; b <= h.bounds_us_.size(); b++)
+				{
+					cumulative += h.buckets_[b].load(std::memory_order_relaxed);
+					std::string le = b < h.bounds_us_.size() ? format_value(h.bounds_us_[b] / 1e6) : "+Inf";
+					out << with_labels(entry.name + "_bucket", entry.labels, "le=\"" + le + "\"") << " "
+						<< cumulative << "\n";
+				}
+				out << with_labels(entry.name + "_sum", entry.labels) << " " << h.sum_us_ / 1e6 << "\n";
+				out << with_labels(entry.name + "_count", entry.labels) << " " << h.count_ << "\n";
+			}
+		}
+	}
+	return out.str();
+}
+
+MetricsServer::MetricsServer(unsigned int port) : abort_(false)
+{
+	sockaddr_in saddr = {};
+	saddr.sin_family = AF_INET;
+	saddr.sin_addr.s_addr = INADDR_ANY;
+	saddr.sin_port = htons(port);
+	listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	int enable = 1;
+	setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+	if (listen_fd_ < 0 || bind(listen_fd_, (sockaddr *)&saddr, sizeof(saddr)) < 0 || listen(listen_fd_, 4) < 0)
+		throw std::runtime_error("failed to listen for metrics on port " + std::to_string(port));
+
+	Metrics &metrics = Metrics::Get();
+	metrics.AddGaugeFunction("raspindi_cpu_temperature_celsius", "SoC temperature",
+							 [] { return read_number(SOC_TEMPERATURE_PATH, 10) / 1000; }, this);
+	metrics.AddGaugeFunction("raspindi_throttled_flags", "The firmware's get_throttled bits",
+							 [] { return read_number(THROTTLED_PATH, 16); }, this);
+	metrics.AddGaugeFunction("raspindi_throttling", "1 while the CPU is throttled or frequency capped", [] {
+		double flags = read_number(THROTTLED_PATH, 16);
+		return std::isnan(flags) ? flags : ((int)flags & 0x6) != 0;
+	}, this);
+
+	server_thread_ = std::thread(&MetricsServer::serverThread, this);
+	LOG(1, "Serving metrics on port " << port);
+}
+
+MetricsServer::~MetricsServer()
+{
+	abort_ = true;
+	server_thread_.join();
+	Metrics::Get().RemoveGaugeFunctions(this);
+	close(listen_fd_);
+}
+
+void MetricsServer::serverThread()
+{
+	ThreadPolicy::Get().Apply(ThreadPolicy::OTHER, "metrics");
+	while (!abort_)
+	{
+		pollfd p = { listen_fd_, POLLIN, 0 };
+		if (poll(&p, 1, POLL_TIMEOUT_MS) <= 0)
+			continue;
+		// Scrapes are rare and tiny, so one at a time is plenty.
+		int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+		if (fd >= 0)
+		{
+			handleClient(fd);
+			close(fd);
+		}
+	}
+}
+
+void MetricsServer::handleClient(int fd)
+{
+	// Read the request line and headers, but don't let a client that never finishes
+	// them, or never reads the response, hold the thread up, not least at shutdown.
+	timeval timeout = { 0, POLL_TIMEOUT_MS * 1000 };
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	std::string request;
+	char buffer[1024];
+	while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192)
+	{
+		pollfd p = { fd, POLLIN, 0 };
+		if (poll(&p, 1, POLL_TIMEOUT_MS) <= 0)
+			return;
+		ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+		if (n <= 0)
+			return;
+		request.append(buffer, n);
+	}
+
+	bool found = request.rfind("GET /metrics ", 0) == 0 || request.rfind("GET / ", 0) == 0;
+	std::string body = found ? Metrics::Get().Render() : "not found\n";
+	std::string response = std::string(found ? "HTTP/1.0 200 OK\r\n" : "HTTP/1.0 404 Not Found\r\n") +
+						   "Content-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+						   std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+	for (size_t sent = 0; sent < response.size();)
+	{
+		ssize_t n = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+		if (n <= 0)
+			return;
+		sent += n;
+	}
+}
@@ -0,0 +1,151 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * metrics.hpp - counters, gauges and histograms for fleet monitoring.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// One registry for the whole process, which anything can add to. Updating a metric is a
+// single relaxed atomic operation on a cache line of its own, and every counter is only
+// ever updated from one thread (the main loop, or one encoder's output thread), so nothing
+// on the frame path ever waits for a lock or for another core. The registry's own lock is
+// only taken to add metrics and to read them all out.
+//
+// Metrics are added once and live as long as the process. Adding the same name and labels
+// again returns the existing one, so that objects recreated on a restart keep counting.
+// Gauges that call back into an object are the exception, and must be removed by their
+// owner before it goes away.
+//
+// Labels are written as Prometheus has them, for example stage="encode".
+
+class Metrics
+{
+public:
+	class Counter
+	{
+	public:
+		void Inc(uint64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+		uint64_t Value() const { return value_.load(std::memory_order_relaxed); }
+
+	private:
+		alignas(64) std::atomic<uint64_t> value_ { 0 };
+	};
+
+	class Gauge
+	{
+	public:
+		void Set(double value) { value_.store(value, std::memory_order_relaxed); }
+		double Value() const { return value_.load(std::memory_order_relaxed); }
+
+	private:
+		alignas(64) std::atomic<double> value_ { 0 };
+	};
+
+	// Observations are in microseconds, and are reported in seconds.
+	class Histogram
+	{
+	public:
+		Histogram(std::vector<int64_t> const &bounds_us);
+		void Observe(int64_t value_us);
+
+	private:
+		friend class Metrics;
+		std::vector<int64_t> bounds_us_;
+		std::unique_ptr<std::atomic<uint64_t>[]> buckets_; // the last one is +Inf
+		std::atomic<uint64_t> count_ { 0 };
+		std::atomic<int64_t> sum_us_ { 0 };
+	};
+
+	typedef std::function<double()> GaugeFunction;
+
+	static Metrics &Get();
+
+	Counter &AddCounter(std::string const &name, std::string const &help, std::string const &labels = "");
+	Gauge &AddGauge(std::string const &name, std::string const &help, std::string const &labels = "");
+	Histogram &AddHistogram(std::string const &name, std::string const &help, std::vector<int64_t> const &bounds_us,
+							std::string const &labels = "");
+	// A gauge read by calling fn whenever the metrics are read. The owner can be null if
+	// fn only uses other metrics, which never go away.
+	void AddGaugeFunction(std::string const &name, std::string const &help, GaugeFunction fn, void const *owner,
+						  std::string const &labels = "");
+	void RemoveGaugeFunctions(void const *owner);
+
+	// A label for the given value, quoted and escaped as Prometheus wants.
+	static std::string Label(std::string const &name, std::string const &value);
+
+	// Everything, in the Prometheus text format.
+	std::string Render();
+
+private:
+	enum Type
+	{
+		COUNTER,
+		GAUGE,
+		GAUGE_FUNCTION,
+		HISTOGRAM
+	};
+
+	struct Entry
+	{
+		std::string name;
+		std::string help;
+		std::string labels;
+		Type type;
+		std::unique_ptr<Counter> counter;
+		std::unique_ptr<Gauge> gauge;
+		std::unique_ptr<Histogram> histogram;
+		GaugeFunction fn;
+		void const *owner;
+	};
+
+	Metrics() = default;
+	Entry *find(std::string const &name, std::string const &labels, Type type);
+	Entry &add(std::string const &name, std::string const &help, std::string const &labels, Type type);
+
+	std::mutex mutex_;
+	// Entries never move once added, so references to their metrics stay good.
+	std::deque<Entry> entries_;
+};
+
+// Sysfs files that hold a single number, in the given base. NaN if there's no such file,
+// which Prometheus understands.
+double read_number(char const *path, int base);
+
+// Where the Pi keeps its SoC temperature (in millidegrees) and the firmware's get_throttled
+// bits: 0 under-voltage, 1 arm frequency capped, 2 throttled and 3 soft temperature limit,
+// and the same again from bit 16 for "has happened since boot".
+constexpr char const *SOC_TEMPERATURE_PATH = "/sys/class/thermal/thermal_zone0/temp";
+constexpr char const *THROTTLED_PATH = "/sys/devices/platform/soc/soc:firmware/get_throttled";
+
+// Serves the metrics, and the Pi's temperature and throttling state, over HTTP at /metrics
+// on its own thread, so that a slow scraper never holds up anything else.
+class MetricsServer
+{
+public:
+	MetricsServer(unsigned int port);
+	~MetricsServer();
+
+private:
+	// How long a client gets for each read or write, and how often the thread checks for
+	// shutdown.
+	static constexpr int POLL_TIMEOUT_MS = 200;
+
+	void serverThread();
+	void handleClient(int fd);
+
+	int listen_fd_;
+	std::atomic<bool> abort_;
+	std::thread server_thread_;
+};
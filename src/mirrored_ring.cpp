@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * mirrored_ring.cpp - a byte ring mapped twice in a row.
+ */
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <stdexcept>
+#include <string>
+
+#include "mirrored_ring.hpp"
+
+MirroredRing::MirroredRing(size_t size, char const *name)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_ = (size + page_size - 1) / page_size * page_size;
+
+	// Reserve twice the size, then map the same pages into both halves.
+	int fd = memfd_create(name, MFD_CLOEXEC);
+	if (fd < 0)
+		throw std::runtime_error(std::string(name) + ": failed to create ring");
+	if (ftruncate(fd, size_) < 0)
+	{
+		close(fd);
+		throw std::runtime_error(std::string(name) + ": failed to create ring");
+	}
+	void *reserved = mmap(nullptr, 2 * size_, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (reserved == MAP_FAILED)
+	{
+		close(fd);
+		throw std::runtime_error(std::string(name) + ": failed to map ring");
+	}
+	data_ = (uint8_t *)reserved;
+	for (unsigned int i = 0; i < 2; i++)
+	{
+		if (mmap(data_ + i * size_, size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+		{
+			close(fd);
+			munmap(data_, 2 * size_);
+			throw std::runtime_error(std::string(name) + ": failed to map ring");
+		}
+	}
+	close(fd);
+}
+
+MirroredRing::~MirroredRing()
+{
+	munmap(data_, 2 * size_);
+}
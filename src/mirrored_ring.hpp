@@ -0,0 +1,35 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * mirrored_ring.hpp - a byte ring mapped twice in a row.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// The same memory mapped twice in a row, so that anything that runs off the end carries
+// straight on at the start. Whatever goes in is stored with a single memcpy, and can be
+// written out again as one contiguous block, wherever in the ring it falls.
+
+class MirroredRing
+{
+public:
+	// Rounded up to a whole number of pages. Throws if it can't be mapped.
+	MirroredRing(size_t size, char const *name);
+	~MirroredRing();
+
+	MirroredRing(MirroredRing const &) = delete;
+	MirroredRing &operator=(MirroredRing const &) = delete;
+
+	// Positions count bytes since the ring was created. Anything up to Size() bytes from
+	// At(pos) on is valid.
+	uint8_t *At(uint64_t pos) const { return data_ + pos % size_; }
+	size_t Size() const { return size_; }
+
+private:
+	uint8_t *data_;
+	size_t size_;
+};
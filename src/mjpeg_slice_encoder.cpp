@@ -0,0 +1,314 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * mjpeg_slice_encoder.cpp - mjpeg encoder that spreads each frame across all cores.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <jpeglib.h>
+
+#include "core/logging.hpp"
+
+#include "mjpeg_slice_encoder.hpp"
+#include "ndi_options.hpp"
+#include "thread_policy.hpp"
+
+#if JPEG_LIB_VERSION_MAJOR > 9 || (JPEG_LIB_VERSION_MAJOR == 9 && JPEG_LIB_VERSION_MINOR >= 4)
+typedef size_t jpeg_mem_len_t;
+#else
+typedef unsigned long jpeg_mem_len_t;
+#endif
+
+// With 4:2:0 chroma, an MCU is 16x16 pixels, so every slice but the last must be a
+// multiple of 16 rows high.
+static constexpr unsigned int MCU_SIZE = 16;
+
+// Find where the entropy coded data starts in a JPEG that libjpeg has written, and where
+// its frame header keeps the image height.
+static size_t find_scan(uint8_t const *jpeg, size_t size, size_t &height_offset)
+{
+	size_t pos = 2; // skip SOI
+	while (pos + 4 <= size && jpeg[pos] == 0xff)
+	{
+		uint8_t marker = jpeg[pos + 1];
+		size_t length = (jpeg[pos + 2] << 8) | jpeg[pos + 3];
+		if (marker == 0xc0)
+			height_offset = pos + 5;
+		pos += 2 + length;
+		if (marker == 0xda)
+			return pos;
+	}
+	throw std::runtime_error("MjpegSliceEncoder: no scan found in slice");
+}
+
+MjpegSliceEncoder::MjpegSliceEncoder(VideoOptions const *options, StreamInfo const &info)
+	: Encoder(options), info_(info), quality_(options->Get().quality), affinity_(false), head_(0), tail_(0),
+	  abort_(false), abort_output_(false)
+{
+	unsigned int num_threads = 0;
+	NDIOptions const *ndi_options = dynamic_cast<NDIOptions const *>(options);
+	if (ndi_options)
+	{
+		num_threads = ndi_options->mjpeg_threads;
+		affinity_ = ndi_options->mjpeg_affinity;
+	}
+	if (!num_threads)
+		num_threads = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+
+	// One slice per thread, but never so thin that there are slices with nothing in them.
+	unsigned int mcu_rows = (info_.height + MCU_SIZE - 1) / MCU_SIZE;
+	slice_height_ = ((mcu_rows + num_threads - 1) / num_threads) * MCU_SIZE;
+	num_slices_ = (info_.height + slice_height_ - 1) / slice_height_;
+	if (((info_.width + MCU_SIZE - 1) / MCU_SIZE) * (slice_height_ / MCU_SIZE) > 65535)
+		throw std::runtime_error("MjpegSliceEncoder: image too large for restart markers");
+	slice_sizes_ = std::make_unique<std::atomic<size_t>[]>(num_slices_);
+
+	for (auto &frame : frames_)
+	{
+		frame.slices.resize(num_slices_);
+		for (auto &slice : frame.slices)
+		{
+			// Plenty for any sensible quality. libjpeg finds us more if not.
+			slice.capacity = info_.width * slice_height_;
+			slice.buffer = (uint8_t *)malloc(slice.capacity);
+			slice.bytes_used = 0;
+		}
+	}
+
+	output_thread_ = std::thread(&MjpegSliceEncoder::outputThread, this);
+	for (unsigned int i = 0; i < num_threads; i++)
+		encode_threads_.emplace_back(&MjpegSliceEncoder::encodeThread, this, i);
+	LOG(2, "Opened MjpegSliceEncoder: " << num_threads << " threads, " << num_slices_ << " slices of "
+										<< slice_height_ << " rows" << (affinity_ ? ", pinned to cores" : ""));
+}
+
+MjpegSliceEncoder::~MjpegSliceEncoder()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	// Everything already handed to us still gets encoded and output.
+	encode_cond_var_.notify_all();
+	for (auto &thread : encode_threads_)
+		thread.join();
+	{
+		std::lock_guard<std::mutex> lock(output_mutex_);
+		abort_output_ = true;
+	}
+	output_cond_var_.notify_all();
+	output_thread_.join();
+
+	for (auto &frame : frames_)
+		for (auto &slice : frame.slices)
+			free(slice.buffer);
+	LOG(2, "MjpegSliceEncoder closed");
+}
+
+void MjpegSliceEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	space_cond_var_.wait(lock, [this] { return tail_ - head_ < NUM_FRAMES; });
+
+	Frame &frame = frames_[tail_ % NUM_FRAMES];
+	frame.mem = mem;
+	frame.timestamp_us = timestamp_us;
+	frame.next_slice = 0;
+	frame.slices_done.store(0, std::memory_order_relaxed);
+	tail_.store(tail_ + 1, std::memory_order_release);
+	lock.unlock();
+	encode_cond_var_.notify_all();
+}
+
+void MjpegSliceEncoder::encodeThread(unsigned int num)
+{
+	std::string name = "mjpeg-" + std::to_string(num);
+	ThreadPolicy::Get().Apply(ThreadPolicy::ENCODE, name.c_str());
+	// Each thread to a core of its own overrides the policy's cores.
+	if (affinity_)
+	{
+		cpu_set_t cpuset;
+		CPU_ZERO(&cpuset);
+		CPU_SET(num % std::max(1L, sysconf(_SC_NPROCESSORS_ONLN)), &cpuset);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset))
+			LOG(1, "MjpegSliceEncoder: could not pin thread " << num);
+	}
+
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (true)
+	{
+		// Take the first slice nobody has started on, oldest frame first, so that frames
+		// finish in order.
+		Frame *frame = nullptr;
+		for (uint64_t i = head_; i < tail_ && !frame; i++)
+			if (frames_[i % NUM_FRAMES].next_slice < num_slices_)
+				frame = &frames_[i % NUM_FRAMES];
+		if (!frame)
+		{
+			if (abort_)
+				break;
+			encode_cond_var_.wait(lock);
+			continue;
+		}
+
+		unsigned int slice = frame->next_slice++;
+		lock.unlock();
+		encodeSlice(cinfo, *frame, slice);
+		if (frame->slices_done.fetch_add(1, std::memory_order_acq_rel) + 1 == num_slices_)
+		{
+			// Only so that the output thread can't miss this between looking and waiting.
+			{
+				std::lock_guard<std::mutex> output_lock(output_mutex_);
+			}
+			output_cond_var_.notify_one();
+		}
+		lock.lock();
+	}
+
+	jpeg_destroy_compress(&cinfo);
+}
+
+void MjpegSliceEncoder::encodeSlice(struct jpeg_compress_struct &cinfo, Frame &frame, unsigned int slice)
+{
+	unsigned int y0 = slice * slice_height_;
+	unsigned int height = std::min(slice_height_, info_.height - y0);
+
+	cinfo.image_width = info_.width;
+	cinfo.image_height = height;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_YCbCr;
+	cinfo.jpeg_color_space = JCS_YCbCr;
+	jpeg_set_defaults(&cinfo);
+	cinfo.raw_data_in = TRUE;
+	jpeg_set_quality(&cinfo, quality_, TRUE);
+	// The slices follow one another as restart intervals. The first slice's headers are
+	// the only ones that survive, so they must announce a restart after each slice.
+	cinfo.restart_interval = num_slices_ > 1 ? ((info_.width + MCU_SIZE - 1) / MCU_SIZE) * (slice_height_ / MCU_SIZE)
+											 : 0;
+
+	// Make room for what this slice took last time and then some, so that libjpeg
+	// rarely has to find more part way through.
+	Slice &out = frame.slices[slice];
+	size_t expected = slice_sizes_[slice].load(std::memory_order_relaxed);
+	unsigned long wanted = expected + expected / SLICE_HEADROOM;
+	if (out.capacity < wanted)
+	{
+		free(out.buffer);
+		out.buffer = (uint8_t *)malloc(wanted);
+		out.capacity = wanted;
+	}
+	uint8_t *buffer = out.buffer;
+	jpeg_mem_len_t bytes = out.capacity;
+	jpeg_mem_dest(&cinfo, &buffer, &bytes);
+	jpeg_start_compress(&cinfo, TRUE);
+
+	uint8_t *Y = (uint8_t *)frame.mem;
+	uint8_t *U = Y + info_.stride * info_.height;
+	uint8_t *V = U + (info_.stride / 2) * (info_.height / 2);
+	JSAMPROW y_rows[MCU_SIZE], u_rows[MCU_SIZE / 2], v_rows[MCU_SIZE / 2];
+	JSAMPARRAY rows[] = { y_rows, u_rows, v_rows };
+	for (unsigned int row = 0; row < height; row += MCU_SIZE)
+	{
+		// Rows past the bottom of the image repeat the last one, to fill the final MCU.
+		for (unsigned int i = 0; i < MCU_SIZE; i++)
+			y_rows[i] = Y + std::min(y0 + row + i, info_.height - 1) * info_.stride;
+		for (unsigned int i = 0; i < MCU_SIZE / 2; i++)
+		{
+			unsigned int offset = std::min((y0 + row) / 2 + i, info_.height / 2 - 1) * (info_.stride / 2);
+			u_rows[i] = U + offset;
+			v_rows[i] = V + offset;
+		}
+		jpeg_write_raw_data(&cinfo, rows, MCU_SIZE);
+	}
+	jpeg_finish_compress(&cinfo);
+
+	// If libjpeg needed a bigger buffer it will have made one, and we keep that instead.
+	if (buffer != out.buffer)
+	{
+		free(out.buffer);
+		out.buffer = buffer;
+		out.capacity = bytes;
+	}
+	out.bytes_used = bytes;
+	slice_sizes_[slice].store(bytes, std::memory_order_relaxed);
+}
+
+void MjpegSliceEncoder::joinSlices(Frame &frame)
+{
+	// The first slice keeps its headers, with the height patched to the whole frame's.
+	// Each later slice contributes just its entropy coded data, after a restart marker.
+	// clear() keeps the buffer, so this only allocates when frames get bigger.
+	size_t total = 0;
+	for (Slice const &slice : frame.slices)
+		total += slice.bytes_used + 2;
+	frame.jpeg.clear();
+	if (frame.jpeg.capacity() < total)
+		frame.jpeg.reserve(total + total / SLICE_HEADROOM);
+	for (unsigned int i = 0; i < num_slices_; i++)
+	{
+		Slice const &slice = frame.slices[i];
+		size_t height_offset = 0;
+		size_t start = i ? find_scan(slice.buffer, slice.bytes_used, height_offset) : 0;
+		size_t end = slice.bytes_used - 2; // drop EOI
+		if (i)
+		{
+			frame.jpeg.push_back(0xff);
+			frame.jpeg.push_back(0xd0 + ((i - 1) & 7));
+		}
+		frame.jpeg.insert(frame.jpeg.end(), slice.buffer + start, slice.buffer + end);
+	}
+	frame.jpeg.push_back(0xff);
+	frame.jpeg.push_back(0xd9);
+
+	size_t height_offset = 0;
+	find_scan(frame.jpeg.data(), frame.jpeg.size(), height_offset);
+	frame.jpeg[height_offset] = info_.height >> 8;
+	frame.jpeg[height_offset + 1] = info_.height & 0xff;
+}
+
+void MjpegSliceEncoder::outputThread()
+{
+	ThreadPolicy::Get().Apply(ThreadPolicy::SEND, "mjpeg-output");
+	std::unique_lock<std::mutex> lock(output_mutex_);
+	while (true)
+	{
+		uint64_t head = head_.load(std::memory_order_relaxed);
+		Frame &frame = frames_[head % NUM_FRAMES];
+		if (head == tail_.load(std::memory_order_acquire) ||
+			frame.slices_done.load(std::memory_order_acquire) < num_slices_)
+		{
+			if (abort_output_ && head == tail_)
+				break;
+			output_cond_var_.wait(lock);
+			continue;
+		}
+
+		lock.unlock();
+		// We are done with the camera buffer, so let it go before anything else.
+		input_done_callback_(nullptr);
+		joinSlices(frame);
+		output_ready_callback_(frame.jpeg.data(), frame.jpeg.size(), frame.timestamp_us, true);
+
+		// The encoders' lock once a frame, only so that EncodeBuffer can't miss the space.
+		{
+			std::lock_guard<std::mutex> space_lock(mutex_);
+			head_.store(head + 1, std::memory_order_release);
+		}
+		space_cond_var_.notify_one();
+		lock.lock();
+	}
+}
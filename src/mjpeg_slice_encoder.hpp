@@ -0,0 +1,102 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * mjpeg_slice_encoder.hpp - mjpeg encoder that spreads each frame across all cores.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "encoder/encoder.hpp"
+
+struct jpeg_compress_struct;
+
+// MjpegEncoder gives each of its 4 threads a whole frame, which raises the frame rate it
+// can keep up with but not how long any one frame takes. Here every frame is cut into
+// horizontal slices, one per thread, each of which is compressed as its own JPEG. The
+// slices' entropy coded data is then joined with restart markers between them behind the
+// first slice's headers, which makes one ordinary baseline JPEG of the whole frame. So a
+// frame takes roughly 1/N of the time it would on one core, and frames still overlap, as
+// spare threads start on the next frame's slices.
+//
+// There is one thread per online core unless the options say otherwise, and the threads
+// can be pinned one to each core. The camera buffers are returned in order, as soon
+// as all their slices are done.
+//
+// Once running, our own buffers are not reallocated per frame: each slice's buffer is
+// kept with room to spare over what that slice took last time, and the joined frame
+// reuses its own. libjpeg itself still allocates its per-image working memory (the
+// JPOOL_IMAGE pool) in every jpeg_start_compress and frees it again at the end of the
+// slice, which is a few small mallocs per slice that come straight back off the heap.
+// The output thread only waits on the encoders through each frame's count of finished
+// slices, so they never queue behind it for the lock.
+
+class MjpegSliceEncoder : public Encoder
+{
+public:
+	MjpegSliceEncoder(VideoOptions const *options, StreamInfo const &info);
+	~MjpegSliceEncoder();
+	// Encode the given buffer. Only blocks if NUM_FRAMES frames are already in hand.
+	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
+
+private:
+	// How many frames can be on the go at once, counting the one being output.
+	static constexpr unsigned int NUM_FRAMES = 4;
+
+	struct Slice
+	{
+		uint8_t *buffer; // grows as needed, and then stays allocated
+		unsigned long capacity;
+		size_t bytes_used;
+	};
+	// A quarter over the last frame's size.
+	static constexpr unsigned int SLICE_HEADROOM = 4;
+
+	struct Frame
+	{
+		void *mem;
+		int64_t timestamp_us;
+		unsigned int next_slice; // the next one for a thread to pick up
+		// The last slice to finish hands the frame to the output thread.
+		std::atomic<unsigned int> slices_done;
+		std::vector<Slice> slices;
+		std::vector<uint8_t> jpeg;
+	};
+
+	void encodeThread(unsigned int num);
+	void outputThread();
+	void encodeSlice(struct jpeg_compress_struct &cinfo, Frame &frame, unsigned int slice);
+	void joinSlices(Frame &frame);
+
+	StreamInfo info_;
+	int quality_;
+	bool affinity_;
+	unsigned int num_slices_;
+	unsigned int slice_height_;
+	// What each slice last took, on whichever frame had it.
+	std::unique_ptr<std::atomic<size_t>[]> slice_sizes_;
+
+	// Frames tail_ - head_ are in hand, in arrival order, and frames_[head_ % NUM_FRAMES]
+	// is the next to be output. Only the output thread moves head_, and only EncodeBuffer
+	// tail_. mutex_ guards handing out the slices, and output_mutex_ is just for waking
+	// the output thread.
+	Frame frames_[NUM_FRAMES];
+	std::atomic<uint64_t> head_;
+	std::atomic<uint64_t> tail_;
+	bool abort_;
+	bool abort_output_;
+	std::mutex mutex_;
+	std::condition_variable encode_cond_var_;
+	std::condition_variable space_cond_var_;
+	std::mutex output_mutex_;
+	std::condition_variable output_cond_var_;
+	std::vector<std::thread> encode_threads_;
+	std::thread output_thread_;
+};
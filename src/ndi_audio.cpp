@@ -0,0 +1,102 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * ndi_audio.cpp - capture audio for NDI.
+ */
+
+#include <time.h>
+
+#include <stdexcept>
+
+#include "core/logging.hpp"
+
+#include "ndi_audio.hpp"
+#include "thread_policy.hpp"
+
+static void check(int err, char const *what)
+{
+	if (err < 0)
+		throw std::runtime_error(std::string("audio: failed to ") + what + ": " + snd_strerror(err));
+}
+
+NdiAudio::NdiAudio(std::string const &device, unsigned int channels, unsigned int samplerate, int64_t offset_us,
+				   SendCallback callback)
+	: pcm_(nullptr), channels_(channels ? channels : 2), samplerate_(samplerate ? samplerate : 48000),
+	  offset_us_(offset_us), send_callback_(callback), abort_(false)
+{
+	check(snd_pcm_open(&pcm_, device.c_str(), SND_PCM_STREAM_CAPTURE, 0), ("open " + device).c_str());
+
+	snd_pcm_hw_params_t *hw_params;
+	snd_pcm_hw_params_alloca(&hw_params);
+	try
+	{
+		check(snd_pcm_hw_params_any(pcm_, hw_params), "read the device parameters");
+		check(snd_pcm_hw_params_set_access(pcm_, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED), "set access");
+		check(snd_pcm_hw_params_set_format(pcm_, hw_params, SND_PCM_FORMAT_S16_LE), "set 16 bit samples");
+		check(snd_pcm_hw_params_set_channels_near(pcm_, hw_params, &channels_), "set channels");
+		check(snd_pcm_hw_params_set_rate_near(pcm_, hw_params, &samplerate_, nullptr), "set sample rate");
+		unsigned int period_us = PERIOD_US, periods = PERIODS;
+		check(snd_pcm_hw_params_set_period_time_near(pcm_, hw_params, &period_us, nullptr), "set period");
+		check(snd_pcm_hw_params_set_periods_near(pcm_, hw_params, &periods, nullptr), "set periods");
+		check(snd_pcm_hw_params(pcm_, hw_params), "configure the device");
+		check(snd_pcm_hw_params_get_period_size(hw_params, &period_frames_, nullptr), "read period size");
+	}
+	catch (std::exception const &e)
+	{
+		snd_pcm_close(pcm_);
+		throw;
+	}
+
+	samples_.resize(period_frames_ * channels_);
+	LOG(1, "Audio from " << device << ": " << channels_ << " channels at " << samplerate_ << "Hz, "
+						 << period_frames_ << " samples per period");
+	audio_thread_ = std::thread(&NdiAudio::audioThread, this);
+}
+
+NdiAudio::~NdiAudio()
+{
+	abort_ = true;
+	audio_thread_.join();
+	snd_pcm_close(pcm_);
+}
+
+void NdiAudio::audioThread()
+{
+	ThreadPolicy::Get().Apply(ThreadPolicy::AUDIO, "ndi-audio");
+	NDIlib_audio_frame_interleaved_16s_t frame;
+	frame.sample_rate = samplerate_;
+	frame.no_channels = channels_;
+	frame.reference_level = 0;
+	frame.p_data = samples_.data();
+
+	while (!abort_)
+	{
+		// This blocks for (at most) one period.
+		snd_pcm_sframes_t frames = snd_pcm_readi(pcm_, samples_.data(), period_frames_);
+		if (frames < 0)
+		{
+			LOG(1, "Audio overrun: " << snd_strerror(frames));
+			if (snd_pcm_recover(pcm_, frames, 1) < 0)
+			{
+				LOG_ERROR("ERROR: audio capture failed, no more audio will be sent");
+				return;
+			}
+			continue;
+		}
+
+		// Work back from now to when the first of these samples was captured, allowing for
+		// any that are still waiting in the buffer behind them.
+		snd_pcm_sframes_t delay = 0;
+		if (snd_pcm_delay(pcm_, &delay) < 0)
+			delay = 0;
+		timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		int64_t now_us = now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+		int64_t capture_us = now_us - (frames + delay) * 1000000LL / samplerate_ + offset_us_;
+
+		frame.no_samples = frames;
+		frame.timecode = capture_us * 10; // NDI works in 100ns units, the sender makes it a timecode
+		send_callback_(&frame);
+	}
+}
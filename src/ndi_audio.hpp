@@ -0,0 +1,53 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * ndi_audio.hpp - capture audio for NDI.
+ */
+
+#pragma once
+
+#include <alsa/asoundlib.h>
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <Processing.NDI.Lib.h>
+
+// Captures 16-bit audio from an ALSA device (with PulseAudio installed, its "default" and
+// "pulse" devices go through that) on its own thread. Samples are read a whole period at
+// a time, so the thread only wakes once per period, and each period is stamped with the
+// CLOCK_MONOTONIC time of its first sample (in 100ns units), for the sender to turn into
+// a timecode just as it does the camera's buffer timestamps.
+
+class NdiAudio
+{
+public:
+	typedef std::function<void(NDIlib_audio_frame_interleaved_16s_t const *frame)> SendCallback;
+
+	// A channels or samplerate of 0 means "whatever the device prefers". The offset is
+	// added to every timestamp, for sources that are not in sync with the camera.
+	NdiAudio(std::string const &device, unsigned int channels, unsigned int samplerate, int64_t offset_us,
+			 SendCallback callback);
+	~NdiAudio();
+
+private:
+	// Long enough to keep wakeups rare, short enough not to hold up lip sync.
+	static constexpr unsigned int PERIOD_US = 20000;
+	static constexpr unsigned int PERIODS = 4;
+
+	void audioThread();
+
+	snd_pcm_t *pcm_;
+	unsigned int channels_;
+	unsigned int samplerate_;
+	int64_t offset_us_;
+	snd_pcm_uframes_t period_frames_;
+	std::vector<int16_t> samples_;
+	SendCallback send_callback_;
+	std::atomic<bool> abort_;
+	std::thread audio_thread_;
+};
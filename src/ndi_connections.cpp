@@ -0,0 +1,57 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * ndi_connections.cpp - watch whether anyone is receiving our NDI sources.
+ */
+
+#include <chrono>
+
+#include "core/logging.hpp"
+
+#include "ndi_connections.hpp"
+#include "thread_policy.hpp"
+
+NdiConnections::NdiConnections(std::vector<NDIlib_send_instance_t> const &sends, ConnectionCallback callback)
+	: sends_(sends), callback_(callback), count_(0), connected_(true), abort_(false)
+{
+	connection_thread_ = std::thread(&NdiConnections::connectionThread, this);
+}
+
+NdiConnections::~NdiConnections()
+{
+	abort_ = true;
+	connection_thread_.join();
+}
+
+void NdiConnections::connectionThread()
+{
+	ThreadPolicy::Get().Apply(ThreadPolicy::OTHER, "ndi-connections");
+	typedef std::chrono::steady_clock Clock;
+	Clock::time_point last_seen = Clock::now();
+	uint32_t timeout_ms = sends_.size() == 1 ? CONNECTION_TIMEOUT_MS : SHARED_TIMEOUT_MS;
+
+	while (!abort_)
+	{
+		// This blocks until somebody connects, or the timeout expires, but only while
+		// nobody is connected to that sender already.
+		unsigned int count = 0;
+		for (auto send : sends_)
+			count += NDIlib_send_get_no_connections(send, connected_ ? 0 : timeout_ms);
+		count_.store(count, std::memory_order_relaxed);
+
+		Clock::time_point now = Clock::now();
+		if (count)
+			last_seen = now;
+		bool connected = count || now - last_seen < std::chrono::milliseconds(IDLE_DELAY_MS);
+		if (connected != connected_)
+		{
+			LOG(1, (connected ? "NDI receiver connected" : "No NDI receivers connected"));
+			connected_.store(connected, std::memory_order_relaxed);
+			callback_(connected);
+		}
+
+		if (connected_)
+			std::this_thread::sleep_for(std::chrono::milliseconds(CHECK_INTERVAL_MS));
+	}
+}
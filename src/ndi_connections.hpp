@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * ndi_connections.hpp - watch whether anyone is receiving our NDI sources.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include <Processing.NDI.Lib.h>
+
+// Counts the receivers connected to one or more NDI senders on its own thread, and says
+// when the first one connects, or the last one has been gone for a while. While nobody
+// is connected the thread stays blocked in NDI waiting for a connection, so it hears of
+// one at once. The count is only checked now and again once somebody is connected, as
+// nothing is in a hurry to stop.
+
+class NdiConnections
+{
+public:
+	typedef std::function<void(bool connected)> ConnectionCallback;
+
+	// The callback is made from the watching thread. We start out assuming there are
+	// receivers, so the first callback is either a disconnection, made once nobody has
+	// connected for IDLE_DELAY_MS, or nothing.
+	NdiConnections(std::vector<NDIlib_send_instance_t> const &sends, ConnectionCallback callback);
+	~NdiConnections();
+
+	unsigned int Count() const { return count_.load(std::memory_order_relaxed); }
+	bool Connected() const { return connected_.load(std::memory_order_relaxed); }
+
+private:
+	// How long to block waiting for a connection, before checking for shutdown. With more
+	// than one sender we can only wait on one at a time, so each gets much less.
+	static constexpr uint32_t CONNECTION_TIMEOUT_MS = 250;
+	static constexpr uint32_t SHARED_TIMEOUT_MS = 10;
+	// How often to count the receivers while there are some.
+	static constexpr unsigned int CHECK_INTERVAL_MS = 250;
+	// How long there must have been nobody before we call it idle. Receivers switching
+	// between sources, or NDI discovery at startup, shouldn't count.
+	static constexpr unsigned int IDLE_DELAY_MS = 2000;
+
+	void connectionThread();
+
+	std::vector<NDIlib_send_instance_t> sends_;
+	ConnectionCallback callback_;
+	std::atomic<unsigned int> count_;
+	std::atomic<bool> connected_;
+	std::atomic<bool> abort_;
+	std::thread connection_thread_;
+};
@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * ndi_encoder.cpp - zero-copy "encoder" handing camera buffers to NDI.
+ */
+
+#include "core/logging.hpp"
+
+#include "ndi_encoder.hpp"
+#include "ndi_options.hpp"
+
+NdiEncoder::NdiEncoder(VideoOptions const *options) : Encoder(options), buffer_held_(false)
+{
+	NDIOptions const *ndi_options = dynamic_cast<NDIOptions const *>(options);
+	// A converted frame is sent from NdiOutput's own buffers, so only I420 needs us to
+	// keep hold of the camera's.
+	async_ = ndi_options && ndi_options->ndi_async && ndi_options->ndi_fourcc == "i420";
+	LOG(2, "NdiEncoder started, camera buffers are recycled "
+			   << (async_ ? "when the following frame has been sent" : "as soon as each send returns"));
+}
+
+NdiEncoder::~NdiEncoder()
+{
+	LOG(2, "NdiEncoder closed");
+}
+
+void NdiEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
+{
+	output_ready_callback_(mem, size, timestamp_us, true);
+
+	// In async mode NDI has only now let go of the previous frame, which is the one we
+	// return. Buffers are queued in order, so input_done_callback_ needs no pointer.
+	if (async_ && !buffer_held_)
+	{
+		buffer_held_ = true;
+		return;
+	}
+	input_done_callback_(nullptr);
+}
+
+static Encoder *ndi_codec_create(VideoOptions *options, const StreamInfo &info)
+{
+	return new NdiEncoder(options);
+}
+
+static RegisterEncoder reg("ndi", &ndi_codec_create);
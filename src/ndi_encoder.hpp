@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * ndi_encoder.hpp - zero-copy "encoder" handing camera buffers to NDI.
+ */
+
+#pragma once
+
+#include "encoder/encoder.hpp"
+
+// The NdiEncoder does no encoding at all. It passes the mmapped camera buffer straight
+// to the output from the calling thread, so there is neither a copy nor a queue nor an
+// extra thread between the camera and NDI.
+//
+// Buffer recycling: with synchronous sends the camera buffer is returned to libcamera
+// as soon as the output callback returns. With async sends (the default) NDI keeps using
+// the buffer until the next frame has been submitted, so each camera buffer is returned
+// exactly one frame later, when the following frame's send has returned. The output may
+// discard the in-flight buffer earlier only by flushing it.
+
+class NdiEncoder : public Encoder
+{
+public:
+	NdiEncoder(VideoOptions const *options);
+	~NdiEncoder();
+	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
+
+private:
+	bool async_;
+	bool buffer_held_;
+};
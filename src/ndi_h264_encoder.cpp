@@ -0,0 +1,511 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * ndi_h264_encoder.cpp - h264 video encoder for NDI|HX.
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <linux/dma-buf.h>
+#include <linux/videodev2.h>
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <map>
+
+#include "core/logging.hpp"
+
+#include "dma_buffer_pool.hpp"
+#include "flight_recorder.hpp"
+#include "ndi_h264_encoder.hpp"
+#include "ndi_options.hpp"
+#include "thread_policy.hpp"
+
+static int xioctl(int fd, unsigned long ctl, void *arg)
+{
+	int ret, num_tries = 10;
+	do
+	{
+		ret = ioctl(fd, ctl, arg);
+	} while (ret == -1 && errno == EINTR && num_tries-- > 0);
+	return ret;
+}
+
+// The CPU reads dma pool buffers through a cached mapping, so it must be told when the
+// codec has written one (before reading) and when it's about to again (after).
+static void sync_dma_buf(int fd, uint64_t flags)
+{
+	dma_buf_sync sync = {};
+	sync.flags = flags | DMA_BUF_SYNC_READ;
+	if (xioctl(fd, DMA_BUF_IOCTL_SYNC, &sync) < 0)
+		LOG_ERROR("NdiH264Encoder: failed to sync dma buffer, errno " << errno);
+}
+
+static int get_v4l2_colorspace(std::optional<libcamera::ColorSpace> const &cs)
+{
+	if (cs == libcamera::ColorSpace::Rec709)
+		return V4L2_COLORSPACE_REC709;
+	else if (cs == libcamera::ColorSpace::Smpte170m)
+		return V4L2_COLORSPACE_SMPTE170M;
+
+	LOG(1, "NdiH264Encoder: surprising colour space: " << (cs ? cs->toString() : "none"));
+	return V4L2_COLORSPACE_SMPTE170M;
+}
+
+NdiH264Encoder::NdiH264Encoder(VideoOptions const *options, StreamInfo const &info, Bitrate const &bitrate)
+	: Encoder(options), abortPoll_(false), abortOutput_(false), keyframe_requested_(false),
+	  bitrate_requested_(0), input_buffers_available_(NUM_OUTPUT_BUFFERS), output_queue_(NUM_CAPTURE_BUFFERS),
+	  dropping_output_(false), max_output_backlog_(MAX_OUTPUT_BACKLOG)
+{
+	// First open the encoder device. Maybe we should double-check its "caps".
+
+	const char device_name[] = "/dev/video11";
+	fd_ = open(device_name, O_RDWR, 0);
+	if (fd_ < 0)
+		throw std::runtime_error("failed to open V4L2 H264 encoder");
+	LOG(2, "Opened NdiH264Encoder on " << device_name << " as fd " << fd_);
+
+	// Apply any options.
+
+	if (bitrate)
+		setControl(V4L2_CID_MPEG_VIDEO_BITRATE, bitrate.bps(), "bitrate");
+	if (!options->Get().profile.empty())
+	{
+		static const std::map<std::string, int> profile_map =
+			{ { "baseline", V4L2_MPEG_VIDEO_H264_PROFILE_CONSTRAINED_BASELINE },
+			  { "main", V4L2_MPEG_VIDEO_H264_PROFILE_MAIN },
+			  { "high", V4L2_MPEG_VIDEO_H264_PROFILE_HIGH } };
+		auto it = profile_map.find(options->Get().profile);
+		if (it == profile_map.end())
+			throw std::runtime_error("no such profile " + options->Get().profile);
+		setControl(V4L2_CID_MPEG_VIDEO_H264_PROFILE, it->second, "profile");
+	}
+	if (!options->Get().level.empty())
+	{
+		static const std::map<std::string, int> level_map =
+			{ { "4", V4L2_MPEG_VIDEO_H264_LEVEL_4_0 },
+			  { "4.1", V4L2_MPEG_VIDEO_H264_LEVEL_4_1 },
+			  { "4.2", V4L2_MPEG_VIDEO_H264_LEVEL_4_2 } };
+		auto it = level_map.find(options->Get().level);
+		if (it == level_map.end())
+			throw std::runtime_error("no such level " + options->Get().level);
+		setControl(V4L2_CID_MPEG_VIDEO_H264_LEVEL, it->second, "level");
+	}
+	NDIOptions const *ndi_options = dynamic_cast<NDIOptions const *>(options);
+	if (ndi_options && ndi_options->latency_profile == "low")
+		max_output_backlog_ = LOW_LATENCY_OUTPUT_BACKLOG;
+	if (ndi_options && ndi_options->ndi_intra_refresh)
+	{
+		unsigned int period = options->Get().intra;
+		if (!period)
+			period = std::lround(options->Get().framerate.value_or(DEFAULT_FRAMERATE));
+		if (setIntraRefresh(info, period))
+			LOG(2, "NdiH264Encoder: intra refresh every " << period << " frames");
+		else
+		{
+			LOG(1, "NdiH264Encoder: codec can't do intra refresh, sending a keyframe every " << period << " frames");
+			setControl(V4L2_CID_MPEG_VIDEO_H264_I_PERIOD, period, "intra");
+		}
+	}
+	else if (options->Get().intra)
+		setControl(V4L2_CID_MPEG_VIDEO_H264_I_PERIOD, options->Get().intra, "intra");
+	// Receivers may join at any moment, so every IDR frame must carry the SPS/PPS.
+	setControl(V4L2_CID_MPEG_VIDEO_REPEAT_SEQ_HEADER, 1, "inline");
+
+	// Set the output and capture formats. We know exactly what they will be.
+
+	v4l2_format fmt = {};
+	fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	fmt.fmt.pix_mp.width = info.width;
+	fmt.fmt.pix_mp.height = info.height;
+	// We assume YUV420 here, but it would be nice if we could do something
+	// like info.pixel_format.toV4L2Fourcc();
+	fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_YUV420;
+	fmt.fmt.pix_mp.plane_fmt[0].bytesperline = info.stride;
+	fmt.fmt.pix_mp.field = V4L2_FIELD_ANY;
+	fmt.fmt.pix_mp.colorspace = get_v4l2_colorspace(info.colour_space);
+	fmt.fmt.pix_mp.num_planes = 1;
+	if (xioctl(fd_, VIDIOC_S_FMT, &fmt) < 0)
+		throw std::runtime_error("failed to set output format");
+
+	fmt = {};
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	fmt.fmt.pix_mp.width = info.width;
+	fmt.fmt.pix_mp.height = info.height;
+	fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_H264;
+	fmt.fmt.pix_mp.field = V4L2_FIELD_ANY;
+	fmt.fmt.pix_mp.colorspace = V4L2_COLORSPACE_DEFAULT;
+	fmt.fmt.pix_mp.num_planes = 1;
+	fmt.fmt.pix_mp.plane_fmt[0].bytesperline = 0;
+	fmt.fmt.pix_mp.plane_fmt[0].sizeimage = 512 << 10;
+	if (xioctl(fd_, VIDIOC_S_FMT, &fmt) < 0)
+		throw std::runtime_error("failed to set capture format");
+
+	// Initialise the framerate.
+
+	struct v4l2_streamparm parm = {};
+	parm.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	parm.parm.output.timeperframe.numerator = 1000 / options->Get().framerate.value_or(DEFAULT_FRAMERATE);
+	parm.parm.output.timeperframe.denominator = 1000;
+	if (xioctl(fd_, VIDIOC_S_PARM, &parm) < 0)
+		throw std::runtime_error("failed to set streamparm");
+
+	// Request that the necessary buffers are allocated. The output queue
+	// (input to the encoder) shares buffers from our caller, these must be
+	// DMABUFs. Buffers for the encoded bitstream must be allocated and
+	// m-mapped.
+
+	v4l2_requestbuffers reqbufs = {};
+	reqbufs.count = NUM_OUTPUT_BUFFERS;
+	reqbufs.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	reqbufs.memory = V4L2_MEMORY_DMABUF;
+	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
+		throw std::runtime_error("request for output buffers failed");
+	LOG(2, "Got " << reqbufs.count << " output buffers");
+
+	// We have to maintain a list of the buffers we can use when our caller gives
+	// us another frame to encode.
+	for (unsigned int i = 0; i < reqbufs.count; i++)
+		input_buffers_available_.Push(i);
+
+	// The bitstream buffers come from the dma buffer pool where possible, so that they
+	// survive the encoder being recreated on a restart. Failing that, the codec allocates
+	// them itself, as it always used to.
+	size_t capture_size = fmt.fmt.pix_mp.plane_fmt[0].sizeimage;
+	capture_memory_ = V4L2_MEMORY_DMABUF;
+	for (int i = 0; i < NUM_CAPTURE_BUFFERS && capture_memory_ == V4L2_MEMORY_DMABUF; i++)
+	{
+		DmaBufferPool::Buffer buffer;
+		if (!DmaBufferPool::Get().Acquire(capture_size, buffer))
+		{
+			for (int j = 0; j < i; j++)
+				DmaBufferPool::Get().Release({ buffers_[j].fd, buffers_[j].mem, buffers_[j].size });
+			capture_memory_ = V4L2_MEMORY_MMAP;
+			break;
+		}
+		buffers_[i] = { buffer.mem, buffer.size, buffer.fd };
+	}
+
+	reqbufs = {};
+	reqbufs.count = NUM_CAPTURE_BUFFERS;
+	reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	reqbufs.memory = capture_memory_;
+	if (capture_memory_ == V4L2_MEMORY_DMABUF && xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
+	{
+		LOG(1, "Codec can't take dma buffers for its output, allocating its own");
+		for (int i = 0; i < NUM_CAPTURE_BUFFERS; i++)
+			DmaBufferPool::Get().Release({ buffers_[i].fd, buffers_[i].mem, buffers_[i].size });
+		capture_memory_ = V4L2_MEMORY_MMAP;
+		reqbufs.count = NUM_CAPTURE_BUFFERS;
+		reqbufs.memory = capture_memory_;
+	}
+	if (capture_memory_ == V4L2_MEMORY_MMAP && xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
+		throw std::runtime_error("request for capture buffers failed");
+	LOG(2, "Got " << reqbufs.count << " capture buffers");
+	if (capture_memory_ == V4L2_MEMORY_DMABUF)
+	{
+		// Any the codec didn't want go straight back.
+		for (int i = reqbufs.count; i < NUM_CAPTURE_BUFFERS; i++)
+			DmaBufferPool::Get().Release({ buffers_[i].fd, buffers_[i].mem, buffers_[i].size });
+	}
+	num_capture_buffers_ = reqbufs.count;
+
+	for (unsigned int i = 0; i < reqbufs.count; i++)
+	{
+		v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+		v4l2_buffer buffer = {};
+		buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+		buffer.memory = capture_memory_;
+		buffer.index = i;
+		buffer.length = 1;
+		buffer.m.planes = planes;
+		if (capture_memory_ == V4L2_MEMORY_DMABUF)
+		{
+			planes[0].m.fd = buffers_[i].fd;
+			planes[0].length = buffers_[i].size;
+		}
+		else
+		{
+			if (xioctl(fd_, VIDIOC_QUERYBUF, &buffer) < 0)
+				throw std::runtime_error("failed to capture query buffer " + std::to_string(i));
+			buffers_[i].mem = mmap(0, buffer.m.planes[0].length, PROT_READ | PROT_WRITE, MAP_SHARED, fd_,
+								   buffer.m.planes[0].m.mem_offset);
+			if (buffers_[i].mem == MAP_FAILED)
+				throw std::runtime_error("failed to mmap capture buffer " + std::to_string(i));
+			buffers_[i].size = buffer.m.planes[0].length;
+			buffers_[i].fd = -1;
+		}
+		// Whilst we're going through all the capture buffers, we may as well queue
+		// them ready for the encoder to write into.
+		if (xioctl(fd_, VIDIOC_QBUF, &buffer) < 0)
+			throw std::runtime_error("failed to queue capture buffer " + std::to_string(i));
+	}
+
+	// Enable streaming and we're done.
+
+	v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	if (xioctl(fd_, VIDIOC_STREAMON, &type) < 0)
+		throw std::runtime_error("failed to start output streaming");
+	type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	if (xioctl(fd_, VIDIOC_STREAMON, &type) < 0)
+		throw std::runtime_error("failed to start capture streaming");
+	LOG(2, "Codec streaming started");
+
+	output_thread_ = std::thread(&NdiH264Encoder::outputThread, this);
+	poll_thread_ = std::thread(&NdiH264Encoder::pollThread, this);
+}
+
+NdiH264Encoder::~NdiH264Encoder()
+{
+	abortPoll_ = true;
+	poll_thread_.join();
+	abortOutput_ = true;
+	output_thread_.join();
+
+	// Turn off streaming on both the output and capture queues, and "free" the
+	// buffers that we requested. The capture ones need to be "munmapped" first.
+
+	v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	if (xioctl(fd_, VIDIOC_STREAMOFF, &type) < 0)
+		LOG(1, "Failed to stop output streaming");
+	type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	if (xioctl(fd_, VIDIOC_STREAMOFF, &type) < 0)
+		LOG(1, "Failed to stop capture streaming");
+
+	v4l2_requestbuffers reqbufs = {};
+	reqbufs.count = 0;
+	reqbufs.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	reqbufs.memory = V4L2_MEMORY_DMABUF;
+	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
+		LOG(1, "Request to free output buffers failed");
+
+	if (capture_memory_ == V4L2_MEMORY_MMAP)
+	{
+		for (int i = 0; i < num_capture_buffers_; i++)
+			if (munmap(buffers_[i].mem, buffers_[i].size) < 0)
+				LOG(1, "Failed to unmap buffer");
+	}
+	reqbufs = {};
+	reqbufs.count = 0;
+	reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	reqbufs.memory = capture_memory_;
+	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
+		LOG(1, "Request to free capture buffers failed");
+	// Kept, mapped, for whichever encoder comes next.
+	if (capture_memory_ == V4L2_MEMORY_DMABUF)
+	{
+		for (int i = 0; i < num_capture_buffers_; i++)
+			DmaBufferPool::Get().Release({ buffers_[i].fd, buffers_[i].mem, buffers_[i].size });
+	}
+
+	close(fd_);
+	LOG(2, "NdiH264Encoder closed");
+}
+
+void NdiH264Encoder::setControl(uint32_t id, int32_t value, char const *name)
+{
+	if (!trySetControl(id, value))
+		throw std::runtime_error(std::string("failed to set ") + name);
+}
+
+bool NdiH264Encoder::trySetControl(uint32_t id, int32_t value)
+{
+	v4l2_control ctrl = {};
+	ctrl.id = id;
+	ctrl.value = value;
+	return xioctl(fd_, VIDIOC_S_CTRL, &ctrl) == 0;
+}
+
+bool NdiH264Encoder::setIntraRefresh(StreamInfo const &info, unsigned int period)
+{
+	// Newer kernels take the period in frames. Failing that, the older control says how
+	// many macroblocks to refresh in each frame, which comes to the same thing.
+	bool refresh = trySetControl(V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD_TYPE,
+								 V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD_TYPE_CYCLIC) &&
+				   trySetControl(V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD, period);
+	if (!refresh)
+	{
+		unsigned int macroblocks = ((info.width + 15) / 16) * ((info.height + 15) / 16);
+		refresh = trySetControl(V4L2_CID_MPEG_VIDEO_CYCLIC_INTRA_REFRESH_MB, (macroblocks + period - 1) / period);
+	}
+	// The refresh does the job of the periodic IDR frames, so there are none, and a
+	// receiver joining asks for one of its own.
+	if (refresh)
+		setControl(V4L2_CID_MPEG_VIDEO_H264_I_PERIOD, INT32_MAX, "intra");
+	return refresh;
+}
+
+void NdiH264Encoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
+{
+	// The codec applies this control to the next buffer we queue. Neither failing is worth
+	// losing the stream over, so carry on with the frame regardless.
+	if (keyframe_requested_.exchange(false))
+	{
+		LOG(2, "NdiH264Encoder: forcing keyframe");
+		if (!trySetControl(V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME, 1))
+			LOG_ERROR("NdiH264Encoder: failed to force keyframe, errno " << errno);
+	}
+	unsigned int bitrate_bps = bitrate_requested_.exchange(0);
+	if (bitrate_bps)
+	{
+		LOG(2, "NdiH264Encoder: bitrate now " << bitrate_bps / 1000 << "kbps");
+		if (!trySetControl(V4L2_CID_MPEG_VIDEO_BITRATE, bitrate_bps))
+			LOG_ERROR("NdiH264Encoder: failed to set bitrate, errno " << errno);
+	}
+
+	int index;
+	{
+		// We need to find an available output buffer (input to the codec) to
+		// "wrap" the DMABUF.
+		if (!input_buffers_available_.TryPop(index))
+			throw std::runtime_error("no buffers available to queue codec input");
+	}
+	v4l2_buffer buf = {};
+	v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+	buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	buf.index = index;
+	buf.field = V4L2_FIELD_NONE;
+	buf.memory = V4L2_MEMORY_DMABUF;
+	buf.length = 1;
+	buf.timestamp.tv_sec = timestamp_us / 1000000;
+	buf.timestamp.tv_usec = timestamp_us % 1000000;
+	buf.m.planes = planes;
+	buf.m.planes[0].m.fd = fd;
+	buf.m.planes[0].bytesused = size;
+	buf.m.planes[0].length = size;
+	if (xioctl(fd_, VIDIOC_QBUF, &buf) < 0)
+		throw std::runtime_error("failed to queue input to codec");
+}
+
+void NdiH264Encoder::pollThread()
+{
+	ThreadPolicy::Get().Apply(ThreadPolicy::ENCODE, "h264-poll");
+	while (true)
+	{
+		pollfd p = { fd_, POLLIN, 0 };
+		int ret = poll(&p, 1, 200);
+		if (abortPoll_ && input_buffers_available_.Size() == NUM_OUTPUT_BUFFERS)
+			break;
+		if (ret == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			// Nothing comes back from the codec after this, so the camera runs out of
+			// buffers and times out, and recovery builds us again.
+			LOG_ERROR("NdiH264Encoder: unexpected errno " << errno << " from poll, giving up on the codec");
+			break;
+		}
+		if (p.revents & POLLIN)
+		{
+			v4l2_buffer buf = {};
+			v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+			buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+			buf.memory = V4L2_MEMORY_DMABUF;
+			buf.length = 1;
+			buf.m.planes = planes;
+			int ret = xioctl(fd_, VIDIOC_DQBUF, &buf);
+			if (ret == 0)
+			{
+				// Return this to the caller, first noting that this buffer, identified
+				// by its index, is available for queueing up another frame.
+				input_buffers_available_.Push(buf.index);
+				input_done_callback_(nullptr);
+			}
+
+			buf = {};
+			memset(planes, 0, sizeof(planes));
+			buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+			buf.memory = capture_memory_;
+			buf.length = 1;
+			buf.m.planes = planes;
+			ret = xioctl(fd_, VIDIOC_DQBUF, &buf);
+			if (ret == 0)
+			{
+				// We push this encoded buffer to another thread so that our
+				// application can take its time with the data without blocking the
+				// encode process.
+				int64_t timestamp_us = (buf.timestamp.tv_sec * (int64_t)1000000) + buf.timestamp.tv_usec;
+				if (capture_memory_ == V4L2_MEMORY_DMABUF)
+					sync_dma_buf(buffers_[buf.index].fd, DMA_BUF_SYNC_START);
+				OutputItem item = { buffers_[buf.index].mem,
+									buf.m.planes[0].bytesused,
+									buf.m.planes[0].length,
+									buf.index,
+									!!(buf.flags & V4L2_BUF_FLAG_KEYFRAME),
+									timestamp_us };
+				// There are only as many of these as there are slots in the ring.
+				if (!output_queue_.Push(item))
+				{
+					LOG_ERROR("NdiH264Encoder: encoded output queue overflowed");
+					requeueCaptureBuffer(item.index, item.length);
+				}
+			}
+		}
+	}
+}
+
+void NdiH264Encoder::outputThread()
+{
+	ThreadPolicy::Get().Apply(ThreadPolicy::SEND, "h264-output");
+	OutputItem item;
+	while (true)
+	{
+		// Must check the abort first, to allow items in the output queue to have a
+		// callback.
+		if (abortOutput_ && !output_queue_.Size())
+			return;
+		if (!output_queue_.Wait(item, 200))
+			continue;
+
+		// Dropping any frame breaks the ones that follow, so once we start we keep going
+		// until the keyframe we asked for turns up.
+		if (!dropping_output_ && output_queue_.Size() >= max_output_backlog_)
+		{
+			LOG(1, "NdiH264Encoder: output " << output_queue_.Size() << " frames behind, dropping until next keyframe");
+			dropping_output_ = true;
+			RequestKeyframe();
+		}
+		if (dropping_output_ && item.keyframe)
+			dropping_output_ = false;
+
+		if (!dropping_output_)
+			output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, item.keyframe);
+		else
+			FlightRecorder::Get().Record(FlightEvent::DROP, item.timestamp_us, 0, FlightEvent::ENCODER_BACKLOG);
+		requeueCaptureBuffer(item.index, item.length);
+	}
+}
+
+void NdiH264Encoder::requeueCaptureBuffer(unsigned int index, size_t length)
+{
+	v4l2_buffer buf = {};
+	v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	buf.memory = capture_memory_;
+	buf.index = index;
+	buf.length = 1;
+	buf.m.planes = planes;
+	buf.m.planes[0].bytesused = 0;
+	buf.m.planes[0].length = length;
+	if (capture_memory_ == V4L2_MEMORY_DMABUF)
+	{
+		sync_dma_buf(buffers_[index].fd, DMA_BUF_SYNC_END);
+		buf.m.planes[0].m.fd = buffers_[index].fd;
+	}
+	if (xioctl(fd_, VIDIOC_QBUF, &buf) < 0)
+		LOG_ERROR("NdiH264Encoder: failed to re-queue encoded buffer, errno " << errno);
+}
+
+static Encoder *ndi_h264_codec_create(VideoOptions *options, const StreamInfo &info)
+{
+	return new NdiH264Encoder(options, info, options->Get().bitrate);
+}
+
+static RegisterEncoder reg("ndi_h264", &ndi_h264_codec_create);
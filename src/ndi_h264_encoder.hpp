@@ -0,0 +1,111 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * ndi_h264_encoder.hpp - h264 video encoder for NDI|HX.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <thread>
+
+#include "encoder/encoder.hpp"
+
+#include "spsc_ring.hpp"
+
+// This is the V4L2 hardware H.264 encoder as used by H264Encoder, with the extra control
+// that compressed NDI needs: receivers can ask for a keyframe at any time, and we must
+// be able to force one. The encoded size comes from the stream being encoded rather than
+// the options, so that the same class can encode the low resolution stream too.
+//
+// Keyframes are several times the size of the frames between, which switches and Wi-Fi
+// links have to buffer. With --ndi_intra_refresh, the codec instead refreshes a band of
+// macroblocks in every frame, so frame sizes stay even, and only sends an IDR frame when
+// a receiver asks for one.
+
+class NdiH264Encoder : public Encoder
+{
+public:
+	NdiH264Encoder(VideoOptions const *options, StreamInfo const &info, Bitrate const &bitrate);
+	~NdiH264Encoder();
+	// Encode the given DMABUF.
+	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
+	// Make the next frame to be encoded an IDR frame. May be called from any thread.
+	void RequestKeyframe() { keyframe_requested_ = true; }
+	// Change the target bitrate from the next frame on, without restarting the stream. May
+	// be called from any thread.
+	void SetBitrate(unsigned int bitrate_bps) { bitrate_requested_ = bitrate_bps; }
+	// Frames handed to us that the codec hasn't yet given back. May be called from any thread.
+	unsigned int Backlog() const { return NUM_OUTPUT_BUFFERS - input_buffers_available_.Size(); }
+
+	// We want at least as many output buffers as there are in the camera queue
+	// (we always want to be able to queue them when they arrive). This is also the
+	// most camera buffers we can be holding on to at once.
+	static constexpr int NUM_OUTPUT_BUFFERS = 6;
+
+private:
+	// Make loads of capture buffers, as this is our buffering mechanism in case of
+	// delays dealing with the output bitstream.
+	static constexpr int NUM_CAPTURE_BUFFERS = 12;
+	// Once this many encoded frames are waiting to be sent, we have fallen too far behind.
+	// Rather than keep every capture buffer tied up, throw the backlog away and restart
+	// from a keyframe.
+	static constexpr unsigned int MAX_OUTPUT_BACKLOG = NUM_CAPTURE_BUFFERS / 2;
+	// With --latency_profile low, a backlog of more than a frame is already too far behind.
+	static constexpr unsigned int LOW_LATENCY_OUTPUT_BACKLOG = 2;
+
+	// This thread just sits waiting for the encoder to finish stuff. It will either:
+	// * receive "output" buffers (codec inputs), which we must return to the caller
+	// * receive encoded buffers, which we pass to the application.
+	void pollThread();
+
+	// Handle the output buffers in another thread so as not to block the encoder. The
+	// application can take its time, after which we return this buffer to the encoder for
+	// re-use.
+	void outputThread();
+
+	void setControl(uint32_t id, int32_t value, char const *name);
+	// As setControl, but for controls not every kernel has. Returns whether it took.
+	bool trySetControl(uint32_t id, int32_t value);
+	// Cyclic intra refresh over this many frames, with no IDR frames unless asked for.
+	// Returns false if the codec can't do it.
+	bool setIntraRefresh(StreamInfo const &info, unsigned int period);
+
+	// Hand an encoded buffer back to the codec to be written into again.
+	void requeueCaptureBuffer(unsigned int index, size_t length);
+
+	bool abortPoll_;
+	bool abortOutput_;
+	int fd_;
+	std::atomic<bool> keyframe_requested_;
+	std::atomic<unsigned int> bitrate_requested_;
+	struct BufferDescription
+	{
+		void *mem;
+		size_t size;
+		// The dma buffer, when they come from the DmaBufferPool.
+		int fd;
+	};
+	BufferDescription buffers_[NUM_CAPTURE_BUFFERS];
+	int num_capture_buffers_;
+	// V4L2_MEMORY_DMABUF or V4L2_MEMORY_MMAP.
+	unsigned int capture_memory_;
+	std::thread poll_thread_;
+	// Filled by the poll thread, emptied by whoever calls EncodeBuffer.
+	SpscRing<int> input_buffers_available_;
+	struct OutputItem
+	{
+		void *mem;
+		size_t bytes_used;
+		size_t length;
+		unsigned int index;
+		bool keyframe;
+		int64_t timestamp_us;
+	};
+	// Filled by the poll thread, emptied by the output thread.
+	SpscRing<OutputItem> output_queue_;
+	bool dropping_output_;
+	unsigned int max_output_backlog_;
+	std::thread output_thread_;
+};
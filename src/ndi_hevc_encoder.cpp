@@ -0,0 +1,272 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * ndi_hevc_encoder.cpp - HEVC video encoder for NDI|HX, through libavcodec.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <stdexcept>
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+#include "libavutil/opt.h"
+}
+
+#include "core/logging.hpp"
+
+#include "flight_recorder.hpp"
+#include "h264_bitstream.hpp"
+#include "ndi_h264_encoder.hpp"
+#include "ndi_hevc_encoder.hpp"
+#include "ndi_options.hpp"
+#include "thread_policy.hpp"
+
+static_assert(NdiHevcEncoder::MAX_QUEUED == NdiH264Encoder::NUM_OUTPUT_BUFFERS,
+			  "the lores queue is sized for either encoder");
+
+static std::string av_error(int err)
+{
+	char buf[64];
+	av_strerror(err, buf, sizeof(buf));
+	return buf;
+}
+
+NdiHevcEncoder::NdiHevcEncoder(VideoOptions const *options, StreamInfo const &info, Bitrate const &bitrate)
+	: Encoder(options), info_(info), framerate_(std::lround(options->Get().framerate.value_or(DEFAULT_FRAMERATE))),
+	  intra_(options->Get().intra), intra_refresh_(false), bitrate_bps_(0), codec_failed_(false),
+	  ctx_(nullptr), frame_(av_frame_alloc()), packet_(av_packet_alloc()),
+	  keyframe_requested_(false), bitrate_requested_(0), backlog_(0), input_queue_(MAX_QUEUED), abort_(false)
+{
+	NDIOptions const *ndi_options = dynamic_cast<NDIOptions const *>(options);
+	intra_refresh_ = ndi_options && ndi_options->ndi_intra_refresh;
+
+	// Hardware first. FFmpeg may have the V4L2 encoder built in with no device behind it,
+	// in which case it fails to open.
+	for (char const *name : { "hevc_v4l2m2m", "libx265" })
+	{
+		if (!avcodec_find_encoder_by_name(name))
+			continue;
+		codec_name_ = name;
+		try
+		{
+			openCodec(bitrate ? bitrate.bps() : DEFAULT_BITRATE_BPS);
+			break;
+		}
+		catch (std::exception const &e)
+		{
+			LOG(1, "NdiHevcEncoder: " << e.what());
+			codec_name_.clear();
+		}
+	}
+	if (codec_name_.empty())
+	{
+		av_packet_free(&packet_);
+		av_frame_free(&frame_);
+		throw std::runtime_error("NdiHevcEncoder: no HEVC encoder, FFmpeg needs libx265");
+	}
+	LOG(1, "NdiHevcEncoder encoding " << info.width << "x" << info.height << " with " << codec_name_);
+
+	encode_thread_ = std::thread(&NdiHevcEncoder::encodeThread, this);
+}
+
+NdiHevcEncoder::~NdiHevcEncoder()
+{
+	abort_ = true;
+	encode_thread_.join();
+	closeCodec();
+	av_packet_free(&packet_);
+	av_frame_free(&frame_);
+	LOG(2, "NdiHevcEncoder closed");
+}
+
+void NdiHevcEncoder::openCodec(unsigned int bitrate_bps)
+{
+	closeCodec();
+	AVCodec const *codec = avcodec_find_encoder_by_name(codec_name_.c_str());
+	ctx_ = avcodec_alloc_context3(codec);
+	if (!ctx_)
+		throw std::runtime_error("failed to allocate " + codec_name_);
+	ctx_->width = info_.width;
+	ctx_->height = info_.height;
+	ctx_->pix_fmt = AV_PIX_FMT_YUV420P;
+	// Timestamps go through in microseconds, as they come.
+	ctx_->time_base = { 1, 1000000 };
+	ctx_->framerate = { (int)framerate_, 1 };
+	ctx_->bit_rate = bitrate_bps;
+	// A quarter of a second of buffer keeps frame sizes even, without starving keyframes.
+	// With intra refresh there are no keyframes to make room for, and two frames' worth is
+	// all the buffer there needs to be.
+	ctx_->rc_max_rate = bitrate_bps;
+	ctx_->rc_buffer_size = intra_refresh_ ? 2 * bitrate_bps / framerate_ : bitrate_bps / 4;
+	// NDI|HX receivers expect a keyframe (or a full refresh) every second or so, and ask for
+	// a keyframe when they join.
+	ctx_->gop_size = intra_ ? intra_ : framerate_;
+	ctx_->max_b_frames = 0;
+	ctx_->flags |= AV_CODEC_FLAG_LOW_DELAY;
+	bool rec709 = info_.colour_space == libcamera::ColorSpace::Rec709;
+	ctx_->colorspace = rec709 ? AVCOL_SPC_BT709 : AVCOL_SPC_SMPTE170M;
+	ctx_->color_primaries = rec709 ? AVCOL_PRI_BT709 : AVCOL_PRI_SMPTE170M;
+	ctx_->color_trc = rec709 ? AVCOL_TRC_BT709 : AVCOL_TRC_SMPTE170M;
+	ctx_->color_range = AVCOL_RANGE_MPEG;
+	if (codec_name_ == "libx265")
+	{
+		// One frame in flight, cut into a slice for each core, and the VPS, SPS and PPS
+		// repeated on every keyframe.
+		unsigned int slices = std::max(1u, std::thread::hardware_concurrency());
+		std::string params = "repeat-headers=1:scenecut=0:frame-threads=1:slices=" + std::to_string(slices);
+		if (intra_refresh_)
+			params += ":intra-refresh=1";
+		av_opt_set(ctx_->priv_data, "preset", "ultrafast", 0);
+		av_opt_set(ctx_->priv_data, "tune", "zerolatency", 0);
+		av_opt_set(ctx_->priv_data, "forced-idr", "1", 0);
+		av_opt_set(ctx_->priv_data, "x265-params", params.c_str(), 0);
+	}
+	else if (intra_refresh_)
+		LOG(1, "NdiHevcEncoder: " << codec_name_ << " can't do intra refresh, sending keyframes");
+	int ret = avcodec_open2(ctx_, codec, nullptr);
+	if (ret < 0)
+	{
+		closeCodec();
+		throw std::runtime_error("failed to open " + codec_name_ + ": " + av_error(ret));
+	}
+	bitrate_bps_ = bitrate_bps;
+
+	// The frame only ever points into camera buffers, which libavcodec copies from.
+	frame_->format = AV_PIX_FMT_YUV420P;
+	frame_->width = info_.width;
+	frame_->height = info_.height;
+	frame_->linesize[0] = info_.stride;
+	frame_->linesize[1] = frame_->linesize[2] = info_.stride / 2;
+}
+
+bool NdiHevcEncoder::reopenCodec(unsigned int bitrate_bps)
+{
+	try
+	{
+		openCodec(bitrate_bps);
+		codec_failed_ = false;
+		return true;
+	}
+	catch (std::exception const &e)
+	{
+		if (!codec_failed_)
+			LOG_ERROR("NdiHevcEncoder: " << e.what());
+		codec_failed_ = true;
+		return false;
+	}
+}
+
+void NdiHevcEncoder::closeCodec()
+{
+	avcodec_free_context(&ctx_);
+}
+
+void NdiHevcEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
+{
+	// The ring only fills while a single encode stalls for several frames. Frames have to
+	// go back to the camera in order, so we can't drop this one, and wait for room instead.
+	while (!input_queue_.Push({ mem, timestamp_us }))
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	backlog_++;
+}
+
+void NdiHevcEncoder::encodeThread()
+{
+	ThreadPolicy::Get().Apply(ThreadPolicy::ENCODE, "hevc-encode");
+	InputItem item;
+	while (true)
+	{
+		if (abort_ && !input_queue_.Size())
+			return;
+		if (!input_queue_.Wait(item, 200))
+			continue;
+
+		// Every frame goes back to the camera in the order it came, encoded or not.
+		if (input_queue_.Size() >= MAX_BACKLOG)
+		{
+			LOG(2, "NdiHevcEncoder: " << input_queue_.Size() << " frames behind, skipping one");
+			backlog_--;
+			input_done_callback_(nullptr);
+			FlightRecorder::Get().Record(FlightEvent::DROP, item.timestamp_us, 0, FlightEvent::ENCODER_BACKLOG);
+			continue;
+		}
+
+		unsigned int bitrate_bps = bitrate_requested_.exchange(0);
+		if (bitrate_bps)
+		{
+			// Neither encoder can change it on the fly, so start again from a keyframe.
+			LOG(2, "NdiHevcEncoder: bitrate now " << bitrate_bps / 1000 << "kbps");
+			reopenCodec(bitrate_bps);
+		}
+		// After a failure, keep trying at the last bitrate that worked.
+		if (!ctx_ && !reopenCodec(bitrate_bps_))
+		{
+			backlog_--;
+			input_done_callback_(nullptr);
+			continue;
+		}
+
+		frame_->data[0] = (uint8_t *)item.mem;
+		frame_->data[1] = frame_->data[0] + info_.stride * info_.height;
+		frame_->data[2] = frame_->data[1] + (info_.stride / 2) * (info_.height / 2);
+		frame_->pts = item.timestamp_us;
+		frame_->pict_type = keyframe_requested_.exchange(false) ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+		int ret = avcodec_send_frame(ctx_, frame_);
+		backlog_--;
+		input_done_callback_(nullptr);
+		if (ret < 0)
+		{
+			LOG_ERROR("NdiHevcEncoder: failed to encode: " << av_error(ret));
+			closeCodec();
+			continue;
+		}
+		sendPackets();
+	}
+}
+
+void NdiHevcEncoder::sendPackets()
+{
+	while (true)
+	{
+		int ret = avcodec_receive_packet(ctx_, packet_);
+		if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+			return;
+		if (ret < 0)
+		{
+			// The next frame reopens it.
+			LOG_ERROR("NdiHevcEncoder: failed to encode: " << av_error(ret));
+			closeCodec();
+			return;
+		}
+
+		uint8_t *data = packet_->data;
+		size_t size = packet_->size;
+		bool keyframe = packet_->flags & AV_PKT_FLAG_KEY;
+		if (keyframe)
+		{
+			extract_parameter_sets(data, size, keyframe_, true);
+			if (!keyframe_.empty())
+				parameter_sets_.swap(keyframe_);
+			else if (!parameter_sets_.empty())
+			{
+				keyframe_ = parameter_sets_;
+				keyframe_.insert(keyframe_.end(), data, data + size);
+				data = keyframe_.data();
+				size = keyframe_.size();
+			}
+		}
+		output_ready_callback_(data, size, packet_->pts, keyframe);
+		av_packet_unref(packet_);
+	}
+}
+
+static Encoder *ndi_hevc_codec_create(VideoOptions *options, const StreamInfo &info)
+{
+	return new NdiHevcEncoder(options, info, options->Get().bitrate);
+}
+
+static RegisterEncoder reg("ndi_hevc", &ndi_hevc_codec_create);
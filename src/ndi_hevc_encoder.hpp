@@ -0,0 +1,100 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * ndi_hevc_encoder.hpp - HEVC video encoder for NDI|HX, through libavcodec.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "encoder/encoder.hpp"
+
+#include "spsc_ring.hpp"
+
+struct AVCodecContext;
+struct AVFrame;
+struct AVPacket;
+
+// The Pi 5 has no H.264 encoder block for NdiH264Encoder to use, and HEVC needs rather
+// less bandwidth anyway. This goes through libavcodec, taking a hardware HEVC encoder
+// (hevc_v4l2m2m) where the kernel has one, and otherwise libx265, tuned for latency: the
+// ultrafast preset with no lookahead and no B frames, and each frame split into slices
+// that the cores encode in parallel, so frames come out in the order they went in,
+// one for one. As with NdiH264Encoder, receivers can force a keyframe and the encoded
+// size comes from the stream, so the same class encodes the low resolution stream too.
+// The bitrate can be set while running, but neither encoder takes a new one on the fly,
+// so each change closes and reopens the codec and the stream starts again from a
+// keyframe. --ndi_intra_refresh has libx265 refresh a column of the picture in every
+// frame instead of sending keyframes.
+//
+// libavcodec copies each frame in as it's submitted, so camera buffers go back at once.
+// If the codec fails on the encode thread, the error is logged and the codec reopened
+// at the last bitrate that worked; frames go straight back to the camera until it is.
+
+class NdiHevcEncoder : public Encoder
+{
+public:
+	NdiHevcEncoder(VideoOptions const *options, StreamInfo const &info, Bitrate const &bitrate);
+	~NdiHevcEncoder();
+	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
+	// Make the next frame to be encoded an IDR frame. May be called from any thread.
+	void RequestKeyframe() { keyframe_requested_ = true; }
+	// Change the target bitrate from the next frame on. May be called from any thread.
+	void SetBitrate(unsigned int bitrate_bps) { bitrate_requested_ = bitrate_bps; }
+	// Frames handed to us that haven't yet gone back. May be called from any thread.
+	unsigned int Backlog() const { return backlog_; }
+
+	// The most frames waiting to be encoded, as many as NdiH264Encoder takes, so that the
+	// lores queue suits either.
+	static constexpr unsigned int MAX_QUEUED = 6;
+
+private:
+	// When nothing sets the bitrate.
+	static constexpr unsigned int DEFAULT_BITRATE_BPS = 8000000;
+	// Once this many frames are waiting to be encoded, we have fallen behind, and skip
+	// frames (which the camera gets straight back) until we catch up.
+	static constexpr unsigned int MAX_BACKLOG = 2;
+
+	// (Re)open the codec at this bitrate. The first frame after is a keyframe.
+	void openCodec(unsigned int bitrate_bps);
+	// The same, but for the encode thread: logs rather than throws, and returns false.
+	bool reopenCodec(unsigned int bitrate_bps);
+	void closeCodec();
+	void encodeThread();
+	void sendPackets();
+
+	std::string codec_name_;
+	StreamInfo info_;
+	unsigned int framerate_;
+	unsigned int intra_;
+	bool intra_refresh_;
+	// What the codec was last opened at.
+	unsigned int bitrate_bps_;
+	// So that a codec that keeps failing to reopen is only reported once.
+	bool codec_failed_;
+	AVCodecContext *ctx_;
+	AVFrame *frame_;
+	AVPacket *packet_;
+	// Some encoders only put the VPS, SPS and PPS in front of the first keyframe, and
+	// every keyframe needs them, so we keep them here.
+	std::vector<uint8_t> parameter_sets_;
+	std::vector<uint8_t> keyframe_;
+	std::atomic<bool> keyframe_requested_;
+	std::atomic<unsigned int> bitrate_requested_;
+	std::atomic<unsigned int> backlog_;
+
+	struct InputItem
+	{
+		void *mem;
+		int64_t timestamp_us;
+	};
+	// Filled by whoever calls EncodeBuffer, emptied by the encode thread.
+	SpscRing<InputItem> input_queue_;
+	std::atomic<bool> abort_;
+	std::thread encode_thread_;
+};
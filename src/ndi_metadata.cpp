@@ -0,0 +1,80 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * ndi_metadata.cpp - NDI metadata from receivers.
+ */
+
+#include <cmath>
+#include <cstdlib>
+
+#include "core/logging.hpp"
+
+#include "ndi_metadata.hpp"
+#include "thread_policy.hpp"
+
+std::string metadata_element(std::string const &xml)
+{
+	size_t start = xml.find('<');
+	if (start == std::string::npos)
+		return "";
+	size_t end = xml.find_first_of(" \t\r\n/>", start + 1);
+	return xml.substr(start + 1, end == std::string::npos ? std::string::npos : end - start - 1);
+}
+
+bool metadata_attribute(std::string const &xml, char const *name, std::string &value)
+{
+	std::string key = std::string(" ") + name + "=\"";
+	size_t start = xml.find(key);
+	if (start == std::string::npos)
+		return false;
+	start += key.size();
+	size_t end = xml.find('"', start);
+	if (end == std::string::npos)
+		return false;
+	value = xml.substr(start, end - start);
+	return true;
+}
+
+bool metadata_attribute(std::string const &xml, char const *name, float &value)
+{
+	std::string text;
+	if (!metadata_attribute(xml, name, text))
+		return false;
+	char *end;
+	float f = strtof(text.c_str(), &end);
+	if (end == text.c_str() || *end || !std::isfinite(f))
+		return false;
+	value = f;
+	return true;
+}
+
+NdiMetadata::NdiMetadata(NDIlib_send_instance_t send, MetadataCallback callback)
+	: send_(send), callback_(callback), abort_(false)
+{
+	metadata_thread_ = std::thread(&NdiMetadata::metadataThread, this);
+}
+
+NdiMetadata::~NdiMetadata()
+{
+	abort_ = true;
+	metadata_thread_.join();
+}
+
+void NdiMetadata::metadataThread()
+{
+	ThreadPolicy::Get().Apply(ThreadPolicy::OTHER, "ndi-metadata");
+	while (!abort_)
+	{
+		NDIlib_metadata_frame_t metadata;
+		// This blocks until something arrives, or the timeout expires.
+		if (NDIlib_send_capture(send_, &metadata, CAPTURE_TIMEOUT_MS) != NDIlib_frame_type_metadata)
+			continue;
+		if (metadata.p_data)
+		{
+			LOG(2, "NDI metadata: " << metadata.p_data);
+			callback_(metadata.p_data);
+		}
+		NDIlib_send_free_metadata(send_, &metadata);
+	}
+}
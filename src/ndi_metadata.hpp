@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * ndi_metadata.hpp - NDI metadata from receivers.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+
+#include <Processing.NDI.Lib.h>
+
+// Just enough XML for the single element messages receivers send, such as
+// <ntk_ptz_pan_tilt pan="0.5" tilt="-0.25"/>: the element's name, and its attributes.
+std::string metadata_element(std::string const &xml);
+bool metadata_attribute(std::string const &xml, char const *name, std::string &value);
+bool metadata_attribute(std::string const &xml, char const *name, float &value);
+
+// Receivers can send metadata back to a sender, such as PTZ commands, which only a
+// capture call on the sender picks up. This makes that call on its own thread, for as
+// long as the sender exists, and passes each message on. Only one thread may capture
+// from a sender, so everything that wants metadata goes through here (see
+// NdiOutput::AddMetadataHandler).
+
+class NdiMetadata
+{
+public:
+	typedef std::function<void(std::string const &xml)> MetadataCallback;
+
+	NdiMetadata(NDIlib_send_instance_t send, MetadataCallback callback);
+	~NdiMetadata();
+
+private:
+	// How long to block waiting for metadata before checking for shutdown.
+	static constexpr uint32_t CAPTURE_TIMEOUT_MS = 250;
+
+	void metadataThread();
+
+	NDIlib_send_instance_t send_;
+	MetadataCallback callback_;
+	std::atomic<bool> abort_;
+	std::thread metadata_thread_;
+};
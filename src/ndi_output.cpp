@@ -5,74 +5,685 @@
  * file_output.cpp - Write output to file.
  */
 
+#include <errno.h>
+#include <time.h>
+
+#include <chrono>
+#include <cstdlib>
+
+#include "core/logging.hpp"
+
+#include "flight_recorder.hpp"
+#include "fraction.hpp"
+#include "h264_bitstream.hpp"
 #include "ndi_output.hpp"
+#include "ndi_sender.hpp"
+#include "thread_policy.hpp"
+#include "timecode_clock.hpp"
+#include "yuv_convert.hpp"
 
-NdiOutput::NdiOutput(VideoOptions const *options, std::string neopixelPath)
-	: Output(options)
+int64_t NdiOutput::timecode(int64_t timestamp_us) const
 {
-    this->NDI_send_create_desc.p_ndi_name = "Video Feed";
-    this->pNDI_send = NDIlib_send_create(&NDI_send_create_desc);
-	if (!pNDI_send)
+	int64_t timecode = clock_->Timecode(timestamp_us);
+	if (!genlock_)
+		return timecode;
+
+	// Round to the nearest frame on a grid of frame periods from the epoch. Every unit
+	// agrees on the grid, so with synchronised sensors and wall clocks, frames captured
+	// together get the same timecode. Periods like 1001/30000s aren't a whole number of
+	// 100ns units, so this is done exactly, in pieces small enough not to overflow.
+	int64_t n = NDI_video_frame.frame_rate_N, d = NDI_video_frame.frame_rate_D;
+	int64_t p = 10000000LL * d; // frames per p is n
+	int64_t frame = timecode / p * n + ((timecode % p) * n + p / 2) / p;
+	return frame / n * p + (frame % n) * p / n;
+}
+
+void NdiOutput::waitForSendPhase(std::unique_lock<std::mutex> &lock, int64_t timecode) const
+{
+	if (!send_phase_us_)
+		return;
+
+	// Never wait more than a frame, whatever the clocks say.
+	int64_t now = clock_->Now();
+	int64_t target = timecode + send_phase_us_ * 10;
+	int64_t frame = 10000000LL * NDI_video_frame.frame_rate_D / NDI_video_frame.frame_rate_N;
+	if (target <= now || target - now > frame)
+		return;
+	// Audio, metadata and the hold carry on sending meanwhile.
+	lock.unlock();
+	clock_->SleepUntil(target);
+	lock.lock();
+}
+
+NdiOutput::NdiOutput(NDIOptions const *options)
+	: Output(options), ndi_name_(options->ndi_name), ndi_groups_(options->ndi_groups),
+	  send_config_(ndi_send_config(options->ndi_transport, options->ndi_discovery)),
+	  neopixel_path_(options->neopixel_path), frame_timestamp_us_(0),
+	  async_(options->ndi_async && options->Get().codec == "ndi"),
+	  fourcc_(NDIlib_FourCC_type_I420), framerate_(0), convert_index_(0),
+	  compressed_(options->Get().codec == "ndi_h264" || options->Get().codec == "ndi_hevc"),
+	  hevc_(options->Get().codec == "ndi_hevc"), speedhq_(options->Get().codec == "ndi_shq"),
+	  rate_control_(options->ndi_rate_control), quality_(0), last_quality_check_us_(0), holding_(false),
+	  last_frame_size_(0), last_timestamp_us_(0),
+	  hold_abort_(false), slate_after_us_(options->ndi_slate_seconds * 1000000), genlock_(options->ndi_genlock),
+	  send_phase_us_(options->ndi_send_phase.get<std::chrono::microseconds>())
+{
+	if (options->ndi_fourcc == "uyvy")
+		fourcc_ = NDIlib_FourCC_type_UYVY;
+	else if (options->ndi_fourcc == "nv12")
+		fourcc_ = NDIlib_FourCC_type_NV12;
+	else if (options->ndi_fourcc == "p216")
+		fourcc_ = NDIlib_FourCC_type_P216;
+
+	if (!NDIlib_initialize())
+		throw std::runtime_error("NDI is not supported on this CPU");
+
+	clock_ = std::make_unique<TimecodeClock>(options->ndi_ptp);
+	createSender();
+	// This outlives the sender, so that positions and presets survive SetSource.
+	if (options->ndi_ptz)
 	{
-		std::cerr << "Failed to create NDI Send" << std::endl;
-        exit(1);
+		ptz_ = std::make_unique<NdiPtz>(options->ndi_ptz_max_zoom);
+		AddMetadataHandler("ntk_ptz_", [this](std::string const &xml) { ptz_->Command(xml); },
+						   "<ntk_ptz enabled=\"true\"/>");
 	}
     // std::cout << "Width: " << options->width << " x Height: " << options->height << std::endl;
     this->NDI_video_frame.xres = options->Get().width;
     this->NDI_video_frame.yres = options->Get().height;
-    this->NDI_video_frame.FourCC = NDIlib_FourCC_type_I420;
+    this->NDI_video_frame.FourCC = fourcc_;
+	if (speedhq_)
+		NDI_video_frame.FourCC = (NDIlib_FourCC_video_type_e)NDIlib_FourCC_type_SHQ0_highest_bandwidth;
+    // Until we know the real stride (see SetStreamInfo), assume the rows are packed.
     this->NDI_video_frame.line_stride_in_bytes = options->Get().width;
     this->NDI_video_frame.frame_format_type = NDIlib_frame_format_type_progressive;
-    this->NDI_video_frame.picture_aspect_ratio = 16.0f/9.0f;
-    this->NDI_video_frame.frame_rate_N = 30000;
-    this->NDI_video_frame.frame_rate_D = 1001;
+    // Square pixels, until we know the real size.
+    this->NDI_video_frame.picture_aspect_ratio = 0;
+    // The camera's frame rate is only certain once frames arrive (see SetFrameRate).
+    fraction_t rate = findFraction(options->Get().framerate.value_or(30));
+    this->NDI_video_frame.frame_rate_N = rate.num;
+    this->NDI_video_frame.frame_rate_D = rate.den;
 
+	for (unsigned int i = 0; i < 2; i++)
+	{
+		CompressedStream &stream = compressed_streams_[i];
+		stream.low_bandwidth = i;
+		stream.bitrate_bps = 0;
+		stream.last_rate_check_us = 0;
+		stream.frame = NDI_video_frame;
+		if (speedhq_)
+			stream.frame.FourCC =
+				(NDIlib_FourCC_video_type_e)(stream.low_bandwidth ? NDIlib_FourCC_type_SHQ0_lowest_bandwidth
+																  : NDIlib_FourCC_type_SHQ0_highest_bandwidth);
+		else if (hevc_)
+			stream.frame.FourCC =
+				(NDIlib_FourCC_video_type_e)(stream.low_bandwidth ? NDIlib_FourCC_type_HEVC_lowest_bandwidth
+																  : NDIlib_FourCC_type_HEVC_highest_bandwidth);
+		else
+			stream.frame.FourCC =
+				(NDIlib_FourCC_video_type_e)(stream.low_bandwidth ? NDIlib_FourCC_type_H264_lowest_bandwidth
+																  : NDIlib_FourCC_type_H264_highest_bandwidth);
+		if (stream.low_bandwidth)
+		{
+			stream.frame.xres = options->Get().lores_width;
+			stream.frame.yres = options->Get().lores_height;
+		}
+	}
+
+	if (options->ndi_proxy)
+		proxy_ = std::make_unique<NdiProxy>(proxyName(), ndi_groups_, send_config_,
+											options->Get().framerate.value_or(30), options->ndi_proxy_fps);
+	watchConnections();
 
-    this->neopixelpath = neopixelPath;
+	if (options->ndi_audio)
+		audio_ = std::make_unique<NdiAudio>(options->Get().audio_device, options->Get().audio_channels,
+											options->Get().audio_samplerate,
+											options->Get().av_sync.get<std::chrono::microseconds>(),
+											std::bind(&NdiOutput::sendAudio, this, std::placeholders::_1));
+
+	Metrics &metrics = Metrics::Get();
+	frames_sent_[0] = &metrics.AddCounter("raspindi_ndi_frames_sent_total", "Frames sent to NDI", "stream=\"main\"");
+	frames_sent_[1] = &metrics.AddCounter("raspindi_ndi_frames_sent_total", "Frames sent to NDI", "stream=\"low\"");
+	proxy_frames_sent_ =
+		&metrics.AddCounter("raspindi_ndi_frames_sent_total", "Frames sent to NDI", "stream=\"proxy\"");
+	// The sender and tally are replaced under the send lock (see SetSource).
+	metrics.AddGaugeFunction("raspindi_ndi_connections", "Receivers connected to the NDI source and its proxy", [this] {
+		std::lock_guard<std::mutex> lock(send_mutex_);
+		return connections_->Count();
+	}, this);
+	metrics.AddGaugeFunction("raspindi_ndi_tally_program", "1 while the source is on program", [this] {
+		std::lock_guard<std::mutex> lock(send_mutex_);
+		return tally_->IsProgram();
+	}, this);
+	metrics.AddGaugeFunction("raspindi_ndi_tally_preview", "1 while the source is on preview", [this] {
+		std::lock_guard<std::mutex> lock(send_mutex_);
+		return tally_->IsPreview();
+	}, this);
 }
 
 NdiOutput::~NdiOutput()
 {
+	Metrics::Get().RemoveGaugeFunctions(this);
+	ReleaseFrame();
+	connections_.reset();
+	audio_.reset();
+	proxy_.reset();
+	flushAsync();
+	tally_.reset();
+	metadata_.reset();
+	NDIlib_send_destroy(pNDI_send);
+	NDIlib_destroy();
+}
+
+void NdiOutput::createSender()
+{
+    this->NDI_send_create_desc.p_ndi_name = ndi_name_.c_str();
+    this->NDI_send_create_desc.p_groups = ndi_groups_.empty() ? NULL : ndi_groups_.c_str();
+    // Frames are already paced by the camera, so don't let NDI block us to clock them.
+    this->NDI_send_create_desc.clock_video = false;
+    this->pNDI_send = ndi_send_create(NDI_send_create_desc, send_config_);
+	if (!pNDI_send)
+		throw std::runtime_error("failed to create NDI sender " + ndi_name_);
+	tally_ = std::make_unique<NdiTally>(pNDI_send, neopixel_path_, [this](NdiTally::State state) {
+		if (tally_callback_)
+			tally_callback_(state);
+	});
+	{
+		std::lock_guard<std::mutex> lock(metadata_mutex_);
+		for (auto const &capability : capabilities_)
+			advertise(capability);
+	}
+	metadata_ = std::make_unique<NdiMetadata>(pNDI_send,
+											  std::bind(&NdiOutput::dispatchMetadata, this, std::placeholders::_1));
+}
+
+void NdiOutput::advertise(std::string const &capability)
+{
+	NDIlib_metadata_frame_t frame;
+	frame.length = 0;
+	frame.timecode = NDIlib_send_timecode_synthesize;
+	frame.p_data = const_cast<char *>(capability.c_str());
+	NDIlib_send_add_connection_metadata(pNDI_send, &frame);
+}
+
+void NdiOutput::AddMetadataHandler(std::string const &prefix, MetadataHandler handler, std::string const &capability)
+{
+	std::lock_guard<std::mutex> send_lock(send_mutex_);
+	std::lock_guard<std::mutex> lock(metadata_mutex_);
+	metadata_handlers_.push_back({ prefix, handler });
+	if (!capability.empty())
+	{
+		capabilities_.push_back(capability);
+		advertise(capability);
+	}
+}
+
+void NdiOutput::dispatchMetadata(std::string const &xml)
+{
+	std::string name = metadata_element(xml);
+	std::lock_guard<std::mutex> lock(metadata_mutex_);
+	for (auto const &[prefix, handler] : metadata_handlers_)
+	{
+		if (name.rfind(prefix, 0) == 0)
+			handler(xml);
+	}
+}
+
+void NdiOutput::watchConnections()
+{
+	std::vector<NDIlib_send_instance_t> sends = { pNDI_send };
+	if (proxy_)
+		sends.push_back(proxy_->Sender());
+	connections_ = std::make_unique<NdiConnections>(sends, [this](bool connected) {
+		if (connection_callback_)
+			connection_callback_(connected);
+	});
+}
+
+std::string NdiOutput::proxyName() const
+{
+	return ndi_name_ + " (proxy)";
+}
+
+void NdiOutput::SetSource(NDIOptions const *options)
+{
+	std::lock_guard<std::mutex> lock(send_mutex_);
+	connections_.reset();
+	flushAsync();
+	tally_.reset();
+	metadata_.reset();
+	NDIlib_send_destroy(pNDI_send);
+
+	ndi_name_ = options->ndi_name;
+	ndi_groups_ = options->ndi_groups;
+	send_config_ = ndi_send_config(options->ndi_transport, options->ndi_discovery);
+	neopixel_path_ = options->neopixel_path;
+	createSender();
+	renderSlate();
+	if (proxy_)
+		proxy_->SetSource(proxyName(), ndi_groups_, send_config_);
+	// Receivers will be looking for the new source, so give them time to find it.
+	watchConnections();
+	if (connection_callback_)
+		connection_callback_(true);
+	LOG(1, "NDI source is now " << ndi_name_ << (ndi_groups_.empty() ? "" : " in groups " + ndi_groups_));
+
+	// New receivers of the compressed streams start from a keyframe.
+	if (compressed_ && keyframe_request_callback_)
+	{
+		keyframe_request_callback_(false);
+		keyframe_request_callback_(true);
+	}
+}
+
+void NdiOutput::Flush()
+{
+	std::lock_guard<std::mutex> lock(send_mutex_);
+	flushAsync();
+}
+
+void NdiOutput::SetStreamInfo(StreamInfo const &info)
+{
+	// A restart may be reconfiguring the camera underneath the hold.
+	std::lock_guard<std::mutex> lock(send_mutex_);
+	if (holding_)
+	{
+		flushAsync();
+		if (info.width != info_.width || info.height != info_.height || info.stride != info_.stride)
+			held_frame_.clear();
+	}
+	// The last frame sent came from a camera (or encoder) buffer that has gone with the
+	// old configuration, so a hold must not copy it.
+	NDI_video_frame.p_data = nullptr;
+	last_frame_size_ = 0;
+
+	// libcamera pads each row to suit the ISP, and NDI finds our I420 chroma planes by
+	// assuming they follow the luma at half its stride, which is how libcamera lays them
+	// out too. So the camera buffer goes out as it is, whatever the sensor mode.
+	NDI_video_frame.xres = info.width;
+	NDI_video_frame.yres = info.height;
+	NDI_video_frame.line_stride_in_bytes = info.stride;
+	info_ = info;
+
+	// Converted frames we pack tightly ourselves.
+	size_t convert_size = 0;
+	if (fourcc_ == NDIlib_FourCC_type_UYVY)
+	{
+		NDI_video_frame.line_stride_in_bytes = info.width * 2;
+		convert_size = info.width * 2 * info.height;
+	}
+	else if (fourcc_ == NDIlib_FourCC_type_NV12)
+	{
+		NDI_video_frame.line_stride_in_bytes = info.width;
+		convert_size = info.width * info.height * 3 / 2;
+	}
+	else if (fourcc_ == NDIlib_FourCC_type_P216)
+	{
+		NDI_video_frame.line_stride_in_bytes = info.width * 2;
+		convert_size = info.width * 2 * info.height * 2;
+	}
+	for (auto &buffer : convert_buffers_)
+		buffer.resize(convert_size);
+	LOG(2, "NDI frames are " << info.width << "x" << info.height << " stride " << info.stride);
+
+	// Our pixels are square, whatever the mode.
+	NDI_video_frame.picture_aspect_ratio = (float)info.width / info.height;
+
+	compressed_streams_[0].frame.xres = info.width;
+	compressed_streams_[0].frame.yres = info.height;
+	compressed_streams_[0].frame.picture_aspect_ratio = NDI_video_frame.picture_aspect_ratio;
+	renderSlate();
+}
+
+void NdiOutput::renderSlate()
+{
+	if (compressed_ || speedhq_ || !info_.width)
+		return;
+	bool full_range = info_.colour_space && info_.colour_space->range == libcamera::ColorSpace::Range::Full;
+	slate_.Render(fourcc_, info_.width, info_.height, NDI_video_frame.line_stride_in_bytes, ndi_name_, full_range);
+}
+
+void NdiOutput::SetLoresStreamInfo(StreamInfo const &info)
+{
+	compressed_streams_[1].frame.xres = info.width;
+	compressed_streams_[1].frame.yres = info.height;
+	compressed_streams_[1].frame.picture_aspect_ratio = (float)info.width / info.height;
+	if (proxy_)
+		proxy_->SetStreamInfo(info);
+}
+
+void NdiOutput::SetFrameRate(float framerate)
+{
+	if (proxy_)
+		proxy_->SetFrameRate(framerate);
+	if (!(framerate > 0))
+		return;
+	// The frames' rates are read as they are sent, so everything here is under the send lock.
+	std::lock_guard<std::mutex> lock(send_mutex_);
+	if (framerate == framerate_)
+		return;
+	framerate_ = framerate;
+
+	// Small wobbles in the frame duration come out as the same fraction.
+	fraction_t rate = findFraction(framerate);
+	if (rate.num == NDI_video_frame.frame_rate_N && rate.den == NDI_video_frame.frame_rate_D)
+		return;
+
+	NDI_video_frame.frame_rate_N = rate.num;
+	NDI_video_frame.frame_rate_D = rate.den;
+	for (auto &stream : compressed_streams_)
+	{
+		stream.frame.frame_rate_N = rate.num;
+		stream.frame.frame_rate_D = rate.den;
+	}
+	LOG(1, "NDI frame rate now " << rate.num << "/" << rate.den);
+}
+
+void NdiOutput::Signal()
+{
+	Flush();
+	Output::Signal();
+}
+
+void NdiOutput::FrameReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe)
+{
+	// OutputReady calls outputBuffer on this same thread before it returns.
+	frame_timestamp_us_ = timestamp_us;
+	FlightRecorder::Get().Record(FlightEvent::ENCODE_END, timestamp_us, size, 0);
+	OutputReady(mem, size, timestamp_us, keyframe);
+}
+
+void NdiOutput::SendMetadata(std::string const &xml, int64_t timestamp_us)
+{
+	NDIlib_metadata_frame_t frame;
+	frame.length = 0;
+	frame.timecode = timecode(timestamp_us);
+	frame.p_data = const_cast<char *>(xml.c_str());
+	std::lock_guard<std::mutex> lock(send_mutex_);
+	NDIlib_send_send_metadata(pNDI_send, &frame);
+}
+
+void NdiOutput::ProxyFrameReady(void *mem, int64_t timestamp_us)
+{
+	proxy_->Send(mem, timecode(timestamp_us));
+	proxy_frames_sent_->Inc();
+}
+
+void NdiOutput::LowBandwidthReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe)
+{
+	FlightRecorder::Get().Record(FlightEvent::ENCODE_END, timestamp_us, size, 1);
+	if (speedhq_)
+		sendSpeedHqLowBandwidth(mem, size, timestamp_us);
+	else
+		sendCompressed(compressed_streams_[1], mem, size, timestamp_us, keyframe);
+}
+
+void NdiOutput::sendSpeedHqLowBandwidth(void *mem, size_t size, int64_t timestamp_us)
+{
+	// As a main stream SpeedHQ frame, but at the lores size. There's no hold for this one.
+	std::lock_guard<std::mutex> lock(send_mutex_);
+	CompressedStream &stream = compressed_streams_[1];
+	stream.frame.timecode = timecode(timestamp_us);
+	stream.frame.p_data = (uint8_t *)mem;
+	stream.frame.data_size_in_bytes = size;
+	FlightRecorder::Get().Record(FlightEvent::SEND_START, timestamp_us, 0, 1);
+	NDIlib_send_send_video_v2(pNDI_send, &stream.frame);
+	FlightRecorder::Get().Record(FlightEvent::SEND_END, timestamp_us, 0, 1);
+	frames_sent_[1]->Inc();
 }
 
 void NdiOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
 {
-    this->NDI_video_frame.p_data = (uint8_t*)mem;
-    NDIlib_send_send_video_v2(this->pNDI_send, &this->NDI_video_frame);
-    NDIlib_tally_t NDI_tally;
-    NDIlib_send_get_tally(this->pNDI_send, &NDI_tally, 0);
-
-    char pixelStatus;
-    std::ofstream neopixel;
-
-    std::cout << "PGM: " << NDI_tally.on_program << " PVW: " << NDI_tally.on_preview << std::endl;
-
-    if(NDI_tally.on_program)
-    {
-        neopixel.open(neopixelpath);
-        neopixel << "L";
-        neopixel.close();
-    }
-    else if (NDI_tally.on_preview)
-    {
-        neopixel.open(neopixelpath);
-        neopixel << "P";
-        neopixel.close();
-    }
-    else
-    {
-        neopixel.open(neopixelpath);
-        neopixel << "N";
-        neopixel.close();
-    }
+	if (compressed_)
+	{
+		if (flags & FLAG_KEYFRAME)
+		{
+			std::lock_guard<std::mutex> lock(send_mutex_);
+			if (!holding_)
+				held_frame_.assign((uint8_t const *)mem, (uint8_t const *)mem + size);
+		}
+		last_timestamp_us_ = frame_timestamp_us_;
+		sendCompressed(compressed_streams_[0], mem, size, frame_timestamp_us_, flags & FLAG_KEYFRAME);
+		return;
+	}
+
+	std::unique_lock<std::mutex> lock(send_mutex_);
+	int64_t frame_timecode = timecode(frame_timestamp_us_);
+	waitForSendPhase(lock, frame_timecode);
+	NDI_video_frame.timecode = frame_timecode;
+	last_timestamp_us_ = frame_timestamp_us_;
+	last_frame_size_ = fourcc_ == NDIlib_FourCC_type_I420 ? size : convert_buffers_[0].size();
+    this->NDI_video_frame.p_data = fourcc_ == NDIlib_FourCC_type_I420 ? (uint8_t*)mem : convert((uint8_t const *)mem);
+	if (speedhq_)
+		NDI_video_frame.data_size_in_bytes = size;
+	// An async send returns at once, and NDI reads the buffer until the next submission.
+	FlightRecorder::Get().Record(FlightEvent::SEND_START, frame_timestamp_us_, 0, 0);
+	if (async_)
+		NDIlib_send_send_video_async_v2(this->pNDI_send, &this->NDI_video_frame);
+	else
+		NDIlib_send_send_video_v2(this->pNDI_send, &this->NDI_video_frame);
+	FlightRecorder::Get().Record(FlightEvent::SEND_END, frame_timestamp_us_, 0, 0);
+	frames_sent_[0]->Inc();
+	if (speedhq_)
+		checkQuality(frame_timestamp_us_);
 }
 
+void NdiOutput::HoldFrame()
+{
+	{
+		std::lock_guard<std::mutex> lock(send_mutex_);
+		if (holding_)
+			return;
+		holding_ = true;
+		// The last frame is still there, as NDI (or the encoder) hasn't given it back yet,
+		// but it belongs to the camera (or for SpeedHQ, the encoder), which is about to be
+		// restarted.
+		if (!compressed_)
+		{
+			if (NDI_video_frame.p_data && last_frame_size_)
+				held_frame_.assign(NDI_video_frame.p_data, NDI_video_frame.p_data + last_frame_size_);
+			else
+				held_frame_.clear();
+			flushAsync();
+		}
+	}
+	LOG(1, "Holding the last NDI frame");
+	FlightRecorder::Get().Record(FlightEvent::HOLD, 0, 1);
+	hold_abort_ = false;
+	hold_thread_ = std::thread(&NdiOutput::holdThread, this);
+}
+
+void NdiOutput::ReleaseFrame()
+{
+	if (!hold_thread_.joinable())
+		return;
+	hold_abort_ = true;
+	hold_thread_.join();
+	std::lock_guard<std::mutex> lock(send_mutex_);
+	holding_ = false;
+	LOG(1, "Released the held NDI frame");
+	FlightRecorder::Get().Record(FlightEvent::HOLD, 0, 0);
+}
+
+void NdiOutput::holdThread()
+{
+	ThreadPolicy::Get().Apply(ThreadPolicy::SEND, "ndi-hold");
+	int64_t period_us;
+	{
+		std::lock_guard<std::mutex> lock(send_mutex_);
+		period_us = 1000000LL * NDI_video_frame.frame_rate_D / NDI_video_frame.frame_rate_N;
+	}
+	// Carry on the timestamps from the last real frame, so that nothing goes backwards.
+	int64_t last_timestamp_us = last_timestamp_us_;
+	auto start = std::chrono::steady_clock::now();
+	bool slate = false;
+	for (unsigned int count = 1; !hold_abort_; count++)
+	{
+		std::this_thread::sleep_until(start + std::chrono::microseconds(count * period_us));
+		if (hold_abort_)
+			continue;
+		int64_t timestamp_us = last_timestamp_us + count * period_us;
+
+		// A restart can clear the held frame (see SetStreamInfo).
+		std::lock_guard<std::mutex> lock(send_mutex_);
+		if (compressed_)
+		{
+			if (!held_frame_.empty())
+				sendCompressedLocked(compressed_streams_[0], held_frame_.data(), held_frame_.size(), timestamp_us,
+									 timecode(timestamp_us), true);
+			continue;
+		}
+
+		if (!slate && (held_frame_.empty() || count * period_us >= slate_after_us_) && !slate_.Empty())
+		{
+			LOG(1, "Sending the NO SIGNAL slate");
+			slate = true;
+		}
+		if (!slate && held_frame_.empty())
+			continue;
+		NDIlib_video_frame_v2_t frame = NDI_video_frame;
+		frame.timecode = timecode(timestamp_us);
+		frame.p_data = slate ? slate_.Data() : held_frame_.data();
+		if (speedhq_)
+			frame.data_size_in_bytes = held_frame_.size();
+		// The same buffer every time, which nothing writes to while we hold, so it can go
+		// out asynchronously as camera frames do.
+		if (async_)
+			NDIlib_send_send_video_async_v2(pNDI_send, &frame);
+		else
+			NDIlib_send_send_video_v2(pNDI_send, &frame);
+	}
+}
+
+void NdiOutput::sendAudio(NDIlib_audio_frame_interleaved_16s_t const *frame)
+{
+	// Audio is stamped on the monotonic clock, like buffer timestamps.
+	NDIlib_audio_frame_interleaved_16s_t stamped = *frame;
+	stamped.timecode = clock_->Timecode(frame->timecode / 10);
+	std::lock_guard<std::mutex> lock(send_mutex_);
+	NDIlib_util_send_send_audio_interleaved_16s(pNDI_send, &stamped);
+}
+
+void NdiOutput::flushAsync()
+{
+	// Submitting a NULL frame waits until NDI has released any frame sent asynchronously.
+	if (async_)
+		NDIlib_send_send_video_async_v2(this->pNDI_send, NULL);
+}
+
+uint8_t *NdiOutput::convert(uint8_t const *mem)
+{
+	uint8_t *dst = convert_buffers_[convert_index_].data();
+	convert_index_ = (convert_index_ + 1) % 2;
+
+	if (fourcc_ == NDIlib_FourCC_type_UYVY)
+		yuv420_to_uyvy(mem, info_.width, info_.height, info_.stride, dst, NDI_video_frame.line_stride_in_bytes);
+	else if (fourcc_ == NDIlib_FourCC_type_P216)
+		rgb48_to_p216(mem, info_.width, info_.height, info_.stride, dst, NDI_video_frame.line_stride_in_bytes);
+	else
+		yuv420_to_nv12(mem, info_.width, info_.height, info_.stride, dst, NDI_video_frame.line_stride_in_bytes);
+	return dst;
+}
+
+void NdiOutput::sendCompressed(CompressedStream &stream, void *mem, size_t size, int64_t timestamp_us, bool keyframe)
+{
+	// The two streams are sent from their encoders' output threads.
+	std::unique_lock<std::mutex> lock(send_mutex_);
+	int64_t frame_timecode = timecode(timestamp_us);
+	waitForSendPhase(lock, frame_timecode);
+	sendCompressedLocked(stream, mem, size, timestamp_us, frame_timecode, keyframe);
+}
+
+void NdiOutput::sendCompressedLocked(CompressedStream &stream, void const *mem, size_t size, int64_t timestamp_us,
+									 int64_t timecode, bool keyframe)
+{
+#ifdef NDI_ADVANCED_SDK
+	if (keyframe)
+		extract_parameter_sets((uint8_t const *)mem, size, stream.parameter_sets, hevc_);
+
+	NDIlib_compressed_packet_t packet;
+	packet.fourCC = hevc_ ? NDIlib_compressed_FourCC_type_HEVC : NDIlib_compressed_FourCC_type_H264;
+	packet.pts = packet.dts = timestamp_us * 10; // NDI works in 100ns units
+	stream.frame.timecode = timecode;
+	packet.flags = keyframe ? NDIlib_compressed_packet_t::flags_keyframe : NDIlib_compressed_packet_t::flags_none;
+	packet.data_size = size;
+	packet.extra_data_size = keyframe ? stream.parameter_sets.size() : 0;
+
+	// Send the header, bitstream and extra data as separate blocks, so that the
+	// bitstream never needs copying.
+	uint8_t *blocks[] = { (uint8_t *)&packet, (uint8_t *)mem, stream.parameter_sets.data(), nullptr };
+	int block_sizes[] = { (int)sizeof(packet), (int)size, (int)packet.extra_data_size, 0 };
+	if (!packet.extra_data_size)
+		blocks[2] = nullptr;
+	NDIlib_frame_scatter_t scatter = { blocks, block_sizes };
+
+	stream.frame.data_size_in_bytes = sizeof(packet) + size + packet.extra_data_size;
+	FlightRecorder::Get().Record(FlightEvent::SEND_START, timestamp_us, 0, stream.low_bandwidth);
+	NDIlib_send_send_video_scatter(pNDI_send, &stream.frame, &scatter);
+	FlightRecorder::Get().Record(FlightEvent::SEND_END, timestamp_us, 0, stream.low_bandwidth);
+	frames_sent_[stream.low_bandwidth]->Inc();
+
+	// Receivers that have just connected need a keyframe before they can decode anything.
+	if (NDIlib_send_wait_for_keyframe_request(pNDI_send, 0, &stream.frame) &&
+		NDIlib_send_is_keyframe_required(pNDI_send, &stream.frame) && keyframe_request_callback_)
+	{
+		LOG(2, "NDI receiver requested a " << (stream.low_bandwidth ? "low" : "high") << " bandwidth keyframe");
+		keyframe_request_callback_(stream.low_bandwidth);
+	}
+
+	checkBitrate(stream, timestamp_us);
+#else
+	throw std::runtime_error("compressed NDI needs raspindi built with the NDI Advanced SDK");
+#endif
+}
+
+void NdiOutput::checkBitrate(CompressedStream &stream, int64_t timestamp_us)
+{
+#ifdef NDI_ADVANCED_SDK
+	if (!rate_control_ || !bitrate_callback_ || timestamp_us - stream.last_rate_check_us < RATE_CHECK_INTERVAL_US)
+		return;
+	stream.last_rate_check_us = timestamp_us;
+
+	// NDI's target accounts for what the connected receivers are actually asking for. The
+	// q factor only means anything for SpeedHQ (it is -1 for H.264), so we leave the
+	// encoder's quantiser to its own rate control.
+	int bitrate_bps = NDIlib_send_get_target_bit_rate(pNDI_send, &stream.frame);
+	if (bitrate_bps <= 0 || bitrate_bps == stream.bitrate_bps)
+		return;
+
+	// Ignore small wobbles, reprogramming the encoder isn't free.
+	if (stream.bitrate_bps && std::abs(bitrate_bps - stream.bitrate_bps) < stream.bitrate_bps / 10)
+		return;
+
+	LOG(1, "NDI target bitrate for the " << (stream.low_bandwidth ? "low" : "high") << " bandwidth stream now "
+										<< bitrate_bps / 1000 << "kbps");
+	stream.bitrate_bps = bitrate_bps;
+	bitrate_callback_(stream.low_bandwidth, bitrate_bps);
+#endif
+}
+
+void NdiOutput::checkQuality(int64_t timestamp_us)
+{
+#ifdef NDI_ADVANCED_SDK
+	// With send_mutex_ held.
+	if (!quality_callback_ || timestamp_us - last_quality_check_us_ < RATE_CHECK_INTERVAL_US)
+		return;
+	last_quality_check_us_ = timestamp_us;
+
+	// As with the bitrate, NDI picks this from what the receivers want, and the resolution.
+	int quality = NDIlib_send_get_q_factor(pNDI_send, &NDI_video_frame);
+	if (quality < 0 || quality == quality_)
+		return;
+	LOG(2, "NDI SpeedHQ quality now " << quality);
+	quality_ = quality;
+	quality_callback_(quality);
+#endif
+}
 
 bool NdiOutput::isProgram()
 {
-    return this->program;
+	return tally_->IsProgram();
 }
 bool NdiOutput::isPreview()
 {
-    return this->preview;
+	return tally_->IsPreview();
 }
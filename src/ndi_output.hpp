@@ -7,15 +7,110 @@
 
 #pragma once
 
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <core/stream_info.hpp>
 #include <output/output.hpp>
 #include <Processing.NDI.Embedded.h>
 
+#include "metrics.hpp"
+#include "ndi_audio.hpp"
+#include "ndi_connections.hpp"
+#include "ndi_metadata.hpp"
+#include "ndi_options.hpp"
+#include "ndi_proxy.hpp"
+#include "ndi_ptz.hpp"
+#include "ndi_slate.hpp"
+#include "ndi_tally.hpp"
+#include "timecode_clock.hpp"
+
 class NdiOutput : public Output
 {
 public:
-	NdiOutput(VideoOptions const *options, std::string neopixelPath);
+	NdiOutput(NDIOptions const *options);
 	~NdiOutput();
 
+	// Describe frames exactly as the camera's video and lores streams deliver them. Call
+	// these once the camera is configured, and before it starts.
+	void SetStreamInfo(StreamInfo const &info);
+	void SetLoresStreamInfo(StreamInfo const &info);
+
+	// Advertise the rate frames are really arriving at, normally CompletedRequest::framerate.
+	// Receivers that frame-sync to it would otherwise duplicate or drop frames. Cheap to
+	// call every frame, as nothing happens unless the rate changes.
+	void SetFrameRate(float framerate);
+
+	// Republish under the options' new name, groups, transport or discovery servers, by
+	// recreating the NDI sender (and the proxy's). Receivers will see the old source go away
+	// and the new one appear.
+	void SetSource(NDIOptions const *options);
+
+	// Wait until NDI has released any camera buffer sent asynchronously.
+	void Flush();
+
+	// Use this rather than Output::OutputReady, which rebases timestamps to zero before
+	// outputBuffer sees them. NDI wants the capture time, to keep audio and video in sync.
+	void FrameReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe);
+
+	// While the camera is being recovered or restarted, keep sending a copy of the last
+	// frame (for NDI|HX, the last keyframe) at the frame rate, so that receivers see a
+	// freeze rather than the source going away. Uncompressed, the freeze gives way to the
+	// slate after --ndi_slate_seconds. Call ReleaseFrame once real frames are coming again.
+	void HoldFrame();
+	void ReleaseFrame();
+
+	// Pausing or resuming must not leave NDI holding on to a camera buffer.
+	void Signal() override;
+
+	// The "<name> (proxy)" source (--ndi_proxy), fed from the lores stream. Check that the
+	// proxy wants a frame before passing it one.
+	bool ProxyDue(int64_t timestamp_us) { return proxy_ && proxy_->Due(timestamp_us); }
+	void ProxyFrameReady(void *mem, int64_t timestamp_us);
+
+	// Send an XML metadata element to receivers, stamped with the frame's timecode.
+	void SendMetadata(std::string const &xml, int64_t timestamp_us);
+
+	// Compressed (NDI|HX, or SpeedHQ) frames from the low bandwidth encoder, which runs
+	// outside the normal Output state machine.
+	void LowBandwidthReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe);
+
+	// Called when a receiver needs a keyframe on the high (false) or low (true) bandwidth
+	// stream.
+	typedef std::function<void(bool low_bandwidth)> KeyframeRequestCallback;
+	void SetKeyframeRequestCallback(KeyframeRequestCallback callback) { keyframe_request_callback_ = callback; }
+
+	// Called when NDI wants a different bitrate on the high (false) or low (true) bandwidth
+	// stream, for example because receivers have switched between the two.
+	typedef std::function<void(bool low_bandwidth, unsigned int bitrate_bps)> BitrateCallback;
+	void SetBitrateCallback(BitrateCallback callback) { bitrate_callback_ = callback; }
+
+	// Called when NDI wants SpeedHQ frames (--codec ndi_shq) at a different quality, from
+	// 0 to 100.
+	typedef std::function<void(int quality)> QualityCallback;
+	void SetQualityCallback(QualityCallback callback) { quality_callback_ = callback; }
+
+	// Called, from another thread, when the first receiver connects to the source or its
+	// proxy, or the last one has gone (see ndi_connections.hpp).
+	void SetConnectionCallback(NdiConnections::ConnectionCallback callback) { connection_callback_ = callback; }
+	// Called, from another thread, whenever the source goes on or off program or preview.
+	void SetTallyCallback(NdiTally::TallyCallback callback) { tally_callback_ = callback; }
+	bool HasReceivers() const { return !connections_ || connections_->Connected(); }
+
+	// Pass metadata from receivers whose element name starts with prefix to the handler, on
+	// another thread. A capability, if given, is advertised to every receiver as it
+	// connects. Both stay through SetSource.
+	typedef NdiMetadata::MetadataCallback MetadataHandler;
+	void AddMetadataHandler(std::string const &prefix, MetadataHandler handler, std::string const &capability = "");
+
+	// Digital PTZ driven by receivers (--ndi_ptz), or null.
+	NdiPtz *Ptz() { return ptz_.get(); }
+
     bool isProgram();
     bool isPreview();
 
@@ -23,11 +118,116 @@ protected:
 	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
 
 private:
-    NDIlib_tally_t NDI_tally;
+	struct CompressedStream
+	{
+		NDIlib_video_frame_v2_t frame;
+		// SPS/PPS from the latest keyframe, sent as the packet's extra data.
+		std::vector<uint8_t> parameter_sets;
+		bool low_bandwidth;
+		// The bitrate NDI last asked for, and when we last asked.
+		int bitrate_bps;
+		int64_t last_rate_check_us;
+	};
+
+	// How often to ask NDI for the bitrate it wants. Encoders only reach a new rate
+	// gradually, so polling faster than this just makes them hunt.
+	static constexpr int64_t RATE_CHECK_INTERVAL_US = 1000000;
+
+	void createSender();
+	void watchConnections();
+	void advertise(std::string const &capability);
+	void dispatchMetadata(std::string const &xml);
+	// The NDI timecode (in 100ns units) for a frame timestamp, on the genlock grid if
+	// there is one.
+	int64_t timecode(int64_t timestamp_us) const;
+	// Sleep until the send phase comes round for the timecode, with send_mutex_ held by
+	// lock, but released while we sleep.
+	void waitForSendPhase(std::unique_lock<std::mutex> &lock, int64_t timecode) const;
+	std::string proxyName() const;
+	void sendAudio(NDIlib_audio_frame_interleaved_16s_t const *frame);
+	void flushAsync();
+	// Repack the camera's YUV420 into the next pool buffer, for any format but I420.
+	uint8_t *convert(uint8_t const *mem);
+	void sendCompressed(CompressedStream &stream, void *mem, size_t size, int64_t timestamp_us, bool keyframe);
+	// As sendCompressed, but straight away. Hold send_mutex_.
+	void sendCompressedLocked(CompressedStream &stream, void const *mem, size_t size, int64_t timestamp_us,
+							  int64_t timecode, bool keyframe);
+	void sendSpeedHqLowBandwidth(void *mem, size_t size, int64_t timestamp_us);
+	void checkBitrate(CompressedStream &stream, int64_t timestamp_us);
+	void checkQuality(int64_t timestamp_us);
+	void holdThread();
+	// Bring the slate up to date with the frame format and source name. Hold send_mutex_.
+	void renderSlate();
+
+	std::string ndi_name_;
+	std::string ndi_groups_;
+	// See ndi_sender.hpp.
+	std::string send_config_;
+	std::string neopixel_path_;
     NDIlib_send_create_t NDI_send_create_desc;
     NDIlib_send_instance_t pNDI_send;
     NDIlib_video_frame_v2_t NDI_video_frame;
-    bool preview;
-    bool program;
-    std::string neopixelpath;
+	std::unique_ptr<NdiTally> tally_;
+	std::unique_ptr<NdiAudio> audio_;
+	std::unique_ptr<NdiProxy> proxy_;
+	std::unique_ptr<NdiPtz> ptz_;
+	// Replaced with the sender, unlike the handlers and capabilities.
+	std::unique_ptr<NdiMetadata> metadata_;
+	std::mutex metadata_mutex_;
+	std::vector<std::pair<std::string, MetadataHandler>> metadata_handlers_;
+	std::vector<std::string> capabilities_;
+	// Watches the sender and the proxy's, so is replaced with them.
+	std::unique_ptr<NdiConnections> connections_;
+	NdiConnections::ConnectionCallback connection_callback_;
+	NdiTally::TallyCallback tally_callback_;
+	// The capture timestamp of the frame OutputReady is passing to outputBuffer.
+	int64_t frame_timestamp_us_;
+	// Async sends are only possible with the "ndi" codec, whose NdiEncoder keeps each
+	// camera buffer until the following frame has been sent (see ndi_encoder.hpp).
+	bool async_;
+	// The pixel format we send uncompressed frames in. Anything but I420 is converted into
+	// one of two pool buffers, as an async send still owns the previous one.
+	NDIlib_FourCC_video_type_e fourcc_;
+	StreamInfo info_;
+	float framerate_;
+	std::vector<uint8_t> convert_buffers_[2];
+	unsigned int convert_index_;
+	bool compressed_;
+	// Compressed streams are HEVC rather than H.264.
+	bool hevc_;
+	// Frames come already compressed to SpeedHQ, and go out as uncompressed ones do but
+	// for their size, which takes the place of the stride.
+	bool speedhq_;
+	CompressedStream compressed_streams_[2];
+	// Held while sending, so that the sender can be replaced underneath the encoders'
+	// output threads.
+	std::mutex send_mutex_;
+	KeyframeRequestCallback keyframe_request_callback_;
+	bool rate_control_;
+	BitrateCallback bitrate_callback_;
+	QualityCallback quality_callback_;
+	// The SpeedHQ quality NDI last asked for, and when we last asked.
+	int quality_;
+	int64_t last_quality_check_us_;
+	// The frame being held (see HoldFrame), and what it takes to send it again. We keep
+	// each keyframe of a compressed stream as it goes, as that's all that can be resent.
+	// Other frames are only copied as the hold starts, SpeedHQ ones from the packet the
+	// encoder keeps until its next.
+	bool holding_;
+	std::vector<uint8_t> held_frame_;
+	size_t last_frame_size_;
+	std::atomic<int64_t> last_timestamp_us_;
+	std::atomic<bool> hold_abort_;
+	std::thread hold_thread_;
+	// Sent by the hold in place of the last frame, once that's been held for
+	// slate_after_us_, or if there is no last frame. Uncompressed only, so not SpeedHQ.
+	NdiSlate slate_;
+	int64_t slate_after_us_;
+	// See --ndi_ptp, --ndi_genlock and --ndi_send_phase.
+	std::unique_ptr<TimecodeClock> clock_;
+	bool genlock_;
+	int64_t send_phase_us_;
+	// Frames sent on the main and low bandwidth streams, and to the proxy.
+	Metrics::Counter *frames_sent_[2];
+	Metrics::Counter *proxy_frames_sent_;
 };
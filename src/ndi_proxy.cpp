@@ -0,0 +1,121 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * ndi_proxy.cpp - a second, low resolution NDI source from the lores stream.
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#include "core/logging.hpp"
+
+#include "fraction.hpp"
+#include "ndi_proxy.hpp"
+#include "ndi_sender.hpp"
+
+NdiProxy::NdiProxy(std::string const &name, std::string const &groups, std::string const &send_config,
+				   float framerate, float max_framerate)
+	: name_(name), groups_(groups), send_config_(send_config), max_framerate_(max_framerate), buffer_index_(0),
+	  framerate_(0), interval_us_(0), next_due_us_(0)
+{
+	createSender();
+	frame_.FourCC = NDIlib_FourCC_type_I420;
+	frame_.frame_format_type = NDIlib_frame_format_type_progressive;
+	SetFrameRate(framerate);
+}
+
+NdiProxy::~NdiProxy()
+{
+	flushAsync();
+	NDIlib_send_destroy(send_);
+}
+
+void NdiProxy::createSender()
+{
+	send_create_desc_.p_ndi_name = name_.c_str();
+	send_create_desc_.p_groups = groups_.empty() ? NULL : groups_.c_str();
+	send_create_desc_.clock_video = false;
+	send_create_desc_.clock_audio = false;
+	send_ = ndi_send_create(send_create_desc_, send_config_);
+	if (!send_)
+		throw std::runtime_error("failed to create NDI sender " + name_);
+}
+
+void NdiProxy::SetSource(std::string const &name, std::string const &groups, std::string const &send_config)
+{
+	flushAsync();
+	NDIlib_send_destroy(send_);
+	name_ = name;
+	groups_ = groups;
+	send_config_ = send_config;
+	createSender();
+}
+
+void NdiProxy::SetStreamInfo(StreamInfo const &info)
+{
+	// Frames are copied packed, so the stride is just the width.
+	frame_.xres = info.width;
+	frame_.yres = info.height;
+	frame_.line_stride_in_bytes = info.width;
+	frame_.picture_aspect_ratio = (float)info.width / info.height;
+	info_ = info;
+
+	flushAsync();
+	for (auto &buffer : buffers_)
+		buffer.resize(info.width * info.height * 3 / 2);
+	LOG(1, "NDI proxy " << name_ << " is " << info.width << "x" << info.height);
+}
+
+void NdiProxy::SetFrameRate(float framerate)
+{
+	if (framerate == framerate_ || !(framerate > 0))
+		return;
+	framerate_ = framerate;
+
+	bool limited = max_framerate_ > 0 && max_framerate_ < framerate;
+	interval_us_ = limited ? 1000000 / max_framerate_ : 0;
+	fraction_t rate = findFraction(limited ? max_framerate_ : framerate);
+	frame_.frame_rate_N = rate.num;
+	frame_.frame_rate_D = rate.den;
+}
+
+bool NdiProxy::Due(int64_t timestamp_us)
+{
+	if (!interval_us_)
+		return true;
+	// Allow for the camera's frames arriving up to half a frame early.
+	int64_t slack = 500000 / framerate_;
+	if (timestamp_us + slack < next_due_us_)
+		return false;
+	// Keep to the average rate, but don't try to catch up after a gap.
+	next_due_us_ = std::max(next_due_us_, timestamp_us) + interval_us_;
+	return true;
+}
+
+void NdiProxy::Send(void const *mem, int64_t timecode)
+{
+	if (buffers_[0].empty())
+		return;
+
+	uint8_t *buffer = buffers_[buffer_index_].data(), *dst = buffer;
+	buffer_index_ = (buffer_index_ + 1) % 2;
+
+	// Repack the rows tightly, as the copy has to be made anyway.
+	uint8_t const *src = (uint8_t const *)mem;
+	for (unsigned int y = 0; y < info_.height; y++, dst += info_.width)
+		memcpy(dst, src + y * info_.stride, info_.width);
+	src += info_.stride * info_.height;
+	unsigned int chroma_width = info_.width / 2, chroma_stride = info_.stride / 2;
+	for (unsigned int y = 0; y < info_.height; y++, dst += chroma_width) // both chroma planes
+		memcpy(dst, src + y * chroma_stride, chroma_width);
+
+	frame_.p_data = buffer;
+	frame_.timecode = timecode;
+	NDIlib_send_send_video_async_v2(send_, &frame_);
+}
+
+void NdiProxy::flushAsync()
+{
+	NDIlib_send_send_video_async_v2(send_, NULL);
+}
@@ -0,0 +1,69 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * ndi_proxy.hpp - a second, low resolution NDI source from the lores stream.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <core/stream_info.hpp>
+#include <Processing.NDI.Lib.h>
+
+// A separate NDI source carrying the camera's lores stream, for multiviewers that only
+// want a thumbnail. The ISP has already done the scaling, so all this costs is a copy of
+// the (small) lores frame, which lets the camera have its buffer back at once while NDI
+// compresses the copy on its own thread. Frames can be skipped to send at a lower rate
+// than the camera's.
+//
+// It has no tally of its own: a multiviewer watching it says nothing about whether the
+// camera is live.
+
+class NdiProxy
+{
+public:
+	// The framerate is the camera's, until SetFrameRate says otherwise. A max_framerate of
+	// 0 sends every frame.
+	NdiProxy(std::string const &name, std::string const &groups, std::string const &send_config, float framerate,
+			 float max_framerate);
+	~NdiProxy();
+
+	// Describe the lores stream. Call once the camera is configured, and before it starts.
+	void SetStreamInfo(StreamInfo const &info);
+	// The rate the camera is running at, which the proxy advertises too unless it is
+	// limited to less.
+	void SetFrameRate(float framerate);
+	void SetSource(std::string const &name, std::string const &groups, std::string const &send_config);
+
+	// Whether the frame with this timestamp should be sent, or skipped to keep to the
+	// maximum frame rate. Sending the frame must follow immediately.
+	bool Due(int64_t timestamp_us);
+	// Send a lores frame, with its NDI timecode (in 100ns units).
+	void Send(void const *mem, int64_t timecode);
+
+	// Replaced by SetSource.
+	NDIlib_send_instance_t Sender() const { return send_; }
+
+private:
+	void createSender();
+	void flushAsync();
+
+	std::string name_;
+	std::string groups_;
+	// See ndi_sender.hpp.
+	std::string send_config_;
+	float max_framerate_;
+	NDIlib_send_create_t send_create_desc_;
+	NDIlib_send_instance_t send_;
+	NDIlib_video_frame_v2_t frame_;
+	StreamInfo info_;
+	// The frame being sent asynchronously belongs to NDI until the next one is submitted.
+	std::vector<uint8_t> buffers_[2];
+	unsigned int buffer_index_;
+	float framerate_;
+	int64_t interval_us_;
+	int64_t next_due_us_;
+};
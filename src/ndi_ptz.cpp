@@ -0,0 +1,167 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * ndi_ptz.cpp - digital pan, tilt and zoom from NDI PTZ commands.
+ */
+
+#include <algorithm>
+#include <cmath>
+
+#include "core/logging.hpp"
+
+#include "ndi_metadata.hpp"
+#include "ndi_ptz.hpp"
+
+// Eases in and out, so a glide doesn't start or stop with a jolt.
+static float smoothstep(float t)
+{
+	return t * t * (3 - 2 * t);
+}
+
+static int even(float value)
+{
+	return 2 * (int)std::lround(value / 2);
+}
+
+NdiPtz::NdiPtz(float max_zoom)
+	: max_zoom_(max_zoom), position_({ 0, 0, 1 }), pan_speed_(0), tilt_speed_(0), zoom_speed_(0), moving_(false),
+	  move_start_us_(0), move_duration_us_(0), last_update_us_(0)
+{
+	preset_stored_.fill(false);
+}
+
+void NdiPtz::SetGeometry(libcamera::Rectangle const &sensor_area, libcamera::Size const &output_size)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	sensor_area_ = sensor_area;
+	output_size_ = output_size;
+	// The camera was probably (re)started with its own crop.
+	last_crop_ = libcamera::Rectangle();
+	last_update_us_ = 0;
+}
+
+libcamera::Rectangle NdiPtz::Crop()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	last_crop_ = cropFor(position_);
+	return last_crop_;
+}
+
+bool NdiPtz::Update(int64_t timestamp_us, libcamera::Rectangle &crop)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (!sensor_area_.width || !output_size_.width)
+		return false;
+
+	int64_t step_us = last_update_us_ ? std::clamp<int64_t>(timestamp_us - last_update_us_, 0, MAX_STEP_US) : 0;
+	last_update_us_ = timestamp_us;
+
+	if (moving_)
+	{
+		if (move_start_us_ < 0)
+			move_start_us_ = timestamp_us;
+		float t = std::min(1.0f, (float)(timestamp_us - move_start_us_) / move_duration_us_);
+		float s = smoothstep(t);
+		position_.pan = move_from_.pan + (move_to_.pan - move_from_.pan) * s;
+		position_.tilt = move_from_.tilt + (move_to_.tilt - move_from_.tilt) * s;
+		position_.zoom = move_from_.zoom + (move_to_.zoom - move_from_.zoom) * s;
+		moving_ = t < 1;
+	}
+	else if (pan_speed_ || tilt_speed_ || zoom_speed_)
+	{
+		float seconds = step_us / 1e6f;
+		float magnification = std::pow(max_zoom_, 1 - position_.zoom);
+		// NDI's pan speed runs the opposite way to its pan position, and its zoom speed
+		// the opposite way to zoom.
+		float pan_tilt_step = PAN_TILT_RATE * seconds / magnification;
+		position_.pan = std::clamp(position_.pan - pan_speed_ * pan_tilt_step, -1.0f, 1.0f);
+		position_.tilt = std::clamp(position_.tilt + tilt_speed_ * pan_tilt_step, -1.0f, 1.0f);
+		position_.zoom = std::clamp(position_.zoom - zoom_speed_ * ZOOM_RATE * seconds, 0.0f, 1.0f);
+	}
+
+	libcamera::Rectangle next = cropFor(position_);
+	if (next.x == last_crop_.x && next.y == last_crop_.y && next.width == last_crop_.width &&
+		next.height == last_crop_.height)
+		return false;
+	last_crop_ = crop = next;
+	return true;
+}
+
+void NdiPtz::Command(std::string const &xml)
+{
+	std::string name = metadata_element(xml);
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	// Anything absolute starts from wherever the last absolute command was headed.
+	Position target = moving_ ? move_to_ : position_;
+	float value, speed;
+	if (name == "ntk_ptz_zoom" && metadata_attribute(xml, "zoom", value))
+	{
+		target.zoom = std::clamp(value, 0.0f, 1.0f);
+		moveTo(target, MOVE_US);
+	}
+	else if (name == "ntk_ptz_pan_tilt" && metadata_attribute(xml, "pan", target.pan) &&
+			 metadata_attribute(xml, "tilt", target.tilt))
+	{
+		target.pan = std::clamp(target.pan, -1.0f, 1.0f);
+		target.tilt = std::clamp(target.tilt, -1.0f, 1.0f);
+		moveTo(target, MOVE_US);
+	}
+	else if (name == "ntk_ptz_zoom_speed" && metadata_attribute(xml, "zoom_speed", value))
+	{
+		zoom_speed_ = std::clamp(value, -1.0f, 1.0f);
+		moving_ = false;
+	}
+	else if (name == "ntk_ptz_pan_tilt_speed" && metadata_attribute(xml, "pan_speed", value) &&
+			 metadata_attribute(xml, "tilt_speed", speed))
+	{
+		pan_speed_ = std::clamp(value, -1.0f, 1.0f);
+		tilt_speed_ = std::clamp(speed, -1.0f, 1.0f);
+		moving_ = false;
+	}
+	else if (name == "ntk_ptz_store_preset" && metadata_attribute(xml, "index", value) && value >= 0 &&
+			 value < PRESETS)
+	{
+		presets_[(unsigned int)value] = target;
+		preset_stored_[(unsigned int)value] = true;
+		LOG(1, "Stored PTZ preset " << (unsigned int)value);
+	}
+	else if (name == "ntk_ptz_recall_preset" && metadata_attribute(xml, "index", value) && value >= 0 &&
+			 value < PRESETS)
+	{
+		if (!preset_stored_[(unsigned int)value])
+			return;
+		speed = 1;
+		metadata_attribute(xml, "speed", speed);
+		speed = std::clamp(speed, 0.0f, 1.0f);
+		moveTo(presets_[(unsigned int)value], MOVE_US + (1 - speed) * (SLOWEST_RECALL_US - MOVE_US));
+	}
+}
+
+void NdiPtz::moveTo(Position const &to, int64_t duration_us)
+{
+	pan_speed_ = tilt_speed_ = zoom_speed_ = 0;
+	moving_ = true;
+	move_from_ = position_;
+	move_to_ = to;
+	move_start_us_ = -1;
+	move_duration_us_ = duration_us;
+}
+
+libcamera::Rectangle NdiPtz::cropFor(Position const &position) const
+{
+	// The widest view is the largest crop with the output's aspect ratio, which zooming
+	// in shrinks. Panning and tilting move it as far as the sensor allows.
+	float full_width = sensor_area_.width, full_height = sensor_area_.height;
+	if (full_width * output_size_.height > full_height * output_size_.width)
+		full_width = full_height * output_size_.width / output_size_.height;
+	else
+		full_height = full_width * output_size_.height / output_size_.width;
+
+	float magnification = std::pow(max_zoom_, 1 - position.zoom);
+	float width = full_width / magnification, height = full_height / magnification;
+	float centre_x = sensor_area_.x + sensor_area_.width / 2.0f + position.pan * (sensor_area_.width - width) / 2;
+	float centre_y = sensor_area_.y + sensor_area_.height / 2.0f - position.tilt * (sensor_area_.height - height) / 2;
+	return libcamera::Rectangle(even(centre_x - width / 2), even(centre_y - height / 2), even(width), even(height));
+}
@@ -0,0 +1,85 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * ndi_ptz.hpp - digital pan, tilt and zoom from NDI PTZ commands.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+#include <libcamera/geometry.h>
+
+// Makes a fixed camera look like a PTZ one to NDI receivers. We advertise PTZ support on
+// the sender, and receivers then send their pan, tilt, zoom and preset commands back to us
+// as metadata (see Command). The camera is "moved" by changing the ISP's ScalerCrop, so the
+// ISP does all the cropping and scaling, and the output size and CPU cost stay exactly as
+// they were.
+//
+// Moves are worked out a frame at a time on the main loop (see Update), so that a preset
+// recall or a joystick move glides rather than jumps. Positions are in NDI's own terms:
+// pan and tilt run from -1 to 1, and zoom from 0 (all the way in) to 1 (all the way out).
+
+class NdiPtz
+{
+public:
+	// max_zoom is how far in "all the way in" is, as a magnification.
+	NdiPtz(float max_zoom);
+
+	// A command from a receiver, any element starting "ntk_ptz_".
+	void Command(std::string const &xml);
+
+	// What can be cropped, normally the ScalerCropMaximum property, and the size of the
+	// video stream, whose aspect ratio every crop keeps. Call once the camera is configured.
+	void SetGeometry(libcamera::Rectangle const &sensor_area, libcamera::Size const &output_size);
+
+	// The crop for where we are now. Pass this to the camera before it starts.
+	libcamera::Rectangle Crop();
+
+	// Call with each frame. Returns true, with the new crop, if it has changed.
+	bool Update(int64_t timestamp_us, libcamera::Rectangle &crop);
+
+private:
+	// How long a move to an absolute position takes, and the range a preset recall's
+	// speed (1 to 0) covers.
+	static constexpr int64_t MOVE_US = 300000;
+	static constexpr int64_t SLOWEST_RECALL_US = 5000000;
+	// At full speed, how far pan or tilt goes in a second (at 1x, and proportionally less
+	// zoomed in, so that the view moves at the same rate whatever the zoom), and zoom.
+	static constexpr float PAN_TILT_RATE = 0.5f;
+	static constexpr float ZOOM_RATE = 0.33f;
+	// Gaps between frames longer than this don't count in full (after a pause, say).
+	static constexpr int64_t MAX_STEP_US = 100000;
+	static constexpr unsigned int PRESETS = 100;
+
+	struct Position
+	{
+		float pan;
+		float tilt;
+		float zoom;
+	};
+
+	void moveTo(Position const &to, int64_t duration_us);
+	libcamera::Rectangle cropFor(Position const &position) const;
+
+	float max_zoom_;
+
+	std::mutex mutex_;
+	libcamera::Rectangle sensor_area_;
+	libcamera::Size output_size_;
+	Position position_;
+	// Speeds, for the commands that give them.
+	float pan_speed_, tilt_speed_, zoom_speed_;
+	// A glide to an absolute position, which starts on the next frame.
+	bool moving_;
+	Position move_from_, move_to_;
+	int64_t move_start_us_, move_duration_us_;
+	std::array<Position, PRESETS> presets_;
+	std::array<bool, PRESETS> preset_stored_;
+	int64_t last_update_us_;
+	libcamera::Rectangle last_crop_;
+};
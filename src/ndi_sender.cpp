@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * ndi_sender.cpp - create NDI senders with settings of their own.
+ */
+
+#include <string>
+
+#include <Processing.NDI.Embedded.h>
+
+#include "ndi_sender.hpp"
+
+static std::string json_string(std::string const &value)
+{
+	std::string json = "\"";
+	for (char c : value)
+	{
+		if (c == '"' || c == '\\')
+			json += '\\';
+		json += c;
+	}
+	return json + "\"";
+}
+
+std::string ndi_send_config(std::string const &transport, std::string const &discovery)
+{
+	std::string ndi;
+	if (!discovery.empty())
+		ndi += "\"networks\":{\"discovery\":" + json_string(discovery) + "}";
+	if (!transport.empty())
+		ndi += std::string(ndi.empty() ? "" : ",") + "\"multicast\":{\"send\":{\"enable\":" +
+			   (transport == "multicast" ? "true" : "false") + "}}";
+	return ndi.empty() ? "" : "{\"ndi\":{" + ndi + "}}";
+}
+
+NDIlib_send_instance_t ndi_send_create(NDIlib_send_create_t const &desc, std::string const &config)
+{
+#ifdef NDI_ADVANCED_SDK
+	if (!config.empty())
+		return NDIlib_send_create_v2(&desc, config.c_str());
+#endif
+	// Neither the options nor the config file allow a config without.
+	return NDIlib_send_create(&desc);
+}
@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * ndi_sender.hpp - create NDI senders with settings of their own.
+ */
+
+#pragma once
+
+#include <string>
+
+#include <Processing.NDI.Lib.h>
+
+// NDI takes settings for each sender as JSON, in the same form as its ndi-config.v1.json
+// file: here, whether it sends multicast or unicast, and the discovery servers it
+// registers with. With a discovery server, a sender that comes back (after SetSource, or
+// a restart) is found again at once, rather than once mDNS gets round to it.
+//
+// The config is built once, and every sender (the proxy's too) is created from the same
+// string, so that they all come back exactly as they were. An empty transport or
+// discovery leaves NDI's own setting, and an empty config leaves them all.
+std::string ndi_send_config(std::string const &transport, std::string const &discovery);
+
+// Null if NDI fails to create the sender.
+NDIlib_send_instance_t ndi_send_create(NDIlib_send_create_t const &desc, std::string const &config);
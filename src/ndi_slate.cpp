@@ -0,0 +1,110 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * ndi_slate.cpp - the "NO SIGNAL" frame sent while the camera is away.
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#include "core/logging.hpp"
+
+#include "bitmap_font.hpp"
+#include "ndi_slate.hpp"
+
+// Font pixels between characters.
+static constexpr unsigned int SPACING = 1;
+
+NdiSlate::NdiSlate()
+	: fourcc_(NDIlib_FourCC_type_I420), width_(0), height_(0), stride_(0), full_range_(false)
+{
+}
+
+void NdiSlate::Render(NDIlib_FourCC_video_type_e fourcc, unsigned int width, unsigned int height, unsigned int stride,
+					  std::string const &name, bool full_range)
+{
+	if (fourcc == fourcc_ && width == width_ && height == height_ && stride == stride_ && name == name_ &&
+		full_range == full_range_ && !frame_.empty())
+		return;
+	fourcc_ = fourcc, width_ = width, height_ = height, stride_ = stride;
+	name_ = name;
+	full_range_ = full_range;
+
+	mask_.assign(width * height, 0);
+	// 18 pixels a font pixel for the title at 1080p, and a third of that for the name.
+	drawText("NO SIGNAL", std::max(1u, height / 60), height * 9 / 20);
+	drawText(name, std::max(1u, height / 180), height * 5 / 8);
+
+	// Grey on grey, so the chroma is the same everywhere.
+	uint8_t back = full_range ? 26 : 38, text = full_range ? 255 : 235;
+	if (fourcc == NDIlib_FourCC_type_P216)
+	{
+		// 16 bit samples: the luma plane, then the interleaved chroma at full height.
+		frame_.resize(stride * height * 2);
+		for (unsigned int y = 0; y < height; y++)
+		{
+			uint16_t *row = (uint16_t *)(frame_.data() + y * stride);
+			for (unsigned int x = 0; x < width; x++)
+				row[x] = (mask_[y * width + x] ? text : back) << 8;
+			uint16_t *chroma = (uint16_t *)(frame_.data() + (height + y) * stride);
+			std::fill_n(chroma, width, 0x8000);
+		}
+	}
+	else if (fourcc == NDIlib_FourCC_type_UYVY)
+	{
+		frame_.resize(stride * height);
+		for (unsigned int y = 0; y < height; y++)
+		{
+			uint8_t *row = frame_.data() + y * stride;
+			for (unsigned int x = 0; x < width; x++)
+			{
+				row[2 * x] = 128;
+				row[2 * x + 1] = mask_[y * width + x] ? text : back;
+			}
+		}
+	}
+	else
+	{
+		// I420 has half stride U and V planes after the luma, NV12 one full stride plane
+		// of both. Either way that's half as much again, all of it neutral.
+		frame_.resize(stride * height * 3 / 2);
+		for (unsigned int y = 0; y < height; y++)
+		{
+			uint8_t *row = frame_.data() + y * stride;
+			for (unsigned int x = 0; x < width; x++)
+				row[x] = mask_[y * width + x] ? text : back;
+		}
+		memset(frame_.data() + stride * height, 128, frame_.size() - stride * height);
+	}
+	std::vector<uint8_t>().swap(mask_);
+	LOG(2, "NDI slate drawn at " << width << "x" << height);
+}
+
+void NdiSlate::drawText(std::string const &text, unsigned int scale, unsigned int centre_y)
+{
+	if (text.empty())
+		return;
+	unsigned int columns = text.size() * (GLYPH_WIDTH + SPACING) - SPACING;
+	// Leave a margin of a tenth of the frame either side.
+	scale = std::min(scale, width_ * 4 / 5 / columns);
+	if (!scale || GLYPH_HEIGHT * scale > height_)
+		return;
+	unsigned int x0 = (width_ - columns * scale) / 2;
+	unsigned int y0 = std::min(centre_y - std::min(centre_y, GLYPH_HEIGHT * scale / 2), height_ - GLYPH_HEIGHT * scale);
+	for (unsigned int c = 0; c < text.size(); c++)
+	{
+		Glyph const &glyph = glyph_for(text[c]);
+		for (unsigned int gy = 0; gy < GLYPH_HEIGHT; gy++)
+		{
+			for (unsigned int gx = 0; gx < GLYPH_WIDTH; gx++)
+			{
+				if (!(glyph.rows[gy] & (0x10 >> gx)))
+					continue;
+				unsigned int x = x0 + (c * (GLYPH_WIDTH + SPACING) + gx) * scale;
+				for (unsigned int y = y0 + gy * scale; y < y0 + (gy + 1) * scale; y++)
+					std::fill_n(&mask_[y * width_ + x], scale, 1);
+			}
+		}
+	}
+}
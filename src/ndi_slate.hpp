@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * ndi_slate.hpp - the "NO SIGNAL" frame sent while the camera is away.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <Processing.NDI.Embedded.h>
+
+// Some switchers drop a source that stops sending frames, even for the few seconds a
+// camera restart takes. While the camera is away, NdiOutput holds the last good frame
+// for a while, and after that sends this: a dark grey card saying NO SIGNAL, with the
+// source name underneath. It's drawn once, straight into the format and layout that
+// uncompressed frames go out in, so sending it again and again costs nothing but the
+// send itself.
+
+class NdiSlate
+{
+public:
+	NdiSlate();
+
+	// Draw the slate for frames of this format, size and stride, in video or full range.
+	// Does nothing if they and the name are the same as last time.
+	void Render(NDIlib_FourCC_video_type_e fourcc, unsigned int width, unsigned int height, unsigned int stride,
+				std::string const &name, bool full_range);
+
+	// The frame, to send as it is. Stays put until the next Render that changes anything.
+	uint8_t *Data() { return frame_.data(); }
+	bool Empty() const { return frame_.empty(); }
+
+private:
+	// Set the mask under a line of text, centred on the given row, as large as fits up to
+	// the given font pixel size.
+	void drawText(std::string const &text, unsigned int scale, unsigned int centre_y);
+
+	NDIlib_FourCC_video_type_e fourcc_;
+	unsigned int width_, height_, stride_;
+	std::string name_;
+	bool full_range_;
+	// One byte a pixel, non-zero under the text.
+	std::vector<uint8_t> mask_;
+	std::vector<uint8_t> frame_;
+};
@@ -0,0 +1,262 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * ndi_speedhq_encoder.cpp - SpeedHQ encoder for NDI, on a pool of pinned threads.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+}
+
+#include "core/logging.hpp"
+
+#include "ndi_options.hpp"
+#include "ndi_speedhq_encoder.hpp"
+#include "thread_policy.hpp"
+
+static std::string av_error(int err)
+{
+	char buf[64];
+	av_strerror(err, buf, sizeof(buf));
+	return buf;
+}
+
+// NDI's q factor runs from 0 to 100, best last, and libavcodec's qscale from 31 to 1.
+static int qscale_for(int quality)
+{
+	return std::clamp((101 - quality) / 2, 1, 31);
+}
+
+NdiSpeedHqEncoder::NdiSpeedHqEncoder(VideoOptions const *options, StreamInfo const &info, bool low_bandwidth)
+	: Encoder(options), info_(info), affinity_(true), quality_(DEFAULT_QUALITY), frames_(), head_(0), tail_(0),
+	  abort_(false), last_packet_(nullptr)
+{
+	unsigned int num_threads = 0;
+	NDIOptions const *ndi_options = dynamic_cast<NDIOptions const *>(options);
+	if (low_bandwidth)
+	{
+		num_threads = 1;
+		affinity_ = false;
+	}
+	else if (ndi_options)
+	{
+		num_threads = ndi_options->ndi_shq_threads;
+		affinity_ = ndi_options->ndi_shq_affinity;
+	}
+	if (!num_threads)
+		num_threads = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+	num_threads = std::min(num_threads, MAX_THREADS);
+
+	AVCodec const *codec = avcodec_find_encoder_by_name("speedhq");
+	if (!codec)
+		throw std::runtime_error("NdiSpeedHqEncoder: FFmpeg has no SpeedHQ encoder");
+	for (unsigned int i = 0; i < num_threads; i++)
+	{
+		AVCodecContext *ctx = avcodec_alloc_context3(codec);
+		AVFrame *frame = av_frame_alloc();
+		if (ctx)
+			contexts_.push_back(ctx);
+		if (frame)
+			av_frames_.push_back(frame);
+		if (!ctx || !frame)
+			break;
+		ctx->width = info_.width;
+		ctx->height = info_.height;
+		ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+		ctx->time_base = { 1, 1000000 };
+		// Each thread is already a core's worth.
+		ctx->thread_count = 1;
+		// A fixed quantiser, from each frame's quality, rather than any rate control.
+		ctx->flags |= AV_CODEC_FLAG_QSCALE;
+		ctx->global_quality = FF_QP2LAMBDA * qscale_for(DEFAULT_QUALITY);
+		bool rec709 = info_.colour_space == libcamera::ColorSpace::Rec709;
+		ctx->colorspace = rec709 ? AVCOL_SPC_BT709 : AVCOL_SPC_SMPTE170M;
+		ctx->color_range = AVCOL_RANGE_MPEG;
+		int ret = avcodec_open2(ctx, codec, nullptr);
+		if (ret < 0)
+		{
+			for (auto &c : contexts_)
+				avcodec_free_context(&c);
+			for (auto &f : av_frames_)
+				av_frame_free(&f);
+			throw std::runtime_error("NdiSpeedHqEncoder: failed to open speedhq: " + av_error(ret));
+		}
+
+		// The frame only ever points into camera buffers, which libavcodec reads from.
+		frame->format = AV_PIX_FMT_YUV420P;
+		frame->width = info_.width;
+		frame->height = info_.height;
+		frame->linesize[0] = info_.stride;
+		frame->linesize[1] = frame->linesize[2] = info_.stride / 2;
+	}
+	if (contexts_.size() < num_threads || av_frames_.size() < num_threads)
+	{
+		for (auto &c : contexts_)
+			avcodec_free_context(&c);
+		for (auto &f : av_frames_)
+			av_frame_free(&f);
+		throw std::runtime_error("NdiSpeedHqEncoder: failed to allocate speedhq");
+	}
+	for (auto &frame : frames_)
+		frame.packet = av_packet_alloc();
+	last_packet_ = av_packet_alloc();
+
+	output_thread_ = std::thread(&NdiSpeedHqEncoder::outputThread, this);
+	for (unsigned int i = 0; i < num_threads; i++)
+		encode_threads_.emplace_back(&NdiSpeedHqEncoder::encodeThread, this, i);
+	LOG(2, "Opened NdiSpeedHqEncoder" << (low_bandwidth ? " (low bandwidth): " : ": ") << info.width << "x"
+										<< info.height << ", " << num_threads << " threads"
+										<< (affinity_ ? ", pinned to cores" : ""));
+}
+
+NdiSpeedHqEncoder::~NdiSpeedHqEncoder()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	// Everything already handed to us still gets encoded and output.
+	encode_cond_var_.notify_all();
+	for (auto &thread : encode_threads_)
+		thread.join();
+	output_cond_var_.notify_all();
+	output_thread_.join();
+
+	for (auto &frame : frames_)
+		av_packet_free(&frame.packet);
+	av_packet_free(&last_packet_);
+	for (auto &ctx : contexts_)
+		avcodec_free_context(&ctx);
+	for (auto &frame : av_frames_)
+		av_frame_free(&frame);
+	LOG(2, "NdiSpeedHqEncoder closed");
+}
+
+void NdiSpeedHqEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	space_cond_var_.wait(lock, [this] { return tail_ - head_ < NUM_FRAMES; });
+
+	Frame &frame = frames_[tail_ % NUM_FRAMES];
+	frame.mem = mem;
+	frame.timestamp_us = timestamp_us;
+	frame.started = false;
+	frame.done = false;
+	tail_++;
+	lock.unlock();
+	encode_cond_var_.notify_one();
+}
+
+unsigned int NdiSpeedHqEncoder::Backlog()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return tail_ - head_;
+}
+
+void NdiSpeedHqEncoder::encodeThread(unsigned int num)
+{
+	std::string name = "shq-" + std::to_string(num);
+	ThreadPolicy::Get().Apply(ThreadPolicy::ENCODE, name.c_str());
+	// Each thread to a core of its own overrides the policy's cores.
+	if (affinity_)
+	{
+		cpu_set_t cpuset;
+		CPU_ZERO(&cpuset);
+		CPU_SET(num % std::max(1L, sysconf(_SC_NPROCESSORS_ONLN)), &cpuset);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset))
+			LOG(1, "NdiSpeedHqEncoder: could not pin thread " << num);
+	}
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (true)
+	{
+		// Oldest frame first, so that they finish about in order.
+		Frame *frame = nullptr;
+		for (uint64_t i = head_; i < tail_ && !frame; i++)
+			if (!frames_[i % NUM_FRAMES].started)
+				frame = &frames_[i % NUM_FRAMES];
+		if (!frame)
+		{
+			if (abort_)
+				break;
+			encode_cond_var_.wait(lock);
+			continue;
+		}
+
+		frame->started = true;
+		lock.unlock();
+		encodeFrame(num, *frame);
+		lock.lock();
+		frame->done = true;
+		output_cond_var_.notify_one();
+	}
+}
+
+void NdiSpeedHqEncoder::encodeFrame(unsigned int num, Frame &frame)
+{
+	AVCodecContext *ctx = contexts_[num];
+	AVFrame *av_frame = av_frames_[num];
+	av_frame->data[0] = (uint8_t *)frame.mem;
+	av_frame->data[1] = av_frame->data[0] + info_.stride * info_.height;
+	av_frame->data[2] = av_frame->data[1] + (info_.stride / 2) * (info_.height / 2);
+	av_frame->pts = frame.timestamp_us;
+	av_frame->quality = FF_QP2LAMBDA * qscale_for(quality_);
+
+	// SpeedHQ frames are all intra, so one in gives one out, straight away.
+	int ret = avcodec_send_frame(ctx, av_frame);
+	if (ret >= 0)
+		ret = avcodec_receive_packet(ctx, frame.packet);
+	if (ret < 0)
+	{
+		LOG_ERROR("NdiSpeedHqEncoder: failed to encode frame: " << av_error(ret));
+		av_packet_unref(frame.packet);
+	}
+}
+
+void NdiSpeedHqEncoder::outputThread()
+{
+	ThreadPolicy::Get().Apply(ThreadPolicy::SEND, "shq-output");
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (true)
+	{
+		if (head_ == tail_ || !frames_[head_ % NUM_FRAMES].done)
+		{
+			if (abort_ && head_ == tail_)
+				break;
+			output_cond_var_.wait(lock);
+			continue;
+		}
+
+		Frame &frame = frames_[head_ % NUM_FRAMES];
+		lock.unlock();
+		// Every camera buffer goes back in the order it came, encoded or not.
+		input_done_callback_(nullptr);
+		if (frame.packet->size)
+		{
+			output_ready_callback_(frame.packet->data, frame.packet->size, frame.timestamp_us, true);
+			// Handing over the reference copies nothing.
+			av_packet_unref(last_packet_);
+			av_packet_move_ref(last_packet_, frame.packet);
+		}
+		lock.lock();
+
+		head_++;
+		space_cond_var_.notify_one();
+	}
+}
+
+static Encoder *ndi_shq_codec_create(VideoOptions *options, const StreamInfo &info)
+{
+	return new NdiSpeedHqEncoder(options, info);
+}
+
+static RegisterEncoder reg("ndi_shq", &ndi_shq_codec_create);
@@ -0,0 +1,96 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * ndi_speedhq_encoder.hpp - SpeedHQ encoder for NDI, on a pool of pinned threads.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "encoder/encoder.hpp"
+
+struct AVCodecContext;
+struct AVFrame;
+struct AVPacket;
+
+// Given uncompressed frames, NDI compresses them to SpeedHQ itself, on threads of its own
+// that we can neither size nor place, and which on a Pi 3B+ fight capture and everything
+// else for the cores. With the Advanced SDK, NDI takes frames already compressed instead,
+// so this encodes them with libavcodec's SpeedHQ (4:2:0, SHQ0) encoder on threads of our
+// own, each with a core to itself unless told otherwise. The CPU this costs is then set
+// by the number of threads, which can be as few as one on a Pi Zero 2 W.
+//
+// libavcodec can only encode a SpeedHQ frame on one thread, so each thread takes whole
+// frames, in turn, and they go out in the order they came. More threads raise the frame
+// rate that can be kept up, but no one frame comes out any sooner. The quality is the
+// q factor NDI asks for (see NdiOutput::SetQualityCallback). The camera buffers are
+// returned in order, as soon as each frame is encoded.
+//
+// The low bandwidth stream (SHQ0_lowest_bandwidth) is encoded from the lores stream by
+// another of these, on one thread of its own left on the thread policy's cores, as a
+// lores frame costs a small fraction of a full one.
+
+class NdiSpeedHqEncoder : public Encoder
+{
+public:
+	NdiSpeedHqEncoder(VideoOptions const *options, StreamInfo const &info, bool low_bandwidth = false);
+	~NdiSpeedHqEncoder();
+	// Only blocks if NUM_FRAMES frames are already in hand.
+	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
+	// Encode at this SpeedHQ quality (as from NDIlib_send_get_q_factor) from the next
+	// frame on. May be called from any thread.
+	void SetQuality(int quality) { quality_ = quality; }
+	// Frames handed to us that haven't yet gone back. May be called from any thread.
+	unsigned int Backlog();
+
+private:
+	// How many frames can be on the go at once, counting the one being output, and so
+	// how many threads can be kept busy.
+	static constexpr unsigned int NUM_FRAMES = 5;
+	static constexpr unsigned int MAX_THREADS = NUM_FRAMES - 1;
+	// Until NDI says otherwise.
+	static constexpr int DEFAULT_QUALITY = 80;
+
+	struct Frame
+	{
+		void *mem;
+		int64_t timestamp_us;
+		bool started;
+		bool done;
+		// Empty if the frame failed to encode.
+		AVPacket *packet;
+	};
+
+	void encodeThread(unsigned int num);
+	void outputThread();
+	void encodeFrame(unsigned int num, Frame &frame);
+
+	StreamInfo info_;
+	bool affinity_;
+	std::atomic<int> quality_;
+	// One codec, and a frame to point at the camera buffer, for each thread.
+	std::vector<AVCodecContext *> contexts_;
+	std::vector<AVFrame *> av_frames_;
+
+	// Frames tail_ - head_ are in hand, in arrival order, and frames_[head_ % NUM_FRAMES]
+	// is the next to be output. All guarded by mutex_.
+	Frame frames_[NUM_FRAMES];
+	uint64_t head_;
+	uint64_t tail_;
+	bool abort_;
+	std::mutex mutex_;
+	std::condition_variable encode_cond_var_;
+	std::condition_variable output_cond_var_;
+	std::condition_variable space_cond_var_;
+	std::vector<std::thread> encode_threads_;
+	std::thread output_thread_;
+	// The last frame output, kept until the next one is, so that whatever it was handed to
+	// can still read it, for instance to copy it in NdiOutput::HoldFrame.
+	AVPacket *last_packet_;
+};
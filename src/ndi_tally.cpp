@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * ndi_tally.cpp - NDI tally monitoring.
+ */
+
+#include <fstream>
+
+#include "core/logging.hpp"
+
+#include "ndi_tally.hpp"
+#include "thread_policy.hpp"
+
+NdiTally::NdiTally(NDIlib_send_instance_t send, std::string const &neopixel_path, TallyCallback callback)
+	: send_(send), neopixel_path_(neopixel_path), callback_(callback), state_(NONE), abort_(false)
+{
+	writeState(NONE);
+	tally_thread_ = std::thread(&NdiTally::tallyThread, this);
+}
+
+NdiTally::~NdiTally()
+{
+	abort_ = true;
+	tally_thread_.join();
+}
+
+void NdiTally::tallyThread()
+{
+	ThreadPolicy::Get().Apply(ThreadPolicy::OTHER, "ndi-tally");
+	while (!abort_)
+	{
+		NDIlib_tally_t tally;
+		// This blocks until the tally changes, or the timeout expires.
+		if (!NDIlib_send_get_tally(send_, &tally, TALLY_TIMEOUT_MS))
+			continue;
+
+		State state = tally.on_program ? PROGRAM : tally.on_preview ? PREVIEW : NONE;
+		if (state == state_)
+			continue;
+
+		LOG(1, "Tally PGM: " << tally.on_program << " PVW: " << tally.on_preview);
+		state_.store(state, std::memory_order_relaxed);
+		writeState(state);
+		if (callback_)
+			callback_(state);
+	}
+}
+
+void NdiTally::writeState(State state)
+{
+	static const char codes[] = { 'N', 'P', 'L' };
+
+	std::ofstream neopixel(neopixel_path_, std::ios::trunc);
+	if (!neopixel)
+	{
+		LOG_ERROR("Failed to open neopixel state file " << neopixel_path_);
+		return;
+	}
+	neopixel << codes[state];
+}
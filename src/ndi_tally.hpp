@@ -0,0 +1,54 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * ndi_tally.hpp - NDI tally monitoring.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+
+#include <Processing.NDI.Lib.h>
+
+// Watches the tally state of an NDI sender on its own thread, so that nothing on the
+// send path ever has to poll for it. The neopixel state file is only rewritten when the
+// state actually changes.
+
+class NdiTally
+{
+public:
+	enum State
+	{
+		NONE = 0,
+		PREVIEW = 1,
+		PROGRAM = 2
+	};
+
+	// Called, on the tally thread, whenever the state changes.
+	typedef std::function<void(State state)> TallyCallback;
+
+	NdiTally(NDIlib_send_instance_t send, std::string const &neopixel_path, TallyCallback callback);
+	~NdiTally();
+
+	State Get() const { return state_.load(std::memory_order_relaxed); }
+	bool IsProgram() const { return Get() == PROGRAM; }
+	bool IsPreview() const { return Get() == PREVIEW; }
+
+private:
+	// How long to block waiting for a tally change before checking for shutdown.
+	static constexpr uint32_t TALLY_TIMEOUT_MS = 250;
+
+	void tallyThread();
+	void writeState(State state);
+
+	NDIlib_send_instance_t send_;
+	std::string neopixel_path_;
+	TallyCallback callback_;
+	std::atomic<State> state_;
+	std::atomic<bool> abort_;
+	std::thread tally_thread_;
+};
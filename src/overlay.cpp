@@ -0,0 +1,276 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * overlay.cpp - tally border, camera ID, timecode and clock drawn onto the video.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <ctime>
+#include <sstream>
+#include <stdexcept>
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "core/logging.hpp"
+
+#include "bitmap_font.hpp"
+#include "overlay.hpp"
+
+namespace
+{
+
+// Font pixels between characters, and around the text inside its box.
+constexpr unsigned int SPACING = 1, PADDING = 2;
+constexpr uint8_t BOX_ALPHA = 160;
+
+unsigned int even(unsigned int value)
+{
+	return value & ~1u;
+}
+
+} // namespace
+
+// Adds what's left of the frame (dst * keep / 255, rounded) to the premultiplied overlay.
+static void blend_row(uint8_t *dst, uint8_t const *src, uint8_t const *keep, unsigned int width)
+{
+	unsigned int x = 0;
+#if defined(__aarch64__)
+	for (; x + 16 <= width; x += 16)
+	{
+		uint8x16_t d = vld1q_u8(dst + x), k = vld1q_u8(keep + x);
+		uint16x8_t lo = vmull_u8(vget_low_u8(d), vget_low_u8(k));
+		uint16x8_t hi = vmull_high_u8(d, k);
+		lo = vaddq_u16(lo, vrshrq_n_u16(lo, 8));
+		hi = vaddq_u16(hi, vrshrq_n_u16(hi, 8));
+		uint8x16_t under = vcombine_u8(vrshrn_n_u16(lo, 8), vrshrn_n_u16(hi, 8));
+		vst1q_u8(dst + x, vqaddq_u8(vld1q_u8(src + x), under));
+	}
+#endif
+	for (; x < width; x++)
+	{
+		unsigned int t = dst[x] * keep[x] + 128;
+		dst[x] = std::min(255u, src[x] + ((t + (t >> 8)) >> 8));
+	}
+}
+
+Overlay::Overlay(std::string const &elements, std::string const &id)
+	: id_(id), scale_(1), margin_x_(0), margin_y_(0), kr_(0.2126f), kb_(0.0722f), full_range_(false)
+{
+	std::stringstream in(elements);
+	std::string name;
+	while (std::getline(in, name, ','))
+	{
+		Kind kind;
+		if (name == "tally")
+			kind = TALLY;
+		else if (name == "id")
+			kind = ID;
+		else if (name == "timecode")
+			kind = TIMECODE;
+		else if (name == "clock")
+			kind = CLOCK;
+		else
+			throw std::runtime_error("unknown overlay element " + name);
+		elements_.push_back({ kind, "", false, {} });
+	}
+}
+
+void Overlay::SetGeometry(StreamInfo const &info)
+{
+	info_ = info;
+	// 4 pixels a font pixel at 1080p, and captions inside the title safe area.
+	scale_ = std::max(1u, info.height / 270);
+	margin_x_ = even(info.width / 20);
+	margin_y_ = even(info.height / 20);
+
+	kr_ = 0.2126f, kb_ = 0.0722f;
+	full_range_ = false;
+	if (info.colour_space)
+	{
+		if (info.colour_space->ycbcrEncoding == libcamera::ColorSpace::YcbcrEncoding::Rec601)
+			kr_ = 0.299f, kb_ = 0.114f;
+		else if (info.colour_space->ycbcrEncoding == libcamera::ColorSpace::YcbcrEncoding::Rec2020)
+			kr_ = 0.2627f, kb_ = 0.0593f;
+		full_range_ = info.colour_space->range == libcamera::ColorSpace::Range::Full;
+	}
+
+	for (auto &element : elements_)
+		element.rendered = false;
+}
+
+bool Overlay::Update(NdiTally::State tally, float framerate)
+{
+	auto now = std::chrono::system_clock::now();
+	std::time_t seconds = std::chrono::system_clock::to_time_t(now);
+	std::tm local;
+	localtime_r(&seconds, &local);
+	char clock[16];
+	strftime(clock, sizeof(clock), "%H:%M:%S", &local);
+	int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(now.time_since_epoch()).count() % 1000000;
+	unsigned int frames = std::ceil(std::max(framerate, 1.0f));
+	char timecode[16];
+	snprintf(timecode, sizeof(timecode), "%s:%02u", clock, std::min<unsigned int>(us * framerate / 1e6, frames - 1));
+
+	bool visible = false;
+	for (auto &element : elements_)
+	{
+		std::string content;
+		if (element.kind == TALLY)
+			content = tally == NdiTally::PROGRAM ? "program" : tally == NdiTally::PREVIEW ? "preview" : "";
+		else if (element.kind == ID)
+			content = id_;
+		else if (element.kind == TIMECODE)
+			content = timecode;
+		else
+			content = clock;
+		if (!element.rendered || content != element.content)
+		{
+			element.content = content;
+			render(element);
+		}
+		visible = visible || !element.patches.empty();
+	}
+	return visible;
+}
+
+void Overlay::Apply(uint8_t *mem)
+{
+	unsigned int chroma_stride = info_.stride / 2;
+	uint8_t *u = mem + info_.stride * info_.height;
+	uint8_t *v = u + chroma_stride * info_.height / 2;
+	for (auto const &element : elements_)
+	{
+		for (auto const &patch : element.patches)
+		{
+			for (unsigned int row = 0; row < patch.height; row++)
+				blend_row(mem + (patch.y + row) * info_.stride + patch.x, &patch.y_plane[row * patch.width],
+						  &patch.y_keep[row * patch.width], patch.width);
+			unsigned int width = patch.width / 2;
+			for (unsigned int row = 0; row < patch.height / 2; row++)
+			{
+				unsigned int offset = (patch.y / 2 + row) * chroma_stride + patch.x / 2;
+				blend_row(u + offset, &patch.u_plane[row * width], &patch.uv_keep[row * width], width);
+				blend_row(v + offset, &patch.v_plane[row * width], &patch.uv_keep[row * width], width);
+			}
+		}
+	}
+}
+
+void Overlay::render(Element &element)
+{
+	element.patches.clear();
+	element.rendered = true;
+	if (!info_.width || element.content.empty())
+		return;
+	if (element.kind == TALLY)
+		renderBorder(element);
+	else
+		renderText(element);
+}
+
+void Overlay::renderText(Element &element)
+{
+	std::string const &text = element.content;
+	unsigned int columns = text.size() * (GLYPH_WIDTH + SPACING) - SPACING + 2 * PADDING;
+	unsigned int rows = GLYPH_HEIGHT + 2 * PADDING;
+	unsigned int width = (columns * scale_ + 1) & ~1u, height = (rows * scale_ + 1) & ~1u;
+	if (width + 2 * margin_x_ > info_.width || height + 2 * margin_y_ > info_.height)
+	{
+		LOG(1, "Overlay \"" << text << "\" doesn't fit in the frame");
+		return;
+	}
+
+	std::vector<uint8_t> rgba(width * height * 4, 0);
+	for (unsigned int i = 3; i < rgba.size(); i += 4)
+		rgba[i] = BOX_ALPHA;
+	for (unsigned int c = 0; c < text.size(); c++)
+	{
+		Glyph const &glyph = glyph_for(text[c]);
+		for (unsigned int gy = 0; gy < GLYPH_HEIGHT; gy++)
+		{
+			for (unsigned int gx = 0; gx < GLYPH_WIDTH; gx++)
+			{
+				if (!(glyph.rows[gy] & (0x10 >> gx)))
+					continue;
+				unsigned int x0 = (PADDING + c * (GLYPH_WIDTH + SPACING) + gx) * scale_;
+				unsigned int y0 = (PADDING + gy) * scale_;
+				for (unsigned int y = y0; y < y0 + scale_; y++)
+					std::fill_n(&rgba[(y * width + x0) * 4], scale_ * 4, 255);
+			}
+		}
+	}
+
+	unsigned int x = element.kind == ID ? margin_x_ : info_.width - margin_x_ - width;
+	unsigned int y = element.kind == CLOCK ? margin_y_ : info_.height - margin_y_ - height;
+	addPatch(element, even(x), even(y), width, height, rgba.data());
+}
+
+void Overlay::renderBorder(Element &element)
+{
+	bool program = element.content == "program";
+	uint8_t const colour[4] = { (uint8_t)(program ? 255 : 0), (uint8_t)(program ? 0 : 255), 0, 255 };
+	unsigned int thickness = std::max(2u, even(info_.height / 54));
+	unsigned int width = even(info_.width), height = even(info_.height);
+	if (2 * thickness >= std::min(width, height))
+		return;
+
+	// One block of colour does for all four sides.
+	std::vector<uint8_t> rgba(std::max(width, height) * thickness * 4);
+	for (unsigned int i = 0; i < rgba.size(); i += 4)
+		std::copy_n(colour, 4, &rgba[i]);
+	addPatch(element, 0, 0, width, thickness, rgba.data());
+	addPatch(element, 0, height - thickness, width, thickness, rgba.data());
+	addPatch(element, 0, thickness, thickness, height - 2 * thickness, rgba.data());
+	addPatch(element, width - thickness, thickness, thickness, height - 2 * thickness, rgba.data());
+}
+
+void Overlay::addPatch(Element &element, unsigned int x, unsigned int y, unsigned int width, unsigned int height,
+					   uint8_t const *rgba)
+{
+	float y_scale = full_range_ ? 255 : 219, y_offset = full_range_ ? 0 : 16;
+	float uv_scale = full_range_ ? 255 : 224;
+	Patch patch;
+	patch.x = x, patch.y = y, patch.width = width, patch.height = height;
+	patch.y_plane.resize(width * height);
+	patch.y_keep.resize(width * height);
+	patch.u_plane.resize(width * height / 4);
+	patch.v_plane.resize(width * height / 4);
+	patch.uv_keep.resize(width * height / 4);
+	// Chroma sums over each 2x2 block, of alpha and of U and V times alpha.
+	std::vector<float> sums(width / 2 * 3, 0);
+
+	for (unsigned int row = 0; row < height; row++)
+	{
+		for (unsigned int col = 0; col < width; col++)
+		{
+			uint8_t const *p = rgba + (row * width + col) * 4;
+			float r = p[0] / 255.0f, g = p[1] / 255.0f, b = p[2] / 255.0f, a = p[3] / 255.0f;
+			float luma = kr_ * r + (1 - kr_ - kb_) * g + kb_ * b;
+			float cb = (b - luma) / (2 * (1 - kb_)), cr = (r - luma) / (2 * (1 - kr_));
+			unsigned int i = row * width + col;
+			patch.y_plane[i] = std::lround((y_offset + y_scale * luma) * a);
+			patch.y_keep[i] = 255 - p[3];
+			float *sum = &sums[col / 2 * 3];
+			sum[0] += a;
+			sum[1] += std::clamp(128 + uv_scale * cb, 0.0f, 255.0f) * a;
+			sum[2] += std::clamp(128 + uv_scale * cr, 0.0f, 255.0f) * a;
+		}
+		if (!(row & 1))
+			continue;
+		for (unsigned int col = 0; col < width / 2; col++)
+		{
+			unsigned int i = row / 2 * (width / 2) + col;
+			float *sum = &sums[col * 3];
+			patch.uv_keep[i] = 255 - std::lround(sum[0] * 255 / 4);
+			patch.u_plane[i] = std::lround(sum[1] / 4);
+			patch.v_plane[i] = std::lround(sum[2] / 4);
+		}
+		std::fill(sums.begin(), sums.end(), 0);
+	}
+	element.patches.push_back(std::move(patch));
+}
@@ -0,0 +1,62 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * pipeline_recovery.cpp - decide how to recover from a camera timeout.
+ */
+
+#include <algorithm>
+
+#include "core/logging.hpp"
+
+#include "pipeline_recovery.hpp"
+
+static char const *const action_names[] = { "restart_camera", "restart_pipeline", "reopen_camera" };
+
+PipelineRecovery::PipelineRecovery() : recovering_(false), attempts_(0), good_frames_(0)
+{
+	Metrics &metrics = Metrics::Get();
+	timeouts_ = &metrics.AddCounter("raspindi_camera_timeouts_total", "Times the camera stopped delivering frames");
+	for (unsigned int action = 0; action < NUM_ACTIONS; action++)
+		actions_[action] = &metrics.AddCounter("raspindi_recovery_attempts_total", "Attempts to recover the camera",
+											   std::string("action=\"") + action_names[action] + "\"");
+	recovering_gauge_ = &metrics.AddGauge("raspindi_recovering", "1 while the camera is being recovered");
+}
+
+bool PipelineRecovery::Timeout()
+{
+	if (recovering_ && Clock::now() - last_action_ < COALESCE_TIME)
+		return false;
+	timeouts_->Inc();
+	recovering_ = true;
+	recovering_gauge_->Set(1);
+	good_frames_ = 0;
+	return true;
+}
+
+PipelineRecovery::Action PipelineRecovery::Next(std::chrono::milliseconds &backoff)
+{
+	// Go through the actions once quickly, then keep reopening, backing off each time.
+	Action action = (Action)std::min<unsigned int>(attempts_, REOPEN_CAMERA);
+	backoff = std::chrono::milliseconds(0);
+	if (attempts_)
+		backoff = std::min(MAX_BACKOFF, MIN_BACKOFF * (1 << std::min(attempts_ - 1, 6u)));
+	attempts_++;
+	actions_[action]->Inc();
+	LOG(1, "Camera recovery attempt " << attempts_ << ": " << action_names[action] << " in " << backoff.count()
+									  << "ms");
+	last_action_ = Clock::now() + backoff;
+	return action;
+}
+
+bool PipelineRecovery::FrameReceived()
+{
+	if (attempts_ && ++good_frames_ >= STABLE_FRAMES)
+		attempts_ = 0;
+	if (!recovering_ || good_frames_ < RECOVERED_FRAMES)
+		return false;
+	recovering_ = false;
+	recovering_gauge_->Set(0);
+	LOG(1, "Camera recovered after " << attempts_ << " attempts");
+	return true;
+}
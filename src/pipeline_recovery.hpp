@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * pipeline_recovery.hpp - decide how to recover from a camera timeout.
+ */
+
+#pragma once
+
+#include <chrono>
+
+#include "metrics.hpp"
+
+// When the camera stops delivering frames, we try the lightest fix first and only go
+// further if that doesn't bring frames back:
+//
+// - restart the camera, which requeues every request,
+// - then restart the encoders and reconfigure the camera as well,
+// - then close and reopen the camera altogether.
+//
+// Each attempt after the first waits a little longer than the one before, so that a
+// camera that has gone for good doesn't have us spinning. Once enough good frames have
+// arrived, we start again from the lightest fix next time.
+//
+// Nothing here touches the camera. The main loop does what we say, as only it knows how.
+
+class PipelineRecovery
+{
+public:
+	enum Action
+	{
+		RESTART_CAMERA,
+		RESTART_PIPELINE,
+		REOPEN_CAMERA,
+		NUM_ACTIONS
+	};
+
+	PipelineRecovery();
+
+	// The camera timed out, or the last attempt to recover it failed. Returns what to
+	// try, and how long to wait first.
+	Action Next(std::chrono::milliseconds &backoff);
+
+	// The camera has timed out again. False if this is only one of several timeouts it
+	// reported at once (one comes for every request it had), and already dealt with.
+	bool Timeout();
+
+	// A frame has arrived. True if this is the one that tells us we have recovered.
+	bool FrameReceived();
+
+	bool Recovering() const { return recovering_; }
+
+private:
+	// Timeouts this soon after we acted were queued before it.
+	static constexpr std::chrono::milliseconds COALESCE_TIME = std::chrono::milliseconds(200);
+	// Frames it takes to count as recovered, and to forget about earlier attempts.
+	static constexpr unsigned int RECOVERED_FRAMES = 1;
+	static constexpr unsigned int STABLE_FRAMES = 300;
+	static constexpr std::chrono::milliseconds MIN_BACKOFF = std::chrono::milliseconds(100);
+	static constexpr std::chrono::milliseconds MAX_BACKOFF = std::chrono::milliseconds(5000);
+
+	typedef std::chrono::steady_clock Clock;
+
+	bool recovering_;
+	unsigned int attempts_;
+	unsigned int good_frames_;
+	Clock::time_point last_action_;
+	Metrics::Counter *timeouts_;
+	Metrics::Counter *actions_[NUM_ACTIONS];
+	Metrics::Gauge *recovering_gauge_;
+};
@@ -0,0 +1,483 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * raspindi_bench.cpp - microbenchmarks, and the NDI pipeline fed without a camera.
+ */
+
+#include <sys/mman.h>
+#include <sys/utsname.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <queue>
+#include <sstream>
+#include <thread>
+
+#include <libcamera/formats.h>
+
+#include "core/dma_heaps.hpp"
+#include "core/logging.hpp"
+#include "core/metadata.hpp"
+#include "encoder/encoder.hpp"
+#include "output/circular_output.hpp"
+
+#include "fraction.hpp"
+#include "luma_scopes.hpp"
+#include "overlay.hpp"
+#include "ndi_options.hpp"
+#include "ndi_output.hpp"
+#include "spsc_ring.hpp"
+#include "tagged_metadata.hpp"
+#include "tone_curve.hpp"
+#include "yuv_convert.hpp"
+
+// Run with the same options as raspindi (so --codec ndi, for example), which shape the
+// pipeline just as they would with a camera, plus a few of our own. Everything is
+// reported as one JSON object, so that runs on different Pis can be compared.
+
+using namespace std::placeholders;
+typedef std::chrono::steady_clock Clock;
+
+struct BenchOptions : public NDIOptions
+{
+	BenchOptions() : NDIOptions()
+	{
+		using namespace boost::program_options;
+		// clang-format off
+		options_->add_options()
+			("bench_seconds", value<unsigned int>(&bench_seconds)->default_value(10),
+			 "How long to run the pipeline for")
+			("bench_min_time", value<unsigned int>(&bench_min_time)->default_value(500),
+			 "How long to repeat each microbenchmark for, in milliseconds")
+			("bench_only", value<std::string>(&bench_only)->default_value("all"),
+			 "Run only the \"micro\" benchmarks or the \"pipeline\", or \"all\" of them")
+			("bench_json", value<std::string>(&bench_json)->default_value("-"),
+			 "Write the results to this file, or - for stdout")
+		;
+		// clang-format on
+	}
+
+	unsigned int bench_seconds;
+	unsigned int bench_min_time;
+	std::string bench_only;
+	std::string bench_json;
+};
+
+struct Result
+{
+	std::string name;
+	double ns_per_op;
+	size_t bytes_per_op;
+};
+
+// Call fn (which does ops operations) over and over for at least min_time, and return
+// the time each operation took.
+template <typename F>
+static double ns_per_op(F fn, unsigned int ops, std::chrono::milliseconds min_time)
+{
+	fn(); // warm the caches up
+	unsigned int calls = 0;
+	auto start = Clock::now(), now = start;
+	do
+	{
+		fn();
+		calls++;
+		now = Clock::now();
+	} while (now - start < min_time);
+	return std::chrono::duration<double, std::nano>(now - start).count() / calls / ops;
+}
+
+static std::string platform()
+{
+	// Pi models identify themselves here.
+	std::ifstream model("/proc/device-tree/model");
+	std::string name;
+	if (model && std::getline(model, name, '\0') && !name.empty())
+		return name;
+	utsname u;
+	uname(&u);
+	return u.machine;
+}
+
+// A libcamera style YUV420 image, with its rows padded to 64 bytes.
+static StreamInfo synthetic_info(unsigned int width, unsigned int height)
+{
+	StreamInfo info;
+	info.width = width;
+	info.height = height;
+	info.stride = (width + 63) & ~63;
+	info.pixel_format = libcamera::formats::YUV420;
+	return info;
+}
+
+static void fill_frame(uint8_t *mem, StreamInfo const &info, unsigned int phase)
+{
+	// A moving gradient, so that NDI's compression has something to work on.
+	for (unsigned int y = 0; y < info.height; y++)
+		for (unsigned int x = 0; x < info.width; x++)
+			mem[y * info.stride + x] = x + y + phase;
+	uint8_t *chroma = mem + info.stride * info.height;
+	for (unsigned int y = 0; y < info.height; y++) // both chroma planes
+		for (unsigned int x = 0; x < info.width / 2; x++)
+			chroma[y * (info.stride / 2) + x] = 128 + ((x * 2 - y + phase) & 63) - 32;
+}
+
+// A slot, for TaggedMetadata to compare with Metadata.
+struct BenchTag
+{
+	typedef float Type;
+	static constexpr char NAME[] = "bench.value";
+};
+
+static void micro_benchmarks(BenchOptions const *options, std::vector<Result> &results)
+{
+	std::chrono::milliseconds min_time(options->bench_min_time);
+	StreamInfo info = synthetic_info(options->Get().width, options->Get().height);
+	std::vector<uint8_t> src(info.stride * info.height * 3 / 2), dst(info.width * info.height * 3);
+	fill_frame(src.data(), info, 0);
+	size_t frame_size = info.width * info.height * 3 / 2;
+	std::string size = std::to_string(info.width) + "x" + std::to_string(info.height);
+
+	results.push_back({ "yuv420_to_uyvy " + size, ns_per_op([&] {
+							yuv420_to_uyvy(src.data(), info.width, info.height, info.stride, dst.data(),
+										   info.width * 2);
+						}, 1, min_time), frame_size });
+	results.push_back({ "yuv420_to_uyvy_scalar " + size, ns_per_op([&] {
+							yuv420_to_uyvy_scalar(src.data(), info.width, info.height, info.stride, dst.data(),
+												  info.width * 2);
+						}, 1, min_time), frame_size });
+	results.push_back({ "yuv420_to_nv12 " + size, ns_per_op([&] {
+							yuv420_to_nv12(src.data(), info.width, info.height, info.stride, dst.data(), info.width);
+						}, 1, min_time), frame_size });
+	results.push_back({ "yuv420_to_nv12_scalar " + size, ns_per_op([&] {
+							yuv420_to_nv12_scalar(src.data(), info.width, info.height, info.stride, dst.data(),
+												  info.width);
+						}, 1, min_time), frame_size });
+
+	{
+		// The 16-bit path starts from RGB48, and makes twice as many bytes as it reads.
+		std::vector<uint8_t> rgb48(info.width * 6 * info.height), p216(info.width * 4 * info.height);
+		for (size_t i = 0; i < rgb48.size(); i++)
+			rgb48[i] = i * 7;
+		size_t rgb48_size = rgb48.size();
+		results.push_back({ "rgb48_to_p216 " + size, ns_per_op([&] {
+								rgb48_to_p216(rgb48.data(), info.width, info.height, info.width * 6, p216.data(),
+											  info.width * 2);
+							}, 1, min_time), rgb48_size });
+		results.push_back({ "rgb48_to_p216_scalar " + size, ns_per_op([&] {
+								rgb48_to_p216_scalar(rgb48.data(), info.width, info.height, info.width * 6,
+													 p216.data(), info.width * 2);
+							}, 1, min_time), rgb48_size });
+	}
+
+	{
+		LumaScopes scopes;
+		LumaStats stats;
+		results.push_back({ "LumaScopes " + size, ns_per_op([&] {
+								scopes.Compute(src.data(), info.width, info.height, info.stride, stats);
+							}, 1, min_time), 0 });
+	}
+
+	{
+		ToneCurve tone_curve;
+		tone_curve.Set("gamma:1.2");
+		results.push_back({ "ToneCurve " + size, ns_per_op([&] {
+								tone_curve.Apply(src.data(), info.width, info.height, info.stride);
+							}, 1, min_time), info.width * info.height });
+	}
+
+	{
+		Overlay overlay("tally,id,timecode,clock", "Camera 1");
+		overlay.SetGeometry(info);
+		overlay.Update(NdiTally::PROGRAM, 30);
+		results.push_back({ "Overlay " + size, ns_per_op([&] { overlay.Apply(src.data()); }, 1, min_time), 0 });
+	}
+
+	// An h.264 frame's worth, at 10Mbps and 30fps, through a 4MB buffer, as CircularOutput
+	// uses it.
+	{
+		constexpr unsigned int FRAME = 10000000 / 8 / 30;
+		CircularBuffer cb(4 << 20);
+		std::vector<uint8_t> frame(FRAME);
+		results.push_back({ "CircularBuffer Write+Read", ns_per_op([&] {
+								cb.Write(frame.data(), FRAME);
+								cb.Read([&](void *src, unsigned int n) { memcpy(dst.data(), src, n); }, FRAME);
+							}, 1, min_time), FRAME });
+	}
+
+	{
+		Metadata metadata;
+		metadata.Set("bench.value", 1.0f);
+		float value;
+		results.push_back({ "Metadata Set+Get", ns_per_op([&] {
+								metadata.Set("bench.value", 2.0f);
+								metadata.Get("bench.value", value);
+							}, 1, min_time), 0 });
+	}
+
+	{
+		TaggedMetadata<BenchTag> metadata;
+		float value = 0;
+		results.push_back({ "TaggedMetadata Set+Get", ns_per_op([&] {
+								metadata.Set<BenchTag>(value + 1);
+								value = *metadata.Get<BenchTag>();
+							}, 1, min_time), 0 });
+	}
+
+	// RPiCamApp::MessageQueue is private, so here is the same queue, as the camera thread
+	// hands requests over to the main loop with it.
+	constexpr unsigned int MESSAGES = 100000;
+	{
+		std::queue<int> queue;
+		std::mutex mutex;
+		std::condition_variable cond;
+		results.push_back({ "MessageQueue handoff", ns_per_op([&] {
+								std::thread producer([&] {
+									for (unsigned int i = 0; i < MESSAGES; i++)
+									{
+										std::unique_lock<std::mutex> lock(mutex);
+										queue.push(i);
+										cond.notify_one();
+									}
+								});
+								for (unsigned int i = 0; i < MESSAGES; i++)
+								{
+									std::unique_lock<std::mutex> lock(mutex);
+									cond.wait(lock, [&] { return !queue.empty(); });
+									queue.pop();
+								}
+								producer.join();
+							}, MESSAGES, min_time), 0 });
+	}
+	{
+		SpscRing<int> ring(64);
+		results.push_back({ "SpscRing handoff", ns_per_op([&] {
+								std::thread producer([&] {
+									for (unsigned int i = 0; i < MESSAGES; i++)
+										while (!ring.Push(i))
+											std::this_thread::yield();
+								});
+								int item;
+								for (unsigned int i = 0; i < MESSAGES; i++)
+									while (!ring.Wait(item, 100))
+										;
+								producer.join();
+							}, MESSAGES, min_time), 0 });
+	}
+
+	{
+		static const float rates[] = { 23.976f, 24, 25, 29.97f, 30, 50, 59.94f, 60, 12.5f, 7.3f };
+		results.push_back({ "findFraction", ns_per_op([&] {
+								for (float rate : rates)
+								{
+									fraction_t f = findFraction(rate);
+									asm volatile("" : : "r"(f.num), "r"(f.den));
+								}
+							}, sizeof(rates) / sizeof(rates[0]), min_time), 0 });
+	}
+}
+
+// Stands in for the camera: frames of the configured size and rate come from a fixed pool
+// of buffers, which the encoder has to give back before they can be used again, just like
+// camera buffers. The buffers come from the dma heap where there is one, so that the
+// hardware encoder can take them.
+class SyntheticSource
+{
+public:
+	static constexpr unsigned int NUM_BUFFERS = 6;
+
+	SyntheticSource(StreamInfo const &info) : info_(info), size_(info.stride * info.height * 3 / 2)
+	{
+		DmaHeap heap;
+		for (unsigned int i = 0; i < NUM_BUFFERS; i++)
+		{
+			Buffer buffer;
+			if (heap.isValid())
+				buffer.fd = heap.alloc("bench", size_);
+			if (buffer.fd.isValid())
+				buffer.mem = (uint8_t *)mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, buffer.fd.get(), 0);
+			else
+				buffer.mem = (uint8_t *)mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+											 -1, 0);
+			if (buffer.mem == MAP_FAILED)
+				throw std::runtime_error("SyntheticSource: failed to allocate buffers");
+			fill_frame(buffer.mem, info_, i * 8);
+			buffers_.push_back(std::move(buffer));
+			free_.push_back(i);
+		}
+	}
+	~SyntheticSource()
+	{
+		for (auto &buffer : buffers_)
+			munmap(buffer.mem, size_);
+	}
+
+	// Feed the encoder at the given rate (or as fast as it will go, for 0) for the given
+	// time. Frames whose turn comes with no buffer free are dropped, as the camera's would be.
+	void Run(Encoder *encoder, float framerate, std::chrono::seconds duration)
+	{
+		auto period = framerate > 0 ? std::chrono::duration_cast<Clock::duration>(
+										  std::chrono::duration<double>(1 / framerate))
+									: Clock::duration(0);
+		auto start = Clock::now(), due = start;
+		while (due - start < duration)
+		{
+			std::this_thread::sleep_until(due);
+			std::unique_lock<std::mutex> lock(mutex_);
+			if (framerate > 0 && free_.empty())
+				dropped_++;
+			else
+			{
+				cond_var_.wait(lock, [this] { return !free_.empty(); });
+				unsigned int index = free_.front();
+				free_.pop_front();
+				in_flight_.push_back(index);
+				lock.unlock();
+
+				// Timestamps are the "capture" time, on the clock the tracer uses.
+				int64_t timestamp_us =
+					std::chrono::duration_cast<std::chrono::microseconds>(Clock::now().time_since_epoch()).count();
+				Buffer &buffer = buffers_[index];
+				encoder->EncodeBuffer(buffer.fd.isValid() ? buffer.fd.get() : -1, size_, buffer.mem, info_,
+									  timestamp_us);
+				submitted_++;
+			}
+			due = period.count() ? due + period : Clock::now();
+		}
+	}
+
+	// Encoders give buffers back in the order they got them.
+	void InputDone(void *)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		free_.push_back(in_flight_.front());
+		in_flight_.pop_front();
+		cond_var_.notify_one();
+	}
+
+	unsigned int Submitted() const { return submitted_; }
+	unsigned int Dropped() const { return dropped_; }
+
+private:
+	struct Buffer
+	{
+		libcamera::UniqueFD fd;
+		uint8_t *mem;
+	};
+
+	StreamInfo info_;
+	size_t size_;
+	std::vector<Buffer> buffers_;
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+	std::deque<unsigned int> free_;
+	std::deque<unsigned int> in_flight_;
+	unsigned int submitted_ = 0;
+	unsigned int dropped_ = 0;
+};
+
+static std::string pipeline_benchmark(BenchOptions *options)
+{
+	StreamInfo info = synthetic_info(options->Get().width, options->Get().height);
+	float framerate = options->Get().framerate.value_or(30);
+
+	NdiOutput output(options);
+	output.SetStreamInfo(info);
+	output.SetFrameRate(framerate);
+	SyntheticSource source(info);
+	std::unique_ptr<Encoder> encoder(Encoder::Create(options, info));
+
+	// Latency is from handing the frame to the encoder until its NDI send returns.
+	std::mutex mutex;
+	std::vector<int64_t> latencies_us;
+	encoder->SetInputDoneCallback(std::bind(&SyntheticSource::InputDone, &source, _1));
+	encoder->SetOutputReadyCallback([&](void *mem, size_t size, int64_t timestamp_us, bool keyframe) {
+		output.FrameReady(mem, size, timestamp_us, keyframe);
+		int64_t now_us =
+			std::chrono::duration_cast<std::chrono::microseconds>(Clock::now().time_since_epoch()).count();
+		std::lock_guard<std::mutex> lock(mutex);
+		latencies_us.push_back(now_us - timestamp_us);
+	});
+
+	auto start = Clock::now();
+	source.Run(encoder.get(), framerate, std::chrono::seconds(options->bench_seconds));
+	encoder.reset(); // waits for anything still being encoded
+	double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+	std::sort(latencies_us.begin(), latencies_us.end());
+	auto percentile = [&](double p) {
+		return latencies_us.empty() ? 0 : latencies_us[std::min(latencies_us.size() - 1,
+																 (size_t)(p * latencies_us.size()))];
+	};
+	std::ostringstream json;
+	json << "{ \"codec\": \"" << options->Get().codec << "\", \"width\": " << info.width
+		 << ", \"height\": " << info.height << ", \"requested_fps\": " << framerate
+		 << ", \"frames_submitted\": " << source.Submitted() << ", \"frames_dropped\": " << source.Dropped()
+		 << ", \"frames_sent\": " << latencies_us.size() << ", \"sent_fps\": " << latencies_us.size() / elapsed
+		 << ", \"latency_us\": { \"p50\": " << percentile(0.5) << ", \"p95\": " << percentile(0.95)
+		 << ", \"p99\": " << percentile(0.99) << ", \"max\": " << percentile(1) << " } }";
+	return json.str();
+}
+
+static std::string json_string(std::string const &s)
+{
+	std::string out = "\"";
+	for (char c : s)
+		out += c == '"' || c == '\\' ? std::string("\\") + c : std::string(1, c);
+	return out + "\"";
+}
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		BenchOptions options;
+		if (!options.Parse(argc, argv))
+			return 0;
+		if (!options.Get().width || !options.Get().height)
+		{
+			options.Set().width = 1920;
+			options.Set().height = 1080;
+		}
+
+		std::vector<Result> results;
+		if (options.bench_only != "pipeline")
+			micro_benchmarks(&options, results);
+		std::string pipeline;
+		if (options.bench_only != "micro")
+			pipeline = pipeline_benchmark(&options);
+
+		std::ostringstream json;
+		json << "{\n  \"platform\": " << json_string(platform()) << ",\n  \"micro\": [";
+		for (size_t i = 0; i < results.size(); i++)
+		{
+			Result const &r = results[i];
+			json << (i ? "," : "") << "\n    { \"name\": " << json_string(r.name) << ", \"ns_per_op\": "
+				 << r.ns_per_op;
+			if (r.bytes_per_op)
+				json << ", \"mb_per_s\": " << r.bytes_per_op / r.ns_per_op * 1000;
+			json << " }";
+		}
+		json << "\n  ]";
+		if (!pipeline.empty())
+			json << ",\n  \"pipeline\": " << pipeline;
+		json << "\n}\n";
+
+		if (options.bench_json == "-")
+			std::cout << json.str();
+		else
+			std::ofstream(options.bench_json) << json.str();
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "ERROR: *** " << e.what() << " ***" << std::endl;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,230 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * raspindi_config.cpp - settings from /etc/raspindi.conf.
+ */
+
+#include <map>
+
+#include <libconfig.h++>
+
+#include <libcamera/control_ids.h>
+#include <libcamera/transform.h>
+
+#include "core/logging.hpp"
+
+#include "raspindi_config.hpp"
+
+namespace controls = libcamera::controls;
+
+template <typename T>
+static void lookup(libconfig::Config const &cfg, char const *name, std::optional<T> &value)
+{
+	T v;
+	if (cfg.lookupValue(name, v))
+		value = v;
+	else if (cfg.exists(name))
+		throw std::runtime_error(std::string("raspindi config: wrong type for ") + name);
+}
+
+// Older config files quote some numbers.
+static void lookup_int(libconfig::Config const &cfg, char const *name, std::optional<int> &value)
+{
+	std::string str;
+	if (!cfg.lookupValue(name, str))
+		return lookup(cfg, name, value);
+	try
+	{
+		value = std::stoi(str);
+	}
+	catch (std::exception const &e)
+	{
+		throw std::runtime_error(std::string("raspindi config: ") + name + " is not a number");
+	}
+}
+
+template <typename T>
+static T find_mode(std::map<std::string, T> const &modes, std::string const &name, char const *what)
+{
+	auto it = modes.find(name);
+	if (it == modes.end())
+		throw std::runtime_error(std::string("raspindi config: unknown ") + what + " " + name);
+	return it->second;
+}
+
+RaspindiConfig RaspindiConfig::Load(std::string const &path)
+{
+	RaspindiConfig config;
+	libconfig::Config cfg;
+	cfg.setAutoConvert(true);
+	try
+	{
+		cfg.readFile(path.c_str());
+	}
+	catch (libconfig::FileIOException const &e)
+	{
+		LOG(1, "Could not open config file " << path << ", using defaults");
+		return config;
+	}
+	catch (libconfig::ParseException const &e)
+	{
+		throw std::runtime_error(std::string("parse error at ") + e.getFile() + ":" + std::to_string(e.getLine()) +
+								 " - " + e.getError());
+	}
+
+	lookup(cfg, "neopixel_path", config.neopixel_path);
+	lookup(cfg, "ndi_name", config.ndi_name);
+	lookup(cfg, "ndi_groups", config.ndi_groups);
+	lookup(cfg, "ndi_transport", config.ndi_transport);
+	lookup(cfg, "ndi_discovery", config.ndi_discovery);
+	lookup_int(cfg, "camera_number", config.camera_number);
+	lookup(cfg, "width", config.width);
+	lookup(cfg, "height", config.height);
+	lookup(cfg, "fps", config.fps);
+	lookup_int(cfg, "rotation", config.rotation);
+	lookup(cfg, "mirror", config.mirror);
+	lookup(cfg, "awb", config.awb);
+	lookup(cfg, "r_gain", config.r_gain);
+	lookup(cfg, "b_gain", config.b_gain);
+	lookup(cfg, "gain", config.gain);
+	lookup(cfg, "saturation", config.saturation);
+	lookup(cfg, "sharpness", config.sharpness);
+	lookup(cfg, "contrast", config.contrast);
+	lookup_int(cfg, "brightness", config.brightness);
+	lookup(cfg, "exposuremode", config.exposuremode);
+	lookup(cfg, "meteringmode", config.meteringmode);
+
+	if (cfg.exists("thermal_profiles"))
+	{
+		libconfig::Setting const &profiles = cfg.lookup("thermal_profiles");
+		for (int i = 0; i < profiles.getLength(); i++)
+		{
+			libconfig::Setting const &setting = profiles[i];
+			ThermalProfile profile;
+			float fps;
+			unsigned int width, height;
+			if (!setting.lookupValue("temperature", profile.temperature))
+				throw std::runtime_error("raspindi config: every thermal profile needs a temperature");
+			if (setting.lookupValue("fps", fps))
+				profile.fps = fps;
+			if (setting.lookupValue("width", width))
+				profile.width = width;
+			if (setting.lookupValue("height", height))
+				profile.height = height;
+			if (!config.thermal_profiles.empty() && profile.temperature <= config.thermal_profiles.back().temperature)
+				throw std::runtime_error("raspindi config: thermal profiles must be in rising order of temperature");
+			config.thermal_profiles.push_back(profile);
+		}
+	}
+
+	// Check the names now, rather than when they're first applied.
+	config.Controls();
+	if (config.mirror && *config.mirror != "none" && *config.mirror != "horizontal" && *config.mirror != "vertical" &&
+		*config.mirror != "both")
+		throw std::runtime_error("raspindi config: unknown mirror " + *config.mirror);
+	if (config.ndi_transport && *config.ndi_transport != "" && *config.ndi_transport != "unicast" &&
+		*config.ndi_transport != "multicast")
+		throw std::runtime_error("raspindi config: ndi_transport must be unicast or multicast");
+#ifndef NDI_ADVANCED_SDK
+	if ((config.ndi_transport && !config.ndi_transport->empty()) ||
+		(config.ndi_discovery && !config.ndi_discovery->empty()))
+		throw std::runtime_error("raspindi config: ndi_transport and ndi_discovery need the NDI Advanced SDK");
+#endif
+	if (config.rotation && *config.rotation != 0 && *config.rotation != 180)
+		throw std::runtime_error("raspindi config: rotation must be 0 or 180");
+
+	return config;
+}
+
+void RaspindiConfig::ApplyToOptions(NDIOptions *options) const
+{
+	if (neopixel_path)
+		options->neopixel_path = *neopixel_path;
+	if (ndi_name)
+		options->ndi_name = *ndi_name;
+	if (ndi_groups)
+		options->ndi_groups = *ndi_groups;
+	if (ndi_transport)
+		options->ndi_transport = *ndi_transport;
+	if (ndi_discovery)
+		options->ndi_discovery = *ndi_discovery;
+	// -1 has always meant "the default camera" here.
+	if (camera_number && *camera_number >= 0)
+		options->Set().camera = *camera_number;
+	if (width)
+		options->Set().width = *width;
+	if (height)
+		options->Set().height = *height;
+	if (fps)
+		options->Set().framerate = *fps;
+
+	if (rotation || mirror)
+	{
+		libcamera::Transform transform = libcamera::Transform::Identity;
+		if (mirror && (*mirror == "horizontal" || *mirror == "both"))
+			transform = libcamera::Transform::HFlip * transform;
+		if (mirror && (*mirror == "vertical" || *mirror == "both"))
+			transform = libcamera::Transform::VFlip * transform;
+		bool ok;
+		libcamera::Transform rot = libcamera::transformFromRotation(rotation.value_or(0), &ok);
+		if (!ok)
+			throw std::runtime_error("illegal rotation value");
+		options->Set().transform = rot * transform;
+	}
+}
+
+libcamera::ControlList RaspindiConfig::Controls() const
+{
+	static const std::map<std::string, int> awb_modes = {
+		{ "auto", controls::AwbAuto },			 { "normal", controls::AwbAuto },
+		{ "incadescent", controls::AwbIncandescent }, { "incandescent", controls::AwbIncandescent },
+		{ "tungsten", controls::AwbTungsten },	 { "fluorescent", controls::AwbFluorescent },
+		{ "indoor", controls::AwbIndoor },		 { "daylight", controls::AwbDaylight },
+		{ "cloudy", controls::AwbCloudy },		 { "custom", controls::AwbCustom },
+	};
+	static const std::map<std::string, int> exposure_modes = {
+		{ "normal", controls::ExposureNormal }, { "auto", controls::ExposureNormal },
+		{ "sport", controls::ExposureShort },	{ "short", controls::ExposureShort },
+		{ "long", controls::ExposureLong },		{ "custom", controls::ExposureCustom },
+	};
+	static const std::map<std::string, int> metering_modes = {
+		{ "centre", controls::MeteringCentreWeighted }, { "spot", controls::MeteringSpot },
+		{ "average", controls::MeteringMatrix },		{ "matrix", controls::MeteringMatrix },
+		{ "custom", controls::MeteringCustom },
+	};
+
+	libcamera::ControlList cl(controls::controls);
+	if (awb)
+		cl.set(controls::AwbMode, find_mode(awb_modes, *awb, "awb mode"));
+	// Fixed gains turn the AWB off, so only use them when asked to.
+	if (awb && *awb == "custom" && r_gain && b_gain)
+		cl.set(controls::ColourGains, libcamera::Span<const float, 2>({ *r_gain, *b_gain }));
+	if (gain && *gain > 0)
+		cl.set(controls::AnalogueGain, *gain);
+	if (saturation)
+		cl.set(controls::Saturation, *saturation);
+	if (sharpness)
+		cl.set(controls::Sharpness, *sharpness);
+	if (contrast)
+		cl.set(controls::Contrast, *contrast);
+	if (brightness)
+		cl.set(controls::Brightness, (*brightness - 50) / 50.0f);
+	if (exposuremode)
+		cl.set(controls::AeExposureMode, find_mode(exposure_modes, *exposuremode, "exposure mode"));
+	if (meteringmode)
+		cl.set(controls::AeMeteringMode, find_mode(metering_modes, *meteringmode, "metering mode"));
+	return cl;
+}
+
+bool RaspindiConfig::NeedsRestart(RaspindiConfig const &other) const
+{
+	return camera_number != other.camera_number || width != other.width || height != other.height ||
+		   fps != other.fps || rotation != other.rotation || mirror != other.mirror;
+}
+
+bool RaspindiConfig::NdiSourceChanged(RaspindiConfig const &other) const
+{
+	return ndi_name != other.ndi_name || ndi_groups != other.ndi_groups || ndi_transport != other.ndi_transport ||
+		   ndi_discovery != other.ndi_discovery || neopixel_path != other.neopixel_path;
+}
@@ -0,0 +1,78 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * raspindi_config.hpp - settings from /etc/raspindi.conf.
+ */
+
+#pragma once
+
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <libcamera/controls.h>
+
+#include "ndi_options.hpp"
+
+// A typed snapshot of the libconfig file, read in one go. Anything the file doesn't set
+// is left empty, so the command line (or the camera's own default) stays in charge of it.
+//
+// Settings fall into three groups, by what it takes to change them while running:
+// camera controls, which go to the camera with the next request; the NDI source name,
+// groups, transport and discovery servers, which only need the NDI sender recreated; and the camera and its mode, which
+// need the whole pipeline restarted.
+
+// A cheaper way to run, which the ThermalGovernor steps down to once the SoC reaches
+// temperature (or the pipeline can't keep up). Anything left empty stays as it was.
+struct ThermalProfile
+{
+	float temperature;
+	std::optional<float> fps;
+	std::optional<unsigned int> width;
+	std::optional<unsigned int> height;
+};
+
+struct RaspindiConfig
+{
+	// Read the file. A missing file is the same as an empty one, but one that doesn't
+	// parse throws, so that a bad edit can't silently reset everything.
+	static RaspindiConfig Load(std::string const &path);
+
+	// Fill in the options that the camera is configured from.
+	void ApplyToOptions(NDIOptions *options) const;
+	// The camera controls these settings correspond to.
+	libcamera::ControlList Controls() const;
+
+	bool NeedsRestart(RaspindiConfig const &other) const;
+	bool NdiSourceChanged(RaspindiConfig const &other) const;
+
+	std::optional<std::string> neopixel_path;
+	std::optional<std::string> ndi_name;
+	std::optional<std::string> ndi_groups;
+	std::optional<std::string> ndi_transport;
+	std::optional<std::string> ndi_discovery;
+
+	// Camera selection and mode.
+	std::optional<int> camera_number;
+	std::optional<unsigned int> width;
+	std::optional<unsigned int> height;
+	std::optional<float> fps;
+	std::optional<int> rotation;
+	std::optional<std::string> mirror;
+
+	// Camera controls.
+	std::optional<std::string> awb;
+	std::optional<float> r_gain;
+	std::optional<float> b_gain;
+	std::optional<float> gain;
+	std::optional<float> saturation;
+	std::optional<float> sharpness;
+	std::optional<float> contrast;
+	std::optional<int> brightness; // 0 to 100
+	std::optional<std::string> exposuremode;
+	std::optional<std::string> meteringmode;
+
+	// In rising order of temperature.
+	std::vector<ThermalProfile> thermal_profiles;
+};
@@ -0,0 +1,113 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * raspindi_flight.cpp - print a flight recorder dump as one timeline.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "flight_recorder.hpp"
+
+static char const *const TYPE_NAMES[] = { "",			"frame_arrived", "encode_start", "encode_end",
+										  "send_start", "send_end",		 "drop",		 "control",
+										  "hold" };
+static_assert(std::size(TYPE_NAMES) == FlightEvent::NUM_TYPES, "a name for every event");
+static char const *const REASON_NAMES[] = { "late_for_encode", "late_for_send", "awaiting_keyframe", "encoder_busy",
+											"encoder_backlog" };
+static_assert(std::size(REASON_NAMES) == FlightEvent::NUM_REASONS, "a name for every reason");
+
+struct Entry
+{
+	FlightEvent const *event;
+	char const *thread;
+};
+
+static void usage()
+{
+	std::cerr << "Usage: raspindi_flight <flight recorder dump>" << std::endl
+			  << "Prints every thread's events, oldest first, as CSV, with the local time of each." << std::endl;
+}
+
+static void print_time(std::ostream &os, int64_t realtime_ns)
+{
+	time_t seconds = realtime_ns / 1000000000;
+	tm local;
+	char buf[32];
+	strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime_r(&seconds, &local));
+	os << buf << "." << std::setw(6) << std::setfill('0') << (realtime_ns / 1000) % 1000000 << std::setfill(' ');
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 2 || argv[1][0] == '-')
+	{
+		usage();
+		return 1;
+	}
+	std::string filename = argv[1];
+
+	std::ifstream file(filename, std::ios::binary);
+	std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	FlightRecorderHeader const *header = (FlightRecorderHeader const *)data.data();
+	if (data.size() < FlightRecorderHeader::SIZE || memcmp(header->magic, FlightRecorderHeader::MAGIC, 8) ||
+		header->version != FlightRecorderHeader::VERSION || header->event_size != sizeof(FlightEvent) ||
+		!header->capacity || header->num_rings > FlightRecorderHeader::MAX_RINGS)
+	{
+		std::cerr << "ERROR: " << filename << " is not a raspindi flight recorder dump" << std::endl;
+		return 1;
+	}
+	if (data.size() < FlightRecorderHeader::SIZE + (size_t)header->num_rings * header->capacity * sizeof(FlightEvent))
+	{
+		std::cerr << "ERROR: " << filename << " is cut short" << std::endl;
+		return 1;
+	}
+	FlightEvent const *events = (FlightEvent const *)(data.data() + FlightRecorderHeader::SIZE);
+
+	// Each ring is in order already, but the threads interleave.
+	std::vector<Entry> entries;
+	std::vector<std::string> threads(header->num_rings);
+	for (unsigned int r = 0; r < header->num_rings; r++)
+	{
+		FlightRecorderHeader::Ring const &ring = header->rings[r];
+		threads[r] = std::string(ring.thread_name, strnlen(ring.thread_name, sizeof(ring.thread_name)));
+		uint64_t first = ring.written > header->capacity ? ring.written - header->capacity : 0;
+		for (uint64_t n = first; n < ring.written; n++)
+		{
+			FlightEvent const &event = events[(size_t)r * header->capacity + n % header->capacity];
+			// Overwritten while the dump was being taken.
+			if (event.position != (uint32_t)n || !event.type || event.type >= FlightEvent::NUM_TYPES)
+				continue;
+			entries.push_back({ &event, threads[r].c_str() });
+		}
+	}
+	std::stable_sort(entries.begin(), entries.end(),
+					 [](Entry const &a, Entry const &b) { return a.event->time_ns < b.event->time_ns; });
+
+	std::string reason(header->reason, strnlen(header->reason, sizeof(header->reason)));
+	std::cerr << "raspindi " << header->pid << ", dumped for " << reason << ": " << entries.size() << " events from "
+			  << header->num_rings << " threads" << std::endl;
+	std::cout << "time,monotonic_ns,thread,event,frame_us,value,detail" << std::endl;
+	for (Entry const &entry : entries)
+	{
+		FlightEvent const &event = *entry.event;
+		print_time(std::cout, event.time_ns + header->realtime_offset_ns);
+		std::cout << "," << event.time_ns << "," << entry.thread << "," << TYPE_NAMES[event.type] << ","
+				  << event.frame_us << "," << event.value << ",";
+		if (event.type == FlightEvent::DROP && event.detail < FlightEvent::NUM_REASONS)
+			std::cout << REASON_NAMES[event.detail];
+		else
+			std::cout << event.detail;
+		std::cout << "\n";
+	}
+	std::cout << std::flush;
+	return 0;
+}
@@ -0,0 +1,126 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * raspindi_metadata.cpp - convert a --metadata_log file to CSV or JSON.
+ */
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "metadata_log.hpp"
+
+// Fields missing from a frame's metadata are left empty in CSV, and out of the JSON.
+struct Column
+{
+	char const *name;
+	uint32_t field;
+	void (*print)(std::ostream &os, MetadataRecord const &record);
+};
+
+static Column const COLUMNS[] = {
+	{ "sequence", 0, [](std::ostream &os, MetadataRecord const &r) { os << r.sequence; } },
+	{ "timestamp_us", 0, [](std::ostream &os, MetadataRecord const &r) { os << r.timestamp_us; } },
+	{ "sensor_timestamp_ns", 0, [](std::ostream &os, MetadataRecord const &r) { os << r.sensor_timestamp_ns; } },
+	{ "exposure_us", MetadataRecord::EXPOSURE, [](std::ostream &os, MetadataRecord const &r) { os << r.exposure_us; } },
+	{ "analogue_gain", MetadataRecord::ANALOGUE_GAIN,
+	  [](std::ostream &os, MetadataRecord const &r) { os << r.analogue_gain; } },
+	{ "digital_gain", MetadataRecord::DIGITAL_GAIN,
+	  [](std::ostream &os, MetadataRecord const &r) { os << r.digital_gain; } },
+	{ "red_gain", MetadataRecord::COLOUR_GAINS, [](std::ostream &os, MetadataRecord const &r) { os << r.red_gain; } },
+	{ "blue_gain", MetadataRecord::COLOUR_GAINS, [](std::ostream &os, MetadataRecord const &r) { os << r.blue_gain; } },
+	{ "colour_temperature", MetadataRecord::COLOUR_TEMPERATURE,
+	  [](std::ostream &os, MetadataRecord const &r) { os << r.colour_temperature; } },
+	{ "lux", MetadataRecord::LUX, [](std::ostream &os, MetadataRecord const &r) { os << r.lux; } },
+	{ "lens_position", MetadataRecord::LENS_POSITION,
+	  [](std::ostream &os, MetadataRecord const &r) { os << r.lens_position; } },
+	{ "focus_fom", MetadataRecord::FOCUS_FOM, [](std::ostream &os, MetadataRecord const &r) { os << r.focus_fom; } },
+};
+
+static void usage()
+{
+	std::cerr << "Usage: raspindi_metadata [--json] <metadata log>" << std::endl
+			  << "Prints every frame in the log, oldest first, as CSV (or with --json, a JSON array)."
+			  << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+	bool json = false;
+	std::string filename;
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--json"))
+			json = true;
+		else if (filename.empty() && argv[i][0] != '-')
+			filename = argv[i];
+		else
+		{
+			usage();
+			return 1;
+		}
+	}
+	if (filename.empty())
+	{
+		usage();
+		return 1;
+	}
+
+	std::ifstream file(filename, std::ios::binary);
+	MetadataLogHeader header;
+	if (!file.read((char *)&header, sizeof(header)) || memcmp(header.magic, MetadataLogHeader::MAGIC, 8) ||
+		header.version != MetadataLogHeader::VERSION || header.record_size != sizeof(MetadataRecord) ||
+		!header.capacity)
+	{
+		std::cerr << "ERROR: " << filename << " is not a raspindi metadata log" << std::endl;
+		return 1;
+	}
+	std::vector<MetadataRecord> records(header.capacity);
+	file.seekg(MetadataLogHeader::SIZE);
+	if (!file.read((char *)records.data(), records.size() * sizeof(MetadataRecord)))
+	{
+		std::cerr << "ERROR: " << filename << " is cut short" << std::endl;
+		return 1;
+	}
+
+	uint64_t first = header.written > header.capacity ? header.written - header.capacity : 0;
+	if (json)
+		std::cout << "[";
+	else
+	{
+		for (size_t c = 0; c < std::size(COLUMNS); c++)
+			std::cout << (c ? "," : "") << COLUMNS[c].name;
+		std::cout << std::endl;
+	}
+	for (uint64_t n = first; n < header.written; n++)
+	{
+		MetadataRecord const &record = records[n % header.capacity];
+		if (json)
+			std::cout << (n > first ? ",\n " : "\n ") << "{";
+		bool any = false;
+		for (size_t c = 0; c < std::size(COLUMNS); c++)
+		{
+			Column const &column = COLUMNS[c];
+			bool present = !column.field || (record.present & column.field);
+			if (json && present)
+			{
+				std::cout << (any ? ", \"" : " \"") << column.name << "\": ";
+				column.print(std::cout, record);
+				any = true;
+			}
+			else if (!json)
+			{
+				std::cout << (c ? "," : "");
+				if (present)
+					column.print(std::cout, record);
+			}
+		}
+		std::cout << (json ? " }" : "\n");
+	}
+	std::cout << (json ? "\n]\n" : "") << std::flush;
+	return 0;
+}
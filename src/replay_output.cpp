@@ -0,0 +1,231 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * replay_output.cpp - keep the last few seconds of video, and save them on demand.
+ */
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#include "core/logging.hpp"
+
+#include "replay_output.hpp"
+#include "thread_policy.hpp"
+
+// When we're told nothing about the bitrate, assume it's as high as the h.264 encoder goes.
+static constexpr uint64_t DEFAULT_BITRATE_BPS = 25000000;
+// Room for a keyframe interval either side of the replay itself.
+static constexpr unsigned int HEADROOM_SECONDS = 4;
+
+// Write everything, even if the kernel only takes some of it at a time.
+static bool write_all(int fd, iovec *iov, unsigned int n)
+{
+	while (n)
+	{
+		ssize_t written = writev(fd, iov, n);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		for (; n && (size_t)written >= iov->iov_len; iov++, n--)
+			written -= iov->iov_len;
+		if (n)
+		{
+			iov->iov_base = (uint8_t *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	return true;
+}
+
+static size_t ring_size(VideoOptions const *options, unsigned int seconds)
+{
+	uint64_t bitrate_bps = options->Get().bitrate.bps() ? options->Get().bitrate.bps() : DEFAULT_BITRATE_BPS;
+	return options->Get().circular ? options->Get().circular << 20 : bitrate_bps / 8 * (seconds + HEADROOM_SECONDS);
+}
+
+ReplayOutput::ReplayOutput(VideoOptions const *options, std::string const &directory, unsigned int seconds)
+	: Output(options), directory_(directory), extension_(options->Get().codec), preroll_us_(seconds * 1000000LL),
+	  ring_(ring_size(options, seconds), "replay"), first_seq_(0), write_pos_(0), flush_seq_(0), stop_seq_(0),
+	  live_(false), new_file_(false), resync_(false), dropped_(0), abort_(false)
+{
+	flush_thread_ = std::thread(&ReplayOutput::flushThread, this);
+	LOG(2, "ReplayOutput: " << (ring_.Size() >> 20) << "MB ring, " << seconds << "s replays to " << directory_);
+}
+
+ReplayOutput::~ReplayOutput()
+{
+	// Like CircularOutput, anything being saved is saved in full first.
+	Trigger(false);
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	cond_var_.notify_one();
+	flush_thread_.join();
+
+	if (dropped_)
+		LOG(1, "ReplayOutput: dropped " << dropped_ << " frames");
+}
+
+void ReplayOutput::Trigger(bool on)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (on == live_)
+		return;
+	live_ = on;
+
+	if (!on)
+	{
+		stop_seq_ = endSeq();
+		LOG(1, "Replay stopping");
+	}
+	else if (flush_seq_ >= stop_seq_)
+	{
+		// Start from the last keyframe that gives us the pre-roll, or as near as we can.
+		int64_t preroll_start_us = frames_.empty() ? 0 : frames_.back().timestamp_us - preroll_us_;
+		uint64_t start = endSeq();
+		for (uint64_t seq = first_seq_; seq < endSeq(); seq++)
+		{
+			Frame const &frame = frames_[seq - first_seq_];
+			if (!frame.keyframe)
+				continue;
+			if (start != endSeq() && frame.timestamp_us > preroll_start_us)
+				break;
+			start = seq;
+		}
+		flush_seq_ = start;
+		new_file_ = true;
+		LOG(1, "Replay starting, " << endSeq() - start << " frames from the ring");
+	}
+	cond_var_.notify_one();
+}
+
+void ReplayOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	bool keyframe = flags & FLAG_KEYFRAME;
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	// After a drop, nothing will decode until the next keyframe.
+	if ((resync_ && !keyframe) || size > ring_.Size() / 2)
+	{
+		resync_ = true;
+		dropped_++;
+		return;
+	}
+
+	// Make room, oldest first, but never at the expense of frames still to be saved.
+	while (!frames_.empty() && write_pos_ + size - frames_.front().pos > ring_.Size())
+	{
+		if (protectedFrame(first_seq_))
+		{
+			if (!resync_)
+				LOG(1, "ReplayOutput: disk too slow, dropping frames");
+			resync_ = true;
+			dropped_++;
+			return;
+		}
+		frames_.pop_front();
+		first_seq_++;
+	}
+	resync_ = false;
+
+	memcpy(ring_.At(write_pos_), mem, size);
+	frames_.push_back({ write_pos_, size, timestamp_us, keyframe });
+	write_pos_ += size;
+	if (live_)
+		cond_var_.notify_one();
+}
+
+void ReplayOutput::flushThread()
+{
+	ThreadPolicy::Get().Apply(ThreadPolicy::OTHER, "replay-flush");
+	// Capture and encoding come first.
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
+
+	int fd = -1;
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (true)
+	{
+		uint64_t end = live_ ? endSeq() : stop_seq_;
+		if (fd >= 0 && !live_ && flush_seq_ >= stop_seq_)
+		{
+			close(fd);
+			fd = -1;
+			LOG(1, "Replay saved");
+			continue;
+		}
+		if (flush_seq_ >= end)
+		{
+			if (abort_)
+				break;
+			cond_var_.wait(lock);
+			continue;
+		}
+
+		if (new_file_)
+		{
+			// A file has to start with a keyframe.
+			if (!frames_[flush_seq_ - first_seq_].keyframe)
+			{
+				flush_seq_++;
+				continue;
+			}
+			new_file_ = false;
+
+			char name[32];
+			time_t now = time(nullptr);
+			tm local;
+			strftime(name, sizeof(name), "replay-%Y%m%d-%H%M%S.", localtime_r(&now, &local));
+			std::string filename = directory_ + "/" + name + extension_;
+			lock.unlock();
+			if (fd >= 0)
+				close(fd);
+			fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+			if (fd < 0)
+				LOG_ERROR("ERROR: ReplayOutput could not open " << filename << ": " << strerror(errno));
+			else
+				LOG(1, "Saving replay to " << filename);
+			lock.lock();
+			continue;
+		}
+		if (fd < 0)
+		{
+			// No file to save to, so let these go.
+			flush_seq_ = end;
+			continue;
+		}
+
+		// Neither the writer nor Trigger will touch these frames until flush_seq_ passes them.
+		iovec iov[WRITE_BATCH];
+		unsigned int n = 0;
+		for (uint64_t seq = flush_seq_; seq < end && n < WRITE_BATCH; seq++, n++)
+		{
+			Frame const &frame = frames_[seq - first_seq_];
+			iov[n].iov_base = ring_.At(frame.pos);
+			iov[n].iov_len = frame.size;
+		}
+		lock.unlock();
+		bool ok = write_all(fd, iov, n);
+		if (!ok)
+		{
+			LOG_ERROR("ERROR: ReplayOutput write failed: " << strerror(errno));
+			close(fd);
+			fd = -1;
+		}
+		lock.lock();
+		flush_seq_ += n;
+	}
+
+	if (fd >= 0)
+		close(fd);
+}
@@ -0,0 +1,80 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * replay_output.hpp - keep the last few seconds of video, and save them on demand.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "output/output.hpp"
+
+#include "mirrored_ring.hpp"
+
+// An instant replay recorder. Encoded frames go continuously into a ring in memory, and
+// when triggered (normally by the NDI tally going to program), the last replay_seconds
+// from the keyframe before, followed by everything that arrives until the trigger goes
+// away, are written to a new file in the given directory.
+//
+// Unlike CircularBuffer, the ring is a MirroredRing, so each frame is stored with a single
+// memcpy, and can be written out straight from the ring, many frames to a writev. That
+// happens on a thread of its own, at a low priority, so that the disk never holds up the
+// encoder. If the disk is so slow that frames still waiting to be written would be
+// overwritten, new frames are dropped instead, up to the next keyframe.
+
+class ReplayOutput : public Output
+{
+public:
+	ReplayOutput(VideoOptions const *options, std::string const &directory, unsigned int seconds);
+	~ReplayOutput();
+
+	// Start saving, or stop once whatever has been captured so far is saved. Starting
+	// again before the previous file is finished just carries on with it.
+	void Trigger(bool on);
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	// How many frames to hand the kernel in one writev.
+	static constexpr unsigned int WRITE_BATCH = 64;
+
+	struct Frame
+	{
+		uint64_t pos; // in bytes, since the ring was created
+		size_t size;
+		int64_t timestamp_us;
+		bool keyframe;
+	};
+
+	void flushThread();
+	bool protectedFrame(uint64_t seq) const { return seq >= flush_seq_ && (live_ || seq < stop_seq_); }
+	uint64_t endSeq() const { return first_seq_ + frames_.size(); }
+
+	std::string directory_;
+	std::string extension_;
+	int64_t preroll_us_;
+	MirroredRing ring_;
+
+	// All guarded by mutex_. Frame number seq is frames_[seq - first_seq_], and frames
+	// flush_seq_ up to stop_seq_ (or all of them, while live_) are still to be saved.
+	std::deque<Frame> frames_;
+	uint64_t first_seq_;
+	uint64_t write_pos_;
+	uint64_t flush_seq_;
+	uint64_t stop_seq_;
+	bool live_;
+	bool new_file_;
+	bool resync_;
+	unsigned int dropped_;
+	bool abort_;
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+	std::thread flush_thread_;
+};
@@ -0,0 +1,175 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * rpicam_ndi_app.hpp - libcamera application class for NDI.
+ */
+
+#pragma once
+
+#include "core/rpicam_encoder.hpp"
+
+#include "flight_recorder.hpp"
+#include "metrics.hpp"
+#include "ndi_h264_encoder.hpp"
+#include "ndi_hevc_encoder.hpp"
+#include "ndi_speedhq_encoder.hpp"
+#include "ndi_options.hpp"
+#include "spsc_ring.hpp"
+
+class RPiCamNdiApp : public RPiCamEncoder
+{
+public:
+	RPiCamNdiApp() : RPiCamEncoder(std::make_unique<NDIOptions>()), lores_queue_(NdiH264Encoder::NUM_OUTPUT_BUFFERS) {}
+
+	NDIOptions *GetOptions() const { return static_cast<NDIOptions *>(RPiCamEncoder::GetOptions()); }
+
+	// The encoders take their frames from the video stream, except with --ndi_fourcc p216,
+	// as libcamera's video streams are only ever 8 bits. That comes from a 16-bit RGB
+	// still stream instead, which the Pi 5's ISP fills at full precision, and which runs
+	// continuously like any other once the camera starts.
+	void ConfigureMain(unsigned int video_flags)
+	{
+		if (GetOptions()->ndi_fourcc != "p216")
+		{
+			ConfigureVideo(video_flags);
+			return;
+		}
+		ConfigureStill(FLAG_STILL_RGB48 | FLAG_STILL_TRIPLE_BUFFER);
+		StreamInfo info;
+		if (!StillStream(&info) || info.pixel_format != libcamera::formats::RGB48)
+			throw std::runtime_error("this camera can't give 16-bit RGB, so can't send P216");
+	}
+	Stream *MainStream(StreamInfo *info = nullptr) const
+	{
+		Stream *stream = StillStream(info);
+		return stream ? stream : VideoStream(info);
+	}
+
+	// The timestamp that the encoders pass on with this frame's buffer, as RPiCamEncoder
+	// works it out.
+	static int64_t FrameTimestamp(CompletedRequestPtr const &completed_request, FrameBuffer *buffer)
+	{
+		auto ts = completed_request->metadata.get(controls::FrameWallClock);
+		return ts ? *ts : buffer->metadata().timestamp / 1000;
+	}
+
+	// Ask whichever encoder feeds the given NDI|HX stream for a keyframe.
+	void RequestKeyframe(bool low_bandwidth)
+	{
+		Encoder *encoder = low_bandwidth ? lores_encoder_.get() : encoder_.get();
+		if (NdiH264Encoder *h264_encoder = dynamic_cast<NdiH264Encoder *>(encoder))
+			h264_encoder->RequestKeyframe();
+		else if (NdiHevcEncoder *hevc_encoder = dynamic_cast<NdiHevcEncoder *>(encoder))
+			hevc_encoder->RequestKeyframe();
+	}
+
+	// Reprogram the bitrate of whichever encoder feeds the given NDI|HX stream.
+	void SetBitrate(bool low_bandwidth, unsigned int bitrate_bps)
+	{
+		Encoder *encoder = low_bandwidth ? lores_encoder_.get() : encoder_.get();
+		if (NdiH264Encoder *h264_encoder = dynamic_cast<NdiH264Encoder *>(encoder))
+			h264_encoder->SetBitrate(bitrate_bps);
+		else if (NdiHevcEncoder *hevc_encoder = dynamic_cast<NdiHevcEncoder *>(encoder))
+			hevc_encoder->SetBitrate(bitrate_bps);
+	}
+
+	// Frames the main encoder has been given and not yet returned, for the encoders that
+	// can queue them up (the rest return each frame before EncodeBuffer does).
+	unsigned int EncoderBacklog()
+	{
+		if (NdiH264Encoder *h264_encoder = dynamic_cast<NdiH264Encoder *>(encoder_.get()))
+			return h264_encoder->Backlog();
+		else if (NdiHevcEncoder *hevc_encoder = dynamic_cast<NdiHevcEncoder *>(encoder_.get()))
+			return hevc_encoder->Backlog();
+		else if (NdiSpeedHqEncoder *speedhq_encoder = dynamic_cast<NdiSpeedHqEncoder *>(encoder_.get()))
+			return speedhq_encoder->Backlog();
+		return 0;
+	}
+
+	// Hides RPiCamApp's, so that the flight recorder sees every control we apply.
+	void SetControls(libcamera::ControlList const &controls)
+	{
+		FlightRecorder::Get().Record(FlightEvent::CONTROL, 0, controls.size());
+		RPiCamEncoder::SetControls(controls);
+	}
+
+	// Set the quality of SpeedHQ frames (--codec ndi_shq), as NDI asks.
+	void SetQuality(int quality)
+	{
+		if (NdiSpeedHqEncoder *speedhq_encoder = dynamic_cast<NdiSpeedHqEncoder *>(encoder_.get()))
+			speedhq_encoder->SetQuality(quality);
+	}
+
+	// The low bandwidth NDI|HX or SpeedHQ stream is encoded from the lores stream, which
+	// the ISP scales for us. Nothing happens if no lores stream was configured.
+	void StartLowBandwidthEncoder(OutputReadyCallback callback)
+	{
+		StreamInfo info;
+		if (!LoresStream(&info))
+			return;
+		// The same codec as the main stream, so receivers switching between them need only one decoder.
+		if (GetOptions()->Get().codec == "ndi_hevc")
+			lores_encoder_ = std::make_unique<NdiHevcEncoder>(GetOptions(), info, GetOptions()->low_bitrate);
+		else if (GetOptions()->Get().codec == "ndi_shq")
+			lores_encoder_ = std::make_unique<NdiSpeedHqEncoder>(GetOptions(), info, true);
+		else
+			lores_encoder_ = std::make_unique<NdiH264Encoder>(GetOptions(), info, GetOptions()->low_bitrate);
+		lores_encoder_->SetInputDoneCallback(std::bind(&RPiCamNdiApp::loresBufferDone, this, std::placeholders::_1));
+		lores_encoder_->SetOutputReadyCallback(callback);
+		Metrics::Get().AddGaugeFunction("raspindi_lores_queue_depth", "Frames waiting for the low bandwidth encoder",
+										[this] { return lores_queue_.Size(); }, this);
+	}
+	void EncodeLowBandwidth(CompletedRequestPtr &completed_request)
+	{
+		if (!lores_encoder_)
+			return;
+
+		StreamInfo info;
+		Stream *stream = LoresStream(&info);
+		FrameBuffer *buffer = completed_request->buffers[stream];
+		BufferReadSync r(this, buffer);
+		libcamera::Span span = r.Get()[0];
+		if (!buffer || !span.data())
+			throw std::runtime_error("no lores buffer to encode");
+		int64_t timestamp_us = FrameTimestamp(completed_request, buffer);
+		if (!lores_queue_.Push(completed_request)) // creates a new reference
+			throw std::runtime_error("no lores buffers available to queue");
+		lores_encoder_->EncodeBuffer(buffer->planes()[0].fd.get(), span.size(), span.data(), info, timestamp_us);
+	}
+	void StopLowBandwidthEncoder()
+	{
+		Metrics::Get().RemoveGaugeFunctions(this);
+		lores_encoder_.reset();
+		// Whatever the encoder never got round to returning goes back to the camera now.
+		CompletedRequestPtr completed_request;
+		while (lores_queue_.TryPop(completed_request))
+			completed_request.reset();
+	}
+
+protected:
+	void createEncoder() override
+	{
+		StreamInfo info;
+		MainStream(&info);
+		if (!info.width || !info.height || !info.stride)
+			throw std::runtime_error("video stream is not configured");
+		encoder_ = std::unique_ptr<Encoder>(Encoder::Create(GetOptions(), info));
+	}
+
+private:
+	void loresBufferDone(void *mem)
+	{
+		CompletedRequestPtr completed_request;
+		if (!lores_queue_.TryPop(completed_request))
+			throw std::runtime_error("no lores buffer available to return");
+		// Dropping the reference here returns the request to the camera.
+	}
+
+	std::unique_ptr<Encoder> lores_encoder_;
+	// Requests the lores encoder is still reading from, in the order it will return them.
+	// Pushed from the main thread and popped from the encoder's, and never holding more
+	// than the encoder has input buffers, so a fixed ring replaces the queue and mutex,
+	// and no frame allocates.
+	SpscRing<CompletedRequestPtr> lores_queue_;
+};
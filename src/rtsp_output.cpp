@@ -0,0 +1,462 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * rtsp_output.cpp - serve h.264 over RTSP, for receivers that don't do NDI.
+ */
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <charconv>
+#include <cstring>
+#include <random>
+#include <sstream>
+
+#include "core/logging.hpp"
+
+#include "rtsp_output.hpp"
+#include "thread_policy.hpp"
+
+// Call fn for each NAL unit in an Annex B bitstream, without its start code.
+template <typename F>
+static void for_each_nal(uint8_t const *data, size_t size, F fn)
+{
+	size_t start = size, i = 0;
+	while (i + 3 <= size)
+	{
+		if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1)
+		{
+			// Trailing zeroes belong to the next (4 byte) start code.
+			size_t end = i;
+			while (end > start && data[end - 1] == 0)
+				end--;
+			if (start < end)
+				fn(data + start, end - start);
+			i += 3;
+			start = i;
+		}
+		else
+			i++;
+	}
+	if (start < size)
+		fn(data + start, size - start);
+}
+
+static std::string base64(uint8_t const *data, size_t size)
+{
+	static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	std::string out;
+	for (size_t i = 0; i < size; i += 3)
+	{
+		uint32_t n = data[i] << 16 | (i + 1 < size ? data[i + 1] << 8 : 0) | (i + 2 < size ? data[i + 2] : 0);
+		out += chars[(n >> 18) & 63];
+		out += chars[(n >> 12) & 63];
+		out += i + 1 < size ? chars[(n >> 6) & 63] : '=';
+		out += i + 2 < size ? chars[n & 63] : '=';
+	}
+	return out;
+}
+
+static std::string header_value(std::string const &request, std::string const &name)
+{
+	std::istringstream lines(request);
+	std::string line;
+	while (std::getline(lines, line))
+	{
+		if (line.size() > name.size() && !strncasecmp(line.c_str(), name.c_str(), name.size()) &&
+			line[name.size()] == ':')
+		{
+			size_t start = line.find_first_not_of(' ', name.size() + 1);
+			size_t end = line.find_last_not_of("\r ");
+			return start == std::string::npos ? "" : line.substr(start, end + 1 - start);
+		}
+	}
+	return "";
+}
+
+// A number a client sent us, at the start of text (or all of it, if whole). False if there
+// isn't one, or it's more than max.
+static bool parse_number(std::string const &text, unsigned long max, unsigned long &value, bool whole = false)
+{
+	char const *end = text.data() + text.size();
+	auto [ptr, ec] = std::from_chars(text.data(), end, value);
+	return ec == std::errc() && ptr != text.data() && (!whole || ptr == end) && value <= max;
+}
+
+static std::string status_reply(char const *status, std::string const &request)
+{
+	return std::string("RTSP/1.0 ") + status + "\r\nCSeq: " + header_value(request, "CSeq") + "\r\n\r\n";
+}
+
+RtspOutput::RtspOutput(VideoOptions const *options)
+	: Output(options), sequence_(0), next_session_(1), abort_(false)
+{
+	std::string const &output = options->Get().output;
+	if (output.rfind("rtsp://", 0) != 0)
+		throw std::runtime_error("RtspOutput: unrecognised address " + output);
+	size_t colon = output.find(':', 7);
+	address_ = output.substr(7, colon == std::string::npos ? std::string::npos : colon - 7);
+	int port = colon == std::string::npos ? 554 : std::stoi(output.substr(colon + 1));
+
+	sockaddr_in saddr = {};
+	saddr.sin_family = AF_INET;
+	saddr.sin_port = htons(port);
+	if (!inet_aton(address_.c_str(), &saddr.sin_addr))
+		throw std::runtime_error("RtspOutput: bad address " + address_);
+
+	listen_fd_ = libcamera::UniqueFD(socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0));
+	int enable = 1;
+	setsockopt(listen_fd_.get(), SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+	if (!listen_fd_.isValid() || bind(listen_fd_.get(), (sockaddr *)&saddr, sizeof(saddr)) < 0 ||
+		listen(listen_fd_.get(), 4) < 0)
+		throw std::runtime_error("RtspOutput: failed to listen on " + output);
+
+	// One socket sends RTP to every UDP client.
+	rtp_fd_ = libcamera::UniqueFD(socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0));
+	saddr.sin_port = 0;
+	socklen_t len = sizeof(saddr);
+	if (!rtp_fd_.isValid() || bind(rtp_fd_.get(), (sockaddr *)&saddr, sizeof(saddr)) < 0 ||
+		getsockname(rtp_fd_.get(), (sockaddr *)&saddr, &len) < 0)
+		throw std::runtime_error("RtspOutput: failed to open RTP socket");
+	rtp_port_ = ntohs(saddr.sin_port);
+
+	std::random_device random;
+	ssrc_ = random();
+	rtp_offset_ = random();
+	frame_period_us_ = 1000000 / options->Get().framerate.value_or(30);
+
+	server_thread_ = std::thread(&RtspOutput::serverThread, this);
+	LOG(1, "RTSP server listening on " << output);
+}
+
+RtspOutput::~RtspOutput()
+{
+	abort_ = true;
+	server_thread_.join();
+	for (auto &client : clients_)
+		close(client->fd);
+}
+
+void RtspOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	bool keyframe = flags & FLAG_KEYFRAME;
+	uint32_t rtp_timestamp = rtp_offset_ + (uint32_t)(timestamp_us * 9 / 100); // 90kHz
+	packetise((uint8_t const *)mem, size, rtp_timestamp, packets_);
+
+	timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int64_t interval_ns = packets_.size() > PACING_BURST
+							  ? frame_period_us_ * 1000 * PACING_FRACTION / packets_.size()
+							  : 0;
+
+	for (size_t i = 0; i < packets_.size(); i++)
+	{
+		if (interval_ns && i)
+		{
+			int64_t ns = start.tv_nsec + interval_ns * i;
+			timespec due = { start.tv_sec + (time_t)(ns / 1000000000), (long)(ns % 1000000000) };
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, nullptr);
+		}
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (auto &client : clients_)
+		{
+			if (!client->playing || client->dead)
+				continue;
+			if (client->waiting_keyframe)
+			{
+				if (!keyframe || i)
+					continue;
+				client->waiting_keyframe = false;
+			}
+			sendPacket(*client, packets_[i]);
+		}
+	}
+}
+
+void RtspOutput::packetise(uint8_t const *data, size_t size, uint32_t rtp_timestamp, std::vector<Packet> &packets)
+{
+	packets.clear();
+	for_each_nal(data, size, [&](uint8_t const *nal, size_t nal_size) {
+		uint8_t type = nal[0] & 0x1f;
+		if (type == 7 || type == 8)
+		{
+			// Keep the parameter sets for the SDP, for clients that want them out of band.
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (type == 7)
+			{
+				sprop_parameter_sets_ = base64(nal, nal_size);
+				if (nal_size >= 4)
+				{
+					char id[7];
+					snprintf(id, sizeof(id), "%02x%02x%02x", nal[1], nal[2], nal[3]);
+					profile_level_id_ = id;
+				}
+			}
+			else if (sprop_parameter_sets_.find(',') == std::string::npos)
+				sprop_parameter_sets_ += "," + base64(nal, nal_size);
+		}
+
+		auto add = [&](uint8_t const *payload, size_t payload_size) -> Packet & {
+			packets.emplace_back();
+			Packet &packet = packets.back();
+			packet.header[0] = 0x80; // version 2
+			packet.header[1] = 96; // dynamic payload type, marker set later
+			packet.header[2] = sequence_ >> 8;
+			packet.header[3] = sequence_ & 0xff;
+			sequence_++;
+			for (int i = 0; i < 4; i++)
+			{
+				packet.header[4 + i] = rtp_timestamp >> (24 - 8 * i);
+				packet.header[8 + i] = ssrc_ >> (24 - 8 * i);
+			}
+			packet.header_size = 12;
+			packet.payload = payload;
+			packet.payload_size = payload_size;
+			return packet;
+		};
+
+		if (nal_size <= RTP_PAYLOAD)
+		{
+			add(nal, nal_size);
+			return;
+		}
+		// FU-A: the NAL header is replaced by the FU indicator and header, in each fragment.
+		for (size_t offset = 1; offset < nal_size; offset += RTP_PAYLOAD - 2)
+		{
+			size_t fragment = std::min(RTP_PAYLOAD - 2, nal_size - offset);
+			Packet &packet = add(nal + offset, fragment);
+			packet.header[12] = (nal[0] & 0xe0) | 28;
+			packet.header[13] = type | (offset == 1 ? 0x80 : 0) | (offset + fragment == nal_size ? 0x40 : 0);
+			packet.header_size = 14;
+		}
+	});
+	// The marker bit ends the access unit.
+	if (!packets.empty())
+		packets.back().header[1] |= 0x80;
+}
+
+void RtspOutput::sendPacket(Client &client, Packet const &packet)
+{
+	uint8_t prefix[4] = { '$', client.channel, (uint8_t)((packet.header_size + packet.payload_size) >> 8),
+						  (uint8_t)(packet.header_size + packet.payload_size) };
+	iovec iov[3] = { { prefix, sizeof(prefix) },
+					 { (void *)packet.header, packet.header_size },
+					 { (void *)packet.payload, packet.payload_size } };
+	msghdr msg = {};
+	if (client.interleaved)
+	{
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 3;
+		// A client that can't keep up over TCP is better dropped than waited for.
+		// A partial send would leave the interleaving out of step, so that counts too.
+		ssize_t size = sizeof(prefix) + packet.header_size + packet.payload_size;
+		if (sendmsg(client.fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT) != size)
+			client.dead = true;
+	}
+	else
+	{
+		msg.msg_name = &client.rtp_addr;
+		msg.msg_namelen = sizeof(client.rtp_addr);
+		msg.msg_iov = iov + 1;
+		msg.msg_iovlen = 2;
+		sendmsg(rtp_fd_.get(), &msg, MSG_DONTWAIT);
+	}
+}
+
+void RtspOutput::serverThread()
+{
+	ThreadPolicy::Get().Apply(ThreadPolicy::OTHER, "rtsp-server");
+	std::vector<pollfd> fds;
+	while (!abort_)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			fds.assign(1, { listen_fd_.get(), POLLIN, 0 });
+			for (auto &client : clients_)
+				fds.push_back({ client->fd, POLLIN, 0 });
+		}
+		if (poll(fds.data(), fds.size(), POLL_TIMEOUT_MS) < 0)
+			continue;
+		if (fds[0].revents & POLLIN)
+			acceptClient();
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (auto it = clients_.begin(); it != clients_.end();)
+		{
+			Client &client = **it;
+			bool ready = false;
+			for (size_t i = 1; i < fds.size(); i++)
+				ready |= fds[i].fd == client.fd && fds[i].revents;
+			if (client.dead || (ready && !readClient(client)))
+			{
+				LOG(1, "RTSP client " << inet_ntoa(client.peer.sin_addr) << " gone");
+				close(client.fd);
+				it = clients_.erase(it);
+			}
+			else
+				it++;
+		}
+	}
+}
+
+void RtspOutput::acceptClient()
+{
+	auto client = std::make_unique<Client>();
+	socklen_t len = sizeof(client->peer);
+	client->fd = accept4(listen_fd_.get(), (sockaddr *)&client->peer, &len, SOCK_CLOEXEC);
+	if (client->fd < 0)
+		return;
+	client->playing = client->waiting_keyframe = client->interleaved = client->dead = false;
+	client->channel = 0;
+	LOG(1, "RTSP client " << inet_ntoa(client->peer.sin_addr) << " connected");
+	std::lock_guard<std::mutex> lock(mutex_);
+	clients_.push_back(std::move(client));
+}
+
+bool RtspOutput::readClient(Client &client)
+{
+	char buffer[4096];
+	ssize_t n = recv(client.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+	if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+		return false;
+	if (n > 0)
+		client.request.append(buffer, n);
+
+	while (!client.request.empty())
+	{
+		// Interleaved RTCP from the client, which we have no use for.
+		if (client.request[0] == '$')
+		{
+			if (client.request.size() < 4)
+				break;
+			size_t length = 4 + ((uint8_t)client.request[2] << 8 | (uint8_t)client.request[3]);
+			if (client.request.size() < length)
+				break;
+			client.request.erase(0, length);
+			continue;
+		}
+
+		size_t end = client.request.find("\r\n\r\n");
+		if (end == std::string::npos)
+			return client.request.size() < MAX_REQUEST;
+		end += 4;
+		std::string header = client.request.substr(0, end);
+		std::string length = header_value(header, "Content-Length");
+		unsigned long body = 0;
+		if (!length.empty() && !parse_number(length, MAX_REQUEST, body, true))
+		{
+			// There's no telling where the next request would start.
+			sendResponse(client, status_reply("400 Bad Request", header));
+			return false;
+		}
+		if (client.request.size() < end + body)
+			break;
+
+		std::string response = handleRequest(client, header);
+		client.request.erase(0, end + body);
+		if (!sendResponse(client, response))
+			return false;
+	}
+	return true;
+}
+
+bool RtspOutput::sendResponse(Client &client, std::string const &response)
+{
+	// We hold the lock, which outputBuffer needs, so this mustn't block. Responses are
+	// small, and a client that hasn't room for one isn't reading what we send it anyway.
+	return send(client.fd, response.data(), response.size(), MSG_NOSIGNAL | MSG_DONTWAIT) ==
+		   (ssize_t)response.size();
+}
+
+std::string RtspOutput::handleRequest(Client &client, std::string const &request)
+{
+	std::istringstream request_line(request);
+	std::string method, url;
+	request_line >> method >> url;
+	if (method.empty() || url.empty())
+		return status_reply("400 Bad Request", request);
+	std::string reply = "RTSP/1.0 200 OK\r\nCSeq: " + header_value(request, "CSeq") + "\r\n";
+	LOG(2, "RTSP " << method << " " << url);
+
+	if (method == "OPTIONS")
+		return reply + "Public: OPTIONS, DESCRIBE, SETUP, PLAY, TEARDOWN\r\n\r\n";
+	else if (method == "DESCRIBE")
+	{
+		std::string sdp = describe();
+		std::string base = url.back() == '/' ? url : url + "/";
+		return reply + "Content-Base: " + base + "\r\nContent-Type: application/sdp\r\nContent-Length: " +
+			   std::to_string(sdp.size()) + "\r\n\r\n" + sdp;
+	}
+	else if (method == "SETUP")
+	{
+		std::string transport = header_value(request, "Transport");
+		size_t pos;
+		if (transport.find("TCP") != std::string::npos)
+		{
+			// The channel after is for RTCP, so it needs to fit too.
+			unsigned long channel = 0;
+			pos = transport.find("interleaved=");
+			if (pos != std::string::npos && !parse_number(transport.substr(pos + 12), 254, channel))
+				return status_reply("400 Bad Request", request);
+			client.interleaved = true;
+			client.channel = channel;
+			transport = "RTP/AVP/TCP;unicast;interleaved=" + std::to_string(client.channel) + "-" +
+						std::to_string(client.channel + 1);
+		}
+		else if ((pos = transport.find("client_port=")) != std::string::npos)
+		{
+			unsigned long port;
+			if (!parse_number(transport.substr(pos + 12), 65534, port) || !port)
+				return status_reply("400 Bad Request", request);
+			client.rtp_addr = client.peer;
+			client.rtp_addr.sin_port = htons(port);
+			transport = "RTP/AVP;unicast;client_port=" + std::to_string(port) + "-" + std::to_string(port + 1) +
+						";server_port=" + std::to_string(rtp_port_) + "-" + std::to_string(rtp_port_ + 1);
+		}
+		else
+			return status_reply("461 Unsupported Transport", request);
+		client.session = std::to_string(next_session_++);
+		return reply + "Transport: " + transport + "\r\nSession: " + client.session + "\r\n\r\n";
+	}
+	else if (method == "PLAY")
+	{
+		// Without a SETUP, there's nowhere to send the RTP.
+		if (client.session.empty())
+			return status_reply("455 Method Not Valid in This State", request);
+		client.playing = client.waiting_keyframe = true;
+		LOG(1, "RTSP client " << inet_ntoa(client.peer.sin_addr) << " playing"
+							  << (client.interleaved ? " over TCP" : " over UDP"));
+		return reply + "Session: " + client.session + "\r\nRange: npt=0.000-\r\n\r\n";
+	}
+	else if (method == "TEARDOWN")
+	{
+		client.playing = false;
+		client.dead = true;
+		return reply + "Session: " + client.session + "\r\n\r\n";
+	}
+	return status_reply("501 Not Implemented", request);
+}
+
+std::string RtspOutput::describe()
+{
+	std::string fmtp = "packetization-mode=1";
+	if (!profile_level_id_.empty())
+		fmtp += ";profile-level-id=" + profile_level_id_;
+	if (sprop_parameter_sets_.find(',') != std::string::npos)
+		fmtp += ";sprop-parameter-sets=" + sprop_parameter_sets_;
+	return "v=0\r\n"
+		   "o=- " + std::to_string(ssrc_) + " 1 IN IP4 " + address_ + "\r\n"
+		   "s=raspindi\r\n"
+		   "c=IN IP4 0.0.0.0\r\n"
+		   "t=0 0\r\n"
+		   "a=control:*\r\n"
+		   "m=video 0 RTP/AVP 96\r\n"
+		   "a=rtpmap:96 H264/90000\r\n"
+		   "a=fmtp:96 " + fmtp + "\r\n"
+		   "a=control:track1\r\n";
+}
@@ -0,0 +1,107 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * rtsp_output.hpp - serve h.264 over RTSP, for receivers that don't do NDI.
+ */
+
+#pragma once
+
+#include <netinet/in.h>
+#include <sys/uio.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <libcamera/base/unique_fd.h>
+
+#include "output/output.hpp"
+
+// A minimal RTSP server (OPTIONS, DESCRIBE, SETUP, PLAY and TEARDOWN, with RTP over UDP or
+// interleaved on the RTSP connection) for an output of rtsp://address:port. Frames are
+// packetised as RFC 6184 describes: each NAL unit that fits is sent in a packet of its
+// own, and bigger ones split into FU-A fragments, all straight from the encoder's buffer.
+//
+// The packets of a big frame are spread over part of the frame period, rather than sent
+// in one burst that a switch might not have the buffer space for. New clients start at
+// the next keyframe, which carries the SPS and PPS (we ask for inline headers).
+
+class RtspOutput : public Output
+{
+public:
+	RtspOutput(VideoOptions const *options);
+	~RtspOutput();
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	// RTP payload per packet, so that packets fit a 1500 byte Ethernet frame.
+	static constexpr size_t RTP_PAYLOAD = 1400;
+	// Frames of up to this many packets go out at once.
+	static constexpr unsigned int PACING_BURST = 8;
+	// What fraction of a frame period the packets of a bigger frame are spread over.
+	static constexpr float PACING_FRACTION = 0.5f;
+	// How often the server thread checks for shutdown.
+	static constexpr int POLL_TIMEOUT_MS = 100;
+	// The most a client may send us in one request, headers and body together.
+	static constexpr size_t MAX_REQUEST = 16384;
+
+	struct Client
+	{
+		int fd;
+		sockaddr_in peer;
+		std::string request; // received, but not yet handled
+		std::string session;
+		bool playing;
+		bool waiting_keyframe;
+		bool interleaved; // RTP goes over the RTSP connection
+		uint8_t channel;
+		sockaddr_in rtp_addr; // otherwise it goes here
+		bool dead;
+	};
+
+	struct Packet
+	{
+		uint8_t header[14]; // RTP header, then for FU-A, the FU indicator and FU header
+		size_t header_size;
+		uint8_t const *payload;
+		size_t payload_size;
+	};
+
+	void serverThread();
+	void acceptClient();
+	// Handle whatever complete requests the client has sent. False if it should go.
+	bool readClient(Client &client);
+	std::string handleRequest(Client &client, std::string const &request);
+	// False if the client couldn't take it all.
+	bool sendResponse(Client &client, std::string const &response);
+	std::string describe();
+	void packetise(uint8_t const *data, size_t size, uint32_t rtp_timestamp, std::vector<Packet> &packets);
+	void sendPacket(Client &client, Packet const &packet);
+
+	// Closed for us, even if the constructor throws.
+	libcamera::UniqueFD listen_fd_;
+	libcamera::UniqueFD rtp_fd_;
+	uint16_t rtp_port_;
+	std::string address_;
+	int64_t frame_period_us_;
+	uint32_t ssrc_;
+	uint16_t sequence_;
+	uint32_t rtp_offset_;
+	// The latest SPS and PPS, base64 encoded as SDP wants them.
+	std::string sprop_parameter_sets_;
+	std::string profile_level_id_;
+	std::vector<Packet> packets_;
+
+	// Held while touching the clients, which both threads do.
+	std::mutex mutex_;
+	std::vector<std::unique_ptr<Client>> clients_;
+	unsigned int next_session_;
+	std::atomic<bool> abort_;
+	std::thread server_thread_;
+};
@@ -0,0 +1,106 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * spsc_ring.hpp - bounded single producer, single consumer ring.
+ */
+
+#pragma once
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+// A fixed size queue for handing items from exactly one thread to exactly one other,
+// without locks or allocations once it has been created. Push() fails rather than
+// growing when the ring is full, so what to do under overload is always the caller's
+// decision. A consumer that runs out of items can sleep in Wait(), and the producer only
+// pays for the eventfd write when someone is actually asleep.
+
+template <typename T>
+class SpscRing
+{
+public:
+	explicit SpscRing(unsigned int capacity) : head_(0), tail_(0), waiting_(false), slots_(capacity)
+	{
+		event_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (event_fd_ < 0)
+			throw std::runtime_error("failed to create eventfd");
+	}
+	~SpscRing() { close(event_fd_); }
+
+	SpscRing(SpscRing const &) = delete;
+	SpscRing &operator=(SpscRing const &) = delete;
+
+	// Producer only. Returns false, leaving the ring untouched, if it is full.
+	bool Push(T const &item)
+	{
+		size_t tail = tail_.load(std::memory_order_relaxed);
+		if (tail - head_.load(std::memory_order_acquire) == slots_.size())
+			return false;
+		slots_[tail % slots_.size()] = item;
+		tail_.store(tail + 1, std::memory_order_seq_cst);
+
+		// Pairs with the consumer setting waiting_ and then looking at tail_ again.
+		if (waiting_.exchange(false, std::memory_order_seq_cst))
+		{
+			uint64_t one = 1;
+			if (write(event_fd_, &one, sizeof(one)) < 0 && errno != EAGAIN)
+				throw std::runtime_error("failed to signal eventfd");
+		}
+		return true;
+	}
+
+	// Consumer only. Returns false if the ring is empty.
+	bool TryPop(T &item)
+	{
+		size_t head = head_.load(std::memory_order_relaxed);
+		if (head == tail_.load(std::memory_order_acquire))
+			return false;
+		item = std::move(slots_[head % slots_.size()]);
+		head_.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer only. Like TryPop(), but sleeps for up to timeout_ms waiting for an item.
+	bool Wait(T &item, int timeout_ms)
+	{
+		if (TryPop(item))
+			return true;
+
+		waiting_.store(true, std::memory_order_seq_cst);
+		if (head_.load(std::memory_order_relaxed) == tail_.load(std::memory_order_seq_cst))
+		{
+			pollfd p = { event_fd_, POLLIN, 0 };
+			if (poll(&p, 1, timeout_ms) > 0)
+			{
+				uint64_t count;
+				if (read(event_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+					throw std::runtime_error("failed to read eventfd");
+			}
+		}
+		waiting_.store(false, std::memory_order_relaxed);
+
+		return TryPop(item);
+	}
+
+	// The number of items queued. Only exact when called from the producer or consumer
+	// while the other side is idle, otherwise it's a snapshot.
+	size_t Size() const { return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire); }
+	size_t Capacity() const { return slots_.size(); }
+
+private:
+	// Keep the two ends on separate cache lines, so that the producer and consumer
+	// don't keep stealing each other's line.
+	alignas(64) std::atomic<size_t> head_;
+	alignas(64) std::atomic<size_t> tail_;
+	alignas(64) std::atomic<bool> waiting_;
+	int event_fd_;
+	std::vector<T> slots_;
+};
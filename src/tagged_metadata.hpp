@@ -0,0 +1,105 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * tagged_metadata.hpp - metadata with typed slots for the tags known at compile time.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "core/metadata.hpp"
+
+// rpicam's Metadata takes its mutex, looks the tag up in a std::map of strings and does an
+// any_cast on every Get and Set, and copies the whole map whenever it is copied. Between
+// the stages and our own threads, results get copied about every frame.
+//
+// Here each tag raspindi sets itself has a slot of its own type, found at compile time,
+// with a Metadata behind them for whatever the stages set. There is no lock of its own, as
+// there is only ever one owner (share it as a pointer to const if need be), and moving or
+// merging slots is a plain assignment. Only merging into a frame's post_process_metadata
+// takes its lock, once for every slot together.
+//
+// A tag is a type naming the slot's type and its name in post_process_metadata:
+//
+//     struct AnalysisTimingTag
+//     {
+//         typedef AnalysisTiming Type;
+//         static constexpr char NAME[] = "analysis.timing";
+//     };
+
+template <typename... Tags>
+class TaggedMetadata
+{
+public:
+	template <typename Tag, typename T>
+	void Set(T &&value)
+	{
+		std::get<index<Tag>()>(slots_) = std::forward<T>(value);
+	}
+
+	// Null if the tag hasn't been set.
+	template <typename Tag>
+	typename Tag::Type const *Get() const
+	{
+		auto const &slot = std::get<index<Tag>()>(slots_);
+		return slot ? &*slot : nullptr;
+	}
+
+	// Whatever the stages set, under the names they gave it.
+	Metadata &Dynamic() { return dynamic_; }
+	Metadata const &Dynamic() const { return dynamic_; }
+
+	// Add everything here to dst, wherever it has nothing of its own, as Metadata::Merge
+	// does. Moves, so leaves this empty.
+	void MergeInto(Metadata &dst)
+	{
+		{
+			std::lock_guard<Metadata> lock(dst);
+			(mergeSlot<Tags>(dst, std::move(std::get<index<Tags>()>(slots_))), ...);
+		}
+		slots_ = {};
+		dst.Merge(dynamic_);
+		dynamic_.Clear();
+	}
+
+	// As MergeInto, but leaves this as it was.
+	void CopyInto(Metadata &dst) const
+	{
+		{
+			std::lock_guard<Metadata> lock(dst);
+			(mergeSlot<Tags>(dst, std::optional<typename Tags::Type>(std::get<index<Tags>()>(slots_))), ...);
+		}
+		Metadata copy(dynamic_);
+		dst.Merge(copy);
+	}
+
+private:
+	template <typename Tag>
+	static constexpr std::size_t index()
+	{
+		constexpr bool match[] = { std::is_same_v<Tag, Tags>... };
+		std::size_t i = 0;
+		while (i < sizeof...(Tags) && !match[i])
+			i++;
+		static_assert(std::disjunction_v<std::is_same<Tag, Tags>...>, "tag has no slot here");
+		return i;
+	}
+
+	// With dst locked.
+	template <typename Tag>
+	static void mergeSlot(Metadata &dst, std::optional<typename Tag::Type> &&slot)
+	{
+		if (slot && !dst.GetLocked<typename Tag::Type>(Tag::NAME))
+			dst.SetLocked(Tag::NAME, std::move(*slot));
+	}
+
+	std::tuple<std::optional<typename Tags::Type>...> slots_;
+	Metadata dynamic_;
+};
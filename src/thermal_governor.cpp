@@ -0,0 +1,136 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * thermal_governor.cpp - steps down to cheaper settings before the Pi overheats.
+ */
+
+#include <cmath>
+#include <sstream>
+
+#include "core/logging.hpp"
+
+#include "thermal_governor.hpp"
+
+ThermalGovernor::ThermalGovernor(std::vector<ThermalProfile> const &profiles, NDIOptions const *options,
+								 Callback callback)
+	: callback_(callback), profiles_(profiles), width_(options->Get().width), height_(options->Get().height),
+	  fps_(options->Get().framerate.value_or(30)), level_(0), next_level_(0), changed_(Clock::now()),
+	  expected_(0), dropped_(0), last_sequence_(0), last_expected_(0), last_dropped_(0)
+{
+	level_gauge_ = &Metrics::Get().AddGauge("raspindi_thermal_level",
+											"How many thermal profiles down from the configured settings we are");
+	LOG(1, "Thermal governor has " << profiles_.size() << " profiles");
+}
+
+void ThermalGovernor::SetProfiles(std::vector<ThermalProfile> const &profiles)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	profiles_ = profiles;
+	level_ = std::min<unsigned int>(level_, profiles_.size());
+	next_level_ = level_;
+	level_gauge_->Set(level_);
+}
+
+void ThermalGovernor::Frame(uint32_t sequence)
+{
+	// The sequence starts again whenever the camera does.
+	uint32_t step = sequence > last_sequence_ ? sequence - last_sequence_ : 1;
+	last_sequence_ = sequence;
+	expected_.fetch_add(step, std::memory_order_relaxed);
+	dropped_.fetch_add(step - 1, std::memory_order_relaxed);
+}
+
+void ThermalGovernor::Check()
+{
+	double temperature = read_number(SOC_TEMPERATURE_PATH, 10) / 1000;
+	double flags = read_number(THROTTLED_PATH, 16);
+	// Throttled right now. A 3B+ has its frequency capped from 60C (the soft limit), so that
+	// on its own is no reason to step down.
+	bool throttled = !std::isnan(flags) && ((int)flags & 0x4);
+	uint64_t expected = expected_.load(std::memory_order_relaxed);
+	uint64_t dropped = dropped_.load(std::memory_order_relaxed);
+	bool overloaded = expected > last_expected_ &&
+					  (dropped - last_dropped_) > MAX_LOSS * (expected - last_expected_);
+	last_expected_ = expected;
+	last_dropped_ = dropped;
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto now = Clock::now();
+	unsigned int levels = profiles_.size();
+	if (next_level_ != level_)
+	{
+		// Receivers have been told, so make the step.
+		if (now - announced_ < ANNOUNCE_PERIOD)
+			return;
+		LOG(1, "Thermal governor stepping to level " << next_level_);
+		level_ = next_level_;
+		level_gauge_->Set(level_);
+		changed_ = now;
+		callback_(STEP);
+		return;
+	}
+
+	// Past the next profile's temperature. Even if it's past several, one step at a time,
+	// as each is only taken once the last has had STEP_PERIOD to show.
+	bool hot = level_ < levels && !std::isnan(temperature) && temperature >= profiles_[level_].temperature;
+	if (hot && now - changed_ >= STEP_PERIOD)
+		announce(level_ + 1, "temperature");
+	else if ((throttled || overloaded) && level_ < levels && now - changed_ >= STEP_PERIOD)
+		announce(level_ + 1, throttled ? "throttled" : "overloaded");
+	else if (!throttled && !overloaded && level_ > 0 && now - changed_ >= RECOVER_PERIOD &&
+			 (std::isnan(temperature) || temperature < profiles_[level_ - 1].temperature - HYSTERESIS))
+		announce(level_ - 1, "cooled");
+}
+
+void ThermalGovernor::announce(unsigned int level, char const *reason)
+{
+	// Lock held.
+	next_level_ = level;
+	announced_ = Clock::now();
+	std::stringstream xml;
+	xml << "<raspindi_profile level=\"" << level << "\" reason=\"" << reason << "\" in_ms=\""
+		<< std::chrono::duration_cast<std::chrono::milliseconds>(ANNOUNCE_PERIOD).count() << "\"";
+	if (level)
+	{
+		ThermalProfile const &profile = profiles_[level - 1];
+		if (profile.fps)
+			xml << " fps=\"" << *profile.fps << "\"";
+		if (profile.width && profile.height)
+			xml << " width=\"" << *profile.width << "\" height=\"" << *profile.height << "\"";
+	}
+	xml << "/>";
+	announcement_ = xml.str();
+	LOG(1, "Thermal governor going to level " << level << " (" << reason << ") in "
+											  << ANNOUNCE_PERIOD.count() << "s");
+	callback_(ANNOUNCE);
+}
+
+std::string ThermalGovernor::Announcement()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	std::string announcement;
+	std::swap(announcement, announcement_);
+	return announcement;
+}
+
+RaspindiConfig ThermalGovernor::Apply(RaspindiConfig config)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	ThermalProfile const *profile = level_ ? &profiles_[level_ - 1] : nullptr;
+	if (profile && profile->fps)
+		config.fps = profile->fps;
+	else if (!config.fps)
+		config.fps = fps_;
+	if (profile && profile->width && profile->height)
+	{
+		config.width = profile->width;
+		config.height = profile->height;
+	}
+	else if (!config.width || !config.height)
+	{
+		config.width = width_;
+		config.height = height_;
+	}
+	return config;
+}
@@ -0,0 +1,100 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * thermal_governor.hpp - steps down to cheaper settings before the Pi overheats.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "metrics.hpp"
+#include "raspindi_config.hpp"
+
+// Once a Pi 3B+ reaches 80C the firmware throttles it, and the frame rate falls apart. The
+// governor watches the SoC temperature, the firmware's throttling flags and how many
+// frames the pipeline is losing, and steps down through the config file's thermal
+// profiles (lower frame rates, smaller frames) before that happens: one level at a time,
+// and back up once it has cooled down again.
+//
+// Each step is announced to receivers first, and only made ANNOUNCE_PERIOD later, by
+// restarting the pipeline in the main loop like a config reload. So a step down is
+// planned, rather than the random stutter of a throttled Pi.
+//
+// Check runs from a timer on the event loop, and calls the callback from there whenever
+// there's an announcement for the main loop to send, or a step for it to make.
+
+class ThermalGovernor
+{
+public:
+	enum Event
+	{
+		ANNOUNCE,
+		STEP
+	};
+	typedef std::function<void(Event event)> Callback;
+
+	ThermalGovernor(std::vector<ThermalProfile> const &profiles, NDIOptions const *options, Callback callback);
+
+	// After a config reload. Stays at the same level, as far as there still is one.
+	void SetProfiles(std::vector<ThermalProfile> const &profiles);
+
+	// Main loop only, with each camera frame's sequence number, so that frames the camera
+	// had to drop for want of buffers show up as gaps. Dropped is for frames the pipeline
+	// dropped itself.
+	void Frame(uint32_t sequence);
+	void Dropped() { dropped_.fetch_add(1, std::memory_order_relaxed); }
+
+	// Call Check this often, from a timer on the event loop.
+	static constexpr std::chrono::milliseconds CHECK_PERIOD { 2000 };
+	void Check();
+
+	// Main loop only. What to tell receivers is coming, or empty if there's nothing new.
+	std::string Announcement();
+	// Main loop only. The config file's settings, with those of the current profile on top.
+	RaspindiConfig Apply(RaspindiConfig config);
+
+private:
+	// How long before a step receivers hear of it.
+	static constexpr std::chrono::seconds ANNOUNCE_PERIOD { 3 };
+	// Time for a step's effect to show before taking another.
+	static constexpr std::chrono::seconds STEP_PERIOD { 10 };
+	// Before stepping back up, how long it must have been since the last step, and how far
+	// below the profile's temperature the SoC must be.
+	static constexpr std::chrono::seconds RECOVER_PERIOD { 60 };
+	static constexpr float HYSTERESIS = 5;
+	// More lost frames than this is overload.
+	static constexpr float MAX_LOSS = 0.05;
+
+	typedef std::chrono::steady_clock Clock;
+
+	void announce(unsigned int level, char const *reason);
+
+	Callback callback_;
+
+	std::mutex mutex_;
+	std::vector<ThermalProfile> profiles_;
+	// What to fall back to where neither a profile nor the file sets something.
+	unsigned int width_, height_;
+	float fps_;
+	// 0 runs as configured, and level n by profile n - 1.
+	unsigned int level_;
+	unsigned int next_level_;
+	Clock::time_point changed_, announced_;
+	std::string announcement_;
+
+	// From the main loop.
+	std::atomic<uint64_t> expected_;
+	std::atomic<uint64_t> dropped_;
+	uint32_t last_sequence_;
+	uint64_t last_expected_, last_dropped_;
+
+	Metrics::Gauge *level_gauge_;
+};
@@ -0,0 +1,107 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * thread_policy.cpp - names, real-time priorities and cores for our threads.
+ */
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include "core/logging.hpp"
+
+#include "thread_policy.hpp"
+
+static char const *const role_names[] = { "capture", "encode", "send", "audio", "ndi" };
+
+ThreadPolicy &ThreadPolicy::Get()
+{
+	static ThreadPolicy policy;
+	return policy;
+}
+
+ThreadPolicy::ThreadPolicy() : configured_(false), warned_(false)
+{
+	for (auto &setting : settings_)
+	{
+		setting.priority = 0;
+		setting.pinned = false;
+		CPU_ZERO(&setting.cpus);
+	}
+}
+
+void ThreadPolicy::Configure(std::string const &policy, bool lock_memory)
+{
+	int min_priority = sched_get_priority_min(SCHED_FIFO), max_priority = sched_get_priority_max(SCHED_FIFO);
+	int cores = sysconf(_SC_NPROCESSORS_ONLN);
+	std::stringstream in(policy);
+	std::string entry;
+	while (std::getline(in, entry, ','))
+	{
+		std::string name = entry.substr(0, entry.find('='));
+		unsigned int role = 0;
+		while (role < OTHER && name != role_names[role])
+			role++;
+		if (role == OTHER || name.size() == entry.size())
+			throw std::runtime_error("bad thread policy " + entry + ", roles are capture, encode, send, audio and ndi");
+
+		Setting &setting = settings_[role];
+		char const *p = entry.c_str() + name.size() + 1;
+		char *end;
+		setting.priority = strtol(p, &end, 10);
+		if (end == p || (setting.priority && (setting.priority < min_priority || setting.priority > max_priority)))
+			throw std::runtime_error("bad priority in thread policy " + entry + ", they run from " +
+									 std::to_string(min_priority) + " to " + std::to_string(max_priority));
+		if (*end == ':')
+		{
+			p = end + 1;
+			int first = strtol(p, &end, 10), last = first;
+			if (end != p && *end == '-')
+				last = strtol(end + 1, &end, 10);
+			if (end == p || *end || first < 0 || last < first || last >= cores)
+				throw std::runtime_error("bad cpus in thread policy " + entry + ", this Pi has cores 0 to " +
+										 std::to_string(cores - 1));
+			setting.pinned = true;
+			for (int cpu = first; cpu <= last; cpu++)
+				CPU_SET(cpu, &setting.cpus);
+		}
+		else if (*end)
+			throw std::runtime_error("bad thread policy " + entry);
+		configured_ = true;
+	}
+
+	if (lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE))
+		LOG_ERROR("Failed to lock memory: " << strerror(errno));
+}
+
+void ThreadPolicy::Apply(Role role, char const *name)
+{
+	if (name)
+		pthread_setname_np(pthread_self(), name);
+	if (!configured_)
+		return;
+
+	// Unconfigured roles go back to the defaults, rather than keep what the thread that
+	// started them had.
+	Setting const &setting = settings_[role];
+	sched_param param = {};
+	param.sched_priority = setting.priority;
+	int ret = pthread_setschedparam(pthread_self(), setting.priority ? SCHED_FIFO : SCHED_OTHER, &param);
+	cpu_set_t cpus = setting.cpus;
+	if (!setting.pinned)
+	{
+		for (int cpu = 0; cpu < sysconf(_SC_NPROCESSORS_ONLN); cpu++)
+			CPU_SET(cpu, &cpus);
+	}
+	if (!ret)
+		ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	// Most likely for want of CAP_SYS_NICE, which every thread would then complain about.
+	if (ret && !warned_.exchange(true))
+		LOG_ERROR("Failed to apply the thread policy: " << strerror(ret));
+}
@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * thread_policy.hpp - names, real-time priorities and cores for our threads.
+ */
+
+#pragma once
+
+#include <sched.h>
+
+#include <array>
+#include <atomic>
+#include <string>
+
+// Frame interval jitter comes almost entirely from the scheduler: under the default
+// policy, apt, journald or the control button script can hold up capture or sending for
+// a few milliseconds at any time. Each of our threads has a role, and the policy gives a
+// role a SCHED_FIFO priority and the cores it may run on. Every thread is also named,
+// so that top -H and perf show what they are.
+//
+// Threads only ever take on their own role's settings, so threads started from a
+// real-time thread don't keep its priority by accident. Threads rpicam_app and libcamera
+// start themselves (the preview thread, for example) get whatever the main thread, which
+// runs capture, had at the time. libndi's threads get the ndi role's settings, as they
+// start along with the sender.
+
+class ThreadPolicy
+{
+public:
+	enum Role
+	{
+		CAPTURE, // the main loop
+		ENCODE, // feeding the encoders
+		SEND, // from the encoders to NDI and the branches
+		AUDIO,
+		NDI, // libndi's own
+		OTHER, // monitoring and housekeeping
+		NUM_ROLES
+	};
+
+	static ThreadPolicy &Get();
+
+	// From a list of role=priority[:cpus], such as "capture=50:2,send=45:1-3", where the
+	// cpus are one core or a range (and a priority of 0 leaves the role unprioritised,
+	// but pinned). Optionally, lock all our memory so that it never has to be paged back
+	// in. Call once, before any threads that apply it start. Throws for a bad list.
+	void Configure(std::string const &policy, bool lock_memory);
+
+	// Apply a role's settings to the calling thread, and name it if name isn't null (at
+	// most 15 characters).
+	void Apply(Role role, char const *name);
+
+private:
+	ThreadPolicy();
+
+	struct Setting
+	{
+		int priority;
+		bool pinned;
+		cpu_set_t cpus;
+	};
+
+	bool configured_;
+	std::array<Setting, NUM_ROLES> settings_;
+	std::atomic<bool> warned_;
+};
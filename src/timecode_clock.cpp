@@ -0,0 +1,151 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * timecode_clock.cpp - NDI timecodes from frame timestamps, on the wall clock or PTP.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/timex.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#include "core/logging.hpp"
+
+#include "timecode_clock.hpp"
+
+// As the kernel turns a clock device's file descriptor into a clock (see clock_gettime(2)).
+#define FD_TO_CLOCKID(fd) ((~(clockid_t)(fd) << 3) | 3)
+
+// Not even a monotonic clock gets that far, it would need decades of uptime.
+static constexpr int64_t YEAR_2000_US = 946684800LL * 1000000;
+// For when nothing has told the kernel, as it has been since 2017.
+static constexpr int DEFAULT_TAI_OFFSET = 37;
+
+static int64_t to_ns(timespec const &ts)
+{
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+TimecodeClock::TimecodeClock(std::string const &ptp_device)
+	: fd_(-1), reference_clock_(CLOCK_REALTIME), tai_offset_ns_(0), monotonic_({ CLOCK_MONOTONIC, false, 0, 0, 0 }),
+	  realtime_({ CLOCK_REALTIME, false, 0, 0, 0 })
+{
+	if (ptp_device.empty())
+		return;
+
+	fd_ = open(ptp_device.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd_ < 0)
+		throw std::runtime_error("failed to open PTP clock " + ptp_device + ": " + strerror(errno));
+	reference_clock_ = FD_TO_CLOCKID(fd_);
+	timespec ts;
+	if (clock_gettime(reference_clock_, &ts) < 0)
+	{
+		int err = errno;
+		close(fd_);
+		throw std::runtime_error(ptp_device + " is not a PTP clock: " + strerror(err));
+	}
+
+	// ptp4l runs the hardware clock on TAI. The kernel knows the offset if something told
+	// it (phc2sys, or chrony with leapsectz).
+	timex tx = {};
+	adjtimex(&tx);
+	int tai_offset = tx.tai > 0 ? tx.tai : DEFAULT_TAI_OFFSET;
+	tai_offset_ns_ = tai_offset * 1000000000LL;
+	LOG(1, "Timecodes from PTP clock " << ptp_device << ", TAI - " << tai_offset << "s");
+}
+
+TimecodeClock::~TimecodeClock()
+{
+	if (fd_ >= 0)
+		close(fd_);
+}
+
+int64_t TimecodeClock::Timecode(int64_t timestamp_us)
+{
+	// FrameWallClock is the system wall clock already.
+	if (timestamp_us >= YEAR_2000_US && reference_clock_ == CLOCK_REALTIME)
+		return timestamp_us * 10;
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	Model &model = timestamp_us >= YEAR_2000_US ? realtime_ : monotonic_;
+	return map(model, timestamp_us * 1000) / 100;
+}
+
+int64_t TimecodeClock::Now()
+{
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	std::lock_guard<std::mutex> lock(mutex_);
+	return map(monotonic_, to_ns(now)) / 100;
+}
+
+void TimecodeClock::SleepUntil(int64_t timecode)
+{
+	int64_t target_ns;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (!monotonic_.valid)
+			return;
+		// Running the model backwards, near enough: the rate term barely moves in a frame.
+		int64_t local_ns = timecode * 100 - monotonic_.offset_ns;
+		target_ns = local_ns - (int64_t)(monotonic_.rate * (local_ns - monotonic_.local_ns));
+	}
+	timespec target = { (time_t)(target_ns / 1000000000), (long)(target_ns % 1000000000) };
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &target, nullptr) == EINTR)
+	{
+	}
+}
+
+int64_t TimecodeClock::map(Model &model, int64_t local_ns)
+{
+	// Lock held.
+	timespec now;
+	clock_gettime(model.clock, &now);
+	if (!model.valid || to_ns(now) - model.local_ns >= SAMPLE_PERIOD_NS)
+		measure(model);
+	return local_ns + model.offset_ns + (int64_t)(model.rate * (local_ns - model.local_ns));
+}
+
+void TimecodeClock::measure(Model &model)
+{
+	// Lock held. The reads bracketed most tightly by the local clock were interrupted least.
+	int64_t best_gap = INT64_MAX, local_ns = 0, offset_ns = 0;
+	for (unsigned int i = 0; i < SAMPLE_READS; i++)
+	{
+		timespec before, ref, after;
+		clock_gettime(model.clock, &before);
+		clock_gettime(reference_clock_, &ref);
+		clock_gettime(model.clock, &after);
+		int64_t gap = to_ns(after) - to_ns(before);
+		if (gap < best_gap)
+		{
+			best_gap = gap;
+			local_ns = to_ns(before) + gap / 2;
+			offset_ns = to_ns(ref) - tai_offset_ns_ - local_ns;
+		}
+	}
+
+	if (model.valid)
+	{
+		int64_t dt = local_ns - model.local_ns;
+		int64_t predicted_ns = model.offset_ns + (int64_t)(model.rate * dt);
+		int64_t error = offset_ns - predicted_ns;
+		if (std::llabs(error) <= STEP_NS && dt > 0)
+		{
+			model.rate += KI * error / dt;
+			model.offset_ns = predicted_ns + (int64_t)(KP * error);
+			model.local_ns = local_ns;
+			return;
+		}
+		LOG(1, "Timecode clock stepped by " << error / 1000 << "us");
+	}
+	model.valid = true;
+	model.local_ns = local_ns;
+	model.offset_ns = offset_ns;
+	model.rate = 0;
+}
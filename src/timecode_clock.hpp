@@ -0,0 +1,75 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * timecode_clock.hpp - NDI timecodes from frame timestamps, on the wall clock or PTP.
+ */
+
+#pragma once
+
+#include <time.h>
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+// Frame timestamps are FrameWallClock (microseconds since the epoch) when libcamera has
+// it, and otherwise the buffer's CLOCK_MONOTONIC timestamp. NDI timecodes are 100ns units
+// of a wall clock: the system's, or with a PTP hardware clock (the /dev/ptp device
+// linuxptp's ptp4l disciplines), that clock, read directly rather than through phc2sys,
+// and turned from TAI into UTC.
+//
+// Reading two clocks one after the other for every frame puts the gap between the reads
+// (scheduling, or a system call for a PTP clock) into the timecode, and receivers' frame
+// sync then buffers to smooth it out. So each clock a timestamp can come from is mapped
+// onto the reference through a model, an offset and a rate, which a simple PI loop pulls
+// towards a measurement about once a second, the best of a few tightly bracketed reads.
+// Timecodes then follow the capture times exactly, and drift only as fast as the clocks
+// really do. A step in either clock (the clock being set) starts the model again.
+//
+// Called from the encoders' output threads and the audio thread.
+
+class TimecodeClock
+{
+public:
+	// An empty device uses the system wall clock. Throws if the device can't be opened.
+	explicit TimecodeClock(std::string const &ptp_device);
+	~TimecodeClock();
+
+	// The NDI timecode for a frame timestamp.
+	int64_t Timecode(int64_t timestamp_us);
+	// The reference clock now, and sleeping until a time on it, in 100ns units.
+	int64_t Now();
+	void SleepUntil(int64_t timecode);
+
+private:
+	// How often the models are measured, and from how many reads.
+	static constexpr int64_t SAMPLE_PERIOD_NS = 1000000000;
+	static constexpr unsigned int SAMPLE_READS = 5;
+	// Loop gains, for the offset and the rate.
+	static constexpr double KP = 0.2;
+	static constexpr double KI = 0.02;
+	// A measurement this far from the model means a clock was stepped.
+	static constexpr int64_t STEP_NS = 1000000;
+
+	// reference = local + offset_ns + rate * (local - local_ns), all in nanoseconds.
+	struct Model
+	{
+		clockid_t clock;
+		bool valid;
+		int64_t local_ns;
+		int64_t offset_ns;
+		double rate;
+	};
+
+	int64_t map(Model &model, int64_t local_ns);
+	void measure(Model &model);
+
+	int fd_;
+	clockid_t reference_clock_;
+	// How far TAI is ahead of UTC, for a PTP clock.
+	int64_t tai_offset_ns_;
+	std::mutex mutex_;
+	Model monotonic_;
+	Model realtime_;
+};
@@ -0,0 +1,176 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * tone_curve.cpp - tone curves applied to the Y plane, for matching cameras.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "core/logging.hpp"
+#include "post_processing_stages/pwl.hpp"
+
+#include "ndi_metadata.hpp"
+#include "tone_curve.hpp"
+
+static constexpr unsigned int GAMMA_POINTS = 33;
+
+static std::vector<Pwl::Point> parse_curve(std::string const &curve)
+{
+	std::vector<Pwl::Point> points;
+	if (curve.rfind("gamma:", 0) == 0)
+	{
+		double gamma = std::stod(curve.substr(6));
+		if (!(gamma > 0))
+			throw std::runtime_error("tone curve gamma must be positive");
+		for (unsigned int i = 0; i < GAMMA_POINTS; i++)
+		{
+			double x = 255.0 * i / (GAMMA_POINTS - 1);
+			points.emplace_back(x, 255.0 * std::pow(x / 255, 1 / gamma));
+		}
+		return points;
+	}
+
+	std::istringstream in(curve);
+	std::string point;
+	while (in >> point)
+	{
+		double x, y;
+		char comma;
+		std::istringstream p(point);
+		if (!(p >> x >> comma >> y) || comma != ',' || x < 0 || x > 255 || y < 0 || y > 255)
+			throw std::runtime_error("bad tone curve point " + point);
+		if (!points.empty() && x <= points.back().x)
+			throw std::runtime_error("tone curve points must have increasing x");
+		points.emplace_back(x, y);
+	}
+	if (points.size() < 2)
+		throw std::runtime_error("a tone curve needs at least two points");
+	return points;
+}
+
+// FNV-1a, over the points themselves, so that curves written differently still match.
+static uint64_t hash_curve(std::vector<Pwl::Point> const &points)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (auto const &point : points)
+	{
+		double values[2] = { point.x, point.y };
+		unsigned char bytes[sizeof(values)];
+		memcpy(bytes, values, sizeof(values));
+		for (unsigned char b : bytes)
+			hash = (hash ^ b) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+void ToneCurve::Set(std::string const &curve)
+{
+	if (curve.empty())
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		lut_.reset();
+		LOG(1, "Tone curve off");
+		return;
+	}
+
+	std::vector<Pwl::Point> points = parse_curve(curve);
+	uint64_t hash = hash_curve(points);
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto it = cache_.find(hash);
+	if (it == cache_.end())
+	{
+		Pwl pwl;
+		for (auto const &point : points)
+			pwl.Append(point.x, point.y);
+		pwl.MatchDomain(Pwl::Interval(0, 255));
+		std::vector<double> values = pwl.GenerateLut<double>();
+		auto lut = std::make_shared<Lut>();
+		bool identity = true;
+		for (unsigned int i = 0; i < 256; i++)
+		{
+			(*lut)[i] = std::lround(std::clamp(values[i], 0.0, 255.0));
+			identity = identity && (*lut)[i] == i;
+		}
+		// Cached tables are tiny, but a receiver sending a stream of curves shouldn't be
+		// able to use up the memory.
+		if (cache_.size() >= MAX_CACHED)
+			cache_.clear();
+		it = cache_.emplace(hash, identity ? nullptr : lut).first;
+	}
+	lut_ = it->second;
+	LOG(1, "Tone curve now " << curve);
+}
+
+void ToneCurve::Command(std::string const &xml)
+{
+	std::string curve;
+	if (metadata_element(xml) != "raspindi_tone_curve" || !metadata_attribute(xml, "curve", curve))
+		return;
+	try
+	{
+		Set(curve);
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("Ignoring tone curve from receiver: " << e.what());
+	}
+}
+
+bool ToneCurve::Active()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return lut_ != nullptr;
+}
+
+void ToneCurve::Apply(uint8_t *y, unsigned int width, unsigned int height, unsigned int stride)
+{
+	std::shared_ptr<Lut const> lut;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		lut = lut_;
+	}
+	if (!lut)
+		return;
+	uint8_t const *table = lut->data();
+
+#if defined(__aarch64__)
+	// TBL looks up in 64 bytes of table at a time, with anything out of range giving
+	// 0, so each pixel finds its entry in exactly one of the four quarters.
+	uint8x16x4_t quarters[4];
+	for (unsigned int q = 0; q < 4; q++)
+		quarters[q] = { { vld1q_u8(table + 64 * q), vld1q_u8(table + 64 * q + 16), vld1q_u8(table + 64 * q + 32),
+						  vld1q_u8(table + 64 * q + 48) } };
+	uint8x16_t const sixty_four = vdupq_n_u8(64);
+#endif
+	for (unsigned int row = 0; row < height; row++)
+	{
+		uint8_t *p = y + row * stride;
+		unsigned int x = 0;
+#if defined(__aarch64__)
+		for (; x + 16 <= width; x += 16)
+		{
+			uint8x16_t index = vld1q_u8(p + x);
+			uint8x16_t out = vqtbl4q_u8(quarters[0], index);
+			index = vsubq_u8(index, sixty_four);
+			out = vorrq_u8(out, vqtbl4q_u8(quarters[1], index));
+			index = vsubq_u8(index, sixty_four);
+			out = vorrq_u8(out, vqtbl4q_u8(quarters[2], index));
+			index = vsubq_u8(index, sixty_four);
+			out = vorrq_u8(out, vqtbl4q_u8(quarters[3], index));
+			vst1q_u8(p + x, out);
+		}
+#endif
+		for (; x < width; x++)
+			p[x] = table[p[x]];
+	}
+}
@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * tone_curve.hpp - tone curves applied to the Y plane, for matching cameras.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// A gamma or "look" curve over the picture's brightness, for matching a Pi to the other
+// cameras in a show. libcamera has no control for the ISP's gamma curve (it comes from the
+// tuning file), so the curve is applied to the Y plane in place, as a single table lookup
+// pass that NEON does 16 pixels at a time on 64-bit Pis.
+//
+// Curves are Pwls over 0 to 255. A curve's table is only generated when the curve
+// changes, and tables are kept by a hash of the curve's points, so going back to an
+// earlier curve costs nothing either.
+
+class ToneCurve
+{
+public:
+	// A curve as points "x,y x,y ..." with x increasing (and flat beyond either end),
+	// "gamma:<g>", which raises to 1/g so that g above 1 lifts the midtones, or "" for
+	// none. Throws if the curve makes no sense.
+	void Set(std::string const &curve);
+
+	// From receivers, as <raspindi_tone_curve curve="..."/>. Bad curves are ignored.
+	void Command(std::string const &xml);
+
+	bool Active();
+
+	// Apply to a Y plane in place. Does nothing without a curve.
+	void Apply(uint8_t *y, unsigned int width, unsigned int height, unsigned int stride);
+
+private:
+	typedef std::array<uint8_t, 256> Lut;
+	static constexpr unsigned int MAX_CACHED = 16;
+
+	std::mutex mutex_;
+	// Null when there's no curve, or it changes nothing.
+	std::shared_ptr<Lut const> lut_;
+	std::unordered_map<uint64_t, std::shared_ptr<Lut const>> cache_;
+};
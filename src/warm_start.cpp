@@ -0,0 +1,176 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * warm_start.cpp - start the camera from where AE and AWB last settled.
+ */
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#include <libcamera/control_ids.h>
+
+#include "core/logging.hpp"
+
+#include "thread_policy.hpp"
+#include "warm_start.hpp"
+
+namespace controls = libcamera::controls;
+
+// Small changes aren't worth a write to the SD card.
+static bool similar(float a, float b)
+{
+	return std::abs(a - b) <= 0.05f * std::max(std::abs(a), std::abs(b));
+}
+
+WarmStart::WarmStart(std::string const &path)
+	: path_(path), seed_(load(path)), seeded_exposure_(false), seeded_gain_(false), seeded_colour_gains_(false),
+	  seed_frames_(0), latest_(seed_), dirty_(false), abort_(false)
+{
+	if (seed_.valid)
+		LOG(1, "Warm start from " << path_ << ": exposure " << seed_.exposure_time_us << "us, gain "
+								  << seed_.analogue_gain << ", colour gains " << seed_.red_gain << " "
+								  << seed_.blue_gain);
+	save_thread_ = std::thread(&WarmStart::saveThread, this);
+}
+
+WarmStart::~WarmStart()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	condition_.notify_one();
+	save_thread_.join();
+}
+
+WarmStart::State WarmStart::load(std::string const &path)
+{
+	State state = {};
+	std::ifstream file(path);
+	std::string line;
+	unsigned int found = 0;
+	while (std::getline(file, line))
+	{
+		std::istringstream in(line);
+		std::string key;
+		in >> key;
+		if (key == "exposure_time" && in >> state.exposure_time_us)
+			found |= 1;
+		else if (key == "analogue_gain" && in >> state.analogue_gain)
+			found |= 2;
+		else if (key == "colour_gains" && in >> state.red_gain >> state.blue_gain)
+			found |= 4;
+	}
+	// Anything half written, or nonsense, is as good as nothing.
+	state.valid = found == 7 && state.exposure_time_us > 0 && state.analogue_gain >= 1 && state.red_gain > 0 &&
+				  state.blue_gain > 0;
+	return state;
+}
+
+void WarmStart::save(State const &state)
+{
+	// Write somewhere else, flush it right out and then rename it, so that losing power
+	// at any point leaves either the old file or the new one.
+	std::string tmp_path = path_ + ".tmp";
+	FILE *fp = fopen(tmp_path.c_str(), "w");
+	if (!fp)
+	{
+		LOG_ERROR("WarmStart: failed to write " << tmp_path);
+		return;
+	}
+	fprintf(fp, "exposure_time %d\nanalogue_gain %f\ncolour_gains %f %f\n", state.exposure_time_us,
+			state.analogue_gain, state.red_gain, state.blue_gain);
+	bool ok = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+	ok = fclose(fp) == 0 && ok;
+	if (!ok || std::rename(tmp_path.c_str(), path_.c_str()))
+		LOG_ERROR("WarmStart: failed to save " << path_);
+	else
+		LOG(2, "Saved warm start state to " << path_);
+}
+
+libcamera::ControlList WarmStart::SeedControls(bool exposure, bool gain, bool colour_gains)
+{
+	libcamera::ControlList cl(controls::controls);
+	seeded_exposure_ = exposure && seed_.valid;
+	seeded_gain_ = gain && seed_.valid;
+	seeded_colour_gains_ = colour_gains && seed_.valid;
+	seed_frames_ = 0;
+
+	if (seeded_exposure_)
+	{
+		cl.set(controls::ExposureTimeMode, controls::ExposureTimeModeManual);
+		cl.set(controls::ExposureTime, seed_.exposure_time_us);
+	}
+	if (seeded_gain_)
+	{
+		cl.set(controls::AnalogueGainMode, controls::AnalogueGainModeManual);
+		cl.set(controls::AnalogueGain, seed_.analogue_gain);
+	}
+	if (seeded_colour_gains_)
+	{
+		cl.set(controls::AwbEnable, false);
+		cl.set(controls::ColourGains, libcamera::Span<const float, 2>({ seed_.red_gain, seed_.blue_gain }));
+	}
+	return cl;
+}
+
+bool WarmStart::Update(libcamera::ControlList const &metadata, libcamera::ControlList &release)
+{
+	auto ae_state = metadata.get(controls::AeState);
+	auto exposure_time = metadata.get(controls::ExposureTime);
+	auto analogue_gain = metadata.get(controls::AnalogueGain);
+	auto colour_gains = metadata.get(controls::ColourGains);
+	bool seeding = seeded_exposure_ || seeded_gain_ || seeded_colour_gains_;
+
+	// Only what AE and AWB chose for themselves is worth keeping.
+	if (!seeding && ae_state && *ae_state == controls::AeStateConverged && exposure_time && analogue_gain &&
+		colour_gains && colour_gains->size() == 2)
+	{
+		State state = { true, *exposure_time, *analogue_gain, (*colour_gains)[0], (*colour_gains)[1] };
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (!latest_.valid || !similar(state.exposure_time_us, latest_.exposure_time_us) ||
+			!similar(state.analogue_gain, latest_.analogue_gain) || !similar(state.red_gain, latest_.red_gain) ||
+			!similar(state.blue_gain, latest_.blue_gain))
+		{
+			latest_ = state;
+			dirty_ = true;
+		}
+	}
+
+	if (!seeding || ++seed_frames_ < SEED_FRAMES)
+		return false;
+
+	release = libcamera::ControlList(controls::controls);
+	if (seeded_exposure_)
+		release.set(controls::ExposureTimeMode, controls::ExposureTimeModeAuto);
+	if (seeded_gain_)
+		release.set(controls::AnalogueGainMode, controls::AnalogueGainModeAuto);
+	if (seeded_colour_gains_)
+		release.set(controls::AwbEnable, true);
+	seeded_exposure_ = seeded_gain_ = seeded_colour_gains_ = false;
+	LOG(2, "Warm start values handed back to AE and AWB");
+	return true;
+}
+
+void WarmStart::saveThread()
+{
+	ThreadPolicy::Get().Apply(ThreadPolicy::OTHER, "warm-start");
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (!abort_)
+	{
+		condition_.wait_for(lock, SAVE_INTERVAL, [this] { return abort_.load(); });
+		if (!dirty_)
+			continue;
+		State state = latest_;
+		dirty_ = false;
+		lock.unlock();
+		save(state);
+		lock.lock();
+	}
+}
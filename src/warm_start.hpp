@@ -0,0 +1,77 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * warm_start.hpp - start the camera from where AE and AWB last settled.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <libcamera/controls.h>
+
+// From cold, AE and AWB take a second or more to converge, and until they have, the
+// frames are too dark, too bright or the wrong colour to be worth sending. So we keep the
+// exposure, gain and colour gains they last converged on in a small file, and start the
+// camera with them fixed instead. After a few frames they are handed back to AE and AWB,
+// which carry on from there, so the very first frames are already usable and a camera
+// coming back from a power cut looks the same as it did before.
+//
+// The file is rewritten now and again, from a thread of its own, while AE is converged.
+
+class WarmStart
+{
+public:
+	// Reads whatever was saved last time. A missing or unreadable file just means a cold
+	// start.
+	WarmStart(std::string const &path);
+	// Saves the latest converged state.
+	~WarmStart();
+
+	// The controls to start the camera with, leaving out anything the user has fixed (the
+	// caller says what it may seed). Empty if there is nothing to start from.
+	libcamera::ControlList SeedControls(bool exposure, bool gain, bool colour_gains);
+
+	// Call with each frame's metadata. Returns true, once, when it's time to hand the
+	// seeded controls back to AE and AWB, with the controls for that.
+	bool Update(libcamera::ControlList const &metadata, libcamera::ControlList &release);
+
+private:
+	// How many frames to hold the seeded values for: enough for them to reach the sensor,
+	// and for the first of those frames to come back.
+	static constexpr unsigned int SEED_FRAMES = 4;
+	// How often to save, at most. Only a change of more than a few percent is saved.
+	static constexpr std::chrono::seconds SAVE_INTERVAL = std::chrono::seconds(30);
+
+	struct State
+	{
+		bool valid;
+		int32_t exposure_time_us;
+		float analogue_gain;
+		float red_gain;
+		float blue_gain;
+	};
+
+	static State load(std::string const &path);
+	void save(State const &state);
+	void saveThread();
+
+	std::string path_;
+	State seed_;
+	bool seeded_exposure_, seeded_gain_, seeded_colour_gains_;
+	unsigned int seed_frames_;
+
+	std::mutex mutex_;
+	std::condition_variable condition_;
+	State latest_;
+	bool dirty_;
+	std::atomic<bool> abort_;
+	std::thread save_thread_;
+};
@@ -0,0 +1,76 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * watchdog.cpp - notices the main loop getting stuck.
+ */
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+
+#include "core/logging.hpp"
+
+#include "flight_recorder.hpp"
+#include "watchdog.hpp"
+
+Watchdog::Watchdog()
+	: fed_(0), last_fed_(0), period_(CHECK_PERIOD), stalled_(0), notify_fd_(-1), notify_addr_len_(0)
+{
+	char const *socket_path = getenv("NOTIFY_SOCKET");
+	char const *watchdog_usec = getenv("WATCHDOG_USEC");
+	if (socket_path && watchdog_usec && strlen(socket_path) < sizeof(notify_addr_.sun_path))
+	{
+		notify_addr_ = {};
+		notify_addr_.sun_family = AF_UNIX;
+		strcpy(notify_addr_.sun_path, socket_path);
+		// An abstract socket.
+		if (notify_addr_.sun_path[0] == '@')
+			notify_addr_.sun_path[0] = 0;
+		notify_addr_len_ = offsetof(sockaddr_un, sun_path) + strlen(socket_path);
+		notify_fd_ = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		// Twice in every period systemd allows, so that one late check doesn't count.
+		period_ = std::min(CHECK_PERIOD, std::chrono::milliseconds(strtoll(watchdog_usec, nullptr, 10) / 2000));
+		period_ = std::max(period_, std::chrono::milliseconds(1));
+		LOG(1, "Notifying the systemd watchdog every " << period_.count() << "ms");
+	}
+}
+
+void Watchdog::Check()
+{
+	uint64_t fed = fed_.load(std::memory_order_relaxed);
+	// Opening the camera and creating the sender isn't a stall.
+	if (!fed)
+	{
+		notify("WATCHDOG=1");
+		return;
+	}
+	if (!last_fed_)
+		notify("READY=1");
+	if (fed != last_fed_)
+	{
+		if (stalled_ >= STALL_WARNING)
+			LOG(1, "Main loop running again");
+		last_fed_ = fed;
+		stalled_ = std::chrono::milliseconds(0);
+		notify("WATCHDOG=1");
+		return;
+	}
+	stalled_ += period_;
+	if (stalled_ >= STALL_WARNING && stalled_ - period_ < STALL_WARNING)
+	{
+		LOG_ERROR("ERROR: main loop stuck for " << stalled_.count() << "ms");
+		// While whatever the main loop is stuck behind is still in the rings.
+		FlightRecorder::Get().Dump("stall");
+	}
+}
+
+void Watchdog::notify(char const *state)
+{
+	if (notify_fd_ < 0)
+		return;
+	sendto(notify_fd_, state, strlen(state), MSG_NOSIGNAL, (sockaddr *)&notify_addr_, notify_addr_len_);
+}
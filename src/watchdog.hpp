@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * watchdog.hpp - notices the main loop getting stuck.
+ */
+
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// The main loop feeds the watchdog every time round, and a timer on the event loop checks
+// that it has been fed. Camera timeouts are already handled by PipelineRecovery, so this
+// is for the main loop itself getting stuck, in an encoder or a send, say. Running as a
+// systemd service with WatchdogSec (and NotifyAccess=all, as the service starts us from a
+// script), systemd is kept informed and restarts us when the loop stops; either way, a
+// stall is logged.
+
+class Watchdog
+{
+public:
+	Watchdog();
+
+	// From the main loop. Never blocks, and makes no system calls.
+	void Feed() { fed_.fetch_add(1, std::memory_order_relaxed); }
+
+	// Call Check this often, from a timer on the event loop.
+	std::chrono::milliseconds Period() const { return period_; }
+	void Check();
+
+private:
+	static constexpr std::chrono::milliseconds CHECK_PERIOD { 1000 };
+	static constexpr std::chrono::milliseconds STALL_WARNING { 5000 };
+
+	void notify(char const *state);
+
+	std::atomic<uint64_t> fed_;
+	uint64_t last_fed_;
+	std::chrono::milliseconds period_;
+	std::chrono::milliseconds stalled_;
+	// systemd's notify socket, where there is one.
+	int notify_fd_;
+	sockaddr_un notify_addr_;
+	socklen_t notify_addr_len_;
+};
@@ -0,0 +1,213 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * yuv_convert.cpp - convert the camera's YUV420 (or RGB48) into other pixel formats.
+ */
+
+#include <cstring>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "yuv_convert.hpp"
+
+// Pixels [start, width) of one UYVY row, from one row each of Y, U and V.
+static void uyvy_row(uint8_t const *y, uint8_t const *u, uint8_t const *v, unsigned int start, unsigned int width,
+					 uint8_t *dst)
+{
+	for (unsigned int x = start; x < width; x += 2)
+	{
+		dst[2 * x] = u[x / 2];
+		dst[2 * x + 1] = y[x];
+		dst[2 * x + 2] = v[x / 2];
+		dst[2 * x + 3] = y[x + 1];
+	}
+}
+
+// Pixels [start, width) of one NV12 chroma row, from one row each of U and V.
+static void uv_row(uint8_t const *u, uint8_t const *v, unsigned int start, unsigned int width, uint8_t *dst)
+{
+	for (unsigned int x = start; x < width; x += 2)
+	{
+		dst[x] = u[x / 2];
+		dst[x + 1] = v[x / 2];
+	}
+}
+
+// P216 conversion works in 15 bit fixed point, unsigned, each sum starting from an offset
+// that keeps it positive, and rounding. The coefficients already scale full range RGB to
+// video levels: Y from 16 << 8 to 235 << 8, and U and V 224 << 8 either side of 128 << 8.
+static constexpr uint16_t YR = 5960, YG = 20049, YB = 2024; // 0.1819, 0.6118, 0.0618
+static constexpr uint16_t UR = 3285, UG = 11051, VG = 13022, VB = 1314; // 0.1003, 0.3373, 0.3974, 0.0401
+static constexpr uint16_t UV_MAX = 14336; // 0.4375, for B in U and R in V
+static constexpr uint32_t Y_OFFSET = (4096u << 15) + (1 << 14), UV_OFFSET = (32768u << 15) + (1 << 14);
+
+// Pixels [start, width) of one P216 row, into rows of the Y and UV planes.
+static void p216_row(uint16_t const *rgb, unsigned int start, unsigned int width, uint16_t *y, uint16_t *uv)
+{
+	for (unsigned int x = start; x < width; x += 2)
+	{
+		uint16_t const *p = rgb + 3 * x;
+		y[x] = (Y_OFFSET + YR * p[0] + YG * p[1] + YB * p[2]) >> 15;
+		y[x + 1] = (Y_OFFSET + YR * p[3] + YG * p[4] + YB * p[5]) >> 15;
+		uint32_t r = (p[0] + p[3]) >> 1, g = (p[1] + p[4]) >> 1, b = (p[2] + p[5]) >> 1;
+		uv[x] = (UV_OFFSET + UV_MAX * b - UR * r - UG * g) >> 15;
+		uv[x + 1] = (UV_OFFSET + UV_MAX * r - VG * g - VB * b) >> 15;
+	}
+}
+
+void yuv420_to_uyvy_scalar(uint8_t const *src, unsigned int width, unsigned int height, unsigned int stride,
+						   uint8_t *dst, unsigned int dst_stride)
+{
+	uint8_t const *u = src + stride * height, *v = u + (stride / 2) * (height / 2);
+	for (unsigned int row = 0; row < height; row++)
+		uyvy_row(src + row * stride, u + (row / 2) * (stride / 2), v + (row / 2) * (stride / 2), 0, width,
+				 dst + row * dst_stride);
+}
+
+void yuv420_to_nv12_scalar(uint8_t const *src, unsigned int width, unsigned int height, unsigned int stride,
+						   uint8_t *dst, unsigned int dst_stride)
+{
+	for (unsigned int row = 0; row < height; row++)
+		memcpy(dst + row * dst_stride, src + row * stride, width);
+
+	uint8_t const *u = src + stride * height, *v = u + (stride / 2) * (height / 2);
+	uint8_t *uv = dst + dst_stride * height;
+	for (unsigned int row = 0; row < height / 2; row++)
+		uv_row(u + row * (stride / 2), v + row * (stride / 2), 0, width, uv + row * dst_stride);
+}
+
+void rgb48_to_p216_scalar(uint8_t const *src, unsigned int width, unsigned int height, unsigned int stride,
+						  uint8_t *dst, unsigned int dst_stride)
+{
+	uint8_t *uv = dst + dst_stride * height;
+	for (unsigned int row = 0; row < height; row++)
+		p216_row((uint16_t const *)(src + row * stride), 0, width, (uint16_t *)(dst + row * dst_stride),
+				 (uint16_t *)(uv + row * dst_stride));
+}
+
+#if defined(__ARM_NEON)
+
+void yuv420_to_uyvy(uint8_t const *src, unsigned int width, unsigned int height, unsigned int stride, uint8_t *dst,
+					unsigned int dst_stride)
+{
+	uint8_t const *u_plane = src + stride * height, *v_plane = u_plane + (stride / 2) * (height / 2);
+	unsigned int vector_width = width & ~15;
+	for (unsigned int row = 0; row < height; row++)
+	{
+		uint8_t const *y = src + row * stride;
+		uint8_t const *u = u_plane + (row / 2) * (stride / 2);
+		uint8_t const *v = v_plane + (row / 2) * (stride / 2);
+		uint8_t *out = dst + row * dst_stride;
+
+		// 16 pixels at a time: split Y into the even and odd pixels and store them
+		// interleaved with the U and V that they share.
+		for (unsigned int x = 0; x < vector_width; x += 16)
+		{
+			uint8x8x2_t luma = vld2_u8(y + x);
+			uint8x8x4_t uyvy;
+			uyvy.val[0] = vld1_u8(u + x / 2);
+			uyvy.val[1] = luma.val[0];
+			uyvy.val[2] = vld1_u8(v + x / 2);
+			uyvy.val[3] = luma.val[1];
+			vst4_u8(out + 2 * x, uyvy);
+		}
+		uyvy_row(y, u, v, vector_width, width, out);
+	}
+}
+
+void yuv420_to_nv12(uint8_t const *src, unsigned int width, unsigned int height, unsigned int stride, uint8_t *dst,
+					unsigned int dst_stride)
+{
+	// The Y plane only changes stride, and if not even that it's one big copy.
+	if (stride == dst_stride)
+		memcpy(dst, src, stride * height);
+	else
+	{
+		for (unsigned int row = 0; row < height; row++)
+			memcpy(dst + row * dst_stride, src + row * stride, width);
+	}
+
+	uint8_t const *u_plane = src + stride * height, *v_plane = u_plane + (stride / 2) * (height / 2);
+	uint8_t *uv_plane = dst + dst_stride * height;
+	unsigned int vector_width = width & ~31;
+	for (unsigned int row = 0; row < height / 2; row++)
+	{
+		uint8_t const *u = u_plane + row * (stride / 2);
+		uint8_t const *v = v_plane + row * (stride / 2);
+		uint8_t *out = uv_plane + row * dst_stride;
+
+		// 16 chroma pairs (32 pixels) at a time.
+		for (unsigned int x = 0; x < vector_width; x += 32)
+		{
+			uint8x16x2_t uv;
+			uv.val[0] = vld1q_u8(u + x / 2);
+			uv.val[1] = vld1q_u8(v + x / 2);
+			vst2q_u8(out + x, uv);
+		}
+		uv_row(u, v, vector_width, width, out);
+	}
+}
+
+void rgb48_to_p216(uint8_t const *src, unsigned int width, unsigned int height, unsigned int stride, uint8_t *dst,
+				   unsigned int dst_stride)
+{
+	uint8_t *uv_plane = dst + dst_stride * height;
+	unsigned int vector_width = width & ~7;
+	uint32x4_t const y_offset = vdupq_n_u32(Y_OFFSET), uv_offset = vdupq_n_u32(UV_OFFSET);
+	for (unsigned int row = 0; row < height; row++)
+	{
+		uint16_t const *rgb = (uint16_t const *)(src + row * stride);
+		uint16_t *y = (uint16_t *)(dst + row * dst_stride);
+		uint16_t *uv = (uint16_t *)(uv_plane + row * dst_stride);
+
+		// 8 pixels, and so 4 chroma pairs, at a time, all the way from the widening
+		// multiplies to the narrowing shifts in one pass.
+		for (unsigned int x = 0; x < vector_width; x += 8)
+		{
+			uint16x8x3_t p = vld3q_u16(rgb + 3 * x);
+			uint32x4_t lo = vmlal_n_u16(y_offset, vget_low_u16(p.val[0]), YR);
+			lo = vmlal_n_u16(vmlal_n_u16(lo, vget_low_u16(p.val[1]), YG), vget_low_u16(p.val[2]), YB);
+			uint32x4_t hi = vmlal_n_u16(y_offset, vget_high_u16(p.val[0]), YR);
+			hi = vmlal_n_u16(vmlal_n_u16(hi, vget_high_u16(p.val[1]), YG), vget_high_u16(p.val[2]), YB);
+			vst1q_u16(y + x, vcombine_u16(vshrn_n_u32(lo, 15), vshrn_n_u32(hi, 15)));
+
+			// Average the even and odd pixels of each channel.
+			uint16x8x2_t pairs = vuzpq_u16(p.val[0], p.val[0]);
+			uint16x4_t r = vhadd_u16(vget_low_u16(pairs.val[0]), vget_low_u16(pairs.val[1]));
+			pairs = vuzpq_u16(p.val[1], p.val[1]);
+			uint16x4_t g = vhadd_u16(vget_low_u16(pairs.val[0]), vget_low_u16(pairs.val[1]));
+			pairs = vuzpq_u16(p.val[2], p.val[2]);
+			uint16x4_t b = vhadd_u16(vget_low_u16(pairs.val[0]), vget_low_u16(pairs.val[1]));
+			uint16x4x2_t chroma;
+			chroma.val[0] = vshrn_n_u32(vmlsl_n_u16(vmlsl_n_u16(vmlal_n_u16(uv_offset, b, UV_MAX), r, UR), g, UG), 15);
+			chroma.val[1] = vshrn_n_u32(vmlsl_n_u16(vmlsl_n_u16(vmlal_n_u16(uv_offset, r, UV_MAX), g, VG), b, VB), 15);
+			vst2_u16(uv + x, chroma);
+		}
+		p216_row(rgb, vector_width, width, y, uv);
+	}
+}
+
+#else
+
+void rgb48_to_p216(uint8_t const *src, unsigned int width, unsigned int height, unsigned int stride, uint8_t *dst,
+				   unsigned int dst_stride)
+{
+	rgb48_to_p216_scalar(src, width, height, stride, dst, dst_stride);
+}
+
+void yuv420_to_uyvy(uint8_t const *src, unsigned int width, unsigned int height, unsigned int stride, uint8_t *dst,
+					unsigned int dst_stride)
+{
+	yuv420_to_uyvy_scalar(src, width, height, stride, dst, dst_stride);
+}
+
+void yuv420_to_nv12(uint8_t const *src, unsigned int width, unsigned int height, unsigned int stride, uint8_t *dst,
+					unsigned int dst_stride)
+{
+	yuv420_to_nv12_scalar(src, width, height, stride, dst, dst_stride);
+}
+
+#endif
@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * yuv_convert.hpp - convert the camera's YUV420 (or RGB48) into other pixel formats.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+// The source is always a planar YUV420 image as libcamera lays it out: the Y plane with
+// rows stride bytes apart, followed by the U and then the V planes at half the stride and
+// half the height. Each conversion makes a single streaming pass over the source, and
+// uses NEON where the compiler targets it. Width and height must be even.
+//
+// The _scalar versions are always available, so that the two can be compared.
+
+// Interleave into UYVY, 2 bytes per pixel, with rows dst_stride bytes apart.
+void yuv420_to_uyvy(uint8_t const *src, unsigned int width, unsigned int height, unsigned int stride, uint8_t *dst,
+					unsigned int dst_stride);
+void yuv420_to_uyvy_scalar(uint8_t const *src, unsigned int width, unsigned int height, unsigned int stride,
+						   uint8_t *dst, unsigned int dst_stride);
+
+// Convert to NV12, a Y plane followed by an interleaved UV plane, both with rows dst_stride
+// bytes apart.
+void yuv420_to_nv12(uint8_t const *src, unsigned int width, unsigned int height, unsigned int stride, uint8_t *dst,
+					unsigned int dst_stride);
+void yuv420_to_nv12_scalar(uint8_t const *src, unsigned int width, unsigned int height, unsigned int stride,
+						   uint8_t *dst, unsigned int dst_stride);
+
+// Convert the ISP's 16-bit RGB (RGB48, with R, G and B in that order in memory, and rows
+// stride bytes apart) to P216, NDI's 16-bit 4:2:2: a Y plane followed by an interleaved UV
+// plane, both with rows dst_stride bytes apart. BT.709, with the video levels of 8-bit
+// YUV shifted up by 8 bits, as NDI expects. Each pair of pixels shares the chroma of
+// their average.
+void rgb48_to_p216(uint8_t const *src, unsigned int width, unsigned int height, unsigned int stride, uint8_t *dst,
+				   unsigned int dst_stride);
+void rgb48_to_p216_scalar(uint8_t const *src, unsigned int width, unsigned int height, unsigned int stride,
+						  uint8_t *dst, unsigned int dst_stride);